@@ -0,0 +1,325 @@
+#include "stdafx.h"
+
+#include <utilities.h>
+#include <FileOnDisk.h>
+#include <Digest.h>
+#include <FileHasher.h>
+#include <BatchHasher.h>
+
+static size_t theFilesInFlight = 0;
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void BatchHasher::SetFilesInFlight(size_t filesInFlight)
+{
+	theFilesInFlight = std::min<size_t>(filesInFlight, maxFilesInFlight);
+}
+
+size_t BatchHasher::GetFilesInFlight()
+{
+	return theFilesInFlight;
+}
+
+
+//=====================================================================================================================================================================================================
+// BatchSlot
+//
+// One file in flight. The OVERLAPPED comes first, and the slot itself is the completion key, so
+// a completion leads straight back to its slot. Only one read per slot is ever outstanding, so
+// only the worker that got its completion touches a slot at a time.
+//=====================================================================================================================================================================================================
+struct BatchSlot
+{
+	OVERLAPPED						Overlapped;
+	BYTE							*pBuffer = nullptr;
+	HANDLE							hFile = nullptr;
+	BatchHasher::Request			*pRequest = nullptr;
+	std::unique_ptr<DigestEngine>	Engine;
+	LONGLONG						Offset = 0;
+	LONGLONG						Size = 0;
+};
+
+
+//=====================================================================================================================================================================================================
+// BatchRun
+//
+// Everything shared by the workers for one call to HashFiles
+//=====================================================================================================================================================================================================
+struct BatchRun
+{
+	HANDLE							hPort = nullptr;
+	size_t							blockSize = 0;
+	uint32_t						numWorkers = 0;
+	std::vector<BatchHasher::Request> *pRequests = nullptr;
+	std::atomic<size_t>				nextRequest{ 0 };
+	std::atomic<size_t>				activeSlots{ 0 };
+	std::atomic<long long>			*pBytesRead = nullptr;
+
+	void StartNextFile(BatchSlot &slot);
+	bool IssueRead(BatchSlot &slot);
+	void FinishFile(BatchSlot &slot, bool hashed);
+	void Work();
+};
+
+
+//=====================================================================================================================================================================================================
+// BatchRun::IssueRead
+//
+// Read the slot's next block. If it finishes right away a completion is still queued, so it's
+// handled the same as any other.
+//=====================================================================================================================================================================================================
+bool BatchRun::IssueRead(BatchSlot &slot)
+{
+	ZeroMemory(&slot.Overlapped, sizeof(slot.Overlapped));
+	slot.Overlapped.Offset		= static_cast<DWORD>(slot.Offset);
+	slot.Overlapped.OffsetHigh	= static_cast<DWORD>(slot.Offset >> 32);
+
+	if (ReadFile(slot.hFile, slot.pBuffer, static_cast<DWORD>(this->blockSize), nullptr, &slot.Overlapped) || (ERROR_IO_PENDING == GetLastError()))
+	{
+		return true;
+	}
+
+	Logger::Get().printf(Logger::Level::Error, "Error reading \"%s\"! (%S, %d)\n", slot.pRequest->FileName.c_str(), GetLastErrorString(), GetLastError());
+	return false;
+}
+
+
+//=====================================================================================================================================================================================================
+// BatchRun::FinishFile
+//
+// Done with the slot's file (one way or the other), so move it on to the next one
+//=====================================================================================================================================================================================================
+void BatchRun::FinishFile(BatchSlot &slot, bool hashed)
+{
+	if (hashed)
+	{
+		slot.pRequest->Hashed = slot.Engine->Final(slot.pRequest->Hash);
+	}
+
+	SafeCloseHandle(slot.hFile);
+
+	this->StartNextFile(slot);
+}
+
+
+//=====================================================================================================================================================================================================
+// BatchRun::StartNextFile
+//
+// Open the next file that hasn't been started and get its first read going. When there aren't
+// any left (or we've been told to stop), the slot goes idle, and whoever idles the last one tells
+// the workers to quit.
+//=====================================================================================================================================================================================================
+void BatchRun::StartNextFile(BatchSlot &slot)
+{
+	while (!ControlCHandler::TestShouldTerminate())
+	{
+		size_t index = this->nextRequest++;
+
+		if (index >= this->pRequests->size())
+		{
+			break;
+		}
+
+		BatchHasher::Request &request = (*this->pRequests)[index];
+		request.Hashed = false;
+
+		slot.pRequest	= &request;
+		slot.Offset		= 0;
+
+		// unbuffered if we can, the same as FileHasher
+		slot.hFile = CreateFileU(request.FileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+		if (INVALID_HANDLE_VALUE == slot.hFile)
+		{
+			slot.hFile = CreateFileU(request.FileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		}
+
+		if (INVALID_HANDLE_VALUE == slot.hFile)
+		{
+			Logger::Get().printf(Logger::Level::Error, "Error opening \"%s\"! (%S, %d)\n", request.FileName.c_str(), GetLastErrorString(), GetLastError());
+			continue;
+		}
+
+		LARGE_INTEGER filesize;
+
+		if (!GetFileSizeEx(slot.hFile, &filesize) || (nullptr == CreateIoCompletionPort(slot.hFile, this->hPort, reinterpret_cast<ULONG_PTR>(&slot), 0)))
+		{
+			Logger::Get().printf(Logger::Level::Error, "Error setting up \"%s\" for reading! (%S, %d)\n", request.FileName.c_str(), GetLastErrorString(), GetLastError());
+			SafeCloseHandle(slot.hFile);
+			continue;
+		}
+
+		slot.Size = filesize.QuadPart;
+
+		if (!slot.Engine->Reset())
+		{
+			SafeCloseHandle(slot.hFile);
+			continue;
+		}
+
+		if (0 == slot.Size)
+		{
+			request.Hashed = slot.Engine->Final(request.Hash);
+			SafeCloseHandle(slot.hFile);
+			continue;
+		}
+
+		if (this->IssueRead(slot))
+		{
+			return;
+		}
+
+		SafeCloseHandle(slot.hFile);
+	}
+
+	slot.hFile = nullptr;
+
+	if (0 == --this->activeSlots)
+	{
+		for (uint32_t worker = 0; worker < this->numWorkers; worker++)
+		{
+			PostQueuedCompletionStatus(this->hPort, 0, 0, nullptr);
+		}
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+// BatchRun::Work
+//
+// Hash each block as it comes back, and keep its file going
+//=====================================================================================================================================================================================================
+void BatchRun::Work()
+{
+	for (;;)
+	{
+		DWORD cbRead = 0;
+		ULONG_PTR key = 0;
+		LPOVERLAPPED pOverlapped = nullptr;
+
+		BOOL completed = GetQueuedCompletionStatus(this->hPort, &cbRead, &key, &pOverlapped, INFINITE);
+
+		if (nullptr == pOverlapped)
+		{
+			// told to quit (or the port is gone)
+			break;
+		}
+
+		BatchSlot &slot = *reinterpret_cast<BatchSlot *>(key);
+
+		if (!completed)
+		{
+			if (ERROR_HANDLE_EOF != GetLastError())
+			{
+				Logger::Get().printf(Logger::Level::Error, "Error reading \"%s\"! (%S, %d)\n", slot.pRequest->FileName.c_str(), GetLastErrorString(), GetLastError());
+				this->FinishFile(slot, false);
+				continue;
+			}
+
+			cbRead = 0;
+		}
+
+		if (ControlCHandler::TestShouldTerminate())
+		{
+			this->FinishFile(slot, false);
+			continue;
+		}
+
+		if ((cbRead > 0) && !slot.Engine->Update(slot.pBuffer, cbRead))
+		{
+			this->FinishFile(slot, false);
+			continue;
+		}
+
+		slot.Offset += cbRead;
+		*this->pBytesRead += cbRead;
+
+		// a short read means we're at the end (even if the file got shorter after we got its size)
+		if ((cbRead < this->blockSize) || (slot.Offset >= slot.Size))
+		{
+			this->FinishFile(slot, true);
+		}
+		else if (!this->IssueRead(slot))
+		{
+			this->FinishFile(slot, false);
+		}
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+// BatchHasher::HashFiles
+//=====================================================================================================================================================================================================
+bool BatchHasher::HashFiles(std::vector<Request> &requests, uint32_t numWorkers, size_t filesInFlight, std::atomic<long long> &bytesRead)
+{
+	size_t numSlots = std::min<size_t>(std::min<size_t>(GetFilesInFlight(), filesInFlight), requests.size());
+
+	if ((0 == numSlots) || (0 == numWorkers))
+	{
+		return false;
+	}
+
+	BatchRun run;
+	run.blockSize	= FileHasher::GetBlockSize();
+	run.numWorkers	= numWorkers;
+	run.pRequests	= &requests;
+	run.pBytesRead	= &bytesRead;
+
+	run.hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, numWorkers);
+	if (nullptr == run.hPort)
+	{
+		Logger::Get().printf(Logger::Level::Warning, "Can't create an I/O completion port (%S, %d); hashing the usual way\n", GetLastErrorString(), GetLastError());
+		return false;
+	}
+
+	BYTE *pPool = reinterpret_cast<BYTE *>(VirtualAlloc(nullptr, numSlots * run.blockSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+	if (nullptr == pPool)
+	{
+		Logger::Get().printf(Logger::Level::Warning, "Can't allocate %s bytes for reading (%S, %d); hashing the usual way\n", comma(numSlots * run.blockSize), GetLastErrorString(), GetLastError());
+		CloseHandle(run.hPort);
+		return false;
+	}
+
+	std::vector<BatchSlot> slots(numSlots);
+	bool result = true;
+
+	for (size_t index = 0; result && (index < numSlots); index++)
+	{
+		slots[index].pBuffer	= pPool + (index * run.blockSize);
+		slots[index].Engine		= DigestEngine::Create(DigestEngine::GetAlgorithm());
+		result = !!slots[index].Engine;
+	}
+
+	if (result)
+	{
+		for (auto &request : requests)
+		{
+			request.Hashed = false;
+		}
+
+		// every slot starts out active; the ones that run out of files drop out as they do
+		run.activeSlots = numSlots;
+
+		for (auto &slot : slots)
+		{
+			run.StartNextFile(slot);
+		}
+
+		std::vector<std::thread> workers;
+		for (uint32_t worker = 0; worker < numWorkers; worker++)
+		{
+			workers.emplace_back([&run]() { run.Work(); });
+		}
+
+		for (auto &worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	CloseHandle(run.hPort);
+	VirtualFree(pPool, 0, MEM_RELEASE);
+
+	return result;
+}
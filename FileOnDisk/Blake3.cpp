@@ -0,0 +1,385 @@
+#include "stdafx.h"
+
+#include <utilities.h>
+#include <FileOnDisk.h>
+#include <Digest.h>
+
+
+//=====================================================================================================================================================================================================
+// BLAKE3
+//
+// The input is split into 1 KB chunks, each chunk is hashed on its own, and the chunks' chaining
+// values are combined pairwise up a binary tree. Since the chunks are independent, AVX2 can
+// hash eight of them at once, one per 32-bit lane, which is where most of its speed comes from.
+// Only the default (unkeyed) hash mode is needed, and only the first 16 bytes of its output.
+//=====================================================================================================================================================================================================
+namespace
+{
+	const size_t	BLOCK_LEN			= 64;
+	const size_t	CHUNK_LEN			= 1024;
+	const size_t	MAX_DEPTH			= 54;		// enough for 2^64 bytes
+	const size_t	SIMD_DEGREE			= 8;
+
+	const uint32_t	CHUNK_START			= 1 << 0;
+	const uint32_t	CHUNK_END			= 1 << 1;
+	const uint32_t	PARENT				= 1 << 2;
+	const uint32_t	ROOT				= 1 << 3;
+
+	const uint32_t IV[8] =
+	{
+		0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+	};
+
+	// the order the message words are used in, for each of the seven rounds
+	const uint8_t MSG_SCHEDULE[7][16] =
+	{
+		{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+		{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+		{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+		{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+		{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+		{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+		{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+	};
+
+	inline uint32_t Read32(const uint8_t *p)
+	{
+		uint32_t value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	inline uint32_t Rotr32(uint32_t x, int r)
+	{
+		return (x >> r) | (x << (32 - r));
+	}
+
+	inline void G(uint32_t *state, size_t a, size_t b, size_t c, size_t d, uint32_t x, uint32_t y)
+	{
+		state[a] = state[a] + state[b] + x;
+		state[d] = Rotr32(state[d] ^ state[a], 16);
+		state[c] = state[c] + state[d];
+		state[b] = Rotr32(state[b] ^ state[c], 12);
+		state[a] = state[a] + state[b] + y;
+		state[d] = Rotr32(state[d] ^ state[a], 8);
+		state[c] = state[c] + state[d];
+		state[b] = Rotr32(state[b] ^ state[c], 7);
+	}
+
+	//=================================================================================================================================================================================================
+	// Compress one block, leaving all 16 words of the state in out
+	//=================================================================================================================================================================================================
+	void Compress(const uint32_t cv[8], const uint8_t block[BLOCK_LEN], uint8_t blockLen, uint64_t counter, uint32_t flags, uint32_t out[16])
+	{
+		uint32_t m[16];
+
+		for (size_t i = 0; i < 16; ++i)
+		{
+			m[i] = Read32(block + 4 * i);
+		}
+
+		uint32_t state[16] =
+		{
+			cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+			IV[0], IV[1], IV[2], IV[3],
+			static_cast<uint32_t>(counter), static_cast<uint32_t>(counter >> 32), blockLen, flags,
+		};
+
+		for (size_t round = 0; round < 7; ++round)
+		{
+			const uint8_t *s = MSG_SCHEDULE[round];
+
+			G(state, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+			G(state, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+			G(state, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+			G(state, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+
+			G(state, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+			G(state, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+			G(state, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+			G(state, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+		}
+
+		for (size_t i = 0; i < 8; ++i)
+		{
+			out[i] = state[i] ^ state[i + 8];
+			out[i + 8] = state[i + 8] ^ cv[i];
+		}
+	}
+
+	//=================================================================================================================================================================================================
+	// Hash eight whole chunks at once, with AVX2, leaving each one's chaining value in out
+	//=================================================================================================================================================================================================
+	inline __m256i Rotr256(__m256i x, int r)
+	{
+		return _mm256_or_si256(_mm256_srli_epi32(x, r), _mm256_slli_epi32(x, 32 - r));
+	}
+
+	inline void G8(__m256i *v, size_t a, size_t b, size_t c, size_t d, __m256i x, __m256i y)
+	{
+		v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x);
+		v[d] = Rotr256(_mm256_xor_si256(v[d], v[a]), 16);
+		v[c] = _mm256_add_epi32(v[c], v[d]);
+		v[b] = Rotr256(_mm256_xor_si256(v[b], v[c]), 12);
+		v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y);
+		v[d] = Rotr256(_mm256_xor_si256(v[d], v[a]), 8);
+		v[c] = _mm256_add_epi32(v[c], v[d]);
+		v[b] = Rotr256(_mm256_xor_si256(v[b], v[c]), 7);
+	}
+
+	void HashEightChunksAvx2(const uint8_t *input, uint64_t counter, uint32_t out[SIMD_DEGREE][8])
+	{
+		__m256i h[8];
+
+		for (size_t i = 0; i < 8; ++i)
+		{
+			h[i] = _mm256_set1_epi32(static_cast<int>(IV[i]));
+		}
+
+		__m256i counterLo = _mm256_setr_epi32(
+			static_cast<int>(counter + 0), static_cast<int>(counter + 1), static_cast<int>(counter + 2), static_cast<int>(counter + 3),
+			static_cast<int>(counter + 4), static_cast<int>(counter + 5), static_cast<int>(counter + 6), static_cast<int>(counter + 7));
+		__m256i counterHi = _mm256_setr_epi32(
+			static_cast<int>((counter + 0) >> 32), static_cast<int>((counter + 1) >> 32), static_cast<int>((counter + 2) >> 32), static_cast<int>((counter + 3) >> 32),
+			static_cast<int>((counter + 4) >> 32), static_cast<int>((counter + 5) >> 32), static_cast<int>((counter + 6) >> 32), static_cast<int>((counter + 7) >> 32));
+
+		// the lanes are strided a chunk apart
+		const __m256i offsets = _mm256_setr_epi32(0, CHUNK_LEN, 2 * CHUNK_LEN, 3 * CHUNK_LEN, 4 * CHUNK_LEN, 5 * CHUNK_LEN, 6 * CHUNK_LEN, 7 * CHUNK_LEN);
+
+		for (size_t block = 0; block < CHUNK_LEN / BLOCK_LEN; ++block)
+		{
+			const uint8_t *pblock = input + block * BLOCK_LEN;
+			__m256i m[16];
+
+			for (size_t i = 0; i < 16; ++i)
+			{
+				m[i] = _mm256_i32gather_epi32(reinterpret_cast<const int *>(pblock + 4 * i), offsets, 1);
+			}
+
+			uint32_t flags = ((0 == block) ? CHUNK_START : 0) | ((CHUNK_LEN / BLOCK_LEN - 1 == block) ? CHUNK_END : 0);
+
+			__m256i v[16] =
+			{
+				h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+				_mm256_set1_epi32(static_cast<int>(IV[0])), _mm256_set1_epi32(static_cast<int>(IV[1])), _mm256_set1_epi32(static_cast<int>(IV[2])), _mm256_set1_epi32(static_cast<int>(IV[3])),
+				counterLo, counterHi, _mm256_set1_epi32(static_cast<int>(BLOCK_LEN)), _mm256_set1_epi32(static_cast<int>(flags)),
+			};
+
+			for (size_t round = 0; round < 7; ++round)
+			{
+				const uint8_t *s = MSG_SCHEDULE[round];
+
+				G8(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+				G8(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+				G8(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+				G8(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+
+				G8(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+				G8(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+				G8(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+				G8(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+			}
+
+			for (size_t i = 0; i < 8; ++i)
+			{
+				h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+			}
+		}
+
+		alignas(32) uint32_t words[8][SIMD_DEGREE];
+
+		for (size_t i = 0; i < 8; ++i)
+		{
+			_mm256_store_si256(reinterpret_cast<__m256i *>(words[i]), h[i]);
+		}
+
+		for (size_t lane = 0; lane < SIMD_DEGREE; ++lane)
+		{
+			for (size_t i = 0; i < 8; ++i)
+			{
+				out[lane][i] = words[i][lane];
+			}
+		}
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+// Blake3DigestEngine
+//
+// The chunk that's currently being filled in is hashed a block at a time. Once it's full, and
+// there's more input after it, its chaining value goes on the stack, and the stack is merged
+// into parent nodes for as many trailing zero bits as there are in the number of chunks so far.
+// With AVX2, runs of eight whole chunks skip the chunk state and go straight through.
+//=====================================================================================================================================================================================================
+class Blake3DigestEngine : public DigestEngine
+{
+public:
+	Blake3DigestEngine()
+	{
+		static const bool avx2 = CpuHasAvx2();
+		this->useAvx2 = avx2;
+		this->ResetChunk(0);
+	}
+
+	bool Reset() override
+	{
+		*this = Blake3DigestEngine();
+		return true;
+	}
+
+	bool Update(const void *pData, size_t size) override
+	{
+		const uint8_t *input = reinterpret_cast<const uint8_t *>(pData);
+
+		while (size > 0)
+		{
+			if (CHUNK_LEN == this->ChunkLength())
+			{
+				// the chunk is full, and there's more after it, so it's not the root
+				uint32_t cv[8];
+				this->ChunkChainingValue(cv);
+				this->AddChunkChainingValue(cv, this->chunkCounter + 1);
+				this->ResetChunk(this->chunkCounter + 1);
+			}
+
+			if (this->useAvx2 && (0 == this->ChunkLength()) && (size > SIMD_DEGREE * CHUNK_LEN))
+			{
+				uint32_t cvs[SIMD_DEGREE][8];
+				HashEightChunksAvx2(input, this->chunkCounter, cvs);
+
+				for (size_t lane = 0; lane < SIMD_DEGREE; ++lane)
+				{
+					this->AddChunkChainingValue(cvs[lane], this->chunkCounter + lane + 1);
+				}
+
+				this->ResetChunk(this->chunkCounter + SIMD_DEGREE);
+				input += SIMD_DEGREE * CHUNK_LEN;
+				size -= SIMD_DEGREE * CHUNK_LEN;
+				continue;
+			}
+
+			// fill in the chunk a block at a time, keeping the last block back until we know
+			// whether it's the last one in the chunk
+			if (BLOCK_LEN == this->blockLen)
+			{
+				uint32_t out[16];
+				Compress(this->cv, this->block, BLOCK_LEN, this->chunkCounter, this->ChunkStartFlag(), out);
+				memcpy(this->cv, out, sizeof(this->cv));
+				++this->blocksCompressed;
+				this->blockLen = 0;
+			}
+
+			size_t take = BLOCK_LEN - this->blockLen;
+			if (take > size)
+			{
+				take = size;
+			}
+
+			memcpy(this->block + this->blockLen, input, take);
+			this->blockLen += take;
+			input += take;
+			size -= take;
+		}
+
+		return true;
+	}
+
+	bool Final(Md5Hash &hash) override
+	{
+		// the output node is the current chunk, merged with everything on the stack
+		uint32_t outputCv[8];
+		uint8_t outputBlock[BLOCK_LEN];
+		uint8_t outputBlockLen = static_cast<uint8_t>(this->blockLen);
+		uint32_t outputFlags = this->ChunkStartFlag() | CHUNK_END;
+		uint64_t outputCounter = this->chunkCounter;
+
+		memcpy(outputCv, this->cv, sizeof(outputCv));
+		memset(outputBlock, 0, sizeof(outputBlock));
+		memcpy(outputBlock, this->block, this->blockLen);
+
+		for (size_t i = this->cvStackLen; i-- > 0;)
+		{
+			uint32_t out[16];
+			Compress(outputCv, outputBlock, outputBlockLen, outputCounter, outputFlags, out);
+
+			memcpy(outputBlock, this->cvStack[i], 32);
+			memcpy(outputBlock + 32, out, 32);
+			memcpy(outputCv, IV, sizeof(outputCv));
+			outputBlockLen = BLOCK_LEN;
+			outputCounter = 0;
+			outputFlags = PARENT;
+		}
+
+		uint32_t out[16];
+		Compress(outputCv, outputBlock, outputBlockLen, outputCounter, outputFlags | ROOT, out);
+
+		memcpy(hash._data, out, sizeof(hash._data));
+		return true;
+	}
+
+private:
+	inline size_t ChunkLength() const
+	{
+		return this->blocksCompressed * BLOCK_LEN + this->blockLen;
+	}
+
+	inline uint32_t ChunkStartFlag() const
+	{
+		return (0 == this->blocksCompressed) ? CHUNK_START : 0;
+	}
+
+	void ResetChunk(uint64_t counter)
+	{
+		memcpy(this->cv, IV, sizeof(this->cv));
+		this->chunkCounter = counter;
+		this->blockLen = 0;
+		this->blocksCompressed = 0;
+	}
+
+	void ChunkChainingValue(uint32_t cvOut[8])
+	{
+		uint32_t out[16];
+		Compress(this->cv, this->block, static_cast<uint8_t>(this->blockLen), this->chunkCounter, this->ChunkStartFlag() | CHUNK_END, out);
+		memcpy(cvOut, out, 32);
+	}
+
+	void AddChunkChainingValue(const uint32_t chunkCv[8], uint64_t totalChunks)
+	{
+		uint32_t newCv[8];
+		memcpy(newCv, chunkCv, sizeof(newCv));
+
+		while (0 == (totalChunks & 1))
+		{
+			uint8_t parentBlock[BLOCK_LEN];
+			memcpy(parentBlock, this->cvStack[--this->cvStackLen], 32);
+			memcpy(parentBlock + 32, newCv, 32);
+
+			uint32_t out[16];
+			Compress(IV, parentBlock, BLOCK_LEN, 0, PARENT, out);
+			memcpy(newCv, out, sizeof(newCv));
+
+			totalChunks >>= 1;
+		}
+
+		memcpy(this->cvStack[this->cvStackLen++], newCv, sizeof(newCv));
+	}
+
+	uint32_t	cv[8];
+	uint64_t	chunkCounter = 0;
+	uint8_t		block[BLOCK_LEN];
+	size_t		blockLen = 0;
+	size_t		blocksCompressed = 0;
+
+	uint32_t	cvStack[MAX_DEPTH + 1][8];
+	size_t		cvStackLen = 0;
+
+	bool		useAvx2 = false;
+};
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+std::unique_ptr<DigestEngine> CreateBlake3DigestEngine()
+{
+	return std::make_unique<Blake3DigestEngine>();
+}
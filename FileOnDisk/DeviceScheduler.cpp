@@ -0,0 +1,255 @@
+#include "stdafx.h"
+
+#include <utilities.h>
+#include <DeviceScheduler.h>
+
+DeviceScheduler DeviceScheduler::thescheduler;
+
+static const char *kindNames[] =
+{
+	"unknown",
+	"rotational",
+	"ssd",
+	"network",
+};
+
+// the readers per device, by kind
+static const uint32_t defaultLimits[] =
+{
+	2,
+	1,
+	8,
+	4,
+};
+
+
+//=====================================================================================================================================================================================================
+// DeviceScheduler::GetVolumeRoot
+//
+// e.g., "c:\" or "\\server\share\" (lower case, so that it can be used as a key); empty if the
+// path doesn't exist
+//=====================================================================================================================================================================================================
+std::string DeviceScheduler::GetVolumeRoot(const char *pszPath)
+{
+	std::wstring path = Utf8ToUnicode(pszPath);
+	wchar_t szRoot[MAX_PATH + 1];
+
+	if (!GetVolumePathNameW(path.c_str(), szRoot, _countof(szRoot)))
+	{
+		return std::string();
+	}
+
+	std::string root = UnicodeToUtf8(szRoot);
+	std::transform(root.begin(), root.end(), root.begin(), [](char c) { return static_cast<char>(tolower(static_cast<unsigned char>(c))); });
+
+	return root;
+}
+
+
+//=====================================================================================================================================================================================================
+// DeviceScheduler::DetectKind
+//
+// Network shares are easy to spot. For a local volume, ask the storage stack whether it has a
+// seek penalty, which is how Windows itself tells a spinning disk from an SSD.
+//=====================================================================================================================================================================================================
+DeviceScheduler::Kind DeviceScheduler::DetectKind(const std::string &root)
+{
+	std::wstring wroot = Utf8ToUnicode(root);
+
+	if ((0 == wroot.compare(0, 2, L"\\\\")) || (DRIVE_REMOTE == GetDriveTypeW(wroot.c_str())))
+	{
+		return Kind::Network;
+	}
+
+	// the volume's device name, without the trailing backslash (e.g., "\\?\Volume{...}")
+	wchar_t szVolume[MAX_PATH + 1];
+	if (!GetVolumeNameForVolumeMountPointW(wroot.c_str(), szVolume, _countof(szVolume)))
+	{
+		return Kind::Unknown;
+	}
+
+	std::wstring volume = szVolume;
+	if (!volume.empty() && (L'\\' == volume.back()))
+	{
+		volume.pop_back();
+	}
+
+	HANDLE hVolume = CreateFileW(volume.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+
+	if (INVALID_HANDLE_VALUE == hVolume)
+	{
+		return Kind::Unknown;
+	}
+
+	STORAGE_PROPERTY_QUERY query = {};
+	query.PropertyId	= StorageDeviceSeekPenaltyProperty;
+	query.QueryType		= PropertyStandardQuery;
+
+	DEVICE_SEEK_PENALTY_DESCRIPTOR penalty = {};
+	DWORD cbReturned = 0;
+	Kind kind = Kind::Unknown;
+
+	if (DeviceIoControl(hVolume, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &penalty, sizeof(penalty), &cbReturned, nullptr) && (cbReturned >= sizeof(penalty)))
+	{
+		kind = penalty.IncursSeekPenalty ? Kind::Rotational : Kind::SolidState;
+	}
+
+	CloseHandle(hVolume);
+
+	return kind;
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+size_t DeviceScheduler::GetDevice(const char *pszPath)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		auto iter = this->byPath.find(pszPath);
+		if (iter != this->byPath.end())
+		{
+			return iter->second;
+		}
+	}
+
+	// the slow part is outside the lock; it doesn't matter if two threads both work it out
+	std::string root = GetVolumeRoot(pszPath);
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		auto iter = this->byRoot.find(root);
+		if (iter != this->byRoot.end())
+		{
+			this->byPath[pszPath] = iter->second;
+			return iter->second;
+		}
+	}
+
+	Kind kind = root.empty() ? Kind::Unknown : DetectKind(root);
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	auto iter = this->byRoot.find(root);
+	if (iter != this->byRoot.end())
+	{
+		this->byPath[pszPath] = iter->second;
+		return iter->second;
+	}
+
+	Device device;
+	device.root		= root;
+	device.kind		= kind;
+	device.limit	= defaultLimits[static_cast<size_t>(kind)];
+
+	auto over = this->overrides.find(root);
+	if (over != this->overrides.end())
+	{
+		device.limit = over->second;
+	}
+
+	this->devices.push_back(device);
+	this->byRoot[root] = this->devices.size() - 1;
+	this->byPath[pszPath] = this->devices.size() - 1;
+
+	return this->devices.size() - 1;
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+uint32_t DeviceScheduler::GetLimit(size_t device)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->devices[device].limit;
+}
+
+DeviceScheduler::Kind DeviceScheduler::GetKind(size_t device)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->devices[device].kind;
+}
+
+bool DeviceScheduler::SetLimit(const char *pszPath, uint32_t limit)
+{
+	std::string root = GetVolumeRoot(pszPath);
+
+	if (root.empty())
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->overrides[root] = std::max<uint32_t>(limit, 1);
+
+	return true;
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void DeviceScheduler::AddReader(size_t device)
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->readerDone.wait(lock, [this, device]() { return (this->devices[device].readers < this->devices[device].limit); });
+	this->devices[device].readers++;
+}
+
+bool DeviceScheduler::TryAddReader(size_t device)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (this->devices[device].readers >= this->devices[device].limit)
+	{
+		return false;
+	}
+
+	this->devices[device].readers++;
+	return true;
+}
+
+void DeviceScheduler::RemoveReader(size_t device)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->devices[device].readers--;
+	}
+
+	this->readerDone.notify_all();
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void DeviceScheduler::AddUsage(size_t device, long long bytes, double seconds)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->devices[device].bytes		+= bytes;
+	this->devices[device].seconds	+= seconds;
+}
+
+
+//=====================================================================================================================================================================================================
+// DeviceScheduler::Report
+//
+// The seconds are added up over all of a device's readers, so the rate is per reader; times the
+// number of readers, it's (roughly) what the device did.
+//=====================================================================================================================================================================================================
+void DeviceScheduler::Report()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	for (auto &device : this->devices)
+	{
+		if (0 == device.bytes)
+		{
+			continue;
+		}
+
+		double rate = (device.bytes / (1024.0*1024.0)) / std::max(device.seconds, 1e-3);
+
+		Logger::Get().printf(Logger::Level::Info, "%-24s %-10s %2u readers %18s bytes %10.1f MB/s per reader\n", device.root.empty() ? "?" : device.root.c_str(), kindNames[static_cast<size_t>(device.kind)], device.limit, comma(device.bytes), rate);
+	}
+}
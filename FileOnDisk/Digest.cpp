@@ -0,0 +1,476 @@
+#include "stdafx.h"
+
+#include <utilities.h>
+#include <FileOnDisk.h>
+#include <Digest.h>
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+inline BOOL SafeCryptReleaseContext(HCRYPTPROV &hProv, DWORD dwFlags)
+{
+	if (0 != hProv)
+	{
+		if (CryptReleaseContext(hProv, dwFlags))
+		{
+			hProv = 0;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+inline BOOL SafeCryptDestroyHash(HCRYPTHASH &hHash)
+{
+	if (0 != hHash)
+	{
+		if (CryptDestroyHash(hHash))
+		{
+			hHash = 0;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+//=====================================================================================================================================================================================================
+// Md5DigestEngine
+//
+// MD5, from the CryptoAPI, which is what was always used before there was a choice
+//=====================================================================================================================================================================================================
+class Md5DigestEngine : public DigestEngine
+{
+public:
+	~Md5DigestEngine()
+	{
+		SafeCryptDestroyHash(this->hHash);
+		SafeCryptReleaseContext(this->hProv, 0);
+	}
+
+	bool Init()
+	{
+		// Get handle to the crypto provider
+		if (!CryptAcquireContext(&this->hProv, nullptr, nullptr, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+		{
+			return false;
+		}
+
+		// create the MD5 hash item
+		return !!CryptCreateHash(this->hProv, CALG_MD5, 0, 0, &this->hHash);
+	}
+
+	bool Update(const void *pData, size_t size) override
+	{
+		const BYTE *p = reinterpret_cast<const BYTE *>(pData);
+
+		while (size > 0)
+		{
+			DWORD cb = static_cast<DWORD>(std::min<size_t>(size, 0x40000000));
+
+			if (!CryptHashData(this->hHash, p, cb, 0))
+			{
+				return false;
+			}
+
+			p		+= cb;
+			size	-= cb;
+		}
+
+		return true;
+	}
+
+	bool Final(Md5Hash &hash) override
+	{
+		DWORD dwSize = sizeof(hash._data);
+
+		if (!CryptGetHashParam(this->hHash, HP_HASHVAL, hash._data, &dwSize, 0))
+		{
+			return false;
+		}
+
+		return (sizeof(hash._data) == dwSize);
+	}
+
+	bool Reset() override
+	{
+		// a CryptoAPI hash can't be reused once its value has been read, but the provider can
+		SafeCryptDestroyHash(this->hHash);
+		return !!CryptCreateHash(this->hProv, CALG_MD5, 0, 0, &this->hHash);
+	}
+
+private:
+	HCRYPTPROV		hProv = 0;
+	HCRYPTHASH		hHash = 0;
+};
+
+
+//=====================================================================================================================================================================================================
+// TreeDigestEngine
+//
+// Streams a tree flavor: the bytes go into the chunk engine, which is finished and started over
+// at each chunk boundary. It comes out the same as hashing the chunks separately.
+//=====================================================================================================================================================================================================
+class TreeDigestEngine : public DigestEngine
+{
+public:
+	TreeDigestEngine(DigestAlgorithm algorithm, std::unique_ptr<DigestEngine> chunkEngine)
+		: algorithm(algorithm), chunkEngine(std::move(chunkEngine))
+	{
+	}
+
+	bool Update(const void *pData, size_t size) override
+	{
+		const BYTE *p = reinterpret_cast<const BYTE *>(pData);
+
+		while (size > 0)
+		{
+			size_t cb = static_cast<size_t>(std::min<unsigned long long>(size, treeChunkSize - this->inChunk));
+
+			if (!this->chunkEngine->Update(p, cb))
+			{
+				return false;
+			}
+
+			p				+= cb;
+			size			-= cb;
+			this->inChunk	+= cb;
+			this->total		+= cb;
+
+			if ((treeChunkSize == this->inChunk) && !this->FinishChunk())
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	bool Final(Md5Hash &hash) override
+	{
+		// an empty file is one empty chunk, but a file that ends on a boundary doesn't get another
+		if (((this->inChunk > 0) || this->chunks.empty()) && !this->FinishChunk())
+		{
+			return false;
+		}
+
+		return DigestEngine::CombineChunks(this->algorithm, this->chunks, this->total, hash);
+	}
+
+	bool Reset() override
+	{
+		this->chunks.clear();
+		this->inChunk	= 0;
+		this->total		= 0;
+
+		return this->chunkEngine->Reset();
+	}
+
+private:
+	bool FinishChunk()
+	{
+		Md5Hash hash;
+
+		if (!this->chunkEngine->Final(hash) || !this->chunkEngine->Reset())
+		{
+			return false;
+		}
+
+		this->chunks.push_back(hash);
+		this->inChunk = 0;
+
+		return true;
+	}
+
+	DigestAlgorithm					algorithm;
+	std::unique_ptr<DigestEngine>	chunkEngine;
+	std::vector<Md5Hash>			chunks;
+	unsigned long long				inChunk = 0;
+	unsigned long long				total = 0;
+};
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+static DigestAlgorithm theAlgorithm = DigestAlgorithm::Md5;
+static long long theTreeThreshold = 1024*1024*1024;
+
+static const char *algorithmNames[] =
+{
+	"md5",
+	"blake3",
+	"xxh3",
+	"md5-tree",
+	"blake3-tree",
+	"xxh3-tree",
+};
+
+static_assert(_countof(algorithmNames) == static_cast<size_t>(DigestAlgorithm::Count), "algorithmNames doesn't match DigestAlgorithm");
+
+
+//=====================================================================================================================================================================================================
+// DigestEngine::Create
+//=====================================================================================================================================================================================================
+std::unique_ptr<DigestEngine> DigestEngine::Create(DigestAlgorithm algorithm)
+{
+	switch (algorithm)
+	{
+	case DigestAlgorithm::Md5:
+		{
+			std::unique_ptr<Md5DigestEngine> engine(new Md5DigestEngine());
+			if (!engine->Init())
+			{
+				Logger::Get().printf(Logger::Level::Error, "Error creating MD5 hash! (%S, %d)\n", GetLastErrorString(), GetLastError());
+				return nullptr;
+			}
+			return std::move(engine);
+		}
+
+	case DigestAlgorithm::Blake3:
+		return CreateBlake3DigestEngine();
+
+	case DigestAlgorithm::Xxh3:
+		return CreateXxh3DigestEngine();
+
+	case DigestAlgorithm::Md5Tree:
+	case DigestAlgorithm::Blake3Tree:
+	case DigestAlgorithm::Xxh3Tree:
+		{
+			std::unique_ptr<DigestEngine> chunkEngine = Create(GetChunkAlgorithm(algorithm));
+			if (!chunkEngine)
+			{
+				return nullptr;
+			}
+			return std::make_unique<TreeDigestEngine>(algorithm, std::move(chunkEngine));
+		}
+
+	default:
+		return nullptr;
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+bool DigestEngine::IsTree(DigestAlgorithm algorithm)
+{
+	return (GetChunkAlgorithm(algorithm) != algorithm);
+}
+
+DigestAlgorithm DigestEngine::GetChunkAlgorithm(DigestAlgorithm algorithm)
+{
+	switch (algorithm)
+	{
+	case DigestAlgorithm::Md5Tree:		return DigestAlgorithm::Md5;
+	case DigestAlgorithm::Blake3Tree:	return DigestAlgorithm::Blake3;
+	case DigestAlgorithm::Xxh3Tree:		return DigestAlgorithm::Xxh3;
+	default:							return algorithm;
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+// DigestEngine::CombineChunks
+//
+// The file's hash is the chunk algorithm's hash of the chunks' hashes, one after the other,
+// followed by the file's length (as 8 little-endian bytes)
+//=====================================================================================================================================================================================================
+bool DigestEngine::CombineChunks(DigestAlgorithm algorithm, const std::vector<Md5Hash> &chunks, unsigned long long size, Md5Hash &hash)
+{
+	std::unique_ptr<DigestEngine> engine = Create(GetChunkAlgorithm(algorithm));
+
+	if (!engine)
+	{
+		return false;
+	}
+
+	for (auto &chunk : chunks)
+	{
+		if (!engine->Update(chunk._data, sizeof(chunk._data)))
+		{
+			return false;
+		}
+	}
+
+	return engine->Update(&size, sizeof(size)) && engine->Final(hash);
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+long long DigestEngine::GetTreeThreshold()
+{
+	return theTreeThreshold;
+}
+
+void DigestEngine::SetTreeThreshold(long long threshold)
+{
+	theTreeThreshold = std::max(threshold, treeChunkSize);
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+DigestAlgorithm DigestEngine::GetAlgorithm()
+{
+	return theAlgorithm;
+}
+
+void DigestEngine::SetAlgorithm(DigestAlgorithm algorithm)
+{
+	theAlgorithm = algorithm;
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+const char *DigestEngine::GetAlgorithmName(DigestAlgorithm algorithm)
+{
+	size_t index = static_cast<size_t>(algorithm);
+	return (index < _countof(algorithmNames)) ? algorithmNames[index] : "unknown";
+}
+
+bool DigestEngine::ParseAlgorithmName(const char *pszName, DigestAlgorithm &algorithm)
+{
+	for (size_t index = 0; index < _countof(algorithmNames); index++)
+	{
+		if (0 == _stricmp(pszName, algorithmNames[index]))
+		{
+			algorithm = static_cast<DigestAlgorithm>(index);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+//=====================================================================================================================================================================================================
+// CpuHasAvx2
+//
+// The CPU has to have AVX2, and the OS has to be saving the YMM registers on a context switch
+//=====================================================================================================================================================================================================
+bool CpuHasAvx2()
+{
+	static const bool hasAvx2 = []()
+	{
+		int info[4];
+
+		__cpuid(info, 0);
+		if (info[0] < 7)
+		{
+			return false;
+		}
+
+		// OSXSAVE and AVX
+		__cpuid(info, 1);
+		if ((info[2] & ((1 << 27) | (1 << 28))) != ((1 << 27) | (1 << 28)))
+		{
+			return false;
+		}
+
+		// XMM and YMM state
+		if ((_xgetbv(0) & 6) != 6)
+		{
+			return false;
+		}
+
+		__cpuidex(info, 7, 0);
+		return (0 != (info[1] & (1 << 5)));
+	}();
+
+	return hasAvx2;
+}
+
+
+//=====================================================================================================================================================================================================
+// BenchmarkDigestAlgorithms
+//
+// Hash the same buffer with each of the algorithms, so that we can see how much faster than the
+// disk each one is on this machine. The buffer is in memory, so this is just the cost of the
+// hashing itself.
+//=====================================================================================================================================================================================================
+void BenchmarkDigestAlgorithms()
+{
+	const size_t bufferSize = 256*1024*1024;
+	const size_t updateSize = 1024*1024;			// the same as files are read in, by default
+
+	std::vector<unsigned char> buffer(bufferSize);
+
+	// something that isn't all zeros
+	unsigned long long x = 0x9E3779B97F4A7C15;
+	for (size_t i = 0; i < bufferSize; i += sizeof(x))
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		memcpy(&buffer[i], &x, sizeof(x));
+	}
+
+	Logger::Get().printf(Logger::Level::Info, "Hashing %s bytes with each algorithm (AVX2 %s)...\n", comma(bufferSize), CpuHasAvx2() ? "available" : "not available");
+
+	for (size_t index = 0; index < static_cast<size_t>(DigestAlgorithm::Count); index++)
+	{
+		if (ControlCHandler::TestShouldTerminate())
+		{
+			break;
+		}
+
+		DigestAlgorithm algorithm = static_cast<DigestAlgorithm>(index);
+		std::unique_ptr<DigestEngine> engine = DigestEngine::Create(algorithm);
+
+		if (!engine)
+		{
+			continue;
+		}
+
+		Md5Hash hash;
+		bool result = true;
+
+		auto start = std::chrono::high_resolution_clock::now();
+
+		for (size_t offset = 0; result && (offset < bufferSize); offset += updateSize)
+		{
+			result = engine->Update(&buffer[offset], updateSize);
+		}
+
+		result = result && engine->Final(hash);
+
+		auto end = std::chrono::high_resolution_clock::now();
+		double seconds = std::chrono::duration<double>(end - start).count();
+
+		if (!result)
+		{
+			Logger::Get().printf(Logger::Level::Error, "Error hashing with %s!\n", DigestEngine::GetAlgorithmName(algorithm));
+			continue;
+		}
+
+		Logger::Get().printf(Logger::Level::Info, "%-8s %10.1f MB/s   %s\n", DigestEngine::GetAlgorithmName(algorithm), (bufferSize / (1024.0*1024.0)) / std::max(seconds, 1e-9), hash.ToString());
+	}
+
+	// the same buffer, cut up into one piece per lane, as MD5 does with small files
+	if (!ControlCHandler::TestShouldTerminate())
+	{
+		size_t lanes = Md5LaneCount();
+		std::vector<const unsigned char *> pieces;
+		std::vector<size_t> sizes(lanes, bufferSize / lanes);
+		std::vector<Md5Hash> hashes(lanes);
+
+		for (size_t lane = 0; lane < lanes; lane++)
+		{
+			pieces.push_back(&buffer[lane * (bufferSize / lanes)]);
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		Md5HashBuffers(pieces.data(), sizes.data(), lanes, hashes.data());
+		auto end = std::chrono::high_resolution_clock::now();
+		double seconds = std::chrono::duration<double>(end - start).count();
+
+		Logger::Get().printf(Logger::Level::Info, "md5 x%-3s %10.1f MB/s\n", comma(lanes), (bufferSize / (1024.0*1024.0)) / std::max(seconds, 1e-9));
+	}
+}
@@ -0,0 +1,350 @@
+#include "stdafx.h"
+
+#include <utilities.h>
+#include <FileOnDisk.h>
+#include <ProgressBar.h>
+#include <Digest.h>
+#include <FileHasher.h>
+
+static size_t theBlockSize	= FileHasher::defaultBlockSize;
+static size_t theQueueDepth	= FileHasher::defaultQueueDepth;
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void FileHasher::SetBlockSize(size_t blockSize)
+{
+	// unbuffered reads have to be whole sectors into sector-aligned memory; a page covers any sector size
+	const size_t pageSize = 4096;
+
+	blockSize = std::max<size_t>(blockSize, 64*1024);
+	blockSize = std::min<size_t>(blockSize, 256*1024*1024);
+
+	theBlockSize = (blockSize + pageSize - 1) & ~(pageSize - 1);
+}
+
+void FileHasher::SetQueueDepth(size_t queueDepth)
+{
+	theQueueDepth = std::max<size_t>(1, std::min<size_t>(queueDepth, maxQueueDepth));
+}
+
+size_t FileHasher::GetBlockSize()
+{
+	return theBlockSize;
+}
+
+size_t FileHasher::GetQueueDepth()
+{
+	return theQueueDepth;
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+FileHasher &FileHasher::ForThisThread()
+{
+	static thread_local FileHasher hasher;
+	return hasher;
+}
+
+FileHasher::~FileHasher()
+{
+	this->FreeRing();
+}
+
+
+//=====================================================================================================================================================================================================
+// FileHasher::PrepareRing
+//
+// Make sure the buffers (and their events) match the current block size and queue depth. All the
+// buffers come from one allocation, which is page-aligned.
+//=====================================================================================================================================================================================================
+bool FileHasher::PrepareRing()
+{
+	size_t blockSize	= GetBlockSize();
+	size_t queueDepth	= GetQueueDepth();
+
+	if ((nullptr != this->pRing) && (this->blockSize == blockSize) && (this->slots.size() == queueDepth))
+	{
+		return true;
+	}
+
+	this->FreeRing();
+
+	this->pRing = reinterpret_cast<BYTE *>(VirtualAlloc(nullptr, blockSize * queueDepth, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+	if (nullptr == this->pRing)
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error allocating %s bytes for reading! (%S, %d)\n", comma(blockSize * queueDepth), GetLastErrorString(), GetLastError());
+		return false;
+	}
+
+	this->blockSize = blockSize;
+	this->slots.resize(queueDepth);
+
+	for (size_t index = 0; index < queueDepth; index++)
+	{
+		Slot &slot = this->slots[index];
+
+		ZeroMemory(&slot.Overlapped, sizeof(slot.Overlapped));
+		slot.pBuffer	= this->pRing + (index * blockSize);
+		slot.Pending	= false;
+
+		slot.Overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+		if (nullptr == slot.Overlapped.hEvent)
+		{
+			Logger::Get().printf(Logger::Level::Error, "Error creating an event! (%S, %d)\n", GetLastErrorString(), GetLastError());
+			this->FreeRing();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void FileHasher::FreeRing()
+{
+	for (auto &slot : this->slots)
+	{
+		if (nullptr != slot.Overlapped.hEvent)
+		{
+			CloseHandle(slot.Overlapped.hEvent);
+		}
+	}
+
+	this->slots.clear();
+
+	if (nullptr != this->pRing)
+	{
+		VirtualFree(this->pRing, 0, MEM_RELEASE);
+		this->pRing = nullptr;
+	}
+
+	this->blockSize = 0;
+}
+
+
+//=====================================================================================================================================================================================================
+// FileHasher::PrepareEngine
+//
+// Reuse the engine from the last file if it's for the same algorithm
+//=====================================================================================================================================================================================================
+bool FileHasher::PrepareEngine(DigestAlgorithm algorithm)
+{
+	if (this->engine && (this->engineAlgorithm == algorithm))
+	{
+		if (this->engine->Reset())
+		{
+			return true;
+		}
+	}
+
+	this->engine = DigestEngine::Create(algorithm);
+	this->engineAlgorithm = algorithm;
+
+	return !!this->engine;
+}
+
+
+//=====================================================================================================================================================================================================
+// FileHasher::IssueRead
+//
+// Start reading the block at offset into the slot. atEnd is set if the read can't be started
+// because the offset is past the end of the file.
+//=====================================================================================================================================================================================================
+bool FileHasher::IssueRead(HANDLE hFile, Slot &slot, LONGLONG offset, bool &atEnd)
+{
+	HANDLE hEvent = slot.Overlapped.hEvent;
+
+	ZeroMemory(&slot.Overlapped, sizeof(slot.Overlapped));
+	slot.Overlapped.hEvent		= hEvent;
+	slot.Overlapped.Offset		= static_cast<DWORD>(offset);
+	slot.Overlapped.OffsetHigh	= static_cast<DWORD>(offset >> 32);
+
+	// even if it finishes right away, the result is still collected with GetOverlappedResult
+	if (ReadFile(hFile, slot.pBuffer, static_cast<DWORD>(this->blockSize), nullptr, &slot.Overlapped) || (ERROR_IO_PENDING == GetLastError()))
+	{
+		slot.Pending = true;
+		return true;
+	}
+
+	if (ERROR_HANDLE_EOF == GetLastError())
+	{
+		atEnd = true;
+		return true;
+	}
+
+	Logger::Get().printf(Logger::Level::Error, "Error reading! (%S, %d)\n", GetLastErrorString(), GetLastError());
+	return false;
+}
+
+
+//=====================================================================================================================================================================================================
+// FileHasher::CancelPending
+//
+// The buffers are used again for the next file, so any reads still going have to be finished
+// (or cancelled) before we give up on this one
+//=====================================================================================================================================================================================================
+void FileHasher::CancelPending(HANDLE hFile)
+{
+	CancelIoEx(hFile, nullptr);
+
+	for (auto &slot : this->slots)
+	{
+		if (slot.Pending)
+		{
+			DWORD cbRead = 0;
+			GetOverlappedResult(hFile, &slot.Overlapped, &cbRead, TRUE);
+			slot.Pending = false;
+		}
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+// FileHasher::HashFile
+//=====================================================================================================================================================================================================
+bool FileHasher::HashFile(const char *szFileName, Md5Hash &hash, ProgressBar *pb)
+{
+	return this->HashRange(szFileName, 0, -1, DigestEngine::GetAlgorithm(), hash, pb);
+}
+
+
+//=====================================================================================================================================================================================================
+// FileHasher::HashRange
+//
+// The ring is filled with reads up front; then the blocks are hashed in order as their reads
+// finish, and each slot is handed back to the disk (for the next block after the ones already
+// in flight) as soon as it's been hashed. The reads in flight always form one run starting at
+// the slot being waited on, so when that slot has nothing pending, we're done.
+//=====================================================================================================================================================================================================
+bool FileHasher::HashRange(const char *szFileName, long long offset, long long length, DigestAlgorithm algorithm, Md5Hash &hash, ProgressBar *pb)
+{
+	if (!this->PrepareRing() || !this->PrepareEngine(algorithm))
+	{
+		return false;
+	}
+
+	// unbuffered, the reads go straight into our buffers, but not everything allows it (e.g., some network shares)
+	HANDLE hFile = CreateFileU(szFileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+	if (INVALID_HANDLE_VALUE == hFile)
+	{
+		hFile = CreateFileU(szFileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	}
+
+	if (INVALID_HANDLE_VALUE == hFile)
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error opening \"%s\"! (%S, %d)\n", szFileName, GetLastErrorString(), GetLastError());
+		return false;
+	}
+
+	LARGE_INTEGER filesize;
+	if (!GetFileSizeEx(hFile, &filesize))
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error getting the size of \"%s\"! (%S, %d)\n", szFileName, GetLastErrorString(), GetLastError());
+		SafeCloseHandle(hFile);
+		return false;
+	}
+
+	const size_t queueDepth = this->slots.size();
+	const LONGLONG blockSize = static_cast<LONGLONG>(this->blockSize);
+
+	// where to stop (the last block read may go past it)
+	LONGLONG end = filesize.QuadPart;
+	if ((length >= 0) && (offset + length < end))
+	{
+		end = offset + length;
+	}
+
+	LONGLONG nextOffset = offset;
+	LONGLONG readSoFar = 0;
+	LONGLONG toRead = std::max<LONGLONG>(end - offset, 0);
+	LONGLONG updateProgressBarAmount = toRead / 1000;
+	LONGLONG nextProgressBarUpdate = updateProgressBarAmount;
+	bool atEnd = false;
+	bool result = true;
+
+	if (nullptr != pb)
+	{
+		pb->Update(readSoFar, toRead);
+	}
+
+	// fill the ring
+	for (size_t index = 0; result && !atEnd && (index < queueDepth) && (nextOffset < end); index++)
+	{
+		result = this->IssueRead(hFile, this->slots[index], nextOffset, atEnd);
+		nextOffset += blockSize;
+	}
+
+	for (size_t head = 0; result && this->slots[head].Pending; head = (head + 1) % queueDepth)
+	{
+		Slot &slot = this->slots[head];
+		DWORD cbRead = 0;
+
+		BOOL completed = GetOverlappedResult(hFile, &slot.Overlapped, &cbRead, TRUE);
+		slot.Pending = false;
+
+		if (!completed)
+		{
+			if (ERROR_HANDLE_EOF != GetLastError())
+			{
+				Logger::Get().printf(Logger::Level::Error, "Error reading \"%s\"! (%S, %d)\n", szFileName, GetLastErrorString(), GetLastError());
+				result = false;
+				break;
+			}
+
+			cbRead = 0;
+		}
+
+		if (ControlCHandler::TestShouldTerminate())
+		{
+			result = false;
+			break;
+		}
+
+		// a short read means the file got shorter after we got its size
+		if (cbRead < static_cast<DWORD>(blockSize))
+		{
+			atEnd = true;
+		}
+
+		DWORD cbWanted = static_cast<DWORD>(std::min<LONGLONG>(cbRead, toRead - readSoFar));
+
+		if ((cbWanted > 0) && !this->engine->Update(slot.pBuffer, cbWanted))
+		{
+			result = false;
+			break;
+		}
+
+		readSoFar += cbWanted;
+		if ((nullptr != pb) && (readSoFar >= nextProgressBarUpdate))
+		{
+			pb->Update(readSoFar, toRead);
+			nextProgressBarUpdate += updateProgressBarAmount;
+		}
+
+		// this slot's been hashed, so it can go back to the disk
+		if (!atEnd && (nextOffset < end))
+		{
+			result = this->IssueRead(hFile, slot, nextOffset, atEnd);
+			nextOffset += blockSize;
+		}
+	}
+
+	if (!result)
+	{
+		this->CancelPending(hFile);
+	}
+
+	SafeCloseHandle(hFile);
+
+	if (result)
+	{
+		result = this->engine->Final(hash);
+	}
+
+	return result;
+}
@@ -5,6 +5,15 @@
 #include <HardLink.h>
 #include <console.h>
 #include <ProgressBar.h>
+#include <WorkQueue.h>
+#include <ThreadPool.h>
+#include <DeviceScheduler.h>
+#include <ScanSnapshot.h>
+#include <Md5CacheRegistry.h>
+#include <HashCacheStore.h>
+#include <Digest.h>
+#include <FileHasher.h>
+#include <BatchHasher.h>
 
 const size_t maxString = 1024 * 8;
 
@@ -22,9 +31,11 @@ static const char *szFileNamesToSafelyDelete[] = { FILE_NAMES_TO_IGNORE,"AlbumAr
 //=====================================================================================================================================================================================================
 // Internal functions
 //=====================================================================================================================================================================================================
-static void ProcessFolder(const char *szName, FileOnDiskSet &files, int depth, bool clean);
-static void ProcessFile(const char *szFolderName, WIN32_FIND_DATAA *pfd, FileOnDiskSet &files, int depth, std::unordered_map<Path,const Md5CacheItem *> *pumap, bool clean);
-static bool GetFileMd5Hash(const char *szFileName, Md5Hash &hash, bool verbose);
+struct FolderEntry;
+static void ProcessFolder(const char *szName, FileOnDiskSet &files, int depth, bool clean, std::vector<std::string> *pSubFolders=nullptr);
+static void ProcessFile(const char *szFolderName, const FolderEntry &entry, const char *szName, FileOnDiskSet &files, int depth, const Md5CacheEntry *pcache, bool clean, std::vector<std::string> *pSubFolders);
+static bool GetFileMd5Hash(const char *szFileName, Md5Hash &hash, bool verbose, bool lookForLinks=true);
+static bool GetHardLinkedHash(const char *szFileName, Md5Hash &hash, bool verbose);
 static bool GetCachedHash(const char *szFileName, Md5Hash &hash, bool verbose);
 
 #define MAX_STRING 1024
@@ -38,6 +49,61 @@ Md5Hash Md5Hash::NullHash;
 int FileOnDiskSet::_numCores = -1;
 
 
+//=====================================================================================================================================================================================================
+// Path::HashOf
+//
+// Hash the path as though its case had been folded, without making a folded copy of it. It goes
+// 16 bytes at a time: a block that's all ASCII has its upper-case letters folded with a couple of
+// SSE2 compares, and one with anything else in it is folded a byte at a time with FoldPathChar
+// (which folds just like _stricmp, so the hash always agrees with Path's operator ==). Each block
+// is then mixed into the hash as two 64-bit words.
+//=====================================================================================================================================================================================================
+size_t Path::HashOf(const char *psz)
+{
+	const unsigned long long multiplier = 0x9E3779B97F4A7C15ull;
+
+	size_t length = strlen(psz);
+	unsigned long long hash = (length + 1) * multiplier;
+
+	for (size_t offset = 0; offset < length; offset += 16)
+	{
+		size_t count = std::min<size_t>(length - offset, 16);
+
+		alignas(16) unsigned char block[16] = {0};
+		memcpy(block, psz + offset, count);
+
+#if !FILEONDISK_CASE_SENSITIVE_PATHS
+		__m128i bytes = _mm_load_si128(reinterpret_cast<const __m128i *>(block));
+
+		if (0 == _mm_movemask_epi8(bytes))
+		{
+			__m128i isUpper = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('Z' + 1)));
+			bytes = _mm_or_si128(bytes, _mm_and_si128(isUpper, _mm_set1_epi8(0x20)));
+			_mm_store_si128(reinterpret_cast<__m128i *>(block), bytes);
+		}
+		else
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				block[i] = static_cast<unsigned char>(FoldPathChar(static_cast<char>(block[i])));
+			}
+		}
+#endif
+
+		unsigned long long words[2];
+		memcpy(words, block, sizeof(words));
+
+		for (auto word : words)
+		{
+			hash = (hash ^ word) * multiplier;
+			hash ^= hash >> 29;
+		}
+	}
+
+	return static_cast<size_t>(hash ^ (hash >> 32));
+}
+
+
 //=====================================================================================================================================================================================================
 //=====================================================================================================================================================================================================
 inline long long GetWin32FindDataFileSize(const WIN32_FIND_DATAA &fd)
@@ -110,80 +176,229 @@ inline std::string GetCacheFileName(const std::string folderName)
 
 
 //=====================================================================================================================================================================================================
+// FolderEntry
+//
+// What we keep for each item in a folder while it's being processed. It's a small fraction of a
+// WIN32_FIND_DATAA, and the name lives in a separate, densely packed string buffer.
 //=====================================================================================================================================================================================================
-template <typename _ProcessFileFunctor> void ProcessFilesInFolder(const char *szFolderName, int depth, _ProcessFileFunctor processFileFunc, bool ignoreKnownTypes=true)
+struct FolderEntry
 {
-	std::string fileSearchSpec{GetFolderWildcard(szFolderName)};
+	size_t		Name;				// offset into FolderEntryArena::Names
+	long long	Size;
+	FILETIME	Time;				// last write time
+	DWORD		Attributes;
+	ULONGLONG	FileId;				// 0 if the enumerator couldn't tell us
 
-	HANDLE				hFile;
-	WIN32_FIND_DATAA	fd;
+	inline bool IsFolder() const
+	{
+		return 0 != (this->Attributes & FILE_ATTRIBUTE_DIRECTORY);
+	}
+};
 
-	const size_t directoryStartSize = 32;
-	std::vector<WIN32_FIND_DATAA>	fds;
-	fds.reserve(directoryStartSize);
+//=====================================================================================================================================================================================================
+// FolderEntryArena
+//
+// Per-thread storage for the folder entries. A folder marks where the arena ends when it starts,
+// appends its entries, and gives them all back when it's done. Folders that recurse into their
+// sub-folders therefore stack up on top of each other, and the memory gets reused over and over
+// rather than reallocated for every folder.
+//=====================================================================================================================================================================================================
+struct FolderEntryArena
+{
+	// if a really big folder grew the arena past this, hand the memory back once we're done with it
+	static const size_t MaxRetainedEntries = 64 * 1024;
 
-	hFile = FindFirstFileExU(fileSearchSpec.c_str(), FindExInfoBasic, reinterpret_cast<void *>(&fd), FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
-	if (hFile != INVALID_HANDLE_VALUE)
+	std::vector<FolderEntry>	Entries;
+	std::vector<char>			Names;
+
+	inline const char *GetName(const FolderEntry &entry) const
 	{
-		do
+		return &this->Names[entry.Name];
+	}
+
+	void Add(FolderEntry &entry, const char *szName, size_t nameLength)
+	{
+		entry.Name = this->Names.size();
+		this->Names.insert(this->Names.end(), szName, szName + nameLength);
+		this->Names.push_back(0);
+		this->Entries.push_back(entry);
+	}
+
+	void Release(size_t entriesMark, size_t namesMark)
+	{
+		this->Entries.resize(entriesMark);
+		this->Names.resize(namesMark);
+
+		if ((0 == entriesMark) && (this->Entries.capacity() > MaxRetainedEntries))
 		{
-			// skip reparse points
-			if (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
-			{
-				continue;
-			}
+			this->Entries.shrink_to_fit();
+			this->Names.shrink_to_fit();
+		}
+	}
+
+	static FolderEntryArena &Get()
+	{
+		static thread_local FolderEntryArena arena;
+		return arena;
+	}
+};
+
+//=====================================================================================================================================================================================================
+// Should this directory entry be skipped altogether?
+//=====================================================================================================================================================================================================
+static bool IgnoreFolderEntry(const char *szName, DWORD attributes, bool ignoreKnownTypes)
+{
+	// skip reparse points
+	if (attributes & FILE_ATTRIBUTE_REPARSE_POINT)
+	{
+		return true;
+	}
 
-			if (ignoreKnownTypes)
+	if (0 == (attributes & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		if (ignoreKnownTypes)
+		{
+			for (auto& pszFileNameToIgnore : szFileNamesToIgnore)
 			{
-				if (0 == (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-				{
-					for (auto& pszFileNameToIgnore : szFileNamesToIgnore)
-					{
-						if (0 == _stricmp(fd.cFileName, pszFileNameToIgnore))
-						{
-							goto continueloop;
-						}
-					}
-				}
-				else
+				if (0 == ComparePathStrings(szName, pszFileNameToIgnore))
 				{
-					for (auto& pszFolderNameToIgnore : szFolderNamesToIgnore)
-					{
-						if (0 == _stricmp(fd.cFileName, pszFolderNameToIgnore))
-						{
-							goto continueloop;
-						}
-					}
+					return true;
 				}
 			}
-			else
+		}
+		else
+		{
+			for (auto& pszFileNameToIgnore : szFileNamesToAlwaysIgnore)
 			{
-				if (0 == (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-				{
-					for (auto& pszFileNameToIgnore : szFileNamesToAlwaysIgnore)
-					{
-						if (0 == _stricmp(fd.cFileName, pszFileNameToIgnore))
-						{
-							goto continueloop;
-						}
-					}
-				}
-				else
+				if (0 == ComparePathStrings(szName, pszFileNameToIgnore))
 				{
-					for (auto& pszFolderNameToIgnore : szFolderNamesToIgnore)
-					{
-						if (0 == _stricmp(fd.cFileName, pszFolderNameToIgnore))
-						{
-							goto continueloop;
-						}
-					}
+					return true;
 				}
 			}
+		}
+	}
+	else
+	{
+		for (auto& pszFolderNameToIgnore : szFolderNamesToIgnore)
+		{
+			if (0 == ComparePathStrings(szName, pszFolderNameToIgnore))
+			{
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+//=====================================================================================================================================================================================================
+// EnumerateFolderByHandle
+//
+// Open the folder itself and read its entries straight off the handle, many at a time, with
+// GetFileInformationByHandleEx. This skips building a wildcard path for FindFirstFile, and
+// the per-entry wide-to-UTF-8 std::string conversions that FindFirstFileExU/FindNextFileU do.
+//
+// Returns false if the file system doesn't support this, in which case nothing was enumerated
+// and the caller should fall back to FindFirstFile.
+//=====================================================================================================================================================================================================
+template <typename _AddEntryFunctor> static bool EnumerateFolderByHandle(const char *szFolderName, _AddEntryFunctor addEntryFunc)
+{
+	const size_t folderBufferSize = 64 * 1024;
+
+	// FILE_ID_BOTH_DIR_INFO needs 8-byte alignment
+	static thread_local std::vector<LONGLONG> buffer(folderBufferSize / sizeof(LONGLONG));
+
+	HANDLE hFolder = CreateFileU(szFolderName, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+
+	if ((nullptr == hFolder) || (INVALID_HANDLE_VALUE == hFolder))
+	{
+		auto err = GetLastError();
+		Logger::Get().printf(Logger::Level::Error, "Error %d accessing path \"%s\"\n", err, szFolderName);
+		return true;
+	}
+
+	// a name is at most 255 UTF-16 characters, and each of those is at most 3 UTF-8 bytes
+	char					szName[MAX_PATH * 3];
+	FolderEntry				entry = {0};
+	FILE_INFO_BY_HANDLE_CLASS	infoClass = FileIdBothDirectoryRestartInfo;
+
+	while (GetFileInformationByHandleEx(hFolder, infoClass, &buffer[0], static_cast<DWORD>(buffer.size() * sizeof(buffer[0]))))
+	{
+		infoClass = FileIdBothDirectoryInfo;
+
+		const BYTE *p = reinterpret_cast<const BYTE *>(&buffer[0]);
+
+		for (;;)
+		{
+			const FILE_ID_BOTH_DIR_INFO *pinfo = reinterpret_cast<const FILE_ID_BOTH_DIR_INFO *>(p);
+
+			int nameLength = WideCharToMultiByte(CP_UTF8, 0, pinfo->FileName, static_cast<int>(pinfo->FileNameLength / sizeof(WCHAR)), szName, ARRAYSIZE(szName) - 1, nullptr, nullptr);
+			szName[nameLength] = 0;
+
+			entry.Attributes			= pinfo->FileAttributes;
+			entry.Size					= pinfo->EndOfFile.QuadPart;
+			entry.Time.dwLowDateTime	= pinfo->LastWriteTime.LowPart;
+			entry.Time.dwHighDateTime	= pinfo->LastWriteTime.HighPart;
+			entry.FileId				= static_cast<ULONGLONG>(pinfo->FileId.QuadPart);
+
+			if (nameLength > 0)
+			{
+				addEntryFunc(entry, szName, static_cast<size_t>(nameLength));
+			}
+
+			if (0 == pinfo->NextEntryOffset)
+			{
+				break;
+			}
+
+			p += pinfo->NextEntryOffset;
+		}
+	}
+
+	auto err = GetLastError();
+	CloseHandle(hFolder);
 
+	if (FileIdBothDirectoryRestartInfo == infoClass)
+	{
+		// never got a single batch back
+		if ((ERROR_INVALID_PARAMETER == err) || (ERROR_INVALID_LEVEL == err) || (ERROR_NOT_SUPPORTED == err) || (ERROR_INVALID_FUNCTION == err))
+		{
+			return false;
+		}
+	}
+
+	if ((ERROR_NO_MORE_FILES != err) && (ERROR_SUCCESS != err))
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error %d accessing path \"%s\"\n", err, szFolderName);
+	}
+
+	return true;
+}
+
+//=====================================================================================================================================================================================================
+// EnumerateFolderByFindFile
+//
+// The FindFirstFile way of doing it, which works everywhere
+//=====================================================================================================================================================================================================
+template <typename _AddEntryFunctor> static void EnumerateFolderByFindFile(const char *szFolderName, _AddEntryFunctor addEntryFunc)
+{
+	std::string fileSearchSpec{GetFolderWildcard(szFolderName)};
+
+	HANDLE				hFile;
+	WIN32_FIND_DATAA	fd;
+	FolderEntry			entry = {0};
 
-			fds.push_back(fd);
+	hFile = FindFirstFileExU(fileSearchSpec.c_str(), FindExInfoBasic, reinterpret_cast<void *>(&fd), FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+	if (hFile != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			entry.Attributes	= fd.dwFileAttributes;
+			entry.Size			= GetWin32FindDataFileSize(fd);
+			entry.Time			= fd.ftLastWriteTime;
+			entry.FileId		= 0;
 
-		continueloop:;
+			addEntryFunc(entry, fd.cFileName, strlen(fd.cFileName));
 
 		} while (FindNextFileU(hFile, &fd));
 
@@ -195,91 +410,129 @@ template <typename _ProcessFileFunctor> void ProcessFilesInFolder(const char *sz
 		Logger::Get().printf(Logger::Level::Error, "Error %d accessing path \"%s\"\n", err, fileSearchSpec.c_str());
 		__nop();
 	}
+}
+
+//=====================================================================================================================================================================================================
+// Define this to always enumerate with FindFirstFile, e.g. to compare scan times
+//=====================================================================================================================================================================================================
+//#define ENUMERATE_FOLDERS_WITH_FINDFIRSTFILE
+
+//=====================================================================================================================================================================================================
+// ProcessFilesInFolder
+//
+// Calls processFileFunc(szFolderName, entry, szName, depth) for each file in the folder, then
+// for each sub-folder. The entry is a copy, and the name stays valid for the duration of the
+// call, so the functor is free to recurse into ProcessFilesInFolder again.
+//=====================================================================================================================================================================================================
+template <typename _ProcessFileFunctor> void ProcessFilesInFolder(const char *szFolderName, int depth, _ProcessFileFunctor processFileFunc, bool ignoreKnownTypes=true)
+{
+	FolderEntryArena &arena	= FolderEntryArena::Get();
+	const size_t entriesMark	= arena.Entries.size();
+	const size_t namesMark		= arena.Names.size();
 
-	// folders
-	for (auto &fd : fds)
+	auto addEntry = [&arena, ignoreKnownTypes](FolderEntry &entry, const char *szName, size_t nameLength)
 	{
-		if (0 == (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		if (!IgnoreFolderEntry(szName, entry.Attributes, ignoreKnownTypes))
 		{
-			processFileFunc(szFolderName, &fd, depth);
+			arena.Add(entry, szName, nameLength);
 		}
+	};
+
+#ifdef ENUMERATE_FOLDERS_WITH_FINDFIRSTFILE
+	EnumerateFolderByFindFile(szFolderName, addEntry);
+#else
+	if (!EnumerateFolderByHandle(szFolderName, addEntry))
+	{
+		EnumerateFolderByFindFile(szFolderName, addEntry);
 	}
+#endif
+
+	const size_t entriesEnd = arena.Entries.size();
 
 	// files
-	for (auto &fd : fds)
+	for (size_t i = entriesMark; i < entriesEnd; i++)
 	{
-		if (0 != (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		const FolderEntry entry = arena.Entries[i];
+
+		if (!entry.IsFolder())
+		{
+			processFileFunc(szFolderName, entry, arena.GetName(entry), depth);
+		}
+	}
+
+	// folders: these may recurse and grow the arena underneath us, so hang on to a copy of the name
+	for (size_t i = entriesMark; i < entriesEnd; i++)
+	{
+		const FolderEntry entry = arena.Entries[i];
+
+		if (entry.IsFolder())
 		{
-			processFileFunc(szFolderName, &fd, depth);
+			const std::string name{arena.GetName(entry)};
+			processFileFunc(szFolderName, entry, name.c_str(), depth);
 		}
 	}
 
+	arena.Release(entriesMark, namesMark);
+
 	return;
 }
 
 //=====================================================================================================================================================================================================
+// ProcessFolder
+//
+// If pSubFolders is given, subfolders are handed back to the caller instead of being recursed
+// into, which is how the parallel scan spreads folders across its workers.
 //=====================================================================================================================================================================================================
-void ProcessFolder(const char *szFolderName, FileOnDiskSet &files, int depth, bool clean)
+void ProcessFolder(const char *szFolderName, FileOnDiskSet &files, int depth, bool clean, std::vector<std::string> *pSubFolders)
 {
 	if (ControlCHandler::TestShouldTerminate())
 	{
 		return;
 	}
 
-	// rename .bin to .md5
-	auto foldercache = GetCacheFileName(szFolderName);
-
-	Md5Cache			cache;
 	Md5Cache			newCache;
-	std::unordered_map<Path,const Md5CacheItem *> umap;
-	std::unordered_map<Path,const Md5CacheItem *> *pumap = nullptr;
+	auto				pcache = HashCacheStore::Get().LoadFolder(szFolderName);
+	size_t				cacheItemCount = 0;
 
+	if (pcache)
 	{
-		if (cache.Load(foldercache.c_str()))
-		{
-			for (auto &item : cache.Items)
-			{
-				umap[cache.GetFileName(item)] = &item;
-			}
-
-			pumap = &umap;
+		cacheItemCount = pcache->Cache.Items.size();
 
-			if (clean)
-			{
-				newCache.Items.reserve(cache.Items.size());
-				newCache.Strings.reserve(cache.Strings.size());
-			}
+		if (clean)
+		{
+			newCache.Items.reserve(pcache->Cache.Items.size());
+			newCache.Strings.reserve(pcache->Cache.Strings.size());
 		}
 	}
 
-	ProcessFilesInFolder(szFolderName, depth, [&pumap,&files,&clean,&cache,&newCache](const char *szFolderName, WIN32_FIND_DATAA *pfd, int depth)
+	ProcessFilesInFolder(szFolderName, depth, [&pcache,&files,&clean,&newCache,&pSubFolders](const char *szFolderName, const FolderEntry &entry, const char *szName, int depth)
 	{
 		if (ControlCHandler::TestShouldTerminate())
 		{
 			return;
 		}
 
-		ProcessFile(szFolderName, pfd, files, depth, pumap, clean);
+		ProcessFile(szFolderName, entry, szName, files, depth, pcache.get(), clean, pSubFolders);
 
-		if (clean && pumap)
+		if (clean && pcache)
 		{
-			if (0 == (pfd->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			if (!entry.IsFolder())
 			{
-				if (pumap->find(pfd->cFileName) != pumap->end())
-				{
-					const Md5CacheItem *pitem = (*pumap)[pfd->cFileName];
+				const Md5CacheItem *pitem = pcache->FindItem(szName);
 
-					if (pitem->Size != GetWin32FindDataFileSize(*pfd))
+				if (nullptr != pitem)
+				{
+					if (pitem->Size != entry.Size)
 					{
 						// remove it
 						__nop();
 					}
-					else if (FileTimeDifference(pitem->Time, pfd->ftLastWriteTime) != 0)
+					else if (FileTimeDifference(pitem->Time, entry.Time) != 0)
 					{
 						// remove it
 						__nop();
 					}
-					else if (pitem->Hash == Md5Hash::NullHash)
+					else if ((pitem->Hash == Md5Hash::NullHash) && (0 == (pitem->Flags & (HASHCACHE_ITEM_HEAD | HASHCACHE_ITEM_TAIL))))
 					{
 						// remove it
 						__nop();
@@ -289,7 +542,7 @@ void ProcessFolder(const char *szFolderName, FileOnDiskSet &files, int depth, bo
 						// add it to the new cache!!
 						Md5CacheItem newItem = *pitem;
 						newItem.Name = static_cast<long>(newCache.Strings.size());
-						const char *pszName = cache.GetFileName(*pitem);
+						const char *pszName = pcache->Cache.GetFileName(*pitem);
 						size_t nameSize = strlen(pszName);
 						newCache.Strings.insert(newCache.Strings.end(), pszName, pszName + nameSize + 1);
 						newCache.Items.push_back(newItem);
@@ -315,20 +568,27 @@ void ProcessFolder(const char *szFolderName, FileOnDiskSet &files, int depth, bo
 
 	if (clean)
 	{
-		if (0 == newCache.Items.size() && (0 != cache.Items.size()))
+		// the cache file may still be mapped, and then it can't be rewritten or deleted
+		pcache.reset();
+		HashCacheStore::Get().Release(szFolderName);
+
+		if (0 == newCache.Items.size() && (0 != cacheItemCount))
 		{
 			// we have an MD5CACHE.md5 file, but we don't have ANY files that still work with it, so delete the file altogether!
-			Logger::Get().printf(Logger::Level::Info, "Deleting  cache file (from %d to %d items) \"%s\"\n", cache.Items.size(), newCache.Items.size(), foldercache.c_str());
-			if (!DeleteFileA(foldercache.c_str()))
+			Logger::Get().printf(Logger::Level::Info, "Deleting  cache (from %d to %d items) for \"%s\"\n", cacheItemCount, newCache.Items.size(), szFolderName);
+			if (!HashCacheStore::Get().Remove(szFolderName))
 			{
 				Logger::Get().printf(Logger::Level::Info, "     couldn't delete.\n");
 			}
 		}
-		else if (newCache.Items.size() != cache.Items.size())
+		else if (newCache.Items.size() != cacheItemCount)
 		{
 			// we're removed SOME items, so we need to re-write it
-			Logger::Get().printf(Logger::Level::Info, "Rewriting cache file (from %d to %d items) \"%s\"\n", cache.Items.size(), newCache.Items.size(), foldercache.c_str());
-			newCache.Save(foldercache.c_str());
+			Logger::Get().printf(Logger::Level::Info, "Rewriting cache (from %d to %d items) for \"%s\"\n", cacheItemCount, newCache.Items.size(), szFolderName);
+			if (!HashCacheStore::Get().Save(szFolderName, newCache))
+			{
+				Logger::Get().printf(Logger::Level::Info, "     couldn't rewrite.\n");
+			}
 		}
 	}
 
@@ -337,60 +597,73 @@ void ProcessFolder(const char *szFolderName, FileOnDiskSet &files, int depth, bo
 
 //=====================================================================================================================================================================================================
 //=====================================================================================================================================================================================================
-void ProcessFile(const char *szFolderName, WIN32_FIND_DATAA *pfd, FileOnDiskSet &files, int depth, std::unordered_map<Path,const Md5CacheItem *> *pumap, bool clean)
+void ProcessFile(const char *szFolderName, const FolderEntry &entry, const char *szName, FileOnDiskSet &files, int depth, const Md5CacheEntry *pcache, bool clean, std::vector<std::string> *pSubFolders)
 {
 	if (ControlCHandler::TestShouldTerminate())
 	{
 		return;
 	}
 
-	std::string fullPath{szFolderName};
-	fullPath.append("\\");
-	fullPath.append(pfd->cFileName);
-
-	if (pfd->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+	if (entry.IsFolder())
 	{
 		if (ControlCHandler::TestShouldTerminate())
 		{
 			return;
 		}
 
+		std::string fullPath{szFolderName};
+		fullPath.append("\\");
+		fullPath.append(szName);
+
+		if (nullptr != pSubFolders)
+		{
+			pSubFolders->push_back(std::move(fullPath));
+			return;
+		}
+
 		return ProcessFolder(fullPath.c_str(), files, depth+1, clean);
 	}
 	else
 	{
-		// see if the file has any hard links
-
-
 		// add the file...
 		FileOnDisk file;
 
-		files.AddPathToStrings(file, fullPath.c_str(), strlen(szFolderName) + 1);
+		files.AddPathToStrings(file, szFolderName, szName);
 
 		file.Hashed		= false;
-		file.Size		= GetWin32FindDataFileSize(*pfd);
-		file.Time		= pfd->ftLastWriteTime;
-		file.SubPath	= file.Path + files.RootPathLength + 1;
+		file.Size		= entry.Size;
+		file.Time		= entry.Time;
+		file.Prints		= 0;
+		file.Head		= 0;
+		file.Tail		= 0;
+		file.Distinct	= false;
 
-		if (nullptr != pumap)
+		file.nNumberOfLinks	= 0;
+		file.nFileIndex		= entry.FileId;
+
+		if (nullptr != pcache)
 		{
-			if (pumap->find(pfd->cFileName) != pumap->end())
+			const Md5CacheItem *pitem = pcache->FindItem(szName);
+
+			if (nullptr != pitem)
 			{
-				//printf("\"%s\": Found in MD5 cache\n", files.GetFilePath(file));
+				//printf("\"%s\": Found in MD5 cache\n", files.GetFilePath(file).c_str());
 
-				const Md5CacheItem *pitem = (*pumap)[pfd->cFileName];
 				if (pitem->Size == file.Size)
 				{
 					if (pitem->Time == file.Time)
 					{
-						file.Hashed = true;
+						file.Hashed = (0 != (pitem->Flags & HASHCACHE_ITEM_HASH));
 						file.Hash = pitem->Hash;
+						file.Prints = pitem->Flags & (HASHCACHE_ITEM_HEAD | HASHCACHE_ITEM_TAIL);
+						file.Head = pitem->Head;
+						file.Tail = pitem->Tail;
 					}
 				}
 			}
 			else
 			{
-				//printf("\"%s\": Not found in MD5 cache\n", files.GetFilePath(file));
+				//printf("\"%s\": Not found in MD5 cache\n", files.GetFilePath(file).c_str());
 			}
 		}
 
@@ -402,331 +675,2617 @@ void ProcessFile(const char *szFolderName, WIN32_FIND_DATAA *pfd, FileOnDiskSet
 
 
 //=====================================================================================================================================================================================================
+// ScanFolder
+//
+// A folder in the parallel scan. Each one is enumerated by exactly one worker, which appends the
+// folder's files to its own shard and records where they landed. Afterwards the shards are
+// stitched back together by walking the folder tree in the same order that the serial scan
+// recurses, so the result is identical to it.
 //=====================================================================================================================================================================================================
-void FileOnDiskSet::QueryFileSystem(const char *pszRootPath, bool clean)
+struct ScanFolder
 {
-	this->RootPathLength = strlen(pszRootPath);
-	ProcessFolder(pszRootPath, *this, 0, clean);
-}
+	std::string					path;
+	int							depth = 0;
+	size_t						shard = 0;
+	size_t						firstItem = 0;
+	size_t						lastItem = 0;
+	size_t						firstFolder = 0;
+	size_t						lastFolder = 0;
+	size_t						firstString = 0;
+	size_t						lastString = 0;
+	std::vector<ScanFolder *>	subFolders;
+
+	// only used when keeping a snapshot
+	FILETIME					time = {0};
+	FILETIME					cacheTime = {0};
+	size_t						previous = ScanSnapshotView::npos;
+};
 
 //=====================================================================================================================================================================================================
-// Adds the files from the input fileset to the output fileset
+// ScanShard
+//
+// Everything one scanning worker owns. The folders live in a deque so that their addresses stay
+// put while the owner keeps adding more, since other workers hold pointers to the ones they
+// have stolen.
 //=====================================================================================================================================================================================================
-void FileOnDiskSet::MergeFrom(const FileOnDiskSet &input)
+struct ScanShard
 {
-	TimeThis t("Merging FileOnDiskSets");
-
-	// first, make a map of paths to make sure that we don't add anything that already exists...
-	std::unordered_map<Path, size_t> umap;
-
-	// reserve space for the strings
-	this->Strings.reserve(this->Strings.size() + input.Strings.size());
+	FileOnDiskSet						files;
+	std::deque<ScanFolder>				folders;
+	WorkStealingQueue<ScanFolder *>		queue;
+};
 
-	if (true)
-	{
-		umap.reserve(this->Items.size());
+//=====================================================================================================================================================================================================
+// ScanSnapshotContext
+//
+// Shared by all the workers when the scan keeps a snapshot. previous is the snapshot from the
+// last scan, if there was a usable one.
+//=====================================================================================================================================================================================================
+struct ScanSnapshotContext
+{
+	const ScanSnapshotView *	pprevious = nullptr;
+	std::atomic<size_t>			reusedFolders{0};
+};
 
-		int index = 0;
-		for (auto &file : this->Items)
-		{
-			umap[this->GetFilePath(file)] = index;
-			index++;
-		}
-	}
+//=====================================================================================================================================================================================================
+// ScanProgress
+//
+// How many folders have been queued but not finished yet. Idle workers sleep on changed until
+// someone queues more folders or the last one is finished; generation tells them which it was.
+//=====================================================================================================================================================================================================
+struct ScanProgress
+{
+	std::atomic<size_t>			pendingFolders{1};
+	std::mutex					mutex;
+	std::condition_variable		changed;
+	size_t						generation = 0;
 
-	for (auto &file : input.Items)
+	void Notify()
 	{
-		if (ControlCHandler::TestShouldTerminate())
-		{
-			return;
-		}
-
-		const char *pszPath = input.GetFilePath(file);
-		if (umap.find(pszPath) != umap.end())
 		{
-			// error---we're trying to add something to the output list that's already there!
-			assert(0);
-			*(volatile int *)0;
+			std::lock_guard<std::mutex> lock(this->mutex);
+			++this->generation;
 		}
 
-		FileOnDisk newFile = file;
-		this->AddPathToStrings(newFile, pszPath, file.Name - file.Path);
-		this->Items.push_back(newFile);
+		this->changed.notify_all();
 	}
-}
+};
 
+//=====================================================================================================================================================================================================
+// Get the last write time of a folder, and the time its cached hashes last changed (zero if it
+// has none)
+//=====================================================================================================================================================================================================
+static void GetFolderTimes(const char *szFolderName, FILETIME &folderTime, FILETIME &cacheTime)
+{
+	folderTime = {0};
 
+	HANDLE hFolder = CreateFileU(szFolderName, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
 
+	if ((nullptr != hFolder) && (INVALID_HANDLE_VALUE != hFolder))
+	{
+		GetFileTime(hFolder, nullptr, nullptr, &folderTime);
+		CloseHandle(hFolder);
+	}
 
+	cacheTime = HashCacheStore::Get().GetFolderTime(szFolderName);
+}
 
 //=====================================================================================================================================================================================================
-// for each file in the input fileset, if a hashed version is in the hashed fileset, copy that
-// hash over, assuming timestamps match up
+// ReuseSnapshotFolder
+//
+// If the folder hasn't changed since the previous snapshot was taken, take its files from the
+// snapshot instead of loading its cached hashes, and hand back its sub-folders just like
+// ProcessFolder would. Returns false if the folder has to be read after all.
+//
+// The folder is still enumerated, because editing a file in place doesn't change the folder's
+// time. A file is only taken from the snapshot if its size and time are still the same as they
+// were then; any other file is added just like ProcessFolder would add it.
 //=====================================================================================================================================================================================================
-void FileOnDiskSet::ApplyHashFrom(const FileOnDiskSet &hashedFiles)
+static bool ReuseSnapshotFolder(ScanFolder &folder, FileOnDiskSet &files, const ScanSnapshotView &previous, std::vector<std::string> &subFolders, std::vector<size_t> &subFolderIndices)
 {
-	//=================================================================================================================================================================================================
-	// build the hashtable
-	std::unordered_map<Path, size_t> umap;
+	const FILETIME null = {0};
 
-	if (true)
+	if (folder.time == null)
+	{
+		// couldn't get the time, so we can't tell whether it changed
+		return false;
+	}
+
+	size_t index = folder.previous;
+
+	if (ScanSnapshotView::npos == index)
+	{
+		index = previous.FindFolder(folder.path.c_str());
+
+		if (ScanSnapshotView::npos == index)
+		{
+			return false;
+		}
+	}
+
+	const ScanSnapshotFolder &snapshotFolder = previous.GetFolder(index);
+
+	if (!(snapshotFolder.Time == folder.time) || !(snapshotFolder.CacheTime == folder.cacheTime))
+	{
+		return false;
+	}
+
+	const size_t firstItem = static_cast<size_t>(snapshotFolder.FirstItem);
+	const size_t numFiles = snapshotFolder.NumFiles;
+	size_t next = 0;
+	std::unordered_map<Path, size_t> byName;
+	std::shared_ptr<const Md5CacheEntry> pcache;
+	bool cacheLoaded = false;
+
+	ProcessFilesInFolder(folder.path.c_str(), folder.depth, [&](const char *szFolderName, const FolderEntry &entry, const char *szName, int depth)
+	{
+		if (ControlCHandler::TestShouldTerminate() || entry.IsFolder())
+		{
+			// the sub-folders come from the snapshot, below
+			return;
+		}
+
+		// the files are almost always enumerated in the same order they were last time
+		size_t match = numFiles;
+
+		if ((next < numFiles) && (0 == strcmp(previous.GetFileName(previous.GetItem(firstItem + next)), szName)))
+		{
+			match = next;
+		}
+		else
+		{
+			// they're not, so look them up by name from now on
+			if (byName.empty())
+			{
+				byName.reserve(numFiles);
+
+				for (size_t i = 0; i < numFiles; ++i)
+				{
+					byName.emplace(previous.GetFileName(previous.GetItem(firstItem + i)), i);
+				}
+			}
+
+			auto iter = byName.find(szName);
+			if (iter != byName.end())
+			{
+				match = iter->second;
+			}
+		}
+
+		if (match < numFiles)
+		{
+			const FileOnDisk &snapshotFile = previous.GetItem(firstItem + match);
+			next = match + 1;
+
+			if ((snapshotFile.Size == entry.Size) && (snapshotFile.Time == entry.Time))
+			{
+				FileOnDisk file = snapshotFile;
+				files.AddPathToStrings(file, szFolderName, szName);
+				files.Items.push_back(file);
+				return;
+			}
+		}
+
+		// new, or changed in place since the snapshot was taken
+		if (!cacheLoaded)
+		{
+			pcache = HashCacheStore::Get().LoadFolder(szFolderName);
+			cacheLoaded = true;
+		}
+
+		ProcessFile(szFolderName, entry, szName, files, depth, pcache.get(), false, nullptr);
+	});
+
+	// the first sub-folder comes right after its parent
+	size_t child = index + 1;
+
+	for (unsigned long i = 0; i < snapshotFolder.NumSubFolders; ++i)
+	{
+		subFolders.push_back(previous.GetFolderPath(child));
+		subFolderIndices.push_back(child);
+		child = previous.GetNextSibling(child);
+	}
+
+	return true;
+}
+
+//=====================================================================================================================================================================================================
+// ScanWorker
+//
+// Take folders from our own queue (or steal them from someone else's), enumerate them into our
+// shard, and queue up their subfolders. We're done when there's no folder left anywhere that
+// hasn't been finished.
+//=====================================================================================================================================================================================================
+static void ScanWorker(std::vector<std::unique_ptr<ScanShard>> &shards, size_t self, ScanProgress &progress, bool clean, ScanSnapshotContext *psnapshot)
+{
+	ScanShard &shard = *shards[self];
+	std::vector<std::string> subFolders;
+	std::vector<size_t> subFolderIndices;
+
+	while (!ControlCHandler::TestShouldTerminate())
+	{
+		ScanFolder *pfolder = nullptr;
+		size_t generation;
+
+		{
+			std::lock_guard<std::mutex> lock(progress.mutex);
+			generation = progress.generation;
+		}
+
+		if (!shard.queue.Pop(pfolder))
+		{
+			for (size_t i = 1; (i < shards.size()) && (nullptr == pfolder); ++i)
+			{
+				shards[(self + i) % shards.size()]->queue.Steal(pfolder);
+			}
+		}
+
+		if (nullptr == pfolder)
+		{
+			if (0 == progress.pendingFolders)
+			{
+				break;
+			}
+
+			// someone is still enumerating, and may yet hand out more folders (the timeout is only
+			// so that we notice Ctrl-C)
+			std::unique_lock<std::mutex> lock(progress.mutex);
+			progress.changed.wait_for(lock, std::chrono::milliseconds(100), [&]() { return (generation != progress.generation) || (0 == progress.pendingFolders); });
+			continue;
+		}
+
+		subFolders.clear();
+		subFolderIndices.clear();
+
+		pfolder->shard			= self;
+		pfolder->firstItem		= shard.files.Items.size();
+		pfolder->firstFolder	= shard.files.Folders.size();
+		pfolder->firstString	= shard.files.Strings.size();
+
+		bool reused = false;
+
+		if (nullptr != psnapshot)
+		{
+			// get the times BEFORE reading the folder, so that any change made while we read it
+			// shows up as a difference next time
+			GetFolderTimes(pfolder->path.c_str(), pfolder->time, pfolder->cacheTime);
+
+			if (nullptr != psnapshot->pprevious)
+			{
+				reused = ReuseSnapshotFolder(*pfolder, shard.files, *psnapshot->pprevious, subFolders, subFolderIndices);
+			}
+		}
+
+		if (reused)
+		{
+			++psnapshot->reusedFolders;
+		}
+		else
+		{
+			ProcessFolder(pfolder->path.c_str(), shard.files, pfolder->depth, clean, &subFolders);
+		}
+
+		pfolder->lastItem		= shard.files.Items.size();
+		pfolder->lastFolder		= shard.files.Folders.size();
+		pfolder->lastString		= shard.files.Strings.size();
+
+		pfolder->subFolders.reserve(subFolders.size());
+
+		for (size_t i = 0; i < subFolders.size(); ++i)
+		{
+			shard.folders.emplace_back();
+			ScanFolder &child = shard.folders.back();
+			child.path = std::move(subFolders[i]);
+			child.depth = pfolder->depth + 1;
+
+			if (i < subFolderIndices.size())
+			{
+				child.previous = subFolderIndices[i];
+			}
+
+			pfolder->subFolders.push_back(&child);
+		}
+
+		progress.pendingFolders += pfolder->subFolders.size();
+
+		// push them backwards, so that we pop them in the order they were enumerated
+		for (auto iter = pfolder->subFolders.rbegin(); iter != pfolder->subFolders.rend(); ++iter)
+		{
+			shard.queue.Push(*iter);
+		}
+
+		// wake up anyone waiting for work, or for the scan to finish
+		if ((0 == --progress.pendingFolders) || !pfolder->subFolders.empty())
+		{
+			progress.Notify();
+		}
+	}
+}
+
+//=====================================================================================================================================================================================================
+// QueryFileSystem
+//
+// With one thread, simply recurse through the folders. With more, the folders are spread over
+// several workers, which helps a lot on network shares where each folder is a round trip.
+//
+// If pszSnapshotFile is given, folders that haven't changed since the snapshot in it was taken
+// are taken from the snapshot instead of being read, and a new snapshot is written at the end.
+// (Clean scans always read every folder, since that's how stale cache entries get removed.)
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::QueryFileSystem(const char *pszRootPath, bool clean, uint32_t numThreads, const char *pszSnapshotFile)
+{
+	this->RootPathLength = strlen(pszRootPath);
+
+	if ((numThreads <= 1) && (nullptr == pszSnapshotFile))
+	{
+		ProcessFolder(pszRootPath, *this, 0, clean);
+		return;
+	}
+
+	if (numThreads < 1)
+	{
+		numThreads = 1;
+	}
+
+	ScanSnapshotView				previous;
+	ScanSnapshot					snapshot;
+	std::unique_ptr<ScanSnapshotContext>	psnapshot;
+
+	if (nullptr != pszSnapshotFile)
+	{
+		psnapshot = std::make_unique<ScanSnapshotContext>();
+
+		if (!clean && previous.Open(pszSnapshotFile))
+		{
+			Logger::Get().printf(Logger::Level::Debug, "Using the scan snapshot \"%s\" (%s folders).\n", pszSnapshotFile, comma(previous.GetNumFolders()));
+			psnapshot->pprevious = &previous;
+		}
+	}
+
+	std::vector<std::unique_ptr<ScanShard>> shards;
+	shards.reserve(numThreads);
+
+	for (uint32_t i = 0; i < numThreads; ++i)
+	{
+		shards.push_back(std::make_unique<ScanShard>());
+		shards.back()->files.RootPathLength = this->RootPathLength;
+	}
+
+	shards[0]->folders.emplace_back();
+	ScanFolder *proot = &shards[0]->folders.back();
+	proot->path = pszRootPath;
+	shards[0]->queue.Push(proot);
+
+	ScanProgress progress;
+
+	{
+		ScanSnapshotContext *pcontext = psnapshot.get();
+
+		if (1 == numThreads)
+		{
+			ScanWorker(shards, 0, progress, clean, pcontext);
+		}
+		else
+		{
+			std::vector<std::thread> threads;
+			threads.reserve(numThreads);
+
+			for (size_t i = 0; i < shards.size(); ++i)
+			{
+				threads.emplace_back([&shards, i, &progress, clean, pcontext]() { ScanWorker(shards, i, progress, clean, pcontext); });
+			}
+
+			for (auto &thread : threads)
+			{
+				thread.join();
+			}
+		}
+	}
+
+	if (ControlCHandler::TestShouldTerminate())
+	{
+		return;
+	}
+
+	//
+	// merge the shards, in the order the serial scan would have produced
+	//
+	size_t totalItems = this->Items.size();
+	size_t totalFolders = this->Folders.size();
+	size_t totalStrings = this->Strings.size();
+
+	for (auto &shard : shards)
+	{
+		totalItems += shard->files.Items.size();
+		totalFolders += shard->files.Folders.size();
+		totalStrings += shard->files.Strings.size();
+	}
+
+	this->Items.reserve(totalItems);
+	this->Folders.reserve(totalFolders);
+	this->Strings.reserve(totalStrings);
+
+	std::vector<ScanFolder *> stack;
+	stack.push_back(proot);
+
+	while (!stack.empty())
+	{
+		ScanFolder *pfolder = stack.back();
+		stack.pop_back();
+
+		const FileOnDiskSet &source = shards[pfolder->shard]->files;
+
+		// the folder's strings are contiguous in its shard, so they move as one block
+		size_t stringBase = this->Strings.size();
+		this->Strings.insert(this->Strings.end(), source.Strings.begin() + pfolder->firstString, source.Strings.begin() + pfolder->lastString);
+
+		// and so are its entries in Folders (there's just the one, unless it has no files)
+		size_t folderBase = this->Folders.size();
+
+		for (size_t i = pfolder->firstFolder; i < pfolder->lastFolder; ++i)
+		{
+			FileOnDiskFolder folder = source.Folders[i];
+			folder.Path		= folder.Path - pfolder->firstString + stringBase;
+			folder.SubPath	= folder.SubPath - pfolder->firstString + stringBase;
+			this->Folders.push_back(folder);
+		}
+
+		for (size_t i = pfolder->firstItem; i < pfolder->lastItem; ++i)
+		{
+			FileOnDisk file = source.Items[i];
+			file.Folder		= file.Folder - pfolder->firstFolder + folderBase;
+			file.Name		= file.Name - pfolder->firstString + stringBase;
+			this->Items.push_back(file);
+		}
+
+		// the merge visits the folders in exactly the order the snapshot stores them
+		if (nullptr != psnapshot)
+		{
+			ScanSnapshotFolder snapshotFolder;
+			snapshotFolder.Path				= snapshot.AddString(pfolder->path.c_str());
+			snapshotFolder.Time				= pfolder->time;
+			snapshotFolder.CacheTime		= pfolder->cacheTime;
+			snapshotFolder.FirstItem		= snapshot.Items.size();
+			snapshotFolder.NumFiles			= static_cast<unsigned long>(pfolder->lastItem - pfolder->firstItem);
+			snapshotFolder.NumSubFolders	= static_cast<unsigned long>(pfolder->subFolders.size());
+			snapshot.Folders.push_back(snapshotFolder);
+
+			for (size_t i = pfolder->firstItem; i < pfolder->lastItem; ++i)
+			{
+				FileOnDisk file = source.Items[i];
+				file.Name		= snapshot.AddString(source.GetFileName(file));
+				file.Folder		= 0;
+				snapshot.Items.push_back(file);
+			}
+		}
+
+		for (auto iter = pfolder->subFolders.rbegin(); iter != pfolder->subFolders.rend(); ++iter)
+		{
+			stack.push_back(*iter);
+		}
+	}
+
+	if (nullptr != psnapshot)
+	{
+		Logger::Get().printf(Logger::Level::Debug, "Took %s of %s folders from the scan snapshot.\n", comma(psnapshot->reusedFolders), comma(snapshot.Folders.size()));
+
+		// let go of the old one before we overwrite it
+		previous.Close();
+		snapshot.Save(pszSnapshotFile);
+	}
+}
+
+//=====================================================================================================================================================================================================
+// ComparePaths
+//
+// Walk the two paths a character at a time as though each were "folder\name", without putting
+// them together (ignoring case, unless FILEONDISK_CASE_SENSITIVE_PATHS says otherwise). Files in
+// the same folder only need their names compared.
+//=====================================================================================================================================================================================================
+int FileOnDiskSet::ComparePaths(const char *pszFolder1, const char *pszName1, const char *pszFolder2, const char *pszName2)
+{
+	if (pszFolder1 == pszFolder2)
+	{
+		return ComparePathStrings(pszName1, pszName2);
+	}
+
+	const char *parts1[] = { pszFolder1, "\\", pszName1 };
+	const char *parts2[] = { pszFolder2, "\\", pszName2 };
+	const size_t lastPart = _countof(parts1) - 1;
+
+	size_t part1 = 0;
+	size_t part2 = 0;
+	const char *p1 = parts1[0];
+	const char *p2 = parts2[0];
+
+	for (;;)
+	{
+		while ((0 == *p1) && (part1 < lastPart))
+		{
+			p1 = parts1[++part1];
+		}
+
+		while ((0 == *p2) && (part2 < lastPart))
+		{
+			p2 = parts2[++part2];
+		}
+
+		int c1 = static_cast<unsigned char>(FoldPathChar(*p1));
+		int c2 = static_cast<unsigned char>(FoldPathChar(*p2));
+
+		if ((c1 != c2) || (0 == c1))
+		{
+			return c1 - c2;
+		}
+
+		++p1;
+		++p2;
+	}
+}
+
+//=====================================================================================================================================================================================================
+// FileOnDiskSet::BuildColumns
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::BuildColumns()
+{
+	TimeThis t("Putting the files into columns");
+
+	size_t count = this->Items.size();
+
+	this->Columns.Sizes.resize(count);
+	this->Columns.Hashes.resize(count);
+	this->Columns.Flags.resize(count);
+	this->Columns.Folders.resize(count);
+	this->Columns.Names.resize(count);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const FileOnDisk &file = this->Items[i];
+
+		this->Columns.Sizes[i]		= file.Size;
+		this->Columns.Hashes[i]		= file.Hash;
+		this->Columns.Flags[i]		= FileOnDiskColumns::GetFlags(file);
+		this->Columns.Folders[i]	= file.Folder;
+		this->Columns.Names[i]		= file.Name;
+	}
+}
+
+void FileOnDiskSet::UpdateHashColumns()
+{
+	if (!this->HasColumns())
+	{
+		return;
+	}
+
+	for (size_t i = 0; i < this->Items.size(); i++)
+	{
+		this->Columns.Hashes[i]	= this->Items[i].Hash;
+		this->Columns.Flags[i]	= FileOnDiskColumns::GetFlags(this->Items[i]);
+	}
+}
+
+void FileOnDiskSet::DropColumns()
+{
+	this->Columns = FileOnDiskColumns();
+}
+
+//=====================================================================================================================================================================================================
+// FilePathKey
+//
+// A file's path, as a key for the maps below, without putting the path together. The folder and
+// the name are compared on their own (a path is only ever split at its last backslash, so two
+// paths are the same if both of those are), and the hash is made from the folder's, which is only
+// worked out once per folder, and the name's.
+//=====================================================================================================================================================================================================
+struct FilePathKey
+{
+	const char	*pszFolder;
+	const char	*pszName;
+	size_t		hash;
+
+	inline bool operator ==(const FilePathKey &other) const
+	{
+		return (this->hash == other.hash) && (0 == ComparePathStrings(this->pszName, other.pszName)) && ((this->pszFolder == other.pszFolder) || (0 == ComparePathStrings(this->pszFolder, other.pszFolder)));
+	}
+};
+
+struct FilePathKeyHash
+{
+	inline size_t operator()(const FilePathKey &key) const
+	{
+		return key.hash;
+	}
+};
+
+class FilePathKeys
+{
+public:
+	explicit FilePathKeys(const FileOnDiskSet &files) : files(files), folderHashes(files.Folders.size())
+	{
+		for (size_t i = 0; i < files.Folders.size(); i++)
+		{
+			this->folderHashes[i] = Path(&files.Strings[files.Folders[i].Path]).GetHash();
+		}
+	}
+
+	FilePathKey Get(const FileOnDisk &file) const
+	{
+		FilePathKey key;
+		key.pszFolder	= this->files.GetFolderName(file);
+		key.pszName		= this->files.GetFileName(file);
+		key.hash		= (this->folderHashes[file.Folder] * 31) + Path(key.pszName).GetHash();
+		return key;
+	}
+
+	// the same, by index (which goes through the set's columns, if it has them)
+	FilePathKey Get(size_t index) const
+	{
+		FilePathKey key;
+		key.pszFolder	= this->files.GetFolderName(index);
+		key.pszName		= this->files.GetFileName(index);
+		key.hash		= (this->folderHashes[this->files.GetFolder(index)] * 31) + Path(key.pszName).GetHash();
+		return key;
+	}
+
+private:
+	const FileOnDiskSet		&files;
+	std::vector<size_t>		folderHashes;
+};
+
+//=====================================================================================================================================================================================================
+// CopyFolder
+//
+// Give the output set a copy of one of the input set's folders (the first time it's asked for;
+// folderMap remembers where each one went after that), and return its index in the output set.
+//=====================================================================================================================================================================================================
+static size_t CopyFolder(FileOnDiskSet &output, const FileOnDiskSet &input, size_t folder, std::vector<size_t> &folderMap)
+{
+	const size_t notCopied = static_cast<size_t>(-1);
+
+	if (folderMap.size() != input.Folders.size())
+	{
+		folderMap.assign(input.Folders.size(), notCopied);
+	}
+
+	if (notCopied == folderMap[folder])
+	{
+		const FileOnDiskFolder &source = input.Folders[folder];
+		const char *pszFolder = &input.Strings[source.Path];
+
+		FileOnDiskFolder copy;
+		copy.Path		= output.Strings.size();
+		copy.SubPath	= copy.Path + (source.SubPath - source.Path);
+		output.Strings.insert(output.Strings.end(), pszFolder, pszFolder + strlen(pszFolder) + 1);
+		output.Folders.push_back(copy);
+
+		folderMap[folder] = output.Folders.size() - 1;
+	}
+
+	return folderMap[folder];
+}
+
+//=====================================================================================================================================================================================================
+// Adds the files from the input fileset to the output fileset
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::MergeFrom(const FileOnDiskSet &input)
+{
+	TimeThis t("Merging FileOnDiskSets");
+
+	// the files we add wouldn't be in them
+	this->DropColumns();
+
+	// first, make a map of paths to make sure that we don't add anything that already exists...
+	std::unordered_map<FilePathKey, size_t, FilePathKeyHash> umap;
+	FilePathKeys ourKeys(*this);
+	FilePathKeys inputKeys(input);
+
+	// reserve space for the strings (the keys point into them, so they mustn't move)
+	this->Folders.reserve(this->Folders.size() + input.Folders.size());
+	this->Strings.reserve(this->Strings.size() + input.Strings.size());
+
+	if (true)
+	{
+		umap.reserve(this->Items.size());
+
+		int index = 0;
+		for (auto &file : this->Items)
+		{
+			umap[ourKeys.Get(file)] = index;
+			index++;
+		}
+	}
+
+	std::vector<size_t> folderMap;
+
+	for (auto &file : input.Items)
+	{
+		if (ControlCHandler::TestShouldTerminate())
+		{
+			return;
+		}
+
+		if (umap.find(inputKeys.Get(file)) != umap.end())
+		{
+			// error---we're trying to add something to the output list that's already there!
+			assert(0);
+			*(volatile int *)0;
+		}
+
+		FileOnDisk newFile = file;
+		this->AddPathToStrings(newFile, CopyFolder(*this, input, file.Folder, folderMap), input.GetFileName(file));
+		this->Items.push_back(newFile);
+	}
+}
+
+
+
+
+
+//=====================================================================================================================================================================================================
+// for each file in the input fileset, if a hashed version is in the hashed fileset, copy that
+// hash over, assuming timestamps match up
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::ApplyHashFrom(const FileOnDiskSet &hashedFiles)
+{
+	//=================================================================================================================================================================================================
+	// build the hashtable
+	std::unordered_map<FilePathKey, size_t, FilePathKeyHash> umap;
+	FilePathKeys hashedKeys(hashedFiles);
+	FilePathKeys ourKeys(*this);
+
+	// (the keys only need the folders and names, so they come from the columns when there are
+	// some, and a file's whole FileOnDisk is only looked at when there's a hash for it)
+	if (true)
 	{
 		umap.reserve(hashedFiles.Items.size());
 
-		int index = 0;
-		for (auto &file : hashedFiles.Items)
+		for (size_t index = 0; index < hashedFiles.Items.size(); index++)
+		{
+			umap[hashedKeys.Get(index)] = index;
+		}
+	}
+
+	//=================================================================================================================================================================================================
+	// now, go through the files and find if there's a hash
+	if (true)
+	{
+		bool hasColumns = this->HasColumns();
+
+		for (size_t i = 0; i < this->Items.size(); i++)
+		{
+			if (ControlCHandler::TestShouldTerminate())
+			{
+				return;
+			}
+
+			auto place = umap.find(ourKeys.Get(i));
+			if (place != umap.end())
+			{
+				FileOnDisk &file = this->Items[i];
+				size_t index = place->second;
+				const FileOnDisk &hashed = hashedFiles.Items[index];
+
+				assert(0 == ComparePathStrings(hashedFiles.GetFilePath(hashed).c_str(), this->GetFilePath(file).c_str()));
+
+				if (FileTimeDifference(hashed.Time, file.Time) < 10 * ftMilliseconds)
+				{
+					if (hashed.Hashed)
+					{
+						file.Hashed = hashed.Hashed;
+						file.Hash = hashed.Hash;
+					}
+
+					file.Prints = hashed.Prints;
+					file.Head = hashed.Head;
+					file.Tail = hashed.Tail;
+					file.Distinct = hashed.Distinct;
+
+					if (hasColumns)
+					{
+						this->Columns.Hashes[i]	= file.Hash;
+						this->Columns.Flags[i]	= FileOnDiskColumns::GetFlags(file);
+					}
+				}
+			}
+		}
+	}
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+bool AreAllOfTheseHardLinksToOneAnother(const std::vector<std::string> &filesToCheckForHardLinks)
+{
+	if (ControlCHandler::TestShouldTerminate())
+	{
+		return false;
+	}
+
+	if (filesToCheckForHardLinks.size() < 2)
+	{
+		return true;
+	}
+
+	AutoCloseHandle	hfile1 = CreateFileU(filesToCheckForHardLinks[0].c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (hfile1.Get() == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	BY_HANDLE_FILE_INFORMATION info1 = {0};
+	GetFileInformationByHandle(hfile1, &info1);
+
+	for (size_t i=1; i<filesToCheckForHardLinks.size(); ++i)
+	{
+		AutoCloseHandle	hfile2 = CreateFileU(filesToCheckForHardLinks[i].c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+		if (hfile2.Get() == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+
+		BY_HANDLE_FILE_INFORMATION info2 = {0};
+		GetFileInformationByHandle(hfile2, &info2);
+
+		if ((info1.nFileIndexHigh == info2.nFileIndexHigh) && (info1.nFileIndexLow == info2.nFileIndexLow))
+		{
+			// it's a link... don't give up
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::CalcAllNeededHashesFromOneBucket(FolderBucket& bucket, HashBucketInfo& hbi, TimeThis& t, std::chrono::system_clock::time_point& hashCalcStart, bool verbose, int& hashedCount, long long& byteCount, int iNum)
+{
+	Md5Cache cache;
+	HashCacheStore &store = HashCacheStore::Get();
+	const char *szFolder = bucket.folder.c_str();
+	bool dirty = false;
+	bool journaled = false;
+
+	// the cache items that changed since the file was last written
+	std::vector<size_t> journal;
+
+	std::wstring eta;
+	std::unordered_map<Path, size_t> umap;
+
+	if (true)
+	{
+		std::lock_guard<std::mutex> lock(hbi.mutex);
+		if (hbi.totalBytesProcessed > 0)
+		{
+			double seconds = t.Elapsed();
+			double pct = (double)hbi.totalBytesProcessed / (double)hbi.totalBytesToProcess;
+			size_t secondsNeeded = static_cast<size_t>(seconds / pct);
+			std::chrono::time_point hashCalcEnd = hashCalcStart + std::chrono::seconds(secondsNeeded);
+
+			auto hashCalcEnd_t = std::chrono::system_clock::to_time_t(hashCalcEnd);
+			std::tm hashCalcEnd_local;
+			localtime_s(&hashCalcEnd_local, &hashCalcEnd_t);
+
+			constexpr size_t maxBufferSize = 100;
+			wchar_t etaBuffer[maxBufferSize];
+
+			wcsftime(etaBuffer, maxBufferSize, L"%Om/%Oe/%Y %I:%M:%S", &hashCalcEnd_local);
+
+			eta = etaBuffer;
+
+			std::wstring ampm = hashCalcEnd_local.tm_hour > 11 ? L" PM" : L" AM";
+			eta += ampm;
+		}
+	}
+
+	if (true)
+	{
+		std::lock_guard<std::mutex> lock(hbi.mutex);
+		++hbi.numBucketsProcessed;
+		Logger::Get().printf(Logger::Level::Info, "Bucket %s of %s (ETA: %S)\n", comma(hbi.numBucketsProcessed), comma(hbi.totalBuckets), eta.c_str());
+	}
+
+	if (store.Load(szFolder, cache))
+	{
+		size_t index = 0;
+		for (auto& item : cache.Items)
+		{
+			umap[cache.GetFileName(item)] = index;
+			index++;
+		}
+	}
+	else
+	{
+		cache.Items.clear();
+		cache.Strings.clear();
+	}
+
+	//
+	// hash the files first, with idle threads helping out with a big folder; the loop below then
+	// just caches them. We're already one of the device's readers, and a helper only takes a
+	// file while the device has a reader to spare. A spinning disk only gets a reader or two,
+	// though, so its folders are left whole.
+	//
+	DeviceScheduler &scheduler = DeviceScheduler::Get();
+	size_t device = scheduler.GetDevice(szFolder);
+	uint32_t limit = scheduler.GetLimit(device);
+	bool hashedAsTasks = (bucket.files.size() > 1) && (limit > 2);
+
+	if (hashedAsTasks)
+	{
+		std::vector<size_t> unhashed;
+
+		for (auto index : bucket.files)
+		{
+			if (!this->Items[index].Hashed)
+			{
+				unhashed.push_back(index);
+			}
+		}
+
+		std::atomic<size_t> next{0};
+
+		auto hashNext = [this, &unhashed, &next, verbose]()
+		{
+			size_t i = next++;
+
+			if ((i >= unhashed.size()) || ControlCHandler::TestShouldTerminate())
+			{
+				return false;
+			}
+
+			static thread_local std::string path;
+
+			FileOnDisk &file = this->Items[unhashed[i]];
+			file.Hashed = GetFileMd5Hash(this->GetFilePath(file, path), file.Hash, verbose, 0 == file.nFileIndex);
+			return true;
+		};
+
+		TaskGroup helpers;
+
+		for (size_t i = 1; i < std::min<size_t>(limit, unhashed.size()); i++)
+		{
+			helpers.Run([&scheduler, device, &hashNext]()
+			{
+				while (scheduler.TryAddReader(device))
+				{
+					bool more = hashNext();
+					scheduler.RemoveReader(device);
+
+					if (!more)
+					{
+						break;
+					}
+				}
+			});
+		}
+
+		while (hashNext())
+		{
+			__nop();
+		}
+
+		if (!helpers.Wait())
+		{
+			return;
+		}
+	}
+
+	//
+	// got through each file in the bucket
+	//
+	auto bucket_start_time = std::chrono::system_clock::now();
+	std::string path;
+
+	for (auto& index : bucket.files)
+	{
+		if (ControlCHandler::TestShouldTerminate())
+		{
+			return;
+		}
+
+		TimeThis t2("Calculating one file's MD5 hash");
+
+		FileOnDisk& file = this->Items[index];
+		this->GetFilePath(file, path);
+		auto name = this->GetFileName(file);
+
+		verboseprintf("Calculating hash for \"%s\"...\n", path.c_str());
+		Logger::Get().printf(Logger::Level::Info, "(%13s) Calculating MD5 hash for \"%s\"\n", comma(file.Size), path.c_str());
+
+		//
+		// see if the hash already exists
+		//
+		if (umap.find(name) != umap.end())
+		{
+			size_t cache_index = umap[name];
+			Md5CacheItem item = file;
+			item.Name = cache.Items[cache_index].Name;
+			cache.Items[cache_index] = item;
+
+		}
+
+
+
+
+		//
+		// time how long it takes to get the hash (unless it was already done in a batch, or as a task)
+		//
+		if (!file.Hashed && !hashedAsTasks)
+		{
+			file.Hashed = GetFileMd5Hash(path.c_str(), file.Hash, verbose, 0 == file.nFileIndex);
+		}
+
+		if (!file.Hashed)
+		{
+			continue;
+		}
+
+		hashedCount++;
+		byteCount += file.Size;
+
+		if (umap.find(name) == umap.end())
+		{
+			Md5CacheItem item = file;
+			const char* pszName = name;
+			item.Name = static_cast<long>(cache.Strings.size());
+			cache.Strings.insert(cache.Strings.end(), pszName, pszName + strlen(pszName) + 1);
+			cache.Items.push_back(item);
+			journal.push_back(cache.Items.size() - 1);
+			dirty = true;
+		}
+		else
+		{
+			// it already exists... overwrite it
+			size_t cache_index = umap[name];
+			Md5CacheItem item = file;
+			item.Name = cache.Items[cache_index].Name;
+			cache.Items[cache_index] = item;
+			journal.push_back(cache_index);
+			dirty = true;
+		}
+
+		//
+		// if it has taken longer than 3 seconds, start the clock over
+		//
+		auto bucket_current_time = std::chrono::system_clock::now();
+		auto elapsed_time = bucket_current_time - bucket_start_time;
+		auto elapsed_time_cutoff = std::chrono::seconds(3);
+
+		if ((elapsed_time > elapsed_time_cutoff) && dirty)
+		{
+			if (dirty)
+			{
+				//
+				// (33,930,525,343) Calculating MD5 hash for "\\parker\all$\ToCheck\Puma\Raid\Video\The_Force_Awakens_-_BLU-RAY\The_Force_Awakens_-_BLU-RAY_t01.mkv"
+				//
+				// just append what's new, rather than writing the whole file again every time
+				verboseprintf("Appending to md5 cache because the elapsed time exceeded the cutoff.\n");
+				bucket_start_time = bucket_current_time;
+				store.Append(szFolder, cache, journal);
+				journal.clear();
+				journaled = true;
+				dirty = false;
+			}
+		}
+
+		//pg.Update(numFilesProcessed, totalNumFiles);
+		if (true)
+		{
+			std::lock_guard<std::mutex> lock(hbi.mutex);
+			hbi.totalBytesProcessed += file.Size;
+			++hbi.numFilesProcessed;
+		}
+	}
+
+	// write it out in full, which also compacts away the journal
+	if (dirty || journaled)
+	{
+		store.Save(szFolder, cache);
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+// GetLayoutKey
+//
+// Where a file's contents start on the disk, so files can be read in that order (and a spinning
+// disk doesn't have to seek back and forth between them). That's the first cluster of the file
+// on the volume, when the file system will say; if it won't (it's on a share, say, or small
+// enough to live in the MFT record), the file's index is the next best guess, since files made
+// around the same time tend to get numbers and clusters near each other. Files we can't open
+// at all go last.
+//=====================================================================================================================================================================================================
+typedef std::pair<int, long long> LayoutKey;
+
+static LayoutKey GetLayoutKey(const char *szFileName)
+{
+	AutoCloseHandle hfile = CreateFileU(szFileName, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (hfile.Get() == INVALID_HANDLE_VALUE)
+	{
+		return LayoutKey(2, 0);
+	}
+
+	// only the first extent is wanted, so a buffer with room for one is enough (it'll say there's more)
+	STARTING_VCN_INPUT_BUFFER input = {};
+	RETRIEVAL_POINTERS_BUFFER output = {};
+	DWORD cbReturned = 0;
+
+	if (DeviceIoControl(hfile, FSCTL_GET_RETRIEVAL_POINTERS, &input, sizeof(input), &output, sizeof(output), &cbReturned, nullptr) || (ERROR_MORE_DATA == GetLastError()))
+	{
+		// an Lcn of -1 is a hole (sparse, or compressed away)
+		if ((output.ExtentCount > 0) && (output.Extents[0].Lcn.QuadPart >= 0))
+		{
+			return LayoutKey(0, output.Extents[0].Lcn.QuadPart);
+		}
+	}
+
+	BY_HANDLE_FILE_INFORMATION info = {0};
+	if (GetFileInformationByHandle(hfile, &info))
+	{
+		return LayoutKey(1, (static_cast<long long>(info.nFileIndexHigh) << 32) | info.nFileIndexLow);
+	}
+
+	return LayoutKey(2, 0);
+}
+
+
+//=====================================================================================================================================================================================================
+// MakeFolderBuckets
+//
+// Group the files by the folder they're in (so that each folder's cache is only loaded and
+// saved once), or into a bucket each when sorting on size, and sort the buckets on size. When
+// sorting on layout, the files in each folder are put in the order they are on the disk, and
+// the folders in the order of their first file.
+//=====================================================================================================================================================================================================
+std::vector<FolderBucket> FileOnDiskSet::MakeFolderBuckets(const std::vector<std::size_t> &indices, bool sortOnSize, bool sortReverse, bool sortOnLayout) const
+{
+	std::unordered_map<std::string, FolderBucket> bucket_map;
+	std::string bucketName;
+
+	for (auto &i : indices)
+	{
+		const FileOnDisk& file = this->Items[i];
+
+		auto folder = this->GetFolderName(i);
+
+		if (sortOnSize && !sortOnLayout)
+		{
+			this->GetFilePath(i, bucketName);
+		}
+		else
+		{
+			bucketName.assign(folder);
+		}
+
+		auto& bucket_iter = bucket_map.find(bucketName);
+		if (bucket_iter == bucket_map.end())
+		{
+			FolderBucket newbucket;
+			newbucket.folder = folder;
+			newbucket.size = 0;
+			bucket_map[bucketName] = std::move(newbucket);
+			bucket_iter = bucket_map.find(bucketName);
+			assert(bucket_iter != bucket_map.end());
+		}
+
+		auto& bucket = bucket_iter->second;
+		bucket.size += static_cast<std::size_t>(file.Size);
+		bucket.files.push_back(i);
+
+		__nop();
+	}
+
+
+	// now, sort the list of buckets
+	std::vector<FolderBucket> folderbucketlist;
+	folderbucketlist.reserve(bucket_map.size());
+
+	for (auto &bucket_item : bucket_map)
+	{
+		auto& bucket = std::move(bucket_item.second);
+		folderbucketlist.push_back(bucket);
+	}
+
+	// sort on where the files are (each device's buckets keep this order when they're handed out)
+	if (sortOnLayout)
+	{
+		TimeThis t("Sort on file layout");
+
+		std::vector<LayoutKey> keys(folderbucketlist.size());
+		std::vector<size_t> order(folderbucketlist.size());
+
+		{
+			TaskGroup group;
+
+			for (size_t b = 0; b < folderbucketlist.size(); b++)
+			{
+				order[b] = b;
+
+				group.Run([&, b]()
+				{
+					FolderBucket &bucket = folderbucketlist[b];
+					std::vector<std::pair<LayoutKey, size_t>> files;
+					std::string path;
+					files.reserve(bucket.files.size());
+
+					for (auto &i : bucket.files)
+					{
+						files.emplace_back(GetLayoutKey(this->GetFilePath(i, path)), i);
+					}
+
+					std::sort(files.begin(), files.end());
+
+					bucket.files.clear();
+
+					for (auto &file : files)
+					{
+						bucket.files.push_back(file.second);
+					}
+
+					keys[b] = files.front().first;
+				});
+			}
+
+			group.Wait();
+		}
+
+		std::sort(order.begin(), order.end(), [&](size_t left, size_t right)
+		{
+			return keys[left] < keys[right];
+		});
+
+		std::vector<FolderBucket> sorted;
+		sorted.reserve(folderbucketlist.size());
+
+		for (auto b : order)
+		{
+			sorted.push_back(std::move(folderbucketlist[b]));
+		}
+
+		return sorted;
+	}
+
+	// sort on size
+	{
+		TimeThis t("Sort on bucket size");
+
+		if (sortReverse)
+		{
+			std::sort(folderbucketlist.begin(), folderbucketlist.end(), [&](FolderBucket const &left, FolderBucket const &right)
+			{
+				return left.size < right.size;
+			});
+		}
+		else
+		{
+			std::sort(folderbucketlist.begin(), folderbucketlist.end(), [&](FolderBucket const &left, FolderBucket const &right)
+			{
+				return left.size > right.size;
+			});
+		}
+	}
+
+	return folderbucketlist;
+}
+
+
+//=====================================================================================================================================================================================================
+// Files compared side by side (see CompareInLockstep)
+//=====================================================================================================================================================================================================
+static const size_t		maxLockstepGroupSize	= 3;				// more than this, and the ones still matching might not all match each other
+static const DWORD		lockstepBlockSize		= 1024 * 1024;
+
+//=====================================================================================================================================================================================================
+// Files hashed in a batch (see HashBucketsInBatch); this much is hashed before it's cached, so
+// that being interrupted doesn't lose all of it
+//=====================================================================================================================================================================================================
+static const long long	batchChunkSize			= 4LL * 1024 * 1024 * 1024;
+
+
+//=====================================================================================================================================================================================================
+// RunOnBuckets
+//
+// Call func on each bucket, on up to maxNumThreads threads at once (the pool's workers). Returns
+// false if we were told to stop before all of them were done.
+//=====================================================================================================================================================================================================
+template <typename _BucketFunctor> static bool RunOnBuckets(std::vector<FolderBucket> &buckets, uint32_t maxNumThreads, _BucketFunctor func)
+{
+	ThreadPool::Get().SetNumThreads(maxNumThreads);
+
+	TaskGroup group;
+
+	for (auto &bucket : buckets)
+	{
+		group.Run([&func, &bucket]() { func(bucket, ThreadPool::GetWorkerIndex()); });
+	}
+
+	return group.Wait();
+}
+
+
+//=====================================================================================================================================================================================================
+// AllotReaders
+//
+// Share maxNumThreads readers out between the devices, given how many each one could use (its
+// limit, or less if it doesn't have that much to do). Every device that wants any gets at least
+// one, even if that takes more than maxNumThreads, and the rest go round one at a time.
+//=====================================================================================================================================================================================================
+static std::vector<uint32_t> AllotReaders(const std::vector<uint32_t> &wanted, uint32_t maxNumThreads)
+{
+	std::vector<uint32_t> readers(wanted.size(), 0);
+	uint32_t total = 0;
+
+	for (size_t device = 0; device < wanted.size(); device++)
+	{
+		if (wanted[device] > 0)
+		{
+			readers[device] = 1;
+			total++;
+		}
+	}
+
+	for (bool more = true; more && (total < maxNumThreads); )
+	{
+		more = false;
+
+		for (size_t device = 0; (device < wanted.size()) && (total < maxNumThreads); device++)
+		{
+			if (readers[device] < wanted[device])
+			{
+				readers[device]++;
+				total++;
+				more = true;
+			}
+		}
+	}
+
+	return readers;
+}
+
+
+//=====================================================================================================================================================================================================
+// RunByDevice
+//
+// Call func on each item in each device's queue, with no more of a device's items running at once
+// than its share of the readers (see AllotReaders). A device's next item is started when one of
+// its items finishes, so a slow disk with a long queue doesn't take threads away from the others.
+// The pool has exactly as many threads as there are readers, so every device always has a thread
+// of its own. Each item counts as one of its device's readers while it runs (anything it hands
+// off to other threads has to count itself too), and func returns how many bytes it read, for
+// the device's throughput.
+//=====================================================================================================================================================================================================
+template <typename _Item, typename _ItemFunctor> static bool RunByDevice(std::vector<std::deque<_Item>> &queues, uint32_t maxNumThreads, _ItemFunctor func)
+{
+	DeviceScheduler &scheduler = DeviceScheduler::Get();
+
+	std::vector<uint32_t> wanted(queues.size(), 0);
+
+	for (size_t device = 0; device < queues.size(); device++)
+	{
+		if (!queues[device].empty())
+		{
+			wanted[device] = static_cast<uint32_t>(std::min<size_t>(scheduler.GetLimit(device), queues[device].size()));
+		}
+	}
+
+	std::vector<uint32_t> readers = AllotReaders(wanted, maxNumThreads);
+	uint32_t numReaders = 0;
+
+	for (auto &r : readers)
+	{
+		numReaders += r;
+	}
+
+	if (0 == numReaders)
+	{
+		return !ControlCHandler::TestShouldTerminate();
+	}
+
+	ThreadPool::Get().SetNumThreads(numReaders);
+
+	TaskGroup group;
+	std::mutex mutex;
+	std::function<void(size_t)> startNext;
+
+	startNext = [&](size_t device)
+	{
+		_Item item;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (queues[device].empty())
+			{
+				return;
+			}
+
+			item = std::move(queues[device].front());
+			queues[device].pop_front();
+		}
+
+		group.Run([&, item, device]()
+		{
+			scheduler.AddReader(device);
+
+			auto start = std::chrono::high_resolution_clock::now();
+
+			long long bytes = func(item, device);
+
+			auto end = std::chrono::high_resolution_clock::now();
+			scheduler.AddUsage(device, bytes, std::chrono::duration<double>(end - start).count());
+			scheduler.RemoveReader(device);
+
+			startNext(device);
+		});
+	};
+
+	for (size_t device = 0; device < queues.size(); device++)
+	{
+		for (uint32_t reader = 0; reader < readers[device]; reader++)
+		{
+			startNext(device);
+		}
+	}
+
+	return group.Wait();
+}
+
+
+//=====================================================================================================================================================================================================
+// RunOnBucketsByDevice
+//
+// Like RunOnBuckets, but each device only gets as many buckets at once as its limit (see
+// RunByDevice)
+//=====================================================================================================================================================================================================
+template <typename _BucketFunctor> static bool RunOnBucketsByDevice(std::vector<FolderBucket> &buckets, uint32_t maxNumThreads, _BucketFunctor func)
+{
+	DeviceScheduler &scheduler = DeviceScheduler::Get();
+
+	// each device's buckets, in the order they came
+	std::vector<std::deque<FolderBucket *>> queues;
+
+	for (auto &bucket : buckets)
+	{
+		size_t device = scheduler.GetDevice(bucket.folder.c_str());
+
+		if (queues.size() <= device)
+		{
+			queues.resize(device + 1);
+		}
+
+		queues[device].push_back(&bucket);
+	}
+
+	return RunByDevice(queues, maxNumThreads, [&func](FolderBucket *pbucket, size_t)
+	{
+		func(*pbucket, ThreadPool::GetWorkerIndex());
+		return static_cast<long long>(pbucket->size);
+	});
+}
+
+
+//=====================================================================================================================================================================================================
+// CacheFiles
+//
+// Write what we know about the given files (which must all be in the folder) to the folder's
+// cache, adding them or replacing what's there for them
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::CacheFiles(const std::string &folder, const std::vector<std::size_t> &indices)
+{
+	if (indices.empty())
+	{
+		return;
+	}
+
+	Md5Cache cache;
+	HashCacheStore &store = HashCacheStore::Get();
+	const char *szFolder = folder.c_str();
+
+	// the cache items that changed
+	std::vector<size_t> journal;
+	std::unordered_map<Path, size_t> umap;
+
+	if (store.Load(szFolder, cache))
+	{
+		size_t index = 0;
+		for (auto& item : cache.Items)
+		{
+			umap[cache.GetFileName(item)] = index;
+			index++;
+		}
+	}
+	else
+	{
+		cache.Items.clear();
+		cache.Strings.clear();
+	}
+
+	for (auto& index : indices)
+	{
+		const FileOnDisk& file = this->Items[index];
+		auto name = this->GetFileName(file);
+
+		Md5CacheItem item = file;
+		auto iter = umap.find(name);
+
+		if (iter == umap.end())
+		{
+			item.Name = static_cast<long>(cache.Strings.size());
+			cache.Strings.insert(cache.Strings.end(), name, name + strlen(name) + 1);
+			cache.Items.push_back(item);
+			journal.push_back(cache.Items.size() - 1);
+		}
+		else
+		{
+			item.Name = cache.Items[iter->second].Name;
+			cache.Items[iter->second] = item;
+			journal.push_back(iter->second);
+		}
+	}
+
+	store.Append(szFolder, cache, journal);
+}
+
+
+//=====================================================================================================================================================================================================
+// CalcPartialHashesFromOneBucket
+//
+// Fingerprint the head (or tail) of each file in the bucket, and put the fingerprints in the
+// folder's cache, so that they don't need doing again next time
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::CalcPartialHashesFromOneBucket(FolderBucket& bucket, unsigned long print, std::atomic<long long>& bytesRead)
+{
+	// the ones we got a fingerprint for
+	std::vector<std::size_t> updated;
+	std::string path;
+
+	for (auto& index : bucket.files)
+	{
+		if (ControlCHandler::TestShouldTerminate())
+		{
+			break;
+		}
+
+		FileOnDisk& file = this->Items[index];
+		long long offset = (HASHCACHE_ITEM_HEAD == print) ? 0 : file.Size - partialHashBlockSize;
+		unsigned long long value = 0;
+
+		if (!CalcFilePartialHash(this->GetFilePath(file, path), offset, value))
+		{
+			// it'll just have to be hashed in full
+			continue;
+		}
+
+		bytesRead += partialHashBlockSize;
+
+		if (HASHCACHE_ITEM_HEAD == print)
+		{
+			file.Head = value;
+		}
+		else
+		{
+			file.Tail = value;
+		}
+
+		file.Prints |= print;
+		updated.push_back(index);
+	}
+
+	this->CacheFiles(bucket.folder, updated);
+}
+
+
+//=====================================================================================================================================================================================================
+// Mark the files in a run of same-sized files that can't have a duplicate, going by the
+// fingerprints given. If any of them that might still have one is missing any of those
+// fingerprints (e.g., it couldn't be read), we can't tell, so none of them are marked.
+//=====================================================================================================================================================================================================
+static void MarkDistinctFiles(std::vector<FileOnDisk> &items, size_t start, size_t end, unsigned long prints)
+{
+	// different heads and tails can end up with the same key, which just means that they don't
+	// get marked, and get hashed after all
+	auto GetKey = [prints](const FileOnDisk &file)
+	{
+		return file.Head ^ ((0 != (prints & HASHCACHE_ITEM_TAIL)) ? file.Tail * 0x9E3779B97F4A7C15ull : 0);
+	};
+
+	std::unordered_map<unsigned long long, size_t> counts;
+
+	for (size_t i = start; i < end; ++i)
+	{
+		const FileOnDisk &file = items[i];
+
+		if (file.Distinct)
+		{
+			// already known to be different from all the others
+			continue;
+		}
+
+		if ((file.Prints & prints) != prints)
+		{
+			return;
+		}
+
+		++counts[GetKey(file)];
+	}
+
+	for (size_t i = start; i < end; ++i)
+	{
+		FileOnDisk &file = items[i];
+
+		if (!file.Distinct && (1 == counts[GetKey(file)]))
+		{
+			file.Distinct = true;
+		}
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+// EliminateByPartialHashes
+//
+// Same-sized files that are big enough for it to be worth it are fingerprinted in stages: first
+// their heads, and then the tails of the ones whose heads matched those of some other file. The
+// ones that are left with fingerprints that no other file of their size has can't have a
+// duplicate, so they don't need reading in full.
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::EliminateByPartialHashes(std::vector<std::size_t> &filesThatNeedTheirHashCalculated, uint32_t maxNumThreads, bool sortReverse)
+{
+	TimeThis t("Tell files apart by their heads and tails");
+
+	// the runs of same-sized files (the items are sorted on size) that are worth checking
+	std::vector<std::pair<size_t, size_t>> groups;
+
+	for (auto &i : filesThatNeedTheirHashCalculated)
+	{
+		const long long size = this->Items[i].Size;
+
+		if ((size < partialHashMinFileSize) || (!groups.empty() && (i < groups.back().second)))
+		{
+			continue;
+		}
+
+		size_t start = i;
+		while ((start > 0) && (size == this->Items[start - 1].Size))
+		{
+			--start;
+		}
+
+		size_t end = i + 1;
+		while ((end < this->Items.size()) && (size == this->Items[end].Size))
+		{
+			++end;
+		}
+
+		groups.emplace_back(start, end);
+	}
+
+	if (groups.empty())
+	{
+		return;
+	}
+
+	std::atomic<long long> bytesRead{0};
+
+	for (unsigned long print : { HASHCACHE_ITEM_HEAD, HASHCACHE_ITEM_TAIL })
+	{
+		// the files that are still in the running that don't have this fingerprint yet; the
+		// ones that already have a hash count too, since they might match one that doesn't
+		std::vector<std::size_t> needed;
+
+		for (auto &group : groups)
 		{
-			const char *pszPath = hashedFiles.GetFilePath(file);
-			umap[pszPath] = index;
-			index++;
+			for (size_t i = group.first; i < group.second; ++i)
+			{
+				const FileOnDisk &file = this->Items[i];
+
+				if (!file.Distinct && (0 == (file.Prints & print)))
+				{
+					needed.push_back(i);
+				}
+			}
+		}
+
+		// always a bucket per folder, even when sorting on size: each bucket caches what it
+		// found in its folder's md5cache.md5, and two buckets must never write the same one
+		std::vector<FolderBucket> buckets = this->MakeFolderBuckets(needed, false, sortReverse);
+
+		bool finished = RunOnBuckets(buckets, maxNumThreads, [&](FolderBucket &bucket, int)
+		{
+			this->CalcPartialHashesFromOneBucket(bucket, print, bytesRead);
+		});
+
+		if (!finished)
+		{
+			return;
+		}
+
+		unsigned long prints = (HASHCACHE_ITEM_HEAD == print) ? HASHCACHE_ITEM_HEAD : (HASHCACHE_ITEM_HEAD | HASHCACHE_ITEM_TAIL);
+
+		for (auto &group : groups)
+		{
+			MarkDistinctFiles(this->Items, group.first, group.second, prints);
 		}
 	}
 
-	//=================================================================================================================================================================================================
-	// now, go through the files and find if there's a hash
-	if (true)
+	//
+	// the ones that turned out to be different don't need a hash after all
+	//
+	size_t numEliminated = 0;
+	long long bytesAvoided = 0;
+
+	filesThatNeedTheirHashCalculated.erase(std::remove_if(filesThatNeedTheirHashCalculated.begin(), filesThatNeedTheirHashCalculated.end(), [&](std::size_t i)
+	{
+		const FileOnDisk &file = this->Items[i];
+
+		if (file.Distinct)
+		{
+			++numEliminated;
+			bytesAvoided += file.Size;
+			return true;
+		}
+
+		return false;
+	}), filesThatNeedTheirHashCalculated.end());
+
+	Logger::Get().printf(Logger::Level::Debug, "Told %s files apart by their heads and tails, reading %s bytes instead of %s bytes.\n", comma(numEliminated), comma(bytesRead.load()), comma(bytesAvoided));
+}
+
+
+//=====================================================================================================================================================================================================
+// CompareInLockstep
+//
+// Read all the files in the group a block at a time, side by side, dropping each one as soon as
+// it doesn't match any of the others. With three or fewer, the ones that are left always all
+// match each other, so one hash of what they read does for all of them. Most files that are
+// different stop after the first block, instead of each being read in full.
+//
+// Returns false if it couldn't finish (in which case, they'll just have to be hashed).
+//=====================================================================================================================================================================================================
+bool FileOnDiskSet::CompareInLockstep(FolderBucket& group, bool wantHash, std::atomic<long long>& bytesRead)
+{
+	struct Member
+	{
+		std::size_t			index;
+		HANDLE				hFile;
+		std::vector<BYTE>	buffer;
+	};
+
+	std::vector<Member> members;
+	members.reserve(group.files.size());
+
+	auto CloseAll = [&members]()
+	{
+		for (auto &member : members)
+		{
+			SafeCloseHandle(member.hFile);
+		}
+	};
+
+	for (auto &index : group.files)
+	{
+		auto path = this->GetFilePath(index);
+		const char *pszPath = path.c_str();
+		HANDLE hFile = CreateFileU(pszPath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+		if (INVALID_HANDLE_VALUE == hFile)
+		{
+			Logger::Get().printf(Logger::Level::Error, "Error opening \"%s\"! (%S, %d)\n", pszPath, GetLastErrorString(), GetLastError());
+			CloseAll();
+			return false;
+		}
+
+		// one that's changed size since the scan can't be compared on what was there then
+		LARGE_INTEGER fileSize = {0};
+
+		if (!GetFileSizeEx(hFile, &fileSize) || (fileSize.QuadPart != this->Items[index].Size))
+		{
+			SafeCloseHandle(hFile);
+			CloseAll();
+			return false;
+		}
+
+		members.push_back(Member{index, hFile, std::vector<BYTE>(lockstepBlockSize)});
+	}
+
+	std::unique_ptr<DigestEngine> engine;
+
+	if (wantHash)
+	{
+		engine = DigestEngine::Create(DigestEngine::GetAlgorithm());
+
+		if (!engine)
+		{
+			CloseAll();
+			return false;
+		}
+	}
+
+	Logger::Get().printf(Logger::Level::Info, "(%13s) Comparing %d files, starting with \"%s\"\n", comma(this->Items[members[0].index].Size), static_cast<int>(members.size()), this->GetFilePath(members[0].index).c_str());
+
+	// the members that still match one another
+	std::vector<size_t> active(members.size());
+	for (size_t m = 0; m < members.size(); ++m)
+	{
+		active[m] = m;
+	}
+
+	long long remaining = this->Items[members[0].index].Size;
+
+	while ((remaining > 0) && (active.size() > 1))
+	{
+		if (ControlCHandler::TestShouldTerminate())
+		{
+			CloseAll();
+			return false;
+		}
+
+		DWORD toRead = static_cast<DWORD>(std::min<long long>(remaining, lockstepBlockSize));
+
+		for (auto &m : active)
+		{
+			DWORD cbRead = 0;
+
+			if (!ReadFile(members[m].hFile, &members[m].buffer[0], toRead, &cbRead, nullptr) || (cbRead != toRead))
+			{
+				Logger::Get().printf(Logger::Level::Error, "Error reading \"%s\"! (%S, %d)\n", this->GetFilePath(members[m].index).c_str(), GetLastErrorString(), GetLastError());
+				CloseAll();
+				return false;
+			}
+
+			bytesRead += toRead;
+		}
+
+		// keep the ones that match at least one of the others
+		std::vector<size_t> matched;
+
+		for (auto &a : active)
+		{
+			bool match = false;
+
+			for (auto &b : active)
+			{
+				if ((a != b) && (0 == memcmp(&members[a].buffer[0], &members[b].buffer[0], toRead)))
+				{
+					match = true;
+					break;
+				}
+			}
+
+			if (match)
+			{
+				matched.push_back(a);
+			}
+			else
+			{
+				this->Items[members[a].index].Distinct = true;
+			}
+		}
+
+		std::swap(active, matched);
+
+		if (engine && (active.size() > 1))
+		{
+			engine->Update(&members[active[0]].buffer[0], toRead);
+		}
+
+		remaining -= toRead;
+	}
+
+	CloseAll();
+
+	if (1 == active.size())
+	{
+		// it didn't match the last one it was compared with, so it doesn't match anything
+		this->Items[members[active[0]].index].Distinct = true;
+	}
+	else if (!active.empty() && engine)
+	{
+		// they're all the same, so they all get the same hash
+		Md5Hash hash;
+
+		if (!engine->Final(hash))
+		{
+			return false;
+		}
+
+		for (auto &m : active)
+		{
+			FileOnDisk &file = this->Items[members[m].index];
+			file.Hashed = true;
+			file.Hash = hash;
+		}
+	}
+
+	return true;
+}
+
+
+//=====================================================================================================================================================================================================
+// CompareSmallGroups
+//
+// Groups of two or three same-sized files that are all still in the running (and that none of
+// which has a hash yet) are compared with one another directly, rather than each being hashed
+// in full on its own. The ones that turn out to be the same get a hash out of it, unless only
+// comparing was asked for, in which case they're left without one (and match each other just
+// by being the only ones of their size that are left).
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::CompareSmallGroups(std::vector<std::size_t> &filesThatNeedTheirHashCalculated, uint32_t maxNumThreads, bool wantHash)
+{
+	TimeThis t("Compare small groups of files directly");
+
+	std::vector<FolderBucket> groups;
+
+	for (size_t n = 0; n < filesThatNeedTheirHashCalculated.size();)
+	{
+		const size_t i = filesThatNeedTheirHashCalculated[n];
+		const long long size = this->Items[i].Size;
+
+		size_t m = n + 1;
+		while ((m < filesThatNeedTheirHashCalculated.size()) && (size == this->Items[filesThatNeedTheirHashCalculated[m]].Size))
+		{
+			++m;
+		}
+
+		// every other file of this size has to be out of the running already
+		size_t numInTheRunning = 0;
+
+		for (size_t i2 = i; (i2 > 0) && (size == this->Items[i2 - 1].Size); --i2)
+		{
+			numInTheRunning += this->Items[i2 - 1].Distinct ? 0 : 1;
+		}
+
+		for (size_t i2 = i; (i2 < this->Items.size()) && (size == this->Items[i2].Size); ++i2)
+		{
+			numInTheRunning += this->Items[i2].Distinct ? 0 : 1;
+		}
+
+		if ((m - n > 1) && (m - n <= maxLockstepGroupSize) && (numInTheRunning == m - n))
+		{
+			FolderBucket group;
+			group.folder = this->GetFolderName(i);
+			group.size = static_cast<std::size_t>(size) * (m - n);
+			group.files.assign(filesThatNeedTheirHashCalculated.begin() + n, filesThatNeedTheirHashCalculated.begin() + m);
+			groups.push_back(std::move(group));
+		}
+
+		n = m;
+	}
+
+	if (groups.empty())
+	{
+		return;
+	}
+
+	std::sort(groups.begin(), groups.end(), [](FolderBucket const &left, FolderBucket const &right)
+	{
+		return left.size > right.size;
+	});
+
+	std::atomic<long long> bytesRead{0};
+	std::vector<char> settled(groups.size(), 0);
+
+	RunOnBuckets(groups, maxNumThreads, [&](FolderBucket &group, int)
+	{
+		if (this->CompareInLockstep(group, wantHash, bytesRead))
+		{
+			settled[&group - &groups[0]] = 1;
+		}
+	});
+
+	//
+	// the ones that got settled don't need hashing; the hashes that came out of it go in the
+	// caches, a folder at a time, after all the comparing is done
+	//
+	std::vector<std::size_t> hashed;
+	std::vector<char> done(this->Items.size(), 0);
+	long long bytesCompared = 0;
+	size_t numSettled = 0;
+
+	for (size_t g = 0; g < groups.size(); ++g)
+	{
+		if (!settled[g])
+		{
+			continue;
+		}
+
+		++numSettled;
+		bytesCompared += groups[g].size;
+
+		for (auto &index : groups[g].files)
+		{
+			done[index] = 1;
+
+			if (this->Items[index].Hashed)
+			{
+				hashed.push_back(index);
+			}
+		}
+	}
+
+	filesThatNeedTheirHashCalculated.erase(std::remove_if(filesThatNeedTheirHashCalculated.begin(), filesThatNeedTheirHashCalculated.end(), [&](std::size_t i)
+	{
+		return 0 != done[i];
+	}), filesThatNeedTheirHashCalculated.end());
+
+	std::vector<FolderBucket> buckets = this->MakeFolderBuckets(hashed, false, false);
+
+	RunOnBuckets(buckets, maxNumThreads, [&](FolderBucket &bucket, int)
+	{
+		this->CacheFiles(bucket.folder, std::vector<std::size_t>(bucket.files.begin(), bucket.files.end()));
+	});
+
+	Logger::Get().printf(Logger::Level::Debug, "Compared %s groups of files directly, reading %s bytes instead of %s bytes.\n", comma(numSettled), comma(bytesRead.load()), comma(bytesCompared));
+}
+
+
+//=====================================================================================================================================================================================================
+// FileIdentities
+//
+// Which file on the disk each path is: the device it's on, and the file's number on that device
+// (which the scan gets for nothing when it enumerates with GetFileInformationByHandleEx). All the
+// hard links to a file have the same identity, so they can be matched up without opening any of
+// them. Each folder's device is only looked up once.
+//=====================================================================================================================================================================================================
+typedef std::pair<size_t, unsigned long long> FileIdentity;
+
+struct FileIdentityHash
+{
+	size_t operator()(const FileIdentity &identity) const
+	{
+		return std::hash<unsigned long long>()(identity.second) ^ identity.first;
+	}
+};
+
+class FileIdentities
+{
+public:
+	explicit FileIdentities(const FileOnDiskSet &files) : files(files), devices(files.Folders.size(), unknownDevice) {}
+
+	// false if the scan couldn't tell what the file's number is
+	bool Get(size_t index, FileIdentity &identity)
+	{
+		const FileOnDisk &file = this->files.Items[index];
+
+		if (0 == file.nFileIndex)
+		{
+			return false;
+		}
+
+		size_t &device = this->devices[file.Folder];
+		if (unknownDevice == device)
+		{
+			device = DeviceScheduler::Get().GetDevice(this->files.GetFolderName(file));
+		}
+
+		identity = FileIdentity(device, file.nFileIndex);
+		return true;
+	}
+
+	// whether the files from start up to end can be told apart, and if so, whether they're all the same file
+	bool AllTheSame(size_t start, size_t end, bool &same)
+	{
+		FileIdentity first;
+		FileIdentity other;
+
+		if (!this->Get(start, first))
+		{
+			return false;
+		}
+
+		same = true;
+
+		for (size_t i = start + 1; i < end; ++i)
+		{
+			if (!this->Get(i, other))
+			{
+				return false;
+			}
+
+			same = same && (other == first);
+		}
+
+		return true;
+	}
+
+private:
+	const FileOnDiskSet							&files;
+	static const size_t							unknownDevice = static_cast<size_t>(-1);
+	std::vector<size_t>							devices;		// for each of the set's folders
+};
+
+
+//=====================================================================================================================================================================================================
+// TakeOutHardLinks
+//
+// A file with several hard links would otherwise be read once for each of them (or have each
+// link's folder cache loaded to look for its hash). Instead, the links are matched up by the
+// identity the scan recorded: a link to a file that's already hashed just gets its hash, and of
+// the links to one that isn't, only the first is left in the list to be hashed.
+//=====================================================================================================================================================================================================
+std::vector<std::pair<std::size_t, std::size_t>> FileOnDiskSet::TakeOutHardLinks(std::vector<std::size_t> &filesThatNeedTheirHashCalculated, bool verbose)
+{
+	TimeThis t("Take out hard links");
+
+	std::vector<std::pair<std::size_t, std::size_t>> links;
+	FileIdentities identities(*this);
+	FileIdentity identity;
+
+	// the file numbers of the ones that need a hash, so that only the hashed files that might be
+	// links to one of them have their identity looked up
+	std::unordered_map<unsigned long long, bool> numbers;
+
+	for (auto index : filesThatNeedTheirHashCalculated)
+	{
+		if (0 != this->Items[index].nFileIndex)
+		{
+			numbers[this->Items[index].nFileIndex] = true;
+		}
+	}
+
+	if (numbers.empty())
+	{
+		return links;
+	}
+
+	// the file each identity gets its hash from
+	std::unordered_map<FileIdentity, size_t, FileIdentityHash> owners;
+
+	for (size_t i = 0; i < this->Items.size(); i++)
+	{
+		const FileOnDisk &file = this->Items[i];
+
+		if (file.Hashed && (numbers.find(file.nFileIndex) != numbers.end()) && identities.Get(i, identity))
+		{
+			owners.emplace(identity, i);
+		}
+	}
+
+	long long bytesSaved = 0;
+	size_t kept = 0;
+
+	for (auto index : filesThatNeedTheirHashCalculated)
 	{
-		for (auto &file : this->Items)
+		const FileOnDisk &file = this->Items[index];
+
+		if (identities.Get(index, identity))
 		{
-			if (ControlCHandler::TestShouldTerminate())
+			auto iter = owners.find(identity);
+
+			if (iter == owners.end())
 			{
-				return;
+				owners.emplace(identity, index);
 			}
-
-			auto place = umap.find(this->GetFilePath(file));
-			if (place != umap.end())
+			else
 			{
-				size_t index = place->second;
-				const FileOnDisk &hashed = hashedFiles.Items[index];
-
-				const char *psz1 = hashedFiles.GetFilePath(hashed);
-				const char *psz2 = this->GetFilePath(file);
-				assert(0 == _stricmp(psz1, psz2));
+				// a link to the same file can't be a different size or age, so if it is, the number's no good
+				const FileOnDisk &owner = this->Items[iter->second];
 
-				if (FileTimeDifference(hashed.Time, file.Time) < 10 * ftMilliseconds)
+				if ((owner.Size == file.Size) && (owner.Time == file.Time))
 				{
-					if (hashed.Hashed)
-					{
-						file.Hashed = hashed.Hashed;
-						file.Hash = hashed.Hash;
-					}
+					verboseprintf("No hash needed for \"%s\" because it's a link to \"%s\"...\n", this->GetFilePath(file).c_str(), this->GetFilePath(owner).c_str());
+					links.push_back(std::make_pair(index, iter->second));
+					bytesSaved += file.Size;
+					continue;
 				}
 			}
 		}
+
+		filesThatNeedTheirHashCalculated[kept++] = index;
+	}
+
+	filesThatNeedTheirHashCalculated.resize(kept);
+
+	if (!links.empty())
+	{
+		Logger::Get().printf(Logger::Level::Debug, "%s files are hard links to others, saving reading %s bytes.\n", comma(links.size()), comma(bytesSaved));
 	}
+
+	return links;
 }
 
+
 //=====================================================================================================================================================================================================
+// ShareHashesWithHardLinks
 //=====================================================================================================================================================================================================
-bool AreAllOfTheseHardLinksToOneAnother(const std::vector<const char *> &filesToCheckForHardLinks)
+void FileOnDiskSet::ShareHashesWithHardLinks(const std::vector<std::pair<std::size_t, std::size_t>> &links, uint32_t maxNumThreads)
 {
-	if (ControlCHandler::TestShouldTerminate())
+	std::vector<std::size_t> shared;
+
+	for (auto &link : links)
 	{
-		return false;
+		FileOnDisk &file = this->Items[link.first];
+		const FileOnDisk &owner = this->Items[link.second];
+
+		if (owner.Hashed)
+		{
+			file.Hash = owner.Hash;
+			file.Hashed = true;
+			shared.push_back(link.first);
+		}
 	}
 
-	if (filesToCheckForHardLinks.size() < 2)
+	std::vector<FolderBucket> buckets = this->MakeFolderBuckets(shared, false, false);
+
+	RunOnBuckets(buckets, maxNumThreads, [&](FolderBucket &bucket, int)
 	{
-		return true;
-	}
+		this->CacheFiles(bucket.folder, std::vector<std::size_t>(bucket.files.begin(), bucket.files.end()));
+	});
+}
 
-	AutoCloseHandle	hfile1 = CreateFileU(filesToCheckForHardLinks[0], 0, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
-	if (hfile1.Get() == INVALID_HANDLE_VALUE)
+
+//=====================================================================================================================================================================================================
+// CountHardLinks
+//
+// The links found by the scan, rather than what the file system would say (which would mean
+// opening every file); links from outside the folders that were scanned aren't counted.
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::CountHardLinks()
+{
+	TimeThis t("Count hard links");
+
+	// only the files that share a number with another one need their device looked up
+	std::unordered_map<unsigned long long, DWORD> numbers;
+
+	for (auto &file : this->Items)
 	{
-		return false;
+		if (0 != file.nFileIndex)
+		{
+			numbers[file.nFileIndex]++;
+		}
 	}
 
-	BY_HANDLE_FILE_INFORMATION info1 = {0};
-	GetFileInformationByHandle(hfile1, &info1);
+	FileIdentities identities(*this);
+	FileIdentity identity;
+	std::unordered_map<FileIdentity, DWORD, FileIdentityHash> counts;
 
-	for (size_t i=1; i<filesToCheckForHardLinks.size(); ++i)
+	for (size_t i = 0; i < this->Items.size(); i++)
 	{
-		AutoCloseHandle	hfile2 = CreateFileU(filesToCheckForHardLinks[i], 0, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
-		if (hfile2.Get() == INVALID_HANDLE_VALUE)
+		const FileOnDisk &file = this->Items[i];
+
+		if ((0 != file.nFileIndex) && (numbers[file.nFileIndex] > 1) && identities.Get(i, identity))
 		{
-			return false;
+			counts[identity]++;
 		}
+	}
 
-		BY_HANDLE_FILE_INFORMATION info2 = {0};
-		GetFileInformationByHandle(hfile2, &info2);
+	for (size_t i = 0; i < this->Items.size(); i++)
+	{
+		const FileOnDisk &file = this->Items[i];
 
-		if ((info1.nFileIndexHigh == info2.nFileIndexHigh) && (info1.nFileIndexLow == info2.nFileIndexLow))
+		if (0 == file.nFileIndex)
 		{
-			// it's a link... don't give up
+			file.nNumberOfLinks = 0;
+		}
+		else if (1 == numbers[file.nFileIndex])
+		{
+			file.nNumberOfLinks = 1;
 		}
 		else
 		{
-			return false;
+			identities.Get(i, identity);
+			file.nNumberOfLinks = counts[identity];
 		}
 	}
-
-	return true;
 }
 
+
 //=====================================================================================================================================================================================================
+// HashBucketsInBatch
+//
+// Each device gets a batch of its own, all at the same time, with no more files in flight than
+// the device's limit
 //=====================================================================================================================================================================================================
-void FileOnDiskSet::CalcAllNeededHashesFromOneBucket(FolderBucket& bucket, HashBucketInfo& hbi, TimeThis& t, std::chrono::system_clock::time_point& hashCalcStart, bool verbose, int& hashedCount, long long& byteCount, int iNum)
+void FileOnDiskSet::HashBucketsInBatch(std::vector<FolderBucket> &buckets, uint32_t numWorkers, bool verbose)
 {
-	Md5Cache cache;
-	char szPath[maxString];
-	strcpy_s(szPath, bucket.folder.c_str());
-	strcat_s(szPath, "\\");
-	strcat_s(szPath, pszLocalCacheFileName);
-	bool dirty = false;
+	DeviceScheduler &scheduler = DeviceScheduler::Get();
 
-	std::wstring eta;
-	std::unordered_map<Path, size_t> umap;
+	std::vector<std::vector<BatchHasher::Request>> requests;
+	std::vector<std::vector<size_t>> indices;
+	std::string path;
 
-	if (true)
+	for (auto &bucket : buckets)
 	{
-		std::lock_guard<std::mutex> lock(hbi.mutex);
-		if (hbi.totalBytesProcessed > 0)
+		size_t device = scheduler.GetDevice(bucket.folder.c_str());
+
+		if (requests.size() <= device)
 		{
-			double seconds = t.Elapsed();
-			double pct = (double)hbi.totalBytesProcessed / (double)hbi.totalBytesToProcess;
-			size_t secondsNeeded = static_cast<size_t>(seconds / pct);
-			std::chrono::time_point hashCalcEnd = hashCalcStart + std::chrono::seconds(secondsNeeded);
+			requests.resize(device + 1);
+			indices.resize(device + 1);
+		}
 
-			auto hashCalcEnd_t = std::chrono::system_clock::to_time_t(hashCalcEnd);
-			std::tm hashCalcEnd_local;
-			localtime_s(&hashCalcEnd_local, &hashCalcEnd_t);
+		for (auto index : bucket.files)
+		{
+			FileOnDisk &file = this->Items[index];
 
-			constexpr size_t maxBufferSize = 100;
-			wchar_t etaBuffer[maxBufferSize];
+			if (file.Hashed)
+			{
+				continue;
+			}
 
-			wcsftime(etaBuffer, maxBufferSize, L"%Om/%Oe/%Y %I:%M:%S", &hashCalcEnd_local);
+			// there's no need to read a hard link to something that's already hashed
+			this->GetFilePath(file, path);
 
-			eta = etaBuffer;
+			if ((0 == file.nFileIndex) && GetHardLinkedHash(path.c_str(), file.Hash, verbose))
+			{
+				file.Hashed = true;
+				continue;
+			}
 
-			std::wstring ampm = hashCalcEnd_local.tm_hour > 11 ? L" PM" : L" AM";
-			eta += ampm;
+			requests[device].push_back(BatchHasher::Request{path, Md5Hash(), false});
+			indices[device].push_back(index);
 		}
 	}
 
-	if (true)
+	std::vector<uint32_t> wanted(requests.size(), 0);
+
+	for (size_t device = 0; device < requests.size(); device++)
 	{
-		std::lock_guard<std::mutex> lock(hbi.mutex);
-		++hbi.numBucketsProcessed;
-		Logger::Get().printf(Logger::Level::Info, "Bucket %s of %s (ETA: %S)\n", comma(hbi.numBucketsProcessed), comma(hbi.totalBuckets), eta.c_str());
+		if (!requests[device].empty())
+		{
+			wanted[device] = static_cast<uint32_t>(std::min<size_t>(scheduler.GetLimit(device), requests[device].size()));
+		}
 	}
 
-	if (cache.Load(szPath))
+	// the hashing threads are shared out like readers would be
+	std::vector<uint32_t> workers = AllotReaders(wanted, numWorkers);
+	std::unique_ptr<bool[]> hashed(new bool[requests.size()]);
+	std::atomic<long long> bytesRead(0);
+	std::vector<std::thread> batches;
+
+	for (size_t device = 0; device < requests.size(); device++)
 	{
-		size_t index = 0;
-		for (auto& item : cache.Items)
+		hashed[device] = false;
+
+		if (!requests[device].empty())
 		{
-			umap[cache.GetFileName(item)] = index;
-			index++;
+			batches.emplace_back([&, device]()
+			{
+				hashed[device] = BatchHasher::HashFiles(requests[device], workers[device], scheduler.GetLimit(device), bytesRead);
+			});
 		}
 	}
-	else
+
+	for (auto &batch : batches)
 	{
-		cache.Items.clear();
-		cache.Strings.clear();
+		batch.join();
 	}
 
-	//
-	// got through each file in the bucket
-	//
-	auto bucket_start_time = std::chrono::system_clock::now();
+	size_t numFiles = 0;
 
-	for (auto& index : bucket.files)
+	for (size_t device = 0; device < requests.size(); device++)
 	{
-		if (ControlCHandler::TestShouldTerminate())
+		if (!hashed[device])
 		{
-			return;
+			continue;
 		}
 
-		TimeThis t2("Calculating one file's MD5 hash");
+		for (size_t i = 0; i < requests[device].size(); i++)
+		{
+			if (requests[device][i].Hashed)
+			{
+				FileOnDisk &file = this->Items[indices[device][i]];
+				file.Hash = requests[device][i].Hash;
+				file.Hashed = true;
+			}
+		}
 
-		FileOnDisk& file = this->Items[index];
-		auto path = this->GetFilePath(file);
-		auto name = this->GetFileName(file);
-		auto subp = this->GetSubPathName(file);
+		numFiles += requests[device].size();
+	}
 
-		verboseprintf("Calculating hash for \"%s\"...\n", this->GetFilePath(file));
-		Logger::Get().printf(Logger::Level::Info, "(%13s) Calculating MD5 hash for \"%s\"\n", comma(file.Size), this->GetFilePath(file));
+	Logger::Get().printf(Logger::Level::Debug, "Read %s bytes of %s files in a batch\n", comma(bytesRead.load()), comma(numFiles));
+}
 
-		//
-		// see if the hash already exists
-		//
-		if (umap.find(name) != umap.end())
-		{
-			size_t cache_index = umap[name];
-			Md5CacheItem item = file;
-			item.Name = cache.Items[cache_index].Name;
-			cache.Items[cache_index] = item;
 
+//=====================================================================================================================================================================================================
+// HashSmallFilesInLanes
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::HashSmallFilesInLanes(std::vector<FolderBucket> &buckets, uint32_t numWorkers, bool verbose)
+{
+	DeviceScheduler &scheduler = DeviceScheduler::Get();
+
+	// each device's files, so that none of them has more readers than its limit
+	std::vector<std::vector<Md5LaneRequest>> queues;
+	std::vector<std::vector<size_t>> indices;
+	size_t numRequests = 0;
+	std::string path;
+
+	for (auto &bucket : buckets)
+	{
+		size_t device = scheduler.GetDevice(bucket.folder.c_str());
+
+		if (queues.size() <= device)
+		{
+			queues.resize(device + 1);
+			indices.resize(device + 1);
 		}
 
+		for (auto index : bucket.files)
+		{
+			FileOnDisk &file = this->Items[index];
 
+			if (file.Hashed || (file.Size > md5LaneMaxFileSize))
+			{
+				continue;
+			}
 
+			// there's no need to read a hard link to something that's already hashed
+			this->GetFilePath(file, path);
 
-		//
-		// time how long it takes to get the hash
-		//
-		file.Hashed = GetFileMd5Hash(this->GetFilePath(file), file.Hash, verbose);
+			if ((0 == file.nFileIndex) && GetHardLinkedHash(path.c_str(), file.Hash, verbose))
+			{
+				file.Hashed = true;
+				continue;
+			}
 
-		if (!file.Hashed)
-		{
-			continue;
+			queues[device].push_back(Md5LaneRequest{path, file.Size, Md5Hash(), false});
+			indices[device].push_back(index);
+			numRequests++;
 		}
+	}
 
-		hashedCount++;
-		byteCount += file.Size;
+	// not enough of them to fill the lanes, so it's not worth it
+	if (numRequests < Md5LaneCount())
+	{
+		return;
+	}
 
-		if (umap.find(name) == umap.end())
+	std::vector<uint32_t> wanted(queues.size(), 0);
+
+	for (size_t device = 0; device < queues.size(); device++)
+	{
+		if (!queues[device].empty())
 		{
-			Md5CacheItem item = file;
-			const char* pszName = name;
-			item.Name = static_cast<long>(cache.Strings.size());
-			cache.Strings.insert(cache.Strings.end(), pszName, pszName + strlen(pszName) + 1);
-			cache.Items.push_back(item);
-			dirty = true;
+			wanted[device] = static_cast<uint32_t>(std::min<size_t>(scheduler.GetLimit(device), queues[device].size()));
 		}
-		else
+	}
+
+	Md5HashFilesInLanes(queues, AllotReaders(wanted, numWorkers));
+
+	for (size_t device = 0; device < queues.size(); device++)
+	{
+		for (size_t i = 0; i < queues[device].size(); i++)
 		{
-			// it already exists... overwrite it
-			size_t cache_index = umap[name];
-			Md5CacheItem item = file;
-			item.Name = cache.Items[cache_index].Name;
-			cache.Items[cache_index] = item;
-			dirty = true;
+			if (queues[device][i].Hashed)
+			{
+				FileOnDisk &file = this->Items[indices[device][i]];
+				file.Hash = queues[device][i].Hash;
+				file.Hashed = true;
+			}
 		}
+	}
 
-		//
-		// if it has taken longer than 3 seconds, start the clock over
-		//
-		auto bucket_current_time = std::chrono::system_clock::now();
-		auto elapsed_time = bucket_current_time - bucket_start_time;
-		auto elapsed_time_cutoff = std::chrono::seconds(3);
+	Logger::Get().printf(Logger::Level::Debug, "Hashed %s small files %s at a time\n", comma(numRequests), comma(Md5LaneCount()));
+}
 
-		if ((elapsed_time > elapsed_time_cutoff) && dirty)
+
+//=====================================================================================================================================================================================================
+// HashBigFilesInChunks
+//
+// On an SSD, every chunk of every big file is a task of its own, so a huge file doesn't leave one
+// thread reading it long after the others are done. Anywhere else, reading chunks of the same
+// file side by side would just make the disk seek between them, so each file's chunks are read
+// in order, by one task. Either way, no device has more readers than its limit.
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::HashBigFilesInChunks(std::vector<FolderBucket> &buckets, uint32_t numWorkers, bool verbose)
+{
+	static const size_t allChunks = static_cast<size_t>(-1);
+
+	struct ChunkTask
+	{
+		size_t	bigFile;
+		size_t	chunk;			// or allChunks, one after another
+	};
+
+	DeviceScheduler &scheduler = DeviceScheduler::Get();
+
+	DigestAlgorithm algorithm = DigestEngine::GetAlgorithm();
+	DigestAlgorithm chunkAlgorithm = DigestEngine::GetChunkAlgorithm(algorithm);
+
+	std::vector<size_t> bigFiles;
+	std::vector<std::deque<ChunkTask>> queues;
+	std::string path;
+
+	for (auto &bucket : buckets)
+	{
+		size_t device = scheduler.GetDevice(bucket.folder.c_str());
+		bool fanOut = (DeviceScheduler::Kind::SolidState == scheduler.GetKind(device));
+
+		for (auto index : bucket.files)
 		{
-			if (dirty)
+			FileOnDisk &file = this->Items[index];
+
+			if (file.Hashed || (file.Size <= DigestEngine::GetTreeThreshold()))
 			{
-				//
-				// (33,930,525,343) Calculating MD5 hash for "\\parker\all$\ToCheck\Puma\Raid\Video\The_Force_Awakens_-_BLU-RAY\The_Force_Awakens_-_BLU-RAY_t01.mkv"
-				//
-				verboseprintf("Writing out md5 cache because the elapsed time exceeded the cutoff.\n");
-				bucket_start_time = bucket_current_time;
-				cache.Save(szPath);
-				dirty = false;
+				continue;
+			}
+
+			// there's no need to read a hard link to something that's already hashed
+			if ((0 == file.nFileIndex) && GetHardLinkedHash(this->GetFilePath(file, path), file.Hash, verbose))
+			{
+				file.Hashed = true;
+				continue;
+			}
+
+			if (queues.size() <= device)
+			{
+				queues.resize(device + 1);
+			}
+
+			if (fanOut)
+			{
+				size_t numChunks = static_cast<size_t>((file.Size + treeChunkSize - 1) / treeChunkSize);
+
+				for (size_t chunk = 0; chunk < numChunks; chunk++)
+				{
+					queues[device].push_back(ChunkTask{bigFiles.size(), chunk});
+				}
+			}
+			else
+			{
+				queues[device].push_back(ChunkTask{bigFiles.size(), allChunks});
 			}
+
+			bigFiles.push_back(index);
 		}
+	}
 
-		//pg.Update(numFilesProcessed, totalNumFiles);
-		if (true)
+	if (bigFiles.empty())
+	{
+		return;
+	}
+
+	std::vector<std::vector<Md5Hash>> chunkHashes(bigFiles.size());
+	std::unique_ptr<std::atomic<bool>[]> failed(new std::atomic<bool>[bigFiles.size()]);
+
+	for (size_t i = 0; i < bigFiles.size(); i++)
+	{
+		chunkHashes[i].resize(static_cast<size_t>((this->Items[bigFiles[i]].Size + treeChunkSize - 1) / treeChunkSize));
+		failed[i] = false;
+
+		Logger::Get().printf(Logger::Level::Info, "(%13s) Hashing \"%s\" in %s chunks\n", comma(this->Items[bigFiles[i]].Size), this->GetFilePath(bigFiles[i], path), comma(chunkHashes[i].size()));
+	}
+
+	bool finished = RunByDevice(queues, numWorkers, [&](const ChunkTask &task, size_t)
+	{
+		static thread_local std::string chunkPath;
+		const char *pszPath = this->GetFilePath(bigFiles[task.bigFile], chunkPath);
+
+		auto &hashes = chunkHashes[task.bigFile];
+		size_t first = (allChunks == task.chunk) ? 0 : task.chunk;
+		size_t last = (allChunks == task.chunk) ? hashes.size() : task.chunk + 1;
+		long long bytes = 0;
+
+		for (size_t chunk = first; (chunk < last) && !failed[task.bigFile]; chunk++)
 		{
-			std::lock_guard<std::mutex> lock(hbi.mutex);
-			hbi.totalBytesProcessed += file.Size;
-			++hbi.numFilesProcessed;
+			if (ControlCHandler::TestShouldTerminate() || !FileHasher::ForThisThread().HashRange(pszPath, chunk * treeChunkSize, treeChunkSize, chunkAlgorithm, hashes[chunk], nullptr))
+			{
+				failed[task.bigFile] = true;
+				break;
+			}
+
+			bytes += std::min<long long>(treeChunkSize, this->Items[bigFiles[task.bigFile]].Size - static_cast<long long>(chunk * treeChunkSize));
 		}
+
+		return bytes;
+	});
+
+	if (!finished)
+	{
+		return;
 	}
 
-	if (dirty)
+	for (size_t i = 0; i < bigFiles.size(); i++)
 	{
-		cache.Save(szPath);
+		FileOnDisk &file = this->Items[bigFiles[i]];
+
+		if (!failed[i] && DigestEngine::CombineChunks(algorithm, chunkHashes[i], file.Size, file.Hash))
+		{
+			file.Hashed = true;
+		}
 	}
 }
 
@@ -742,9 +3301,11 @@ void FileOnDiskSet::UpdateHashedFiles(FindDupesFlags flags)
 	std::vector<std::size_t> filesThatNeedTheirHashCalculated;
 
 	bool forceAll = TestFindDupesFlags(flags, FindDupesFlags::ForceAll);
+	bool compareOnly = TestFindDupesFlags(flags, FindDupesFlags::CompareOnly);
 	bool verbose = TestFindDupesFlags(flags, FindDupesFlags::Verbose);
 	bool sortOnSize = TestFindDupesFlags(flags, FindDupesFlags::SortOnSize);
 	bool sortReverse = TestFindDupesFlags(flags, FindDupesFlags::SortInReverse);
+	bool sortOnLayout = TestFindDupesFlags(flags, FindDupesFlags::SortOnLayout);
 	uint32_t iMaxNumThreads = GetMaxNumThreads(flags);
 
 	if (iMaxNumThreads < 1)
@@ -756,17 +3317,17 @@ void FileOnDiskSet::UpdateHashedFiles(FindDupesFlags flags)
 	// sort on size
 	{
 		TimeThis t("Sort on file path");
-		std::sort(this->Items.begin(), this->Items.end(), [&](FileOnDisk const &left, FileOnDisk const &right)
-		{
-			if (left.Size == right.Size)
-			{
-				return (_stricmp(this->GetFilePath(left), this->GetFilePath(right)) < 0);
-			}
+		this->SortOnSizeAndPath();
+	}
 
-			return left.Size > right.Size;
-		});
+	if (ControlCHandler::TestShouldTerminate())
+	{
+		return;
 	}
 
+	// which files are links to one another (for here, and for showing the dupes)
+	this->CountHardLinks();
+
 	if (ControlCHandler::TestShouldTerminate())
 	{
 		return;
@@ -777,13 +3338,12 @@ void FileOnDiskSet::UpdateHashedFiles(FindDupesFlags flags)
 		TimeThis t("To determine what files need MD5 hashes, and then calculate them.");
 		int hashedCount = 0;
 		long long byteCount = 0;
+		FileIdentities identities(*this);
 
 		for (size_t i = 0; i < this->Items.size(); i++)
 		{
 			FileOnDisk& file = this->Items[i];
-			auto path = this->GetFilePath(i);
 			auto name = this->GetFileName(i);
-			auto subp = this->GetSubPathName(i);
 
 			if (ControlCHandler::TestShouldTerminate())
 			{
@@ -834,24 +3394,36 @@ void FileOnDiskSet::UpdateHashedFiles(FindDupesFlags flags)
 					++iEndIndex;
 				}
 
-				std::vector<const char*> filesToCheckForHardLinks;
-				filesToCheckForHardLinks.reserve(1 + iEndIndex - iStartIndex);
+				// the scan usually knows which file each one is, which saves opening them all to find out
+				bool allHardLinks = false;
 
-				for (size_t i2 = iStartIndex; i2 < iEndIndex; ++i2)
+				if (1 == file.nNumberOfLinks)
 				{
-					filesToCheckForHardLinks.push_back(this->GetFilePath(i2));
+					// it's the only link to it, so the others can't all be links to it
+				}
+				else if (!identities.AllTheSame(iStartIndex, iEndIndex, allHardLinks))
+				{
+					std::vector<std::string> filesToCheckForHardLinks;
+					filesToCheckForHardLinks.reserve(1 + iEndIndex - iStartIndex);
+
+					for (size_t i2 = iStartIndex; i2 < iEndIndex; ++i2)
+					{
+						filesToCheckForHardLinks.push_back(this->GetFilePath(i2));
+					}
+
+					allHardLinks = AreAllOfTheseHardLinksToOneAnother(filesToCheckForHardLinks);
 				}
 
-				if (AreAllOfTheseHardLinksToOneAnother(filesToCheckForHardLinks))
+				if (allHardLinks)
 				{
-					verboseprintf("Skipping hash for \"%s\" because everything that's the same size is a hard link\n", this->GetFilePath(file));
+					verboseprintf("Skipping hash for \"%s\" because everything that's the same size is a hard link\n", this->GetFilePath(file).c_str());
 					hashNeeded = false;
 				}
 			}
 
 			if (hashNeeded)
 			{
-				//verboseprintf("Adding calc hash entry for \"%s\"...\n", this->GetFilePath(file));
+				//verboseprintf("Adding calc hash entry for \"%s\"...\n", this->GetFilePath(file).c_str());
 				filesThatNeedTheirHashCalculated.push_back(i);
 			}
 		}
@@ -880,12 +3452,6 @@ void FileOnDiskSet::UpdateHashedFiles(FindDupesFlags flags)
 				{
 					FileOnDisk& file = this->Items[i];
 
-					auto path = this->GetFilePath(i);
-					auto name = this->GetFileName(i);
-					auto subp = this->GetSubPathName(i);
-					auto folder = this->GetFolderName(i);
-					auto bucketName = folder;
-
 					if (file.Hashed)
 					{
 						filesWereRemoved = true;
@@ -901,75 +3467,34 @@ void FileOnDiskSet::UpdateHashedFiles(FindDupesFlags flags)
 		}
 
 		//=============================================================================================================================================================================================
-		// now, we want to bucketize each item we need to calculcate a hash for based on the folder it's in
+		// before reading all of any big files, see if reading just their heads and tails is enough to tell them apart,
+		// and then compare what's left of the small groups directly instead of hashing them
 		//=============================================================================================================================================================================================
-		std::unordered_map<std::string, FolderBucket> bucket_map;
-
-		for (auto &i : filesThatNeedTheirHashCalculated)
+		if (!forceAll)
 		{
-			FileOnDisk& file = this->Items[i];
-
-			auto path = this->GetFilePath(i);
-			auto name = this->GetFileName(i);
-			auto subp = this->GetSubPathName(i);
-			auto folder = this->GetFolderName(i);
-			auto bucketName = folder;
+			this->EliminateByPartialHashes(filesThatNeedTheirHashCalculated, iMaxNumThreads, sortReverse);
 
-			if (sortOnSize)
+			if (!ControlCHandler::TestShouldTerminate())
 			{
-				bucketName = path;
+				this->CompareSmallGroups(filesThatNeedTheirHashCalculated, iMaxNumThreads, !compareOnly);
 			}
 
-			auto& bucket_iter = bucket_map.find(bucketName);
-			if (bucket_iter == bucket_map.end())
+			if (ControlCHandler::TestShouldTerminate())
 			{
-				FolderBucket newbucket;
-				newbucket.folder = folder;
-				newbucket.size = 0;
-				bucket_map[bucketName] = std::move(newbucket);
-				bucket_iter = bucket_map.find(bucketName);
-				assert(bucket_iter != bucket_map.end());
+				HashCacheStore::Get().Commit();
+				return;
 			}
-
-			auto& bucket = bucket_iter->second;
-			bucket.size += static_cast<std::size_t>(file.Size);
-			bucket.files.push_back(i);
-
-			__nop();
 		}
 
-
 		//=============================================================================================================================================================================================
-		// now, sort the list of buckets
+		// each file on the disk only needs reading once, however many links it has
 		//=============================================================================================================================================================================================
-		std::vector<FolderBucket> folderbucketlist;
-		folderbucketlist.reserve(bucket_map.size());
-
-		for (auto &bucket_item : bucket_map)
-		{
-			auto& bucket = std::move(bucket_item.second);
-			folderbucketlist.push_back(bucket);
-		}
+		std::vector<std::pair<std::size_t, std::size_t>> hardLinks = this->TakeOutHardLinks(filesThatNeedTheirHashCalculated, verbose);
 
-		// sort on size
-		{
-			TimeThis t("Sort on bucket size");
-
-			if (sortReverse)
-			{
-				std::sort(folderbucketlist.begin(), folderbucketlist.end(), [&](FolderBucket const &left, FolderBucket const &right)
-				{
-					return left.size < right.size;
-				});
-			}
-			else
-			{
-				std::sort(folderbucketlist.begin(), folderbucketlist.end(), [&](FolderBucket const &left, FolderBucket const &right)
-				{
-					return left.size > right.size;
-				});
-			}
-		}
+		//=============================================================================================================================================================================================
+		// now, we want to bucketize each item we need to calculcate a hash for based on the folder it's in, and sort the list of buckets
+		//=============================================================================================================================================================================================
+		std::vector<FolderBucket> folderbucketlist = this->MakeFolderBuckets(filesThatNeedTheirHashCalculated, sortOnSize, sortReverse, sortOnLayout);
 
 		//=============================================================================================================================================================================================
 		// now, process each bucket
@@ -993,54 +3518,80 @@ void FileOnDiskSet::UpdateHashedFiles(FindDupesFlags flags)
 				FileOnDiskSet::_numCores = std::thread::hardware_concurrency();
 			}
 
-			//
-			// allocate threads
-			//
-			std::vector<std::thread> threads;//(FileOnDiskSet::_numCores);
-
 			auto hashCalcStart = std::chrono::system_clock::now();
+			bool batched = (BatchHasher::GetFilesInFlight() > 0);
+			bool finished = true;
 
-			for (auto &bucket : folderbucketlist)
+			auto calcOneBucket = [&](FolderBucket &bucket, int iNumThreads)
 			{
-				if (ControlCHandler::TestShouldTerminate())
-				{
-					//
-					// ensure all threads are finished
-					//
-					for (auto& thread : threads)
-					{
-						thread.join();
-					}
+				CalcAllNeededHashesFromOneBucket(bucket, hbi, t, hashCalcStart, verbose, hashedCount, byteCount, iNumThreads);
+			};
 
-					return;
-				}
+			// big files are cut up, so that all the threads can share them
+			if (DigestEngine::IsTree(DigestEngine::GetAlgorithm()))
+			{
+				this->HashBigFilesInChunks(folderbucketlist, iMaxNumThreads, verbose);
+			}
+
+			// lots of small files go much faster with several hashed side by side
+			if (DigestAlgorithm::Md5 == DigestEngine::GetAlgorithm())
+			{
+				this->HashSmallFilesInLanes(folderbucketlist, iMaxNumThreads, verbose);
+			}
 
-				while (threads.size() >= iMaxNumThreads)
+			if (batched)
+			{
+				// hash a chunk of buckets in one batch, and then let the buckets cache them (they'll find them already hashed)
+				size_t next = 0;
+
+				while (finished && (next < folderbucketlist.size()))
 				{
-					// wait
-					threads.erase(std::remove_if(threads.begin(), threads.end(), [](std::thread& thread) {if (thread.joinable()) { thread.join(); return true; } return false; }), threads.end());
-					if (threads.size() >= iMaxNumThreads)
+					std::vector<FolderBucket> chunk;
+					long long chunkSize = 0;
+
+					while ((next < folderbucketlist.size()) && (chunkSize < batchChunkSize))
 					{
-						Sleep(100);
+						chunkSize += folderbucketlist[next].size;
+						chunk.push_back(std::move(folderbucketlist[next++]));
 					}
+
+					this->HashBucketsInBatch(chunk, iMaxNumThreads, verbose);
+
+					finished = !ControlCHandler::TestShouldTerminate() && RunOnBucketsByDevice(chunk, iMaxNumThreads, calcOneBucket);
 				}
+			}
+			else
+			{
+				finished = RunOnBucketsByDevice(folderbucketlist, iMaxNumThreads, calcOneBucket);
+			}
 
-				int iNumThreads = static_cast<int>(threads.size());
+			// if the hashes are going into an index, make sure the last of them get there
+			HashCacheStore::Get().Commit();
 
-				threads.emplace_back([&]() {CalcAllNeededHashesFromOneBucket(bucket, hbi, t, hashCalcStart, verbose, hashedCount, byteCount, iNumThreads); });
+			if (!finished)
+			{
+				return;
 			}
 
-			//
-			// ensure all threads are finished
-			//
-			for (auto& thread : threads)
+			// so the ways of hashing (and the orders the files go in) can be compared on the same files
+			double seconds = std::max(t.Elapsed(), 1e-3);
+			Logger::Get().printf(Logger::Level::Info, "Hashed %s bytes in %.1f seconds (%.1f MB/s, %s, %s)\n", comma(byteCount), seconds, (byteCount / (1024.0*1024.0)) / seconds,
+				batched ? "batched" : "a thread per folder",
+				sortOnLayout ? "in disk order" : (sortOnSize ? "by file size" : "by folder size"));
+
+			if (!batched)
 			{
-				thread.join();
+				DeviceScheduler::Get().Report();
 			}
 		}
 
+		this->ShareHashesWithHardLinks(hardLinks, iMaxNumThreads);
+
 		Logger::Get().printf(Logger::Level::Debug, "Calculated the hash of %d files for %s bytes.\n", hashedCount, comma(byteCount));
 	}
+
+	// the hashing only updated Items
+	this->UpdateHashColumns();
 }
 
 //=====================================================================================================================================================================================================
@@ -1050,7 +3601,9 @@ void FileOnDiskSet::RemoveSetFromSet(const FileOnDiskSet &infiles)
 	TimeThis t("Remove files from one FileOnDiskSet in another FileOnDiskSet");
 
 	// create a path map of the infiles
-	std::unordered_map<Path, size_t> umap;
+	std::unordered_map<FilePathKey, size_t, FilePathKeyHash> umap;
+	FilePathKeys inKeys(infiles);
+	FilePathKeys ourKeys(*this);
 
 	if (true)
 	{
@@ -1059,24 +3612,25 @@ void FileOnDiskSet::RemoveSetFromSet(const FileOnDiskSet &infiles)
 		int index = 0;
 		for (auto &file : infiles.Items)
 		{
-			const char *pszPath = infiles.GetFilePath(file);
-			umap[pszPath] = index;
+			umap[inKeys.Get(file)] = index;
 			index++;
 		}
 	}
 
 	FileOnDiskSet output;
 	output.Items.reserve(this->Items.size());
+	output.Folders.reserve(this->Folders.size());
 	output.Strings.reserve(this->Strings.size());
+	output.RootPathLength = this->RootPathLength;
+
+	std::vector<size_t> folderMap;
 
 	for (auto &file : this->Items)
 	{
-		const char *pszPath = this->GetFilePath(file);
-
-		if (umap.find(pszPath) == umap.end())
+		if (umap.find(ourKeys.Get(file)) == umap.end())
 		{
 			FileOnDisk newFile = file;
-			output.AddPathToStrings(newFile, pszPath, file.Name - file.Path);
+			output.AddPathToStrings(newFile, CopyFolder(output, *this, file.Folder, folderMap), this->GetFileName(file));
 			output.Items.push_back(newFile);
 		}
 		else
@@ -1087,148 +3641,411 @@ void FileOnDiskSet::RemoveSetFromSet(const FileOnDiskSet &infiles)
 	}
 
 	this->Items.clear();
+	this->Folders.clear();
 	this->Strings.clear();
+	this->DropColumns();
 
 	this->Items = std::move(output.Items);
+	this->Folders = std::move(output.Folders);
 	this->Strings = std::move(output.Strings);
 }
 
 //=====================================================================================================================================================================================================
 //=====================================================================================================================================================================================================
-bool FileOnDiskSet::UpdateFile(const FileOnDisk &file)
+bool FileOnDiskSet::UpdateFile(const FileOnDisk &file)
+{
+	Md5Cache cache;
+	HashCacheStore &store = HashCacheStore::Get();
+
+	// the folder the file is in
+	std::string folder = this->GetFolderName(file);
+
+	// load the cache
+	if (store.Load(folder.c_str(), cache))
+	{
+		auto filename = this->GetFileName(file);
+		// find the item
+		for (auto &i : cache.Items)
+		{
+			auto cachedName = cache.GetFileName(i);
+			if (0 == ComparePathStrings(cachedName, filename))
+			{
+				i = file;
+				store.Save(folder.c_str(), cache);
+				return true;
+			}
+		}
+
+		// the filename wasn't found within the MD5 cache at all
+		Md5CacheItem item = file;
+		item.Name = static_cast<long>(cache.Strings.size());
+		cache.Strings.insert(cache.Strings.end(), filename, filename + strlen(filename) + 1);
+		cache.Items.push_back(item);
+		store.Save(folder.c_str(), cache);
+		return true;
+
+	}
+	else
+	{
+		// no MD5 cache file exists... let's create one!
+		cache.Items.clear();
+		cache.Strings.clear();
+
+		Md5CacheItem item = file;
+		item.Name = static_cast<long>(cache.Strings.size());
+		const char *pszName = this->GetFileName(file);
+		cache.Strings.insert(cache.Strings.end(), pszName, pszName + strlen(pszName) + 1);
+		cache.Items.push_back(item);
+		store.Save(folder.c_str(), cache);
+		return true;
+	}
+
+	return false;
+}
+
+
+
+//=====================================================================================================================================================================================================
+// Is the path on a network drive (or a UNC share)?
+//=====================================================================================================================================================================================================
+static bool IsRemotePath(const char *pszPath)
+{
+	if (('\\' == pszPath[0]) && ('\\' == pszPath[1]))
+	{
+		// "\\?\c:\..." is local, anything else starting with "\\" is a share
+		if (('?' == pszPath[2]) && ('\\' == pszPath[3]) && (0 != pszPath[4]) && (':' == pszPath[5]))
+		{
+			pszPath += 4;
+		}
+		else
+		{
+			return true;
+		}
+	}
+
+	if ((0 != pszPath[0]) && (':' == pszPath[1]))
+	{
+		char szRoot[] = "?:\\";
+		szRoot[0] = pszPath[0];
+		return DRIVE_REMOTE == GetDriveTypeA(szRoot);
+	}
+
+	return false;
+}
+
+//=====================================================================================================================================================================================================
+// Copy an item out of a cache file whose items are itemSize bytes, filling in what older
+// versions didn't have
+//=====================================================================================================================================================================================================
+static Md5CacheItem ReadCacheItem(const char *p, size_t itemSize)
+{
+	Md5CacheItem item;
+
+	if (itemSize >= sizeof(item))
+	{
+		memcpy(&item, p, sizeof(item));
+	}
+	else
+	{
+		memcpy(&item, p, HASHCACHE_LEGACY_ITEM_SIZE);
+		item.Flags	= HASHCACHE_ITEM_HASH;
+		item.Head	= 0;
+		item.Tail	= 0;
+	}
+
+	return item;
+}
+
+//=====================================================================================================================================================================================================
+// Md5CacheView::Load
+//
+// Map (or read) the cache file, and check that everything in it is in range before handing
+// out any pointers into it
+//=====================================================================================================================================================================================================
+bool Md5CacheView::Load(const char *pszFileName)
+{
+	// below this, one ReadFile is cheaper than setting up a mapping
+	const long long minMappedFileSize = 64 * 1024;
+
+	this->Close();
+
+	HANDLE hFile = CreateFileU(pszFileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM, nullptr);
+
+	if ((nullptr == hFile) || (INVALID_HANDLE_VALUE == hFile))
+	{
+		return false;
+	}
+
+	LARGE_INTEGER filesize = {0};
+	GetFileSizeEx(hFile, &filesize);
+
+	if (filesize.QuadPart < static_cast<long long>(sizeof(HashCacheHeader)))
+	{
+		CloseHandle(hFile);
+		return false;
+	}
+
+	const char *p = nullptr;
+
+	if ((filesize.QuadPart >= minMappedFileSize) && !IsRemotePath(pszFileName))
+	{
+		this->hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+		if (nullptr != this->hMapping)
+		{
+			this->pView = MapViewOfFile(this->hMapping, FILE_MAP_READ, 0, 0, 0);
+			p = reinterpret_cast<const char *>(this->pView);
+		}
+	}
+
+	if (nullptr == p)
+	{
+		// long longs, so the items are aligned just like they would be in a mapped view
+		SafeCloseHandle(this->hMapping);
+		this->buffer.resize(static_cast<size_t>((filesize.QuadPart + sizeof(long long) - 1) / sizeof(long long)));
+
+		DWORD dwBytes = 0;
+		if (ReadFile(hFile, &this->buffer[0], static_cast<DWORD>(filesize.QuadPart), &dwBytes, nullptr) && (dwBytes == filesize.QuadPart))
+		{
+			p = reinterpret_cast<const char *>(&this->buffer[0]);
+		}
+	}
+
+	CloseHandle(hFile);
+
+	if (nullptr == p)
+	{
+		this->Close();
+		return false;
+	}
+
+	//
+	// work out where everything is
+	//
+	const HashCacheHeader *pheader = reinterpret_cast<const HashCacheHeader *>(p);
+	const size_t fileSize = static_cast<size_t>(filesize.QuadPart);
+
+	size_t headerSize	= sizeof(HashCacheHeader);
+	size_t itemSize		= (FILEONDISK_VERSION == pheader->version) ? sizeof(Md5CacheItem) : HASHCACHE_LEGACY_ITEM_SIZE;
+	size_t itemsSize	= 0;
+	size_t stringsSize	= 0;
+
+	if ((pheader->numFiles < 0) || (static_cast<unsigned long long>(pheader->numFiles) > fileSize / itemSize))
+	{
+		this->Close();
+		return false;
+	}
+
+	itemsSize = static_cast<size_t>(pheader->numFiles) * itemSize;
+
+	if (FILEONDISK_VERSION_1 == pheader->version)
+	{
+		// the strings are everything after the items
+		if ((headerSize + itemsSize > fileSize) || (DigestAlgorithm::Md5 != DigestEngine::GetAlgorithm()))
+		{
+			this->Close();
+			return false;
+		}
+
+		stringsSize = fileSize - headerSize - itemsSize;
+	}
+	else if (((FILEONDISK_VERSION_2 == pheader->version) || (FILEONDISK_VERSION == pheader->version)) && (fileSize >= sizeof(HashCacheHeaderEx)))
+	{
+		const HashCacheHeaderEx *pheaderEx = reinterpret_cast<const HashCacheHeaderEx *>(p);
+
+		if ((pheaderEx->headerSize < static_cast<long long>(sizeof(HashCacheHeaderEx))) || (0 != (pheaderEx->headerSize & 7)) || (pheaderEx->itemSize != static_cast<long long>(itemSize)) || (pheaderEx->stringsSize < 0) || (pheaderEx->algorithm != static_cast<long long>(DigestEngine::GetAlgorithm())))
+		{
+			this->Close();
+			return false;
+		}
+
+		headerSize	= static_cast<size_t>(pheaderEx->headerSize);
+		stringsSize	= static_cast<size_t>(pheaderEx->stringsSize);
+
+		if ((headerSize > fileSize) || (itemsSize > fileSize - headerSize) || (stringsSize > fileSize - headerSize - itemsSize))
+		{
+			this->Close();
+			return false;
+		}
+	}
+	else
+	{
+		this->Close();
+		return false;
+	}
+
+	this->Version		= pheader->version;
+	this->Items.pData	= reinterpret_cast<const Md5CacheItem *>(p + headerSize);
+	this->Items.count	= static_cast<size_t>(pheader->numFiles);
+	this->Strings.pData	= p + headerSize + itemsSize;
+	this->Strings.count	= stringsSize;
+
+	if (itemSize != sizeof(Md5CacheItem))
+	{
+		// an older file, so the items need filling out
+		this->replayedItems.reserve(this->Items.count);
+
+		for (size_t i = 0; i < this->Items.count; ++i)
+		{
+			this->replayedItems.push_back(ReadCacheItem(p + headerSize + i * itemSize, itemSize));
+		}
+
+		this->Items.pData	= this->replayedItems.data();
+	}
+
+	// the names must all be in range, and the last one must be terminated
+	if ((this->Strings.count > 0) && (0 != this->Strings[this->Strings.count - 1]))
+	{
+		this->Close();
+		return false;
+	}
+
+	for (auto &item : this->Items)
+	{
+		if (item.Name >= this->Strings.count)
+		{
+			this->Close();
+			return false;
+		}
+	}
+
+	// anything left over (after the padding) is the journal
+	size_t journalOffset = (headerSize + itemsSize + stringsSize + 7) & ~static_cast<size_t>(7);
+
+	if (journalOffset < fileSize)
+	{
+		this->ReplayJournal(p + journalOffset, fileSize - journalOffset, itemSize);
+	}
+
+	return true;
+}
+
+//=====================================================================================================================================================================================================
+// Md5CacheView::ReplayJournal
+//
+// Copy the items and strings out of the file, and apply the journal records to them in order.
+// If the last record was only partly written (e.g., we were killed in the middle of appending
+// it), it's ignored, along with anything after it.
+//=====================================================================================================================================================================================================
+void Md5CacheView::ReplayJournal(const char *pJournal, size_t journalSize, size_t itemSize)
 {
-	Md5Cache cache;
+	// the records in older files have older (smaller) items in them too
+	const size_t recordHeaderSize = offsetof(HashCacheJournalRecord, item) + itemSize;
 
-	// this will represent the location of the Md5Cache file
-	char szPath[maxString];
+	if (this->Items.pData != this->replayedItems.data())
+	{
+		this->replayedItems.assign(this->Items.begin(), this->Items.end());
+	}
 
-	// get the full path
-	auto pszPath = this->GetFilePath(file);
+	// reserve enough up front that the strings never move, since the map points into them
+	this->replayedStrings.reserve(this->Strings.size() + journalSize);
+	this->replayedStrings.assign(this->Strings.begin(), this->Strings.end());
 
-	// copy the folder part
-	strncpy_s(szPath, pszPath, file.Name - file.Path);
+	std::unordered_map<Path, size_t> umap;
+	umap.reserve(this->replayedItems.size());
 
-	// null-terminate it
-	szPath[file.Name - file.Path] = 0;
+	for (size_t i = 0; i < this->replayedItems.size(); ++i)
+	{
+		umap[&this->replayedStrings[this->replayedItems[i].Name]] = i;
+	}
 
-	// add the name of the cache file
-	strcat_s(szPath, pszLocalCacheFileName);
+	size_t offset = 0;
 
-	// load the cache
-	if (cache.Load(szPath))
+	while (offset + recordHeaderSize <= journalSize)
 	{
-		auto filename = this->GetFileName(file);
-		// find the item
-		for (auto &i : cache.Items)
+		const HashCacheJournalRecord *precord = reinterpret_cast<const HashCacheJournalRecord *>(pJournal + offset);
+		const char *pszName = pJournal + offset + recordHeaderSize;
+		Md5CacheItem item = ReadCacheItem(pJournal + offset + offsetof(HashCacheJournalRecord, item), itemSize);
+		size_t nameSize = item.Name;
+
+		if ((HASHCACHE_JOURNAL_MARKER != precord->marker) || (precord->recordSize > journalSize - offset) || (0 == nameSize) || (recordHeaderSize + nameSize > precord->recordSize) || (0 != pszName[nameSize - 1]))
 		{
-			auto cachedName = cache.GetFileName(i);
-			if (0 == _stricmp(cachedName, filename))
-			{
-				i = file;
-				cache.Save(szPath);
-				return true;
-			}
+			break;
 		}
 
-		// the filename wasn't found within the MD5 cache at all
-		Md5CacheItem item = file;
-		item.Name = static_cast<long>(cache.Strings.size());
-		cache.Strings.insert(cache.Strings.end(), filename, filename + strlen(filename) + 1);
-		cache.Items.push_back(item);
-		cache.Save(szPath);
-		return true;
-
-	}
-	else
-	{
-		// no MD5 cache file exists... let's create one!
-		cache.Items.clear();
-		cache.Strings.clear();
+		auto iter = umap.find(pszName);
+		if (iter != umap.end())
+		{
+			item.Name = this->replayedItems[iter->second].Name;
+			this->replayedItems[iter->second] = item;
+		}
+		else
+		{
+			item.Name = static_cast<unsigned long>(this->replayedStrings.size());
+			this->replayedStrings.insert(this->replayedStrings.end(), pszName, pszName + nameSize);
+			this->replayedItems.push_back(item);
+			umap[&this->replayedStrings[item.Name]] = this->replayedItems.size() - 1;
+		}
 
-		Md5CacheItem item = file;
-		item.Name = static_cast<long>(cache.Strings.size());
-		const char *pszName = this->GetFileName(file);
-		cache.Strings.insert(cache.Strings.end(), pszName, pszName + strlen(pszName) + 1);
-		cache.Items.push_back(item);
-		cache.Save(szPath);
-		return true;
+		++this->NumJournalRecords;
+		offset += precord->recordSize;
 	}
 
-	return false;
+	this->Items.pData	= this->replayedItems.data();
+	this->Items.count	= this->replayedItems.size();
+	this->Strings.pData	= this->replayedStrings.data();
+	this->Strings.count	= this->replayedStrings.size();
 }
 
-
-
 //=====================================================================================================================================================================================================
 //=====================================================================================================================================================================================================
-bool Md5Cache::Load(const char *pszFileName)
+void Md5CacheView::Close()
 {
-	bool result = false;
-
-	HANDLE hFile = CreateFileU(pszFileName, GENERIC_READ, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM, nullptr);
-
-	if (nullptr != hFile && INVALID_HANDLE_VALUE != hFile)
+	this->Items = ConstArrayView<Md5CacheItem>();
+	this->Strings = ConstArrayView<char>();
+	this->Version = 0;
+	this->NumJournalRecords = 0;
+	this->replayedItems.clear();
+	this->replayedStrings.clear();
+
+	if (nullptr != this->pView)
 	{
-		HashCacheHeader header;
-		DWORD dwBytes;
-
-		// get the size
-		LARGE_INTEGER filesize;
-		GetFileSizeEx(hFile, &filesize);
-
-		ReadFile(hFile, &header, sizeof(header), &dwBytes, nullptr);
-
-		if (header.version == FILEONDISK_VERSION)
-		{
-			this->Items.clear();
-			this->Strings.clear();
-
-			size_t itemcount = static_cast<size_t>(header.numFiles);
-			size_t stringSize = static_cast<size_t>(filesize.QuadPart) - (itemcount * sizeof(Md5CacheItem)) - sizeof(header);
+		UnmapViewOfFile(this->pView);
+		this->pView = nullptr;
+	}
 
-			this->Items.reserve(itemcount);
-			this->Strings.reserve(stringSize);
+	SafeCloseHandle(this->hMapping);
+	this->buffer.clear();
+}
 
-			size_t i = 0;
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void Md5CacheView::Assign(std::vector<Md5CacheItem> &&items, std::vector<char> &&strings)
+{
+	this->Close();
 
-			Md5CacheItem item;
+	this->replayedItems		= std::move(items);
+	this->replayedStrings	= std::move(strings);
+	this->Version			= FILEONDISK_VERSION;
 
-			for (i=0 ; i<itemcount ; i++)
-			{
-				ReadFile(hFile, &item, sizeof(item), &dwBytes, nullptr);
-				assert(dwBytes == sizeof(item));
-				assert(item.Size >= 0);
-				if (item.Name < 0)
-				{
-					this->Items.clear();
-					this->Strings.clear();
-					CloseHandle(hFile);
-					return false;
-				}
-				assert(item.Name >= 0);
-				assert(item.Name < stringSize);
-				this->Items.push_back(item);
-			}
+	this->Items.pData	= this->replayedItems.data();
+	this->Items.count	= this->replayedItems.size();
+	this->Strings.pData	= this->replayedStrings.data();
+	this->Strings.count	= this->replayedStrings.size();
+}
 
-			// now, read in the strings...
-			if (stringSize > 0)
-			{
-				this->Strings.assign(stringSize, 0);
-				ReadFile(hFile, &this->Strings[0], static_cast<DWORD>(stringSize), &dwBytes, nullptr);
-				assert(stringSize == dwBytes);
-			}
+//=====================================================================================================================================================================================================
+// Md5Cache::Load
+//
+// Same as Md5CacheView::Load, but into vectors we can change. It comes by way of the registry,
+// so if the file has already been read during this run, it isn't read again.
+//=====================================================================================================================================================================================================
+bool Md5Cache::Load(const char *pszFileName)
+{
+	auto pcache = Md5CacheRegistry::Get().Load(pszFileName);
 
-			LARGE_INTEGER filePos = {0};
-			SetFilePointerEx(hFile, filePos, &filePos, FILE_CURRENT);
-			assert(filePos.QuadPart == filesize.QuadPart);
+	if (!pcache)
+	{
+		return false;
+	}
 
-			result = true;
-		}
+	const Md5CacheView &view = pcache->Cache;
 
-		CloseHandle(hFile);
-	}
+	this->Items.assign(view.Items.begin(), view.Items.end());
+	this->Strings.assign(view.Strings.begin(), view.Strings.end());
+	this->LoadedVersion = view.Version;
 
-	return result;
+	return true;
 }
 
 
@@ -1238,21 +4055,45 @@ bool Md5Cache::Save(const char *pszFileName)
 {
 	bool result = false;
 
+	Md5CacheRegistry::Get().Invalidate(pszFileName);
+
 	HANDLE hFile = CreateFileU(pszFileName, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM, nullptr);
 
 	if (nullptr != hFile && INVALID_HANDLE_VALUE != hFile)
 	{
 		DWORD dwBytes;
 
-		HashCacheHeader header;
-		header.numFiles = this->Items.size();
-		header.version = FILEONDISK_VERSION;
-
-		WriteFile(hFile, &header, sizeof(header), &dwBytes, nullptr);
-		WriteFile(hFile, &this->Items[0], static_cast<DWORD>(sizeof(this->Items[0]) * this->Items.size()), &dwBytes, nullptr);
-		WriteFile(hFile, &this->Strings[0], static_cast<DWORD>(sizeof(this->Strings[0]) * this->Strings.size()), &dwBytes, nullptr);
+		HashCacheHeaderEx header = {0};
+		header.numFiles		= this->Items.size();
+		header.version		= FILEONDISK_VERSION;
+		header.headerSize	= sizeof(header);
+		header.itemSize		= sizeof(Md5CacheItem);
+		header.stringsSize	= this->Strings.size();
+		header.algorithm	= static_cast<long long>(DigestEngine::GetAlgorithm());
+
+		// pad it out so that the journal records that get appended later are aligned
+		const char padding[8] = {0};
+		DWORD itemsSize = static_cast<DWORD>(sizeof(Md5CacheItem) * this->Items.size());
+		DWORD stringsSize = static_cast<DWORD>(sizeof(char) * this->Strings.size());
+		DWORD paddingSize = static_cast<DWORD>((8 - (this->Strings.size() & 7)) & 7);
+
+		result = WriteFile(hFile, &header, sizeof(header), &dwBytes, nullptr) && (sizeof(header) == dwBytes);
+		result = result && ((0 == itemsSize) || (WriteFile(hFile, this->Items.data(), itemsSize, &dwBytes, nullptr) && (itemsSize == dwBytes)));
+		result = result && ((0 == stringsSize) || (WriteFile(hFile, this->Strings.data(), stringsSize, &dwBytes, nullptr) && (stringsSize == dwBytes)));
+		result = result && ((0 == paddingSize) || (WriteFile(hFile, padding, paddingSize, &dwBytes, nullptr) && (paddingSize == dwBytes)));
 
 		CloseHandle(hFile);
+
+		if (result)
+		{
+			this->LoadedVersion = FILEONDISK_VERSION;
+		}
+		else
+		{
+			// don't leave a torn file behind for the next run to trip over
+			Logger::Get().printf(Logger::Level::Error, "Error writing MD5 Cache file \"%s\"! (%S, %d)\n", pszFileName, GetLastErrorString(), GetLastError());
+			DeleteFileA(pszFileName);
+		}
 	}
 	else
 	{
@@ -1265,155 +4106,125 @@ bool Md5Cache::Save(const char *pszFileName)
 }
 
 
-
-
-
-
-
 //=====================================================================================================================================================================================================
+// Md5Cache::Append
+//
+// Add journal records for the given items to the end of the file, all in one write, instead of
+// writing out the whole thing again
 //=====================================================================================================================================================================================================
-inline BOOL SafeCryptReleaseContext(HCRYPTPROV &hProv, DWORD dwFlags)
+bool Md5Cache::Append(const char *pszFileName, const std::vector<size_t> &indices)
 {
-	if (0 != hProv)
+	if (indices.empty())
 	{
-		if (CryptReleaseContext(hProv, dwFlags))
-		{
-			hProv = 0;
-			return TRUE;
-		}
+		return true;
 	}
 
-	return FALSE;
-}
+	if (FILEONDISK_VERSION != this->LoadedVersion)
+	{
+		// there's no file of the current version to add to yet
+		return this->Save(pszFileName);
+	}
 
+	std::vector<char> records;
 
-//=====================================================================================================================================================================================================
-//=====================================================================================================================================================================================================
-inline BOOL SafeCryptDestroyHash(HCRYPTHASH &hHash)
-{
-	if (0 != hHash)
+	for (auto &index : indices)
 	{
-		if (CryptDestroyHash(hHash))
-		{
-			hHash = 0;
-			return TRUE;
-		}
+		const Md5CacheItem &item = this->Items[index];
+		const char *pszName = this->GetFileName(item);
+		size_t nameSize = strlen(pszName) + 1;
+
+		HashCacheJournalRecord record;
+		record.marker		= HASHCACHE_JOURNAL_MARKER;
+		record.recordSize	= static_cast<unsigned long>((sizeof(record) + nameSize + 7) & ~static_cast<size_t>(7));
+		record.item			= item;
+		record.item.Name	= static_cast<unsigned long>(nameSize);
+
+		size_t offset = records.size();
+		records.resize(offset + record.recordSize, 0);
+		memcpy(&records[offset], &record, sizeof(record));
+		memcpy(&records[offset + sizeof(record)], pszName, nameSize);
+	}
+
+	bool result = false;
+
+	Md5CacheRegistry::Get().Invalidate(pszFileName);
+
+	HANDLE hFile = CreateFileU(pszFileName, FILE_APPEND_DATA, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM, nullptr);
+
+	if (nullptr != hFile && INVALID_HANDLE_VALUE != hFile)
+	{
+		DWORD dwBytes = 0;
+		result = WriteFile(hFile, &records[0], static_cast<DWORD>(records.size()), &dwBytes, nullptr) && (dwBytes == records.size());
+		CloseHandle(hFile);
+	}
+
+	if (!result)
+	{
+		// e.g., the file was deleted out from under us; write the whole thing instead
+		return this->Save(pszFileName);
 	}
 
-	return FALSE;
+	return result;
 }
 
 
+
+
+
+
+
 //=====================================================================================================================================================================================================
 // CalcFileMd5Hash
 //
-// Read in the contents of a file, calculating the MD5 cache of its contents, and return the
-// results
+// Read in the contents of a file, calculating the hash of its contents (with whichever
+// algorithm is currently selected), and return the results
 //=====================================================================================================================================================================================================
 bool CalcFileMd5Hash(const char *szFileName, Md5Hash &chash, bool verbose)
 {
-#if defined(_M_X64)
-	const int bufferSize = 1024*1024;
-#else
-	const int bufferSize = 1024;
-#endif
-
 	// "\\parker\all$\ToCheck\Puma\Raid\Video\Encode_2017-04-18\Rogue One.mkv"
 	// FindDupes.exe /w "\\parker\all$\Mike\Raid\Video\Encode_2017-04-18" /I "\\parker\all$\ToCheck\Puma\Raid\Video\Encode_2017-04-18"
 
-	HANDLE hFile = nullptr;
-	bool result = false;
-	HCRYPTPROV hProv = 0;
-	HCRYPTHASH hHash = 0;
-	std::vector<BYTE> buffer(bufferSize);
-	DWORD cbRead = 0;
-	const int hashLen = 16;
-	unsigned char hash[hashLen];
-	DWORD dwSize;
 	ProgressBar pb;
 
-	// open the file
-	hFile = CreateFileU(szFileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	return FileHasher::ForThisThread().HashFile(szFileName, chash, &pb);
+}
+
+
+//=====================================================================================================================================================================================================
+// CalcFilePartialHash
+//
+// Fingerprint the partialHashBlockSize bytes at the given offset in a file. These are only ever
+// compared with each other, never with the hashes, so they're always XXH3 (the fastest), and
+// only 64 bits of it, whatever algorithm the hashes are using.
+//=====================================================================================================================================================================================================
+bool CalcFilePartialHash(const char *szFileName, long long offset, unsigned long long &print)
+{
+	HANDLE hFile = CreateFileU(szFileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
 
 	if (INVALID_HANDLE_VALUE == hFile)
 	{
 		Logger::Get().printf(Logger::Level::Error, "Error opening \"%s\"! (%S, %d)\n", szFileName, GetLastErrorString(), GetLastError());
-		goto Cleanup;
-	}
-
-	//
-	// get the file info
-	//
-	BY_HANDLE_FILE_INFORMATION fileInfo;
-	LARGE_INTEGER filesize;
-	if (GetFileInformationByHandle(hFile, &fileInfo))
-	{
-		filesize.HighPart = fileInfo.nFileSizeHigh;
-		filesize.LowPart = fileInfo.nFileSizeLow;
+		return false;
 	}
 
-	LONGLONG readSoFar = 0;
-	LONGLONG updateProgressBarAmount = filesize.QuadPart / 1000;
-	LONGLONG nextProgressBarUpdate = updateProgressBarAmount;
-	pb.Update(readSoFar, filesize.QuadPart);
-
-	// Get handle to the crypto provider
-	if (!CryptAcquireContext(&hProv, nullptr, nullptr, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
-	{
-		goto Cleanup;
-	}
+	std::vector<BYTE> buffer(static_cast<size_t>(partialHashBlockSize));
+	std::unique_ptr<DigestEngine> engine = CreateXxh3DigestEngine();
+	LARGE_INTEGER position;
+	DWORD cbRead = 0;
+	Md5Hash hash;
+	bool result = false;
 
-	// create the MD5 hash item
-	if (!CryptCreateHash(hProv, CALG_MD5, 0, 0, &hHash))
-	{
-		goto Cleanup;
-	}
+	position.QuadPart = offset;
 
-	// loop, reading the file's contents
-	while (ReadFile(hFile, &buffer[0], static_cast<DWORD>(buffer.size()), &cbRead, nullptr))
+	if (SetFilePointerEx(hFile, position, nullptr, FILE_BEGIN) && ReadFile(hFile, &buffer[0], static_cast<DWORD>(buffer.size()), &cbRead, nullptr) && (cbRead == buffer.size()))
 	{
-		if (ControlCHandler::TestShouldTerminate())
-		{
-			goto Cleanup;
-		}
-
-		if (0 == cbRead)
-		{
-			break;
-		}
-
-		readSoFar += cbRead;
-		if (readSoFar >= nextProgressBarUpdate)
+		if (engine->Update(&buffer[0], cbRead) && engine->Final(hash))
 		{
-			pb.Update(readSoFar, filesize.QuadPart);
-			nextProgressBarUpdate += updateProgressBarAmount;
-		}
-
-		if (!CryptHashData(hHash, &buffer[0], cbRead, 0))
-		{
-			goto Cleanup;
+			memcpy(&print, hash._data, sizeof(print));
+			result = true;
 		}
 	}
 
-	// get the final hash
-	dwSize = hashLen;
-	if (!CryptGetHashParam(hHash, HP_HASHVAL, hash, &dwSize, 0))
-	{
-		goto Cleanup;
-	}
-
-	if (dwSize != hashLen)
-	{
-		goto Cleanup;
-	}
-
-	// copy the result to the output buffer
-	memcpy(chash._data, hash, sizeof(hash));
-	result = true;
-
-Cleanup:
-	SafeCryptDestroyHash(hHash);
-	SafeCryptReleaseContext(hProv, 0);
 	SafeCloseHandle(hFile);
 
 	return result;
@@ -1424,11 +4235,28 @@ Cleanup:
 // GetFileMd5Hash
 //
 // Read in the contents of a file, calculating the MD5 cache of its contents, and return the
-// results
+// results. The links to the files the scan could identify were already matched up (see
+// TakeOutHardLinks), so there's no need to look for those.
 //=====================================================================================================================================================================================================
-bool GetFileMd5Hash(const char *szFileName, Md5Hash &hash, bool verbose)
+bool GetFileMd5Hash(const char *szFileName, Md5Hash &hash, bool verbose, bool lookForLinks)
 {
 	// first, see if there are hard links...
+	if (lookForLinks && GetHardLinkedHash(szFileName, hash, verbose))
+	{
+		return true;
+	}
+
+	return CalcFileMd5Hash(szFileName, hash, verbose);
+}
+
+
+//=====================================================================================================================================================================================================
+// GetHardLinkedHash
+//
+// If the file is a hard link to one whose hash is already cached, that's its hash too
+//=====================================================================================================================================================================================================
+bool GetHardLinkedHash(const char *szFileName, Md5Hash &hash, bool verbose)
+{
 	std::vector<std::string> hardlinks = GetAllHardLinksA(szFileName);
 	for (auto &i : hardlinks)
 	{
@@ -1439,7 +4267,7 @@ bool GetFileMd5Hash(const char *szFileName, Md5Hash &hash, bool verbose)
 		}
 	}
 
-	return CalcFileMd5Hash(szFileName, hash, verbose);
+	return false;
 }
 
 
@@ -1453,36 +4281,27 @@ bool GetFileMd5Hash(const char *szFileName, Md5Hash &hash, bool verbose)
 bool GetCachedHash(const char *szFileName, Md5Hash &hash, bool verbose)
 {
 	bool result = false;
-	Md5Cache cache;
-	std::unordered_map<Path,const Md5CacheItem *> umap;
-	char szCacheFileName[maxString];
+	char szFolderName[maxString];
 
-	strncpy_s(szCacheFileName, szFileName, ARRAYSIZE(szCacheFileName));
+	strncpy_s(szFolderName, szFileName, ARRAYSIZE(szFolderName));
 
 	// remove the filename
-	char *p = szCacheFileName;
+	char *p = szFolderName;
 	while (*p) ++p;
-	while (p>szCacheFileName && (*p!='\\')) p--;
+	while (p>szFolderName && (*p!='\\')) p--;
 	*p = 0;
 
-	size_t fileNameOffset = p - szCacheFileName + 1;
+	size_t fileNameOffset = p - szFolderName + 1;
 
-	strcat_s(szCacheFileName, "\\");
-	strcat_s(szCacheFileName, pszLocalCacheFileName);
+	auto pcache = HashCacheStore::Get().LoadFolder(szFolderName);
 
-	if (cache.Load(szCacheFileName))
+	if (pcache)
 	{
-		for (auto &item : cache.Items)
-		{
-			umap[cache.GetFileName(item)] = &item;
-		}
-
 		// see if we have an entry for this item
 		const char *pszFileNameOnly = &szFileName[fileNameOffset];
-		auto cacheitem = umap.find(pszFileNameOnly);
-		if (cacheitem != umap.end())
+		const Md5CacheItem *pcacheitem = pcache->FindItem(pszFileNameOnly);
+		if ((nullptr != pcacheitem) && (0 != (pcacheitem->Flags & HASHCACHE_ITEM_HASH)))
 		{
-			const Md5CacheItem *pcacheitem = umap[pszFileNameOnly];
 
 			// now, see if it's valid
 			HANDLE hFile = CreateFileU(szFileName, FILE_READ_ATTRIBUTES| FILE_READ_EA, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM, nullptr);
@@ -1521,15 +4340,13 @@ bool GetCachedHash(const char *szFileName, Md5Hash &hash, bool verbose)
 //=====================================================================================================================================================================================================
 static bool CleanFolderRecurse(const char *szFolderName, bool cleanEmptyFolders)
 {
-	Md5Cache cache;
+	std::shared_ptr<const Md5CacheEntry> pcache;
 	Md5Cache newCache;
-	std::unordered_map<Path,const Md5CacheItem *> umap;
-	std::unordered_map<Path,const Md5CacheItem *> *pumap = nullptr;
-	auto foldercache = GetCacheFileName(szFolderName);
+	size_t cacheItemCount = 0;
 
 
 #ifdef _DEBUG
-	if (0 == _stricmp(szFolderName, "\\\\duvall\\All$\\Public\\Photos\\ToCheck\\1"))
+	if (0 == ComparePathStrings(szFolderName, "\\\\duvall\\All$\\Public\\Photos\\ToCheck\\1"))
 	{
 		__nop();
 	}
@@ -1538,17 +4355,14 @@ static bool CleanFolderRecurse(const char *szFolderName, bool cleanEmptyFolders)
 	if (ControlCHandler::TestShouldTerminate()) { return false; }
 
 	{
-		if (cache.Load(foldercache.c_str()))
-		{
-			for (auto &item : cache.Items)
-			{
-				umap[cache.GetFileName(item)] = &item;
-			}
+		pcache = HashCacheStore::Get().LoadFolder(szFolderName);
 
-			pumap = &umap;
+		if (pcache)
+		{
+			cacheItemCount = pcache->Cache.Items.size();
 
-			newCache.Items.reserve(cache.Items.size());
-			newCache.Strings.reserve(cache.Strings.size());
+			newCache.Items.reserve(pcache->Cache.Items.size());
+			newCache.Strings.reserve(pcache->Cache.Strings.size());
 		}
 	}
 
@@ -1559,13 +4373,11 @@ static bool CleanFolderRecurse(const char *szFolderName, bool cleanEmptyFolders)
 	//
 	// Loop through all of a folder's items
 	//
-	ProcessFilesInFolder(szFolderName, 0, [&umap,&cache,&newCache, &cleanEmptyFolders, &noChildren](const char *szFolderName, WIN32_FIND_DATAA *pfd, int depth)
+	ProcessFilesInFolder(szFolderName, 0, [&pcache,&newCache, &cleanEmptyFolders, &noChildren](const char *szFolderName, const FolderEntry &entry, const char *szName, int depth)
 	{
 		if (ControlCHandler::TestShouldTerminate()) { return; }
 
-		WIN32_FIND_DATAA &fd = *pfd;
-
-		if (0 != (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		if (entry.IsFolder())
 		{
 			//
 			// this item is a folder
@@ -1573,7 +4385,7 @@ static bool CleanFolderRecurse(const char *szFolderName, bool cleanEmptyFolders)
 			std::string	newPathName{szFolderName};
 
 			newPathName.append(R"(\)");
-			newPathName.append(fd.cFileName);
+			newPathName.append(szName);
 
 			bool noSubChildren = CleanFolderRecurse(newPathName.c_str(), cleanEmptyFolders);
 			if (!noSubChildren)
@@ -1607,7 +4419,7 @@ static bool CleanFolderRecurse(const char *szFolderName, bool cleanEmptyFolders)
 			bool importantFile = true;
 			for (auto& pszIgnoreFileName : szFileNamesToSafelyDelete)
 			{
-				if (0 == _stricmp(pszIgnoreFileName, fd.cFileName))
+				if (0 == ComparePathStrings(pszIgnoreFileName, szName))
 				{
 					importantFile = false;
 					break;
@@ -1619,42 +4431,42 @@ static bool CleanFolderRecurse(const char *szFolderName, bool cleanEmptyFolders)
 				noChildren = false;
 			}
 
-			if (umap.find(fd.cFileName) != umap.end())
-			{
-				const Md5CacheItem *pitem = umap[fd.cFileName];
+			const Md5CacheItem *pitem = pcache ? pcache->FindItem(szName) : nullptr;
 
-				auto fileSize = GetWin32FindDataFileSize(fd);
+			if (nullptr != pitem)
+			{
+				auto fileSize = entry.Size;
 
 				if (pitem->Size != fileSize)
 				{
 					// remove it
-					Logger::Get().printf(Logger::Level::Debug, "Cache entry found but removed due to size for file \"%s\" (Cache size: %ld, File size: %ld)\n", fd.cFileName, pitem->Size, fileSize);
+					Logger::Get().printf(Logger::Level::Debug, "Cache entry found but removed due to size for file \"%s\" (Cache size: %ld, File size: %ld)\n", szName, pitem->Size, fileSize);
 					__nop();
 				}
-				else if (pitem->Hash == Md5Hash::NullHash)
+				else if ((pitem->Hash == Md5Hash::NullHash) && (0 == (pitem->Flags & (HASHCACHE_ITEM_HEAD | HASHCACHE_ITEM_TAIL))))
 				{
 					// remove it
 					__nop();
 				}
 				else
 				{
-					auto fileTimeDifference = FileTimeDifference(pitem->Time, fd.ftLastWriteTime);
+					auto fileTimeDifference = FileTimeDifference(pitem->Time, entry.Time);
 
 					if (fileTimeDifference != 0)
 					{
 						// remove it
-						Logger::Get().printf(Logger::Level::Debug, "Cache entry found but removed due to time difference for file \"%s\" (Time diff: %ld)\n", fd.cFileName, fileTimeDifference);
+						Logger::Get().printf(Logger::Level::Debug, "Cache entry found but removed due to time difference for file \"%s\" (Time diff: %ld)\n", szName, fileTimeDifference);
 						__nop();
 					}
 					else
 					{
-						//Logger::Get().printf(Logger::Level::Debug, "Cache entry found and used for file \"%s\"\n", fd.cFileName);
+						//Logger::Get().printf(Logger::Level::Debug, "Cache entry found and used for file \"%s\"\n", szName);
 
 						// add it to the new cache!!
 
 						Md5CacheItem newItem = *pitem;
 						newItem.Name = static_cast<long>(newCache.Strings.size());
-						const char *pszName = cache.GetFileName(*pitem);
+						const char *pszName = pcache->Cache.GetFileName(*pitem);
 						size_t nameSize = strlen(pszName);
 						newCache.Strings.insert(newCache.Strings.end(), pszName, pszName + nameSize + 1);
 						newCache.Items.push_back(newItem);
@@ -1664,7 +4476,7 @@ static bool CleanFolderRecurse(const char *szFolderName, bool cleanEmptyFolders)
 			else
 			{
 				// it's a file that's not in the Md5Cache
-				//Logger::Get().printf(Logger::Level::Debug, "No cache entry found for file \"%s\"\n", fd.cFileName);
+				//Logger::Get().printf(Logger::Level::Debug, "No cache entry found for file \"%s\"\n", szName);
 				__nop();
 			}
 		}
@@ -1672,40 +4484,65 @@ static bool CleanFolderRecurse(const char *szFolderName, bool cleanEmptyFolders)
 
 	if (ControlCHandler::TestShouldTerminate()) { return false; }
 
-	if (0 == newCache.Items.size() && (0 != cache.Items.size()))
+	// let go of the cache before going any further: it may be mapped, and then it can't be
+	// rewritten or deleted
+	bool hadCache = !!pcache;
+	size_t numJournalRecords = 0;
+	long long cacheVersion = FILEONDISK_VERSION;
+
+	if (hadCache)
+	{
+		numJournalRecords = pcache->Cache.NumJournalRecords;
+		cacheVersion = pcache->Cache.Version;
+	}
+
+	pcache.reset();
+	HashCacheStore::Get().Release(szFolderName);
+
+	if (0 == newCache.Items.size() && (0 != cacheItemCount))
 	{
 		// we have an MD5CACHE.md5 file, but we don't have ANY files that still work with it, so delete the file altogether!
-		Logger::Get().printf(Logger::Level::Info, "Deleting  cache file (from %d to %d items) \"%s\"\n", cache.Items.size(), newCache.Items.size(), foldercache.c_str());
-		if (!DeleteFileA(foldercache.c_str()))
+		Logger::Get().printf(Logger::Level::Info, "Deleting  cache (from %d to %d items) for \"%s\"\n", cacheItemCount, newCache.Items.size(), szFolderName);
+		if (!HashCacheStore::Get().Remove(szFolderName))
 		{
 			Logger::Get().printf(Logger::Level::Info, "     couldn't delete.\n");
 		}
 	}
-	else if (newCache.Items.size() != cache.Items.size())
+	else if (newCache.Items.size() != cacheItemCount)
 	{
 		// we're removed SOME items, so we need to re-write it
-		Logger::Get().printf(Logger::Level::Info, "Rewriting cache file (from %d to %d items) \"%s\"\n", cache.Items.size(), newCache.Items.size(), foldercache.c_str());
-		newCache.Save(foldercache.c_str());
+		Logger::Get().printf(Logger::Level::Info, "Rewriting cache (from %d to %d items) for \"%s\"\n", cacheItemCount, newCache.Items.size(), szFolderName);
+		if (!HashCacheStore::Get().Save(szFolderName, newCache))
+		{
+			Logger::Get().printf(Logger::Level::Info, "     couldn't rewrite.\n");
+		}
+	}
+	else if (hadCache && ((0 != numJournalRecords) || (FILEONDISK_VERSION_1 == cacheVersion)))
+	{
+		// nothing removed, but compact away the journal (or bring an old file up to date)
+		Logger::Get().printf(Logger::Level::Info, "Compacting cache (%d items, %d journal records) for \"%s\"\n", newCache.Items.size(), numJournalRecords, szFolderName);
+		if (!HashCacheStore::Get().Save(szFolderName, newCache))
+		{
+			Logger::Get().printf(Logger::Level::Info, "     couldn't compact.\n");
+		}
 	}
 
 	if (noChildren)
 	{
 		// we can safely delete all files from this folder
-		ProcessFilesInFolder(szFolderName, 0, [&umap,&cache,&newCache, &cleanEmptyFolders, &noChildren](const char *szFolderName, WIN32_FIND_DATAA *pfd, int depth)
+		ProcessFilesInFolder(szFolderName, 0, [&newCache, &cleanEmptyFolders, &noChildren](const char *szFolderName, const FolderEntry &entry, const char *szName, int depth)
 		{
 			if (ControlCHandler::TestShouldTerminate()) { return; }
 
-			WIN32_FIND_DATAA &fd = *pfd;
-
-			if (0 != (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			if (entry.IsFolder())
 			{
 				// this should never happen!!
 				__nop();
 			}
 			else
 			{
-				Logger::Get().printf(Logger::Level::Info, "Deleting \"%s\\%s\"\n", szFolderName, fd.cFileName);
-				auto r=DeleteFileU(szFolderName, fd.cFileName);
+				Logger::Get().printf(Logger::Level::Info, "Deleting \"%s\\%s\"\n", szFolderName, szName);
+				auto r=DeleteFileU(szFolderName, szName);
 				if (r)
 				{
 					__nop();
@@ -1733,4 +4570,90 @@ void CleanCacheFiles(const char *pszRootPath, bool cleanEmptyFolders)
 {
 	if (ControlCHandler::TestShouldTerminate()) { return; }
 	CleanFolderRecurse(pszRootPath, cleanEmptyFolders);
+	HashCacheStore::Get().Commit();
+}
+
+
+//=====================================================================================================================================================================================================
+// Copy a folder's md5cache.md5 file (and those of all its sub-folders) into the current store
+//=====================================================================================================================================================================================================
+static size_t ImportFolderRecurse(const char *szFolderName, SidecarHashCacheStore &sidecar)
+{
+	if (ControlCHandler::TestShouldTerminate()) { return 0; }
+
+	size_t count = 0;
+	Md5Cache cache;
+
+	if (sidecar.Load(szFolderName, cache) && !cache.Items.empty())
+	{
+		Logger::Get().printf(Logger::Level::Info, "Importing %s items from \"%s\"\n", comma(cache.Items.size()), szFolderName);
+
+		if (HashCacheStore::Get().Save(szFolderName, cache))
+		{
+			++count;
+		}
+	}
+
+	std::vector<std::string> subFolders;
+
+	ProcessFilesInFolder(szFolderName, 0, [&subFolders](const char *szFolderName, const FolderEntry &entry, const char *szName, int depth)
+	{
+		if (entry.IsFolder())
+		{
+			std::string fullPath{szFolderName};
+			fullPath.append("\\");
+			fullPath.append(szName);
+			subFolders.push_back(std::move(fullPath));
+		}
+	});
+
+	for (auto &subFolder : subFolders)
+	{
+		count += ImportFolderRecurse(subFolder.c_str(), sidecar);
+	}
+
+	return count;
+}
+
+//=====================================================================================================================================================================================================
+// ImportHashCacheFiles
+//
+// Fill the hash index with what's in the md5cache.md5 files under the root. The md5cache.md5
+// files themselves are left alone.
+//=====================================================================================================================================================================================================
+void ImportHashCacheFiles(const char *pszRootPath)
+{
+	if (nullptr == HashCacheStore::GetIndex())
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error: importing needs a hash index to import into.\n");
+		return;
+	}
+
+	SidecarHashCacheStore sidecar;
+	size_t count = ImportFolderRecurse(pszRootPath, sidecar);
+	HashCacheStore::Get().Commit();
+
+	Logger::Get().printf(Logger::Level::Info, "Imported the md5cache.md5 files of %s folders.\n", comma(count));
+}
+
+//=====================================================================================================================================================================================================
+// ExportHashCacheFiles
+//
+// The opposite: write an md5cache.md5 file into each folder under the root that has anything in
+// the hash index
+//=====================================================================================================================================================================================================
+void ExportHashCacheFiles(const char *pszRootPath)
+{
+	HashIndexStore *pindex = HashCacheStore::GetIndex();
+
+	if (nullptr == pindex)
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error: exporting needs a hash index to export from.\n");
+		return;
+	}
+
+	SidecarHashCacheStore sidecar;
+	size_t count = pindex->Export(pszRootPath, sidecar);
+
+	Logger::Get().printf(Logger::Level::Info, "Exported md5cache.md5 files for %s folders.\n", comma(count));
 }
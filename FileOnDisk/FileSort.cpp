@@ -0,0 +1,340 @@
+#include "stdafx.h"
+
+#include <utilities.h>
+#include <FileOnDisk.h>
+#include <WorkQueue.h>
+#include <ThreadPool.h>
+
+
+//=====================================================================================================================================================================================================
+// Sorting the file table
+//
+// Everything that looks for same-sized files wants the table sorted on size (biggest first), and
+// then on path (ignoring case). Rather than sorting the (88-byte) FileOnDisk items themselves,
+// with a comparison that compares paths on every tie, it sorts a compact array of (size, index)
+// keys with a radix sort, a byte of the size at a time, with each core taking a slice of the
+// keys. Only files that turn out to be the same size need their paths compared, and each run of
+// those is sorted on its own (the long ones split up, too). The order that comes out is then
+// applied to the table in one go.
+//
+// The sort works from the set's columns (see FileOnDiskSet::BuildColumns), putting the set into
+// columns first if it isn't already, so the sizes and the paths it compares come from arrays of
+// their own rather than from the table; the columns are put in the same order as the table.
+//=====================================================================================================================================================================================================
+namespace
+{
+	struct SortKey
+	{
+		unsigned long long	key;		// the size, flipped so that the biggest comes first
+		size_t				index;		// where the file is in the table
+	};
+
+	// fewer than this many, and it isn't worth waking the pool
+	const size_t minKeysPerSlice = 64 * 1024;
+
+	//=================================================================================================================================================================================================
+	// RunOnSlices
+	//
+	// Cut [0, count) into numSlices slices, and call func(slice, begin, end) for each one (on the
+	// pool, unless there's only the one)
+	//=================================================================================================================================================================================================
+	template <typename _SliceFunctor> void RunOnSlices(size_t count, size_t numSlices, _SliceFunctor func)
+	{
+		if (numSlices <= 1)
+		{
+			func(0, 0, count);
+			return;
+		}
+
+		TaskGroup group;
+
+		for (size_t slice = 0; slice < numSlices; slice++)
+		{
+			size_t begin = count * slice / numSlices;
+			size_t end = count * (slice + 1) / numSlices;
+
+			group.Run([&func, slice, begin, end]() { func(slice, begin, end); });
+		}
+
+		group.Wait();
+	}
+
+	//=================================================================================================================================================================================================
+	// RadixSort
+	//
+	// A stable LSD radix sort of the keys, using scratch (the same size) to move them back and forth.
+	// Each slice counts its own digits, and then scatters its keys to where the counts say they go,
+	// so the slices don't have to share anything but the counts. A byte that's the same for every
+	// key (like the high bytes of the sizes, mostly) is skipped.
+	//=================================================================================================================================================================================================
+	void RadixSort(std::vector<SortKey> &keys, std::vector<SortKey> &scratch, size_t numSlices)
+	{
+		const size_t count = keys.size();
+		std::vector<std::array<size_t, 256>> counts(numSlices);
+
+		for (unsigned shift = 0; shift < 64; shift += 8)
+		{
+			RunOnSlices(count, numSlices, [&](size_t slice, size_t begin, size_t end)
+			{
+				auto &sliceCounts = counts[slice];
+				sliceCounts.fill(0);
+
+				for (size_t i = begin; i < end; i++)
+				{
+					sliceCounts[(keys[i].key >> shift) & 0xFF]++;
+				}
+			});
+
+			// work out where each slice's keys with each digit start
+			bool allTheSame = false;
+			size_t offset = 0;
+
+			for (size_t digit = 0; digit < 256; digit++)
+			{
+				size_t total = 0;
+
+				for (size_t slice = 0; slice < numSlices; slice++)
+				{
+					size_t n = counts[slice][digit];
+					counts[slice][digit] = offset;
+					offset += n;
+					total += n;
+				}
+
+				allTheSame = allTheSame || (total == count);
+			}
+
+			if (allTheSame)
+			{
+				continue;
+			}
+
+			RunOnSlices(count, numSlices, [&](size_t slice, size_t begin, size_t end)
+			{
+				auto &sliceOffsets = counts[slice];
+
+				for (size_t i = begin; i < end; i++)
+				{
+					scratch[sliceOffsets[(keys[i].key >> shift) & 0xFF]++] = keys[i];
+				}
+			});
+
+			keys.swap(scratch);
+		}
+	}
+
+	//=================================================================================================================================================================================================
+	// Gather
+	//
+	// Put a column in the new order (order[i] is where its i'th item was)
+	//=================================================================================================================================================================================================
+	template <typename _Value> void Gather(std::vector<_Value> &column, const std::vector<size_t> &order)
+	{
+		std::vector<_Value> gathered(order.size());
+
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			gathered[i] = column[order[i]];
+		}
+
+		column.swap(gathered);
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+// SortOnSizeAndPath
+//=====================================================================================================================================================================================================
+void FileOnDiskSet::SortOnSizeAndPath()
+{
+	const size_t count = this->Items.size();
+
+	if (count < 2)
+	{
+		return;
+	}
+
+	size_t numThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	size_t numSlices = std::max<size_t>(std::min(numThreads, count / minKeysPerSlice), 1);
+
+	if (numSlices > 1)
+	{
+		ThreadPool::Get().SetNumThreads(static_cast<uint32_t>(numThreads));
+	}
+
+	if (!this->HasColumns())
+	{
+		this->BuildColumns();
+	}
+
+	std::vector<SortKey> keys(count);
+	std::vector<SortKey> scratch(count);
+
+	RunOnSlices(count, numSlices, [&](size_t, size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			keys[i].key = ~static_cast<unsigned long long>(this->Columns.Sizes[i]);
+			keys[i].index = i;
+		}
+	});
+
+	RadixSort(keys, scratch, numSlices);
+
+	//
+	// now sort each run of files that are the same size on their paths. The short runs are shared
+	// out as tasks; a long one (all the empty files, say) is sorted in slices, which are then
+	// merged a pair at a time
+	//
+	auto PathCompare = [this](const SortKey &left, const SortKey &right)
+	{
+		return (this->ComparePaths(left.index, right.index) < 0);
+	};
+
+	std::vector<SortKey>().swap(scratch);
+
+	{
+		TaskGroup runs;
+
+		// sort each of the runs from begin to end, as a task of its own
+		auto SortRuns = [&](size_t batchBegin, size_t batchEnd)
+		{
+			if (batchEnd - batchBegin < 2)
+			{
+				return;
+			}
+
+			auto SortBatch = [&keys, &PathCompare, batchBegin, batchEnd]()
+			{
+				for (size_t begin = batchBegin; begin < batchEnd;)
+				{
+					size_t end = begin + 1;
+					while ((end < batchEnd) && (keys[end].key == keys[begin].key))
+					{
+						++end;
+					}
+
+					if (end - begin > 1)
+					{
+						std::sort(keys.begin() + begin, keys.begin() + end, PathCompare);
+					}
+
+					begin = end;
+				}
+			};
+
+			if (numSlices > 1)
+			{
+				runs.Run(SortBatch);
+			}
+			else
+			{
+				SortBatch();
+			}
+		};
+
+		// sort one long run on all the threads
+		auto SortLongRun = [&](size_t begin, size_t end)
+		{
+			size_t runLength = end - begin;
+
+			RunOnSlices(runLength, numSlices, [&](size_t, size_t sliceBegin, size_t sliceEnd)
+			{
+				std::sort(keys.begin() + begin + sliceBegin, keys.begin() + begin + sliceEnd, PathCompare);
+			});
+
+			for (size_t width = 1; width < numSlices; width *= 2)
+			{
+				size_t numPairs = (numSlices + 2 * width - 1) / (2 * width);
+
+				RunOnSlices(numPairs, numPairs, [&](size_t pair, size_t, size_t)
+				{
+					size_t first = pair * 2 * width;
+
+					if (first + width < numSlices)
+					{
+						size_t sliceBegin = begin + runLength * first / numSlices;
+						size_t sliceMiddle = begin + runLength * (first + width) / numSlices;
+						size_t sliceEnd = begin + runLength * std::min(first + 2 * width, numSlices) / numSlices;
+
+						std::inplace_merge(keys.begin() + sliceBegin, keys.begin() + sliceMiddle, keys.begin() + sliceEnd, PathCompare);
+					}
+				});
+			}
+		};
+
+		// the short runs go in batches of about a slice's worth
+		size_t batchBegin = 0;
+
+		for (size_t begin = 0; begin < count;)
+		{
+			size_t end = begin + 1;
+			while ((end < count) && (keys[end].key == keys[begin].key))
+			{
+				++end;
+			}
+
+			if ((numSlices > 1) && (end - begin >= minKeysPerSlice))
+			{
+				SortRuns(batchBegin, begin);
+				SortLongRun(begin, end);
+				batchBegin = end;
+			}
+			else if (end - batchBegin >= minKeysPerSlice)
+			{
+				SortRuns(batchBegin, end);
+				batchBegin = end;
+			}
+
+			begin = end;
+		}
+
+		SortRuns(batchBegin, count);
+
+		runs.Wait();
+	}
+
+	//
+	// and put the table in that order, following each cycle of the permutation around (rather
+	// than making a second copy of the table)
+	//
+	{
+		std::vector<size_t> order(count);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			order[i] = keys[i].index;
+		}
+
+		std::vector<SortKey>().swap(keys);
+
+		// the columns are small enough to just gather into new ones
+		Gather(this->Columns.Sizes, order);
+		Gather(this->Columns.Hashes, order);
+		Gather(this->Columns.Flags, order);
+		Gather(this->Columns.Folders, order);
+		Gather(this->Columns.Names, order);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			if (order[i] == i)
+			{
+				continue;
+			}
+
+			FileOnDisk item = this->Items[i];
+			size_t j = i;
+
+			while (order[j] != i)
+			{
+				size_t next = order[j];
+				this->Items[j] = this->Items[next];
+				order[j] = j;
+				j = next;
+			}
+
+			this->Items[j] = item;
+			order[j] = j;
+		}
+	}
+}
@@ -0,0 +1,831 @@
+#include "stdafx.h"
+
+#include <utilities.h>
+#include <FileOnDisk.h>
+#include <Md5CacheRegistry.h>
+#include <HashCacheStore.h>
+#include <Digest.h>
+
+static SidecarHashCacheStore			thesidecarstore;
+static std::unique_ptr<HashIndexStore>	theindexstore;
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+HashCacheStore &HashCacheStore::Get()
+{
+	if (theindexstore)
+	{
+		return *theindexstore;
+	}
+
+	return thesidecarstore;
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+bool HashCacheStore::OpenIndexFile(const char *pszIndexFile)
+{
+	CloseIndexFile();
+
+	auto pindex = std::make_unique<HashIndexStore>();
+
+	if (!pindex->Open(pszIndexFile))
+	{
+		return false;
+	}
+
+	theindexstore = std::move(pindex);
+	return true;
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void HashCacheStore::CloseIndexFile()
+{
+	theindexstore.reset();
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+HashIndexStore *HashCacheStore::GetIndex()
+{
+	return theindexstore.get();
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+bool HashCacheStore::Load(const char *pszFolderName, Md5Cache &cache)
+{
+	auto pentry = this->LoadFolder(pszFolderName);
+
+	if (!pentry)
+	{
+		return false;
+	}
+
+	cache.Items.assign(pentry->Cache.Items.begin(), pentry->Cache.Items.end());
+	cache.Strings.assign(pentry->Cache.Strings.begin(), pentry->Cache.Strings.end());
+	cache.LoadedVersion = pentry->Cache.Version;
+
+	return true;
+}
+
+
+
+//=====================================================================================================================================================================================================
+// the md5cache.md5 file in a folder
+//=====================================================================================================================================================================================================
+static std::string GetSidecarFileName(const char *pszFolderName)
+{
+	std::string foldercache{pszFolderName};
+
+	foldercache.append(R"(\)");
+	foldercache.append(pszLocalCacheFileName);
+
+	return foldercache;
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+std::shared_ptr<const Md5CacheEntry> SidecarHashCacheStore::LoadFolder(const char *pszFolderName)
+{
+	return Md5CacheRegistry::Get().Load(GetSidecarFileName(pszFolderName).c_str());
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+bool SidecarHashCacheStore::Save(const char *pszFolderName, Md5Cache &cache)
+{
+	return cache.Save(GetSidecarFileName(pszFolderName).c_str());
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+bool SidecarHashCacheStore::Append(const char *pszFolderName, Md5Cache &cache, const std::vector<size_t> &indices)
+{
+	return cache.Append(GetSidecarFileName(pszFolderName).c_str(), indices);
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+bool SidecarHashCacheStore::Remove(const char *pszFolderName)
+{
+	auto foldercache = GetSidecarFileName(pszFolderName);
+
+	// unmap it first; a mapped file can't be deleted
+	this->Release(pszFolderName);
+
+	if (!DeleteFileA(foldercache.c_str()))
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error deleting MD5 Cache file \"%s\"! (%S, %d)\n", foldercache.c_str(), GetLastErrorString(), GetLastError());
+		return false;
+	}
+
+	return true;
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void SidecarHashCacheStore::Release(const char *pszFolderName)
+{
+	Md5CacheRegistry::Get().Invalidate(GetSidecarFileName(pszFolderName).c_str());
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+FILETIME SidecarHashCacheStore::GetFolderTime(const char *pszFolderName)
+{
+	return GetFileTimeStamp(GetSidecarFileName(pszFolderName).c_str());
+}
+
+
+
+//=====================================================================================================================================================================================================
+// WriteFile all of a buffer, even one bigger than a single WriteFile can take
+//=====================================================================================================================================================================================================
+static bool WriteAll(HANDLE hFile, const char *p, size_t size)
+{
+	const size_t maxChunk = 64 * 1024 * 1024;
+
+	while (size > 0)
+	{
+		DWORD dwToWrite = static_cast<DWORD>((size < maxChunk) ? size : maxChunk);
+		DWORD dwBytes = 0;
+
+		if (!WriteFile(hFile, p, dwToWrite, &dwBytes, nullptr) || (dwBytes != dwToWrite))
+		{
+			return false;
+		}
+
+		p += dwBytes;
+		size -= dwBytes;
+	}
+
+	return true;
+}
+
+//=====================================================================================================================================================================================================
+// Add a record to the end of a buffer
+//=====================================================================================================================================================================================================
+static void AddIndexRecord(std::vector<char> &buffer, unsigned long marker, const FILETIME &stamp, const char *pszFolderName, const char *pszName, const Md5CacheItem *pitem)
+{
+	size_t folderSize = strlen(pszFolderName) + 1;
+	size_t nameSize = (nullptr == pszName) ? 0 : strlen(pszName) + 1;
+
+	HashIndexRecord record = {0};
+	record.marker		= marker;
+	record.recordSize	= static_cast<unsigned long>((sizeof(record) + folderSize + nameSize + 7) & ~static_cast<size_t>(7));
+	record.Stamp		= stamp;
+	record.folderSize	= static_cast<unsigned long>(folderSize);
+	record.nameSize		= static_cast<unsigned long>(nameSize);
+
+	if (nullptr != pitem)
+	{
+		record.item		= *pitem;
+		record.item.Name	= 0;
+	}
+
+	size_t offset = buffer.size();
+	buffer.resize(offset + record.recordSize, 0);
+	memcpy(&buffer[offset], &record, sizeof(record));
+	memcpy(&buffer[offset + sizeof(record)], pszFolderName, folderSize);
+
+	if (0 != nameSize)
+	{
+		memcpy(&buffer[offset + sizeof(record) + folderSize], pszName, nameSize);
+	}
+}
+
+//=====================================================================================================================================================================================================
+// Add a commit record, for a batch of numRecords records, to the end of a buffer
+//=====================================================================================================================================================================================================
+static void AddIndexCommit(std::vector<char> &buffer, size_t numRecords)
+{
+	HashIndexCommit commit = {0};
+	commit.marker		= HASHINDEX_COMMIT_MARKER;
+	commit.recordSize	= sizeof(commit);
+	commit.numRecords	= numRecords;
+
+	const char *p = reinterpret_cast<const char *>(&commit);
+	buffer.insert(buffer.end(), p, p + sizeof(commit));
+}
+
+//=====================================================================================================================================================================================================
+// MakeKey
+//
+// Folders are looked up by their path, folded like any other path (in lower case, unless paths
+// are case-sensitive; see FILEONDISK_CASE_SENSITIVE_PATHS), with forward slashes turned into
+// backslashes, and without a trailing backslash, so that the same folder always gets the same
+// key however it was spelled.
+//=====================================================================================================================================================================================================
+std::string HashIndexStore::MakeKey(const char *pszPath)
+{
+	std::string key{pszPath};
+
+	for (auto &c : key)
+	{
+		c = ('/' == c) ? '\\' : FoldPathChar(c);
+	}
+
+	while ((key.size() > 1) && ('\\' == key.back()))
+	{
+		key.pop_back();
+	}
+
+	return key;
+}
+
+//=====================================================================================================================================================================================================
+// Open
+//
+// Read in the whole index (creating an empty one if there isn't one yet), replaying each batch
+// of records that was completely written, and chopping off anything after the last one.
+//=====================================================================================================================================================================================================
+bool HashIndexStore::Open(const char *pszFileName)
+{
+	this->Close();
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->hFile = CreateFileU(pszFileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if ((nullptr == this->hFile) || (INVALID_HANDLE_VALUE == this->hFile))
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error opening hash index \"%s\"! (%S, %d)\n", pszFileName, GetLastErrorString(), GetLastError());
+		this->hFile = nullptr;
+		return false;
+	}
+
+	this->fileName = pszFileName;
+
+	LARGE_INTEGER filesize = {0};
+	GetFileSizeEx(this->hFile, &filesize);
+
+	if (0 == filesize.QuadPart)
+	{
+		// a brand new one
+		HashIndexHeader header = {0};
+		header.version		= HASHINDEX_VERSION;
+		header.headerSize	= sizeof(header);
+		header.itemSize		= sizeof(Md5CacheItem);
+		header.algorithm	= static_cast<long long>(DigestEngine::GetAlgorithm());
+
+		if (!WriteAll(this->hFile, reinterpret_cast<const char *>(&header), sizeof(header)))
+		{
+			Logger::Get().printf(Logger::Level::Error, "Error writing hash index \"%s\"! (%S, %d)\n", pszFileName, GetLastErrorString(), GetLastError());
+			SafeCloseHandle(this->hFile);
+			return false;
+		}
+
+		this->fileSize = sizeof(header);
+		this->lastCommit = GetTickCount64();
+		return true;
+	}
+
+	HANDLE hMapping = CreateFileMappingW(this->hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	const char *pView = (nullptr == hMapping) ? nullptr : reinterpret_cast<const char *>(MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+
+	if (nullptr == pView)
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error reading hash index \"%s\"! (%S, %d)\n", pszFileName, GetLastErrorString(), GetLastError());
+		SafeCloseHandle(hMapping);
+		SafeCloseHandle(this->hFile);
+		return false;
+	}
+
+	const size_t size = static_cast<size_t>(filesize.QuadPart);
+	const HashIndexHeader *pheader = reinterpret_cast<const HashIndexHeader *>(pView);
+
+	if ((size < sizeof(HashIndexHeader)) || (HASHINDEX_VERSION != pheader->version) || (sizeof(Md5CacheItem) != pheader->itemSize) || (pheader->headerSize < static_cast<long long>(sizeof(HashIndexHeader))) || (pheader->headerSize > static_cast<long long>(size)) || (0 != (pheader->headerSize & 7)))
+	{
+		// don't touch anything we don't recognize
+		Logger::Get().printf(Logger::Level::Error, "\"%s\" isn't a hash index file (or is from a different version)!\n", pszFileName);
+		UnmapViewOfFile(pView);
+		SafeCloseHandle(hMapping);
+		SafeCloseHandle(this->hFile);
+		return false;
+	}
+
+	if (pheader->algorithm != static_cast<long long>(DigestEngine::GetAlgorithm()))
+	{
+		// mixing hashes from two algorithms would make every file look different
+		Logger::Get().printf(Logger::Level::Error, "\"%s\" was made with %s hashes, not %s!\n", pszFileName, DigestEngine::GetAlgorithmName(static_cast<DigestAlgorithm>(pheader->algorithm)), DigestEngine::GetAlgorithmName(DigestEngine::GetAlgorithm()));
+		UnmapViewOfFile(pView);
+		SafeCloseHandle(hMapping);
+		SafeCloseHandle(this->hFile);
+		return false;
+	}
+
+	size_t offset = static_cast<size_t>(pheader->headerSize);
+	size_t validSize = offset;
+	std::vector<const HashIndexRecord *> batch;
+
+	while (offset + 2 * sizeof(unsigned long) <= size)
+	{
+		const HashIndexRecord *precord = reinterpret_cast<const HashIndexRecord *>(pView + offset);
+
+		if ((precord->recordSize < 2 * sizeof(unsigned long)) || (precord->recordSize > size - offset) || (0 != (precord->recordSize & 7)))
+		{
+			break;
+		}
+
+		if (HASHINDEX_COMMIT_MARKER == precord->marker)
+		{
+			const HashIndexCommit *pcommit = reinterpret_cast<const HashIndexCommit *>(precord);
+
+			if ((precord->recordSize < sizeof(HashIndexCommit)) || (pcommit->numRecords != batch.size()))
+			{
+				break;
+			}
+
+			for (auto &pbatchrecord : batch)
+			{
+				this->ApplyRecord(pbatchrecord);
+			}
+
+			this->numRecordsInFile += batch.size();
+			batch.clear();
+			validSize = offset + precord->recordSize;
+		}
+		else if ((HASHINDEX_ITEM_MARKER == precord->marker) || (HASHINDEX_CLEAR_MARKER == precord->marker))
+		{
+			if (precord->recordSize < sizeof(HashIndexRecord))
+			{
+				break;
+			}
+
+			const char *pszFolderName = reinterpret_cast<const char *>(precord + 1);
+			size_t stringsSize = static_cast<size_t>(precord->folderSize) + precord->nameSize;
+			bool isItem = (HASHINDEX_ITEM_MARKER == precord->marker);
+
+			if ((0 == precord->folderSize) || (stringsSize > precord->recordSize - sizeof(HashIndexRecord)) || (0 != pszFolderName[precord->folderSize - 1]))
+			{
+				break;
+			}
+
+			if (isItem ? ((0 == precord->nameSize) || (0 != pszFolderName[stringsSize - 1])) : (0 != precord->nameSize))
+			{
+				break;
+			}
+
+			batch.push_back(precord);
+		}
+		else
+		{
+			break;
+		}
+
+		offset += precord->recordSize;
+	}
+
+	UnmapViewOfFile(pView);
+	SafeCloseHandle(hMapping);
+
+	if (validSize < size)
+	{
+		// whatever comes after the last commit was never finished
+		Logger::Get().printf(Logger::Level::Info, "Dropping %s bytes of unfinished changes from the end of hash index \"%s\"\n", comma(size - validSize), pszFileName);
+
+		LARGE_INTEGER position;
+		position.QuadPart = validSize;
+		SetFilePointerEx(this->hFile, position, nullptr, FILE_BEGIN);
+		SetEndOfFile(this->hFile);
+	}
+
+	this->fileSize = validSize;
+	this->lastCommit = GetTickCount64();
+
+	Logger::Get().printf(Logger::Level::Info, "Hash index \"%s\" has %s items in %s folders\n", pszFileName, comma(this->numItems), comma(this->folders.size()));
+
+	return true;
+}
+
+//=====================================================================================================================================================================================================
+// Close
+//
+// Commit anything that's pending, and if most of the records in the file have since been
+// replaced by later ones, write it out again from scratch.
+//=====================================================================================================================================================================================================
+void HashIndexStore::Close()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (nullptr == this->hFile)
+	{
+		return;
+	}
+
+	this->CommitLocked();
+	SafeCloseHandle(this->hFile);
+
+	if (this->numRecordsInFile > 2 * this->numItems + commitBatchSize)
+	{
+		this->Compact();
+	}
+
+	this->folders.clear();
+	this->fileName.clear();
+	this->fileSize = 0;
+	this->numRecordsInFile = 0;
+	this->numItems = 0;
+}
+
+//=====================================================================================================================================================================================================
+// Compact
+//
+// Write every folder that has anything in it to a new file, as a single batch, and then put the
+// new file in place of the old one. If anything goes wrong, the old file is left as it is.
+//=====================================================================================================================================================================================================
+bool HashIndexStore::Compact()
+{
+	std::string tempFileName{this->fileName};
+	tempFileName.append(".tmp");
+
+	HANDLE hTempFile = CreateFileU(tempFileName.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+	if ((nullptr == hTempFile) || (INVALID_HANDLE_VALUE == hTempFile))
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error creating \"%s\"! (%S, %d)\n", tempFileName.c_str(), GetLastErrorString(), GetLastError());
+		return false;
+	}
+
+	const size_t flushSize = 16 * 1024 * 1024;
+
+	HashIndexHeader header = {0};
+	header.version		= HASHINDEX_VERSION;
+	header.headerSize	= sizeof(header);
+	header.itemSize		= sizeof(Md5CacheItem);
+	header.algorithm	= static_cast<long long>(DigestEngine::GetAlgorithm());
+
+	std::vector<char> buffer;
+	buffer.reserve(flushSize + 64 * 1024);
+	buffer.insert(buffer.end(), reinterpret_cast<const char *>(&header), reinterpret_cast<const char *>(&header) + sizeof(header));
+
+	bool result = true;
+	size_t numRecords = 0;
+
+	for (auto &iter : this->folders)
+	{
+		const Folder &folder = iter.second;
+
+		for (auto &item : folder.Items)
+		{
+			AddIndexRecord(buffer, HASHINDEX_ITEM_MARKER, folder.Time, folder.FolderName.c_str(), &folder.Strings[item.Name], &item);
+			++numRecords;
+		}
+
+		if (buffer.size() >= flushSize)
+		{
+			result = result && WriteAll(hTempFile, buffer.data(), buffer.size());
+			buffer.clear();
+		}
+	}
+
+	AddIndexCommit(buffer, numRecords);
+
+	result = result && WriteAll(hTempFile, buffer.data(), buffer.size());
+	result = result && FlushFileBuffers(hTempFile);
+
+	CloseHandle(hTempFile);
+
+	if (result)
+	{
+		result = !!MoveFileExA(tempFileName.c_str(), this->fileName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+	}
+
+	if (result)
+	{
+		Logger::Get().printf(Logger::Level::Info, "Compacted hash index \"%s\" from %s records to %s\n", this->fileName.c_str(), comma(this->numRecordsInFile), comma(numRecords));
+	}
+	else
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error compacting hash index \"%s\"! (%S, %d)\n", this->fileName.c_str(), GetLastErrorString(), GetLastError());
+		DeleteFileA(tempFileName.c_str());
+	}
+
+	return result;
+}
+
+//=====================================================================================================================================================================================================
+// Find a folder; nullptr if it's not in the index
+//=====================================================================================================================================================================================================
+HashIndexStore::Folder *HashIndexStore::FindFolder(const char *pszFolderName)
+{
+	auto iter = this->folders.find(MakeKey(pszFolderName));
+	return (iter == this->folders.end()) ? nullptr : &iter->second;
+}
+
+//=====================================================================================================================================================================================================
+// Find a folder, adding it if it's not already in the index
+//=====================================================================================================================================================================================================
+HashIndexStore::Folder &HashIndexStore::GetFolder(const char *pszFolderName)
+{
+	Folder &folder = this->folders[MakeKey(pszFolderName)];
+
+	if (folder.FolderName.empty())
+	{
+		folder.FolderName = pszFolderName;
+	}
+
+	return folder;
+}
+
+//=====================================================================================================================================================================================================
+// Add an item to a folder, or replace the one that's already there with the same name
+//=====================================================================================================================================================================================================
+void HashIndexStore::SetItem(Folder &folder, const char *pszName, const Md5CacheItem &item)
+{
+	auto iter = folder.Names.find(pszName);
+
+	if (iter != folder.Names.end())
+	{
+		Md5CacheItem &existing = folder.Items[iter->second];
+		unsigned long name = existing.Name;
+		existing = item;
+		existing.Name = name;
+		return;
+	}
+
+	// the names point into the strings, so if adding this one moves them, they all need redoing
+	const char *pOldStrings = folder.Strings.data();
+
+	Md5CacheItem newItem = item;
+	newItem.Name = static_cast<unsigned long>(folder.Strings.size());
+	folder.Strings.insert(folder.Strings.end(), pszName, pszName + strlen(pszName) + 1);
+	folder.Items.push_back(newItem);
+	++this->numItems;
+
+	if (pOldStrings != folder.Strings.data())
+	{
+		folder.Names.clear();
+
+		for (size_t i = 0; i < folder.Items.size(); ++i)
+		{
+			folder.Names[&folder.Strings[folder.Items[i].Name]] = i;
+		}
+	}
+	else
+	{
+		folder.Names[&folder.Strings[newItem.Name]] = folder.Items.size() - 1;
+	}
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void HashIndexStore::ClearFolder(Folder &folder)
+{
+	this->numItems -= folder.Items.size();
+
+	folder.Names.clear();
+	folder.Items.clear();
+	folder.Strings.clear();
+}
+
+//=====================================================================================================================================================================================================
+// Apply a record read in from the file
+//=====================================================================================================================================================================================================
+void HashIndexStore::ApplyRecord(const HashIndexRecord *precord)
+{
+	const char *pszFolderName = reinterpret_cast<const char *>(precord + 1);
+	Folder &folder = this->GetFolder(pszFolderName);
+
+	if (HASHINDEX_CLEAR_MARKER == precord->marker)
+	{
+		this->ClearFolder(folder);
+	}
+	else
+	{
+		this->SetItem(folder, pszFolderName + precord->folderSize, precord->item);
+	}
+
+	folder.Time = precord->Stamp;
+}
+
+//=====================================================================================================================================================================================================
+// Queue up a change to be written out with the next batch
+//=====================================================================================================================================================================================================
+void HashIndexStore::QueueRecord(unsigned long marker, const Folder &folder, const char *pszName, const Md5CacheItem *pitem)
+{
+	AddIndexRecord(this->pending, marker, folder.Time, folder.FolderName.c_str(), pszName, pitem);
+	++this->numPending;
+}
+
+//=====================================================================================================================================================================================================
+// Write out the pending batch if it's big enough, or old enough
+//=====================================================================================================================================================================================================
+bool HashIndexStore::CommitIfDue()
+{
+	if ((this->numPending >= commitBatchSize) || (GetTickCount64() - this->lastCommit >= commitInterval * 1000))
+	{
+		return this->CommitLocked();
+	}
+
+	return true;
+}
+
+//=====================================================================================================================================================================================================
+// CommitLocked
+//
+// Write out the pending batch, followed by its commit record, all in one go. If that fails
+// part way through, cut the file back to where it was, so that the next batch doesn't end up
+// after a broken one. Must be called with the lock held.
+//=====================================================================================================================================================================================================
+bool HashIndexStore::CommitLocked()
+{
+	this->lastCommit = GetTickCount64();
+
+	if ((0 == this->numPending) || (nullptr == this->hFile))
+	{
+		return true;
+	}
+
+	AddIndexCommit(this->pending, this->numPending);
+
+	LARGE_INTEGER position;
+	position.QuadPart = this->fileSize;
+
+	bool result = !!SetFilePointerEx(this->hFile, position, nullptr, FILE_BEGIN);
+	result = result && WriteAll(this->hFile, this->pending.data(), this->pending.size());
+	result = result && FlushFileBuffers(this->hFile);
+
+	if (result)
+	{
+		this->fileSize += this->pending.size();
+		this->numRecordsInFile += this->numPending;
+	}
+	else
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error writing %s changes to hash index \"%s\"! (%S, %d)\n", comma(this->numPending), this->fileName.c_str(), GetLastErrorString(), GetLastError());
+
+		SetFilePointerEx(this->hFile, position, nullptr, FILE_BEGIN);
+		SetEndOfFile(this->hFile);
+	}
+
+	this->pending.clear();
+	this->numPending = 0;
+
+	return result;
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+bool HashIndexStore::Commit()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->CommitLocked();
+}
+
+//=====================================================================================================================================================================================================
+// LoadFolder
+//
+// The entry gets its own copy of the folder's items, so it stays the same no matter what
+// happens to the folder after it's handed out.
+//=====================================================================================================================================================================================================
+std::shared_ptr<const Md5CacheEntry> HashIndexStore::LoadFolder(const char *pszFolderName)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	const Folder *pfolder = this->FindFolder(pszFolderName);
+
+	if ((nullptr == pfolder) || pfolder->Items.empty())
+	{
+		return nullptr;
+	}
+
+	auto pentry = std::make_shared<Md5CacheEntry>();
+
+	std::vector<Md5CacheItem> items{pfolder->Items};
+	std::vector<char> strings{pfolder->Strings};
+
+	pentry->Cache.Assign(std::move(items), std::move(strings));
+	pentry->BuildIndex();
+
+	return pentry;
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+bool HashIndexStore::Save(const char *pszFolderName, Md5Cache &cache)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	Folder &folder = this->GetFolder(pszFolderName);
+	GetSystemTimeAsFileTime(&folder.Time);
+
+	this->ClearFolder(folder);
+	this->QueueRecord(HASHINDEX_CLEAR_MARKER, folder, nullptr, nullptr);
+
+	for (auto &item : cache.Items)
+	{
+		const char *pszName = cache.GetFileName(item);
+
+		this->SetItem(folder, pszName, item);
+		this->QueueRecord(HASHINDEX_ITEM_MARKER, folder, pszName, &item);
+	}
+
+	cache.LoadedVersion = FILEONDISK_VERSION;
+
+	return this->CommitIfDue();
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+bool HashIndexStore::Append(const char *pszFolderName, Md5Cache &cache, const std::vector<size_t> &indices)
+{
+	if (indices.empty())
+	{
+		return true;
+	}
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	Folder &folder = this->GetFolder(pszFolderName);
+	GetSystemTimeAsFileTime(&folder.Time);
+
+	for (auto &index : indices)
+	{
+		const Md5CacheItem &item = cache.Items[index];
+		const char *pszName = cache.GetFileName(item);
+
+		this->SetItem(folder, pszName, item);
+		this->QueueRecord(HASHINDEX_ITEM_MARKER, folder, pszName, &item);
+	}
+
+	return this->CommitIfDue();
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+bool HashIndexStore::Remove(const char *pszFolderName)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	Folder *pfolder = this->FindFolder(pszFolderName);
+
+	if ((nullptr == pfolder) || pfolder->Items.empty())
+	{
+		return false;
+	}
+
+	GetSystemTimeAsFileTime(&pfolder->Time);
+
+	this->ClearFolder(*pfolder);
+	this->QueueRecord(HASHINDEX_CLEAR_MARKER, *pfolder, nullptr, nullptr);
+
+	return this->CommitIfDue();
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+FILETIME HashIndexStore::GetFolderTime(const char *pszFolderName)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	const Folder *pfolder = this->FindFolder(pszFolderName);
+
+	if ((nullptr == pfolder) || pfolder->Items.empty())
+	{
+		FILETIME null = {0};
+		return null;
+	}
+
+	return pfolder->Time;
+}
+
+//=====================================================================================================================================================================================================
+// Export
+//
+// Returns the number of folders written out
+//=====================================================================================================================================================================================================
+size_t HashIndexStore::Export(const char *pszRootPath, HashCacheStore &dest)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	std::string root = MakeKey(pszRootPath);
+	size_t count = 0;
+
+	for (auto &iter : this->folders)
+	{
+		const std::string &key = iter.first;
+		const Folder &folder = iter.second;
+
+		if (folder.Items.empty() || (0 != key.compare(0, root.size(), root)) || ((key.size() > root.size()) && ('\\' != key[root.size()])))
+		{
+			continue;
+		}
+
+		Md5Cache cache;
+		cache.Items = folder.Items;
+		cache.Strings = folder.Strings;
+
+		Logger::Get().printf(Logger::Level::Info, "Exporting %s items to \"%s\"\n", comma(cache.Items.size()), folder.FolderName.c_str());
+
+		if (dest.Save(folder.FolderName.c_str(), cache))
+		{
+			++count;
+		}
+	}
+
+	return count;
+}
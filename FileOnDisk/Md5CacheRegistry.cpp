@@ -0,0 +1,171 @@
+#include "stdafx.h"
+
+#include <utilities.h>
+#include <FileOnDisk.h>
+#include <Md5CacheRegistry.h>
+
+Md5CacheRegistry Md5CacheRegistry::theregistry;
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void Md5CacheEntry::BuildIndex()
+{
+	this->Index.clear();
+	this->Index.reserve(this->Cache.Items.size());
+
+	size_t index = 0;
+	for (auto &item : this->Cache.Items)
+	{
+		this->Index[this->Cache.GetFileName(item)] = index;
+		++index;
+	}
+
+	// roughly: the items and names, plus a node and a bucket for each of them in the index
+	this->MemoryUsed = sizeof(Md5CacheEntry) + (this->Cache.Items.size() * (sizeof(Md5CacheItem) + 4 * sizeof(void *))) + this->Cache.Strings.size();
+}
+
+//=====================================================================================================================================================================================================
+// The keys are folded the way paths are compared, so they're all lower case unless paths are
+// case-sensitive
+//=====================================================================================================================================================================================================
+std::string Md5CacheRegistry::MakeKey(const char *pszFileName)
+{
+	std::string key{pszFileName};
+
+	for (auto &c : key)
+	{
+		c = FoldPathChar(c);
+	}
+
+	return key;
+}
+
+//=====================================================================================================================================================================================================
+// Load
+//
+// The file is read outside the lock, so that threads loading different folders don't wait on
+// one another. If two threads race to load the same one, the first one in wins, and the other
+// one's copy is thrown away. If the file is invalidated while it's being read, what was read is
+// still handed back, but isn't kept.
+//=====================================================================================================================================================================================================
+std::shared_ptr<const Md5CacheEntry> Md5CacheRegistry::Load(const char *pszFileName)
+{
+	std::string key = MakeKey(pszFileName);
+	size_t generation;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		auto iter = this->slots.find(key);
+		if (iter != this->slots.end())
+		{
+			this->lru.splice(this->lru.begin(), this->lru, iter->second.lru);
+			return iter->second.entry;
+		}
+
+		generation = this->GetGeneration(key);
+	}
+
+	auto pentry = std::make_shared<Md5CacheEntry>();
+
+	if (!pentry->Cache.Load(pszFileName))
+	{
+		return nullptr;
+	}
+
+	pentry->BuildIndex();
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (generation != this->GetGeneration(key))
+	{
+		// it was written (or deleted) while we were reading it
+		return pentry;
+	}
+
+	auto iter = this->slots.find(key);
+	if (iter != this->slots.end())
+	{
+		this->lru.splice(this->lru.begin(), this->lru, iter->second.lru);
+		return iter->second.entry;
+	}
+
+	this->lru.push_front(key);
+
+	Slot &slot = this->slots[key];
+	slot.entry = pentry;
+	slot.lru = this->lru.begin();
+
+	this->memoryUsed += pentry->MemoryUsed;
+	this->EvictOverBudget();
+
+	return pentry;
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void Md5CacheRegistry::Invalidate(const char *pszFileName)
+{
+	std::string key = MakeKey(pszFileName);
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->generations[key] = ++this->lastGeneration;
+
+	auto iter = this->slots.find(key);
+	if (iter != this->slots.end())
+	{
+		this->memoryUsed -= iter->second.entry->MemoryUsed;
+		this->lru.erase(iter->second.lru);
+		this->slots.erase(iter);
+	}
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+size_t Md5CacheRegistry::GetGeneration(const std::string &key) const
+{
+	auto iter = this->generations.find(key);
+	size_t generation = (iter == this->generations.end()) ? 0 : iter->second;
+
+	return (generation > this->clearedGeneration) ? generation : this->clearedGeneration;
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void Md5CacheRegistry::SetMemoryBudget(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->memoryBudget = bytes;
+	this->EvictOverBudget();
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void Md5CacheRegistry::Clear()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->slots.clear();
+	this->lru.clear();
+	this->generations.clear();
+	this->clearedGeneration = ++this->lastGeneration;
+	this->memoryUsed = 0;
+}
+
+//=====================================================================================================================================================================================================
+// Drop the least recently used entries until we're within budget (but always keep the most
+// recent one, even if it alone is over). Must be called with the lock held.
+//=====================================================================================================================================================================================================
+void Md5CacheRegistry::EvictOverBudget()
+{
+	while ((this->memoryUsed > this->memoryBudget) && (this->lru.size() > 1))
+	{
+		auto iter = this->slots.find(this->lru.back());
+		assert(iter != this->slots.end());
+
+		this->memoryUsed -= iter->second.entry->MemoryUsed;
+		this->slots.erase(iter);
+		this->lru.pop_back();
+	}
+}
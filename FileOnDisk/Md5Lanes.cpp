@@ -0,0 +1,448 @@
+#include "stdafx.h"
+
+#include <utilities.h>
+#include <FileOnDisk.h>
+#include <Digest.h>
+#include <WorkQueue.h>
+#include <ThreadPool.h>
+
+
+//=====================================================================================================================================================================================================
+// Multi-buffer MD5
+//
+// MD5 can't be sped up within one message, since each step needs the one before it, but the
+// same steps can be run on several messages at once, one per SIMD lane: four with SSE2, eight
+// with AVX2. Each lane has its own message, at its own block; when a lane's message is done,
+// the next one is started in it, so the lanes stay full until there's nothing left to start.
+// The result is plain MD5, the same as the CryptoAPI's, so the cached hashes are still good.
+//=====================================================================================================================================================================================================
+namespace
+{
+	const uint32_t K[64] =
+	{
+		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+		0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+		0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+		0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+		0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+		0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+	};
+
+	const int ROTATE[64] =
+	{
+		7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+		5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+		4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+		6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+	};
+
+	const uint32_t IV[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+	const size_t BLOCK_LEN = 64;
+	const size_t MAX_LANES = 8;
+
+	//=================================================================================================================================================================================================
+	// The lanes, four 32-bit words at a time (SSE2) or eight (AVX2)
+	//=================================================================================================================================================================================================
+	struct Sse2Lanes
+	{
+		typedef __m128i Vec;
+		static const size_t count = 4;
+
+		static Vec Load(const uint32_t *p)			{ return _mm_load_si128(reinterpret_cast<const __m128i *>(p)); }
+		static void Store(uint32_t *p, Vec v)		{ _mm_store_si128(reinterpret_cast<__m128i *>(p), v); }
+		static Vec Set1(uint32_t x)					{ return _mm_set1_epi32(static_cast<int>(x)); }
+		static Vec Add(Vec a, Vec b)				{ return _mm_add_epi32(a, b); }
+		static Vec And(Vec a, Vec b)				{ return _mm_and_si128(a, b); }
+		static Vec Or(Vec a, Vec b)					{ return _mm_or_si128(a, b); }
+		static Vec Xor(Vec a, Vec b)				{ return _mm_xor_si128(a, b); }
+		static Vec Rotate(Vec x, int s)				{ return _mm_or_si128(_mm_sll_epi32(x, _mm_cvtsi32_si128(s)), _mm_srl_epi32(x, _mm_cvtsi32_si128(32 - s))); }
+	};
+
+	struct Avx2Lanes
+	{
+		typedef __m256i Vec;
+		static const size_t count = 8;
+
+		static Vec Load(const uint32_t *p)			{ return _mm256_load_si256(reinterpret_cast<const __m256i *>(p)); }
+		static void Store(uint32_t *p, Vec v)		{ _mm256_store_si256(reinterpret_cast<__m256i *>(p), v); }
+		static Vec Set1(uint32_t x)					{ return _mm256_set1_epi32(static_cast<int>(x)); }
+		static Vec Add(Vec a, Vec b)				{ return _mm256_add_epi32(a, b); }
+		static Vec And(Vec a, Vec b)				{ return _mm256_and_si256(a, b); }
+		static Vec Or(Vec a, Vec b)					{ return _mm256_or_si256(a, b); }
+		static Vec Xor(Vec a, Vec b)				{ return _mm256_xor_si256(a, b); }
+		static Vec Rotate(Vec x, int s)				{ return _mm256_or_si256(_mm256_sll_epi32(x, _mm_cvtsi32_si128(s)), _mm256_srl_epi32(x, _mm_cvtsi32_si128(32 - s))); }
+	};
+
+	//=================================================================================================================================================================================================
+	// CompressLanes
+	//
+	// Run one block through each lane. state[i][lane] is word i (a, b, c, d) of that lane's state.
+	//=================================================================================================================================================================================================
+	template <typename Lanes> void CompressLanes(uint32_t (*state)[MAX_LANES], const uint8_t *const *blocks)
+	{
+		typedef typename Lanes::Vec Vec;
+
+		// the message words, with the lanes side by side
+		alignas(32) uint32_t words[16][MAX_LANES];
+		for (size_t lane = 0; lane < Lanes::count; lane++)
+		{
+			for (size_t w = 0; w < 16; w++)
+			{
+				memcpy(&words[w][lane], blocks[lane] + (w * 4), 4);
+			}
+		}
+
+		const Vec ones = Lanes::Set1(0xFFFFFFFF);
+
+		Vec a = Lanes::Load(state[0]);
+		Vec b = Lanes::Load(state[1]);
+		Vec c = Lanes::Load(state[2]);
+		Vec d = Lanes::Load(state[3]);
+
+		for (int i = 0; i < 64; i++)
+		{
+			Vec f;
+			int g;
+
+			if (i < 16)
+			{
+				f = Lanes::Xor(d, Lanes::And(b, Lanes::Xor(c, d)));
+				g = i;
+			}
+			else if (i < 32)
+			{
+				f = Lanes::Xor(c, Lanes::And(d, Lanes::Xor(b, c)));
+				g = ((5 * i) + 1) & 15;
+			}
+			else if (i < 48)
+			{
+				f = Lanes::Xor(Lanes::Xor(b, c), d);
+				g = ((3 * i) + 5) & 15;
+			}
+			else
+			{
+				f = Lanes::Xor(c, Lanes::Or(b, Lanes::Xor(d, ones)));
+				g = (7 * i) & 15;
+			}
+
+			Vec t = Lanes::Add(Lanes::Add(a, f), Lanes::Add(Lanes::Set1(K[i]), Lanes::Load(words[g])));
+
+			a = d;
+			d = c;
+			c = b;
+			b = Lanes::Add(b, Lanes::Rotate(t, ROTATE[i]));
+		}
+
+		Lanes::Store(state[0], Lanes::Add(Lanes::Load(state[0]), a));
+		Lanes::Store(state[1], Lanes::Add(Lanes::Load(state[1]), b));
+		Lanes::Store(state[2], Lanes::Add(Lanes::Load(state[2]), c));
+		Lanes::Store(state[3], Lanes::Add(Lanes::Load(state[3]), d));
+	}
+
+	//=================================================================================================================================================================================================
+	// LaneMessage
+	//
+	// A message going through a lane. The whole blocks come straight from the data; the padding
+	// (and whatever's left over of the data) makes up one or two more blocks at the end.
+	//=================================================================================================================================================================================================
+	struct LaneMessage
+	{
+		const uint8_t	*pData = nullptr;
+		size_t			fullBlocks = 0;
+		size_t			totalBlocks = 0;
+		size_t			block = 0;
+		uint8_t			tail[2 * BLOCK_LEN];
+
+		void Start(const void *pData, size_t size)
+		{
+			this->pData			= reinterpret_cast<const uint8_t *>(pData);
+			this->fullBlocks	= size / BLOCK_LEN;
+			this->block			= 0;
+
+			size_t leftover = size % BLOCK_LEN;
+			size_t tailBlocks = (leftover < BLOCK_LEN - 8) ? 1 : 2;
+
+			memset(this->tail, 0, sizeof(this->tail));
+			memcpy(this->tail, this->pData + (this->fullBlocks * BLOCK_LEN), leftover);
+			this->tail[leftover] = 0x80;
+
+			unsigned long long bits = static_cast<unsigned long long>(size) * 8;
+			memcpy(this->tail + (tailBlocks * BLOCK_LEN) - 8, &bits, 8);
+
+			this->totalBlocks = this->fullBlocks + tailBlocks;
+		}
+
+		const uint8_t *CurrentBlock() const
+		{
+			if (this->block < this->fullBlocks)
+			{
+				return this->pData + (this->block * BLOCK_LEN);
+			}
+
+			return this->tail + ((this->block - this->fullBlocks) * BLOCK_LEN);
+		}
+	};
+
+	//=================================================================================================================================================================================================
+	// RunLanes
+	//
+	// next(lane, message) starts the next message in the lane, or returns false if there isn't
+	// one; done(lane, hash) is called when the lane's message is finished.
+	//=================================================================================================================================================================================================
+	template <typename Lanes, typename _NextFunctor, typename _DoneFunctor> void RunLanes(_NextFunctor next, _DoneFunctor done)
+	{
+		static const uint8_t idleBlock[BLOCK_LEN] = {};
+
+		alignas(32) uint32_t state[4][MAX_LANES];
+		LaneMessage messages[Lanes::count];
+		bool busy[Lanes::count];
+		size_t numBusy = 0;
+
+		auto startLane = [&](size_t lane)
+		{
+			busy[lane] = next(lane, messages[lane]);
+
+			if (busy[lane])
+			{
+				for (size_t i = 0; i < 4; i++)
+				{
+					state[i][lane] = IV[i];
+				}
+			}
+
+			return busy[lane];
+		};
+
+		for (size_t lane = 0; lane < Lanes::count; lane++)
+		{
+			if (startLane(lane))
+			{
+				numBusy++;
+			}
+		}
+
+		while (numBusy > 0)
+		{
+			if (ControlCHandler::TestShouldTerminate())
+			{
+				return;
+			}
+
+			const uint8_t *blocks[Lanes::count];
+			for (size_t lane = 0; lane < Lanes::count; lane++)
+			{
+				blocks[lane] = busy[lane] ? messages[lane].CurrentBlock() : idleBlock;
+			}
+
+			CompressLanes<Lanes>(state, blocks);
+
+			for (size_t lane = 0; lane < Lanes::count; lane++)
+			{
+				if (busy[lane] && (++messages[lane].block == messages[lane].totalBlocks))
+				{
+					Md5Hash hash;
+					for (size_t i = 0; i < 4; i++)
+					{
+						memcpy(hash._data + (i * 4), &state[i][lane], 4);
+					}
+
+					done(lane, hash);
+
+					if (!startLane(lane))
+					{
+						numBusy--;
+					}
+				}
+			}
+		}
+	}
+
+	//=================================================================================================================================================================================================
+	//=================================================================================================================================================================================================
+	template <typename _NextFunctor, typename _DoneFunctor> void RunLanes(_NextFunctor next, _DoneFunctor done)
+	{
+		if (CpuHasAvx2())
+		{
+			RunLanes<Avx2Lanes>(next, done);
+		}
+		else
+		{
+			RunLanes<Sse2Lanes>(next, done);
+		}
+	}
+
+	//=================================================================================================================================================================================================
+	// ReadWholeFile
+	//
+	// Fails if the file isn't the size it was when it was scanned (or doesn't read back as that
+	// many bytes), so that it gets hashed the usual way instead of from part of it
+	//=================================================================================================================================================================================================
+	bool ReadWholeFile(const char *szFileName, long long size, std::vector<BYTE> &buffer, size_t &cbData)
+	{
+		HANDLE hFile = CreateFileU(szFileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+		if (INVALID_HANDLE_VALUE == hFile)
+		{
+			Logger::Get().printf(Logger::Level::Error, "Error opening \"%s\"! (%S, %d)\n", szFileName, GetLastErrorString(), GetLastError());
+			return false;
+		}
+
+		LARGE_INTEGER fileSize = {0};
+
+		if (!GetFileSizeEx(hFile, &fileSize) || (fileSize.QuadPart != size))
+		{
+			SafeCloseHandle(hFile);
+			return false;
+		}
+
+		buffer.resize(static_cast<size_t>(fileSize.QuadPart));
+		cbData = 0;
+
+		bool result = true;
+		DWORD cbRead = 0;
+
+		while (cbData < buffer.size())
+		{
+			if (!ReadFile(hFile, &buffer[cbData], static_cast<DWORD>(buffer.size() - cbData), &cbRead, nullptr))
+			{
+				Logger::Get().printf(Logger::Level::Error, "Error reading \"%s\"! (%S, %d)\n", szFileName, GetLastErrorString(), GetLastError());
+				result = false;
+				break;
+			}
+
+			if (0 == cbRead)
+			{
+				// it got shorter after we got its size
+				result = false;
+				break;
+			}
+
+			cbData += cbRead;
+		}
+
+		SafeCloseHandle(hFile);
+
+		return result;
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+size_t Md5LaneCount()
+{
+	return CpuHasAvx2() ? Avx2Lanes::count : Sse2Lanes::count;
+}
+
+
+//=====================================================================================================================================================================================================
+// Md5HashBuffers
+//=====================================================================================================================================================================================================
+void Md5HashBuffers(const unsigned char *const *ppData, const size_t *pSizes, size_t count, Md5Hash *pHashes)
+{
+	size_t nextIndex = 0;
+	size_t inLane[MAX_LANES];
+
+	RunLanes([&](size_t lane, LaneMessage &message)
+	{
+		if (nextIndex >= count)
+		{
+			return false;
+		}
+
+		inLane[lane] = nextIndex++;
+		message.Start(ppData[inLane[lane]], pSizes[inLane[lane]]);
+		return true;
+	},
+	[&](size_t lane, const Md5Hash &hash)
+	{
+		pHashes[inLane[lane]] = hash;
+	});
+}
+
+
+//=====================================================================================================================================================================================================
+// Md5HashFilesInLanes
+//
+// Each worker reads the files in its queue a lane at a time, taking the next one off the queue
+// whenever one of its lanes comes free. Every worker gets a thread of its own.
+//=====================================================================================================================================================================================================
+void Md5HashFilesInLanes(std::vector<std::vector<Md5LaneRequest>> &queues, const std::vector<uint32_t> &numWorkers)
+{
+	std::unique_ptr<std::atomic<size_t>[]> nextRequests(new std::atomic<size_t>[queues.size()]);
+	uint32_t totalWorkers = 0;
+
+	for (size_t queue = 0; queue < queues.size(); queue++)
+	{
+		for (auto &request : queues[queue])
+		{
+			request.Hashed = false;
+		}
+
+		nextRequests[queue] = 0;
+		totalWorkers += queues[queue].empty() ? 0 : numWorkers[queue];
+	}
+
+	if (0 == totalWorkers)
+	{
+		return;
+	}
+
+	ThreadPool::Get().SetNumThreads(totalWorkers);
+
+	TaskGroup workers;
+
+	for (size_t queue = 0; queue < queues.size(); queue++)
+	{
+		if (queues[queue].empty())
+		{
+			continue;
+		}
+
+		std::vector<Md5LaneRequest> &requests = queues[queue];
+		std::atomic<size_t> &nextRequest = nextRequests[queue];
+
+		for (uint32_t worker = 0; worker < numWorkers[queue]; worker++)
+		{
+			workers.Run([&requests, &nextRequest]()
+			{
+				std::vector<BYTE> buffers[MAX_LANES];
+				Md5LaneRequest *inLane[MAX_LANES];
+
+				RunLanes([&](size_t lane, LaneMessage &message)
+				{
+					while (!ControlCHandler::TestShouldTerminate())
+					{
+						size_t index = nextRequest++;
+
+						if (index >= requests.size())
+						{
+							break;
+						}
+
+						size_t cbData = 0;
+
+						if (ReadWholeFile(requests[index].FileName.c_str(), requests[index].Size, buffers[lane], cbData))
+						{
+							inLane[lane] = &requests[index];
+							message.Start(buffers[lane].data(), cbData);
+							return true;
+						}
+					}
+
+					return false;
+				},
+				[&](size_t lane, const Md5Hash &hash)
+				{
+					inLane[lane]->Hash = hash;
+					inLane[lane]->Hashed = true;
+				});
+			});
+		}
+	}
+
+	workers.Wait();
+}
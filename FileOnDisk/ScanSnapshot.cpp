@@ -0,0 +1,242 @@
+#include "stdafx.h"
+
+#include <utilities.h>
+#include <FileOnDisk.h>
+#include <ScanSnapshot.h>
+#include <Digest.h>
+
+
+//=====================================================================================================================================================================================================
+// WriteFile all of a vector, even one bigger than a single WriteFile can take
+//=====================================================================================================================================================================================================
+template <typename _Ty> static bool WriteVector(HANDLE hFile, const std::vector<_Ty> &v)
+{
+	const size_t maxChunk = 64 * 1024 * 1024;
+
+	const char *p = reinterpret_cast<const char *>(v.data());
+	size_t remaining = v.size() * sizeof(_Ty);
+
+	while (remaining > 0)
+	{
+		DWORD dwToWrite = static_cast<DWORD>((remaining < maxChunk) ? remaining : maxChunk);
+		DWORD dwBytes = 0;
+
+		if (!WriteFile(hFile, p, dwToWrite, &dwBytes, nullptr) || (dwBytes != dwToWrite))
+		{
+			return false;
+		}
+
+		p += dwBytes;
+		remaining -= dwBytes;
+	}
+
+	return true;
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+bool ScanSnapshot::Save(const char *pszFileName) const
+{
+	bool result = false;
+
+	HANDLE hFile = CreateFileU(pszFileName, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+	if (nullptr != hFile && INVALID_HANDLE_VALUE != hFile)
+	{
+		ScanSnapshotHeader header;
+		header.version		= SCANSNAPSHOT_VERSION;
+		header.itemSize		= sizeof(FileOnDisk);
+		header.numFolders	= this->Folders.size();
+		header.numItems		= this->Items.size();
+		header.stringsSize	= this->Strings.size();
+		header.algorithm	= static_cast<long long>(DigestEngine::GetAlgorithm());
+
+		DWORD dwBytes;
+
+		result = WriteFile(hFile, &header, sizeof(header), &dwBytes, nullptr) && (sizeof(header) == dwBytes);
+		result = result && WriteVector(hFile, this->Folders);
+		result = result && WriteVector(hFile, this->Items);
+		result = result && WriteVector(hFile, this->Strings);
+
+		CloseHandle(hFile);
+
+		if (!result)
+		{
+			// don't leave a truncated snapshot lying around
+			Logger::Get().printf(Logger::Level::Error, "Error writing scan snapshot \"%s\"! (%S, %d)\n", pszFileName, GetLastErrorString(), GetLastError());
+			DeleteFileA(pszFileName);
+		}
+	}
+	else
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error creating scan snapshot \"%s\"! (%S, %d)\n", pszFileName, GetLastErrorString(), GetLastError());
+	}
+
+	return result;
+}
+
+//=====================================================================================================================================================================================================
+// Open
+//
+// Map the snapshot into memory, and make sure that it's consistent before anything trusts the
+// offsets in it. Returns false (and leaves nothing open) if there's no usable snapshot.
+//=====================================================================================================================================================================================================
+bool ScanSnapshotView::Open(const char *pszFileName)
+{
+	this->Close();
+
+	this->hFile = CreateFileU(pszFileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if ((nullptr == this->hFile) || (INVALID_HANDLE_VALUE == this->hFile))
+	{
+		this->hFile = nullptr;
+		return false;
+	}
+
+	LARGE_INTEGER filesize = {0};
+	GetFileSizeEx(this->hFile, &filesize);
+
+	if (filesize.QuadPart < static_cast<long long>(sizeof(ScanSnapshotHeader)))
+	{
+		this->Close();
+		return false;
+	}
+
+	this->hMapping = CreateFileMappingW(this->hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (nullptr == this->hMapping)
+	{
+		this->Close();
+		return false;
+	}
+
+	this->pView = MapViewOfFile(this->hMapping, FILE_MAP_READ, 0, 0, 0);
+	if (nullptr == this->pView)
+	{
+		this->Close();
+		return false;
+	}
+
+	//
+	// check the header
+	//
+	const char *p = reinterpret_cast<const char *>(this->pView);
+	const ScanSnapshotHeader *pheader = reinterpret_cast<const ScanSnapshotHeader *>(p);
+
+	if ((pheader->version != SCANSNAPSHOT_VERSION) || (pheader->itemSize != sizeof(FileOnDisk)) || (pheader->numFolders < 1) || (pheader->numItems < 0) || (pheader->stringsSize < 1) || (pheader->algorithm != static_cast<long long>(DigestEngine::GetAlgorithm())))
+	{
+		this->Close();
+		return false;
+	}
+
+	unsigned long long expectedSize = sizeof(ScanSnapshotHeader);
+	expectedSize += static_cast<unsigned long long>(pheader->numFolders) * sizeof(ScanSnapshotFolder);
+	expectedSize += static_cast<unsigned long long>(pheader->numItems) * sizeof(FileOnDisk);
+	expectedSize += static_cast<unsigned long long>(pheader->stringsSize);
+
+	if (expectedSize != static_cast<unsigned long long>(filesize.QuadPart))
+	{
+		this->Close();
+		return false;
+	}
+
+	this->pHeader	= pheader;
+	this->pFolders	= reinterpret_cast<const ScanSnapshotFolder *>(p + sizeof(ScanSnapshotHeader));
+	this->pItems	= reinterpret_cast<const FileOnDisk *>(this->pFolders + pheader->numFolders);
+	this->pStrings	= reinterpret_cast<const char *>(this->pItems + pheader->numItems);
+
+	const size_t numFolders		= static_cast<size_t>(pheader->numFolders);
+	const size_t numItems		= static_cast<size_t>(pheader->numItems);
+	const size_t stringsSize	= static_cast<size_t>(pheader->stringsSize);
+
+	if (0 != this->pStrings[stringsSize - 1])
+	{
+		this->Close();
+		return false;
+	}
+
+	for (size_t i = 0; i < numItems; ++i)
+	{
+		if (this->pItems[i].Name >= stringsSize)
+		{
+			this->Close();
+			return false;
+		}
+	}
+
+	//
+	// work out where each folder's sub-tree ends, going backwards so that the sub-folders are
+	// always done before their parent
+	//
+	this->next.assign(numFolders, npos);
+
+	for (size_t i = numFolders; i-- > 0;)
+	{
+		const ScanSnapshotFolder &folder = this->pFolders[i];
+
+		if ((folder.Path >= stringsSize) || (folder.FirstItem > numItems) || (folder.NumFiles > numItems - folder.FirstItem))
+		{
+			this->Close();
+			return false;
+		}
+
+		size_t child = i + 1;
+
+		for (unsigned long j = 0; j < folder.NumSubFolders; ++j)
+		{
+			if (child >= numFolders)
+			{
+				this->Close();
+				return false;
+			}
+
+			child = this->next[child];
+		}
+
+		this->next[i] = child;
+	}
+
+	this->folderMap.reserve(numFolders);
+
+	for (size_t i = 0; i < numFolders; ++i)
+	{
+		this->folderMap[this->GetFolderPath(i)] = i;
+	}
+
+	return true;
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void ScanSnapshotView::Close()
+{
+	this->folderMap.clear();
+	this->next.clear();
+
+	this->pHeader	= nullptr;
+	this->pFolders	= nullptr;
+	this->pItems	= nullptr;
+	this->pStrings	= nullptr;
+
+	if (nullptr != this->pView)
+	{
+		UnmapViewOfFile(this->pView);
+		this->pView = nullptr;
+	}
+
+	SafeCloseHandle(this->hMapping);
+	SafeCloseHandle(this->hFile);
+}
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+size_t ScanSnapshotView::FindFolder(const char *pszPath) const
+{
+	auto iter = this->folderMap.find(pszPath);
+
+	if (iter == this->folderMap.end())
+	{
+		return npos;
+	}
+
+	return iter->second;
+}
@@ -0,0 +1,238 @@
+#include "stdafx.h"
+
+#include <utilities.h>
+#include <WorkQueue.h>
+#include <ThreadPool.h>
+
+ThreadPool ThreadPool::thepool;
+
+static thread_local int theWorkerIndex = -1;
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+ThreadPool::~ThreadPool()
+{
+	this->Stop();
+}
+
+int ThreadPool::GetWorkerIndex()
+{
+	return theWorkerIndex;
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void ThreadPool::SetNumThreads(uint32_t numThreads)
+{
+	numThreads = std::max<uint32_t>(numThreads, 1);
+
+	if (numThreads == this->GetNumThreads())
+	{
+		return;
+	}
+
+	this->Stop();
+
+	for (uint32_t i = 0; i < numThreads; i++)
+	{
+		this->queues.push_back(std::make_unique<WorkStealingQueue<QueuedTask>>());
+	}
+
+	for (uint32_t i = 0; i < numThreads; i++)
+	{
+		this->threads.emplace_back([this, i]() { this->Worker(i); });
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+// ThreadPool::Stop
+//
+// Let the workers finish what's queued, and then get rid of them
+//=====================================================================================================================================================================================================
+void ThreadPool::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+
+	this->wake.notify_all();
+
+	for (auto &thread : this->threads)
+	{
+		thread.join();
+	}
+
+	this->threads.clear();
+	this->queues.clear();
+	this->stopping = false;
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void ThreadPool::Submit(const TaskGroup *pGroup, Task task)
+{
+	if (this->threads.empty())
+	{
+		this->SetNumThreads(1);
+	}
+
+	int self = GetWorkerIndex();
+	size_t queue = (self >= 0) ? static_cast<size_t>(self) : (this->nextQueue++ % this->queues.size());
+
+	this->queues[queue]->Push(QueuedTask{pGroup, std::move(task)});
+
+	// counted under the lock, so that a worker about to go to sleep can't miss it
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		++this->queued;
+	}
+
+	this->wake.notify_one();
+}
+
+
+//=====================================================================================================================================================================================================
+// ThreadPool::RunOne
+//
+// Run one task, from our own queue if there's one there, or else stolen from someone else's.
+// Returns false if there weren't any.
+//=====================================================================================================================================================================================================
+bool ThreadPool::RunOne(size_t self)
+{
+	QueuedTask task;
+
+	if (!this->queues[self]->Pop(task))
+	{
+		bool stolen = false;
+
+		for (size_t i = 1; (i < this->queues.size()) && !stolen; ++i)
+		{
+			stolen = this->queues[(self + i) % this->queues.size()]->Steal(task);
+		}
+
+		if (!stolen)
+		{
+			return false;
+		}
+	}
+
+	--this->queued;
+	task.task();
+
+	return true;
+}
+
+
+//=====================================================================================================================================================================================================
+// ThreadPool::RunOneFrom
+//
+// Run the task at the back of our own queue, but only if it belongs to the group
+//=====================================================================================================================================================================================================
+bool ThreadPool::RunOneFrom(size_t self, const TaskGroup *pGroup)
+{
+	QueuedTask task;
+
+	if (!this->queues[self]->PopIf(task, [pGroup](const QueuedTask &queued) { return (queued.pGroup == pGroup); }))
+	{
+		return false;
+	}
+
+	--this->queued;
+	task.task();
+
+	return true;
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void ThreadPool::Worker(size_t self)
+{
+	theWorkerIndex = static_cast<int>(self);
+
+	for (;;)
+	{
+		if (this->RunOne(self))
+		{
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->wake.wait(lock, [this]() { return this->stopping || (this->queued > 0); });
+
+		if (this->stopping && (0 == this->queued))
+		{
+			break;
+		}
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+void TaskGroup::Run(ThreadPool::Task task)
+{
+	++this->pending;
+
+	ThreadPool::Get().Submit(this, [this, task = std::move(task)]()
+	{
+		if (!ControlCHandler::TestShouldTerminate())
+		{
+			task();
+		}
+
+		this->Finished();
+	});
+}
+
+void TaskGroup::Finished()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (0 == --this->pending)
+	{
+		this->done.notify_all();
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+// TaskGroup::Wait
+//
+// A worker runs the group's tasks that are still on its own queue first. After that it keeps
+// running whatever else it can find (stolen if need be), since some of the group may be stuck
+// under other tasks on another queue, and a worker that just blocked here would sit idle (or,
+// if they all did, deadlock). It only sleeps, briefly, when there's nothing to run anywhere.
+//=====================================================================================================================================================================================================
+bool TaskGroup::Wait()
+{
+	int self = ThreadPool::GetWorkerIndex();
+
+	if (self >= 0)
+	{
+		ThreadPool &pool = ThreadPool::Get();
+
+		while (this->pending > 0)
+		{
+			if (pool.RunOneFrom(static_cast<size_t>(self), this) || pool.RunOne(static_cast<size_t>(self)))
+			{
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->done.wait_for(lock, std::chrono::milliseconds(1), [this]() { return (0 == this->pending); });
+		}
+
+		return !ControlCHandler::TestShouldTerminate();
+	}
+
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->done.wait(lock, [this]() { return (0 == this->pending); });
+
+	return !ControlCHandler::TestShouldTerminate();
+}
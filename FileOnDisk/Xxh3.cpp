@@ -0,0 +1,556 @@
+#include "stdafx.h"
+
+#include <utilities.h>
+#include <FileOnDisk.h>
+#include <Digest.h>
+
+
+//=====================================================================================================================================================================================================
+// XXH3-128
+//
+// The 128-bit flavor of XXH3 (from xxHash 0.8), with no seed and the default secret. It's not a
+// cryptographic hash, but it's a very good one, and it's many times faster than MD5: the long
+// input loop is just multiplies and adds on eight 64-bit accumulators, which AVX2 does four at
+// a time.
+//=====================================================================================================================================================================================================
+namespace
+{
+	const uint32_t	PRIME32_1	= 0x9E3779B1U;
+	const uint32_t	PRIME32_2	= 0x85EBCA77U;
+	const uint32_t	PRIME32_3	= 0xC2B2AE3DU;
+
+	const uint64_t	PRIME64_1	= 0x9E3779B185EBCA87ULL;
+	const uint64_t	PRIME64_2	= 0xC2B2AE3D27D4EB4FULL;
+	const uint64_t	PRIME64_3	= 0x165667B19E3779F9ULL;
+	const uint64_t	PRIME64_4	= 0x85EBCA77C2B2AE63ULL;
+	const uint64_t	PRIME64_5	= 0x27D4EB2F165667C5ULL;
+
+	const uint64_t	PRIME_MX1	= 0x165667919E3779F9ULL;
+	const uint64_t	PRIME_MX2	= 0x9FB21C651E98DF25ULL;
+
+	const size_t	STRIPE_LEN				= 64;
+	const size_t	SECRET_CONSUME_RATE		= 8;
+	const size_t	ACC_NB					= 8;
+	const size_t	SECRET_SIZE				= 192;
+	const size_t	SECRET_LASTACC_START	= 7;
+	const size_t	SECRET_MERGEACCS_START	= 11;
+	const size_t	MIDSIZE_STARTOFFSET		= 3;
+	const size_t	MIDSIZE_LASTOFFSET		= 17;
+	const size_t	SECRET_SIZE_MIN			= 136;
+	const size_t	STRIPES_PER_BLOCK		= (SECRET_SIZE - STRIPE_LEN) / SECRET_CONSUME_RATE;
+	const size_t	INTERNAL_BUFFER_SIZE	= 256;
+
+	alignas(64) const uint8_t kSecret[SECRET_SIZE] =
+	{
+		0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+		0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+		0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+		0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+		0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+		0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+		0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+		0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+		0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+		0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+		0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+		0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+	};
+
+	struct Hash128
+	{
+		uint64_t	low64;
+		uint64_t	high64;
+	};
+
+	inline uint32_t Read32(const uint8_t *p)
+	{
+		uint32_t value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	inline uint64_t Read64(const uint8_t *p)
+	{
+		uint64_t value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	inline uint32_t Swap32(uint32_t x)
+	{
+		return _byteswap_ulong(x);
+	}
+
+	inline uint64_t Swap64(uint64_t x)
+	{
+		return _byteswap_uint64(x);
+	}
+
+	inline uint32_t Rotl32(uint32_t x, int r)
+	{
+		return (x << r) | (x >> (32 - r));
+	}
+
+	inline uint64_t Rotl64(uint64_t x, int r)
+	{
+		return (x << r) | (x >> (64 - r));
+	}
+
+	inline Hash128 Mult64to128(uint64_t lhs, uint64_t rhs)
+	{
+		Hash128 result;
+		result.low64 = _umul128(lhs, rhs, &result.high64);
+		return result;
+	}
+
+	inline uint64_t Mul128Fold64(uint64_t lhs, uint64_t rhs)
+	{
+		Hash128 product = Mult64to128(lhs, rhs);
+		return product.low64 ^ product.high64;
+	}
+
+	inline uint64_t XorShift64(uint64_t v, int shift)
+	{
+		return v ^ (v >> shift);
+	}
+
+	inline uint64_t Xxh64Avalanche(uint64_t h)
+	{
+		h ^= h >> 33;
+		h *= PRIME64_2;
+		h ^= h >> 29;
+		h *= PRIME64_3;
+		h ^= h >> 32;
+		return h;
+	}
+
+	inline uint64_t Avalanche(uint64_t h)
+	{
+		h = XorShift64(h, 37);
+		h *= PRIME_MX1;
+		h = XorShift64(h, 32);
+		return h;
+	}
+
+	inline uint64_t Mix16B(const uint8_t *input, const uint8_t *secret, uint64_t seed)
+	{
+		uint64_t inputLo = Read64(input);
+		uint64_t inputHi = Read64(input + 8);
+		return Mul128Fold64(inputLo ^ (Read64(secret) + seed), inputHi ^ (Read64(secret + 8) - seed));
+	}
+
+	inline Hash128 Mix32B(Hash128 acc, const uint8_t *input1, const uint8_t *input2, const uint8_t *secret, uint64_t seed)
+	{
+		acc.low64 += Mix16B(input1, secret, seed);
+		acc.low64 ^= Read64(input2) + Read64(input2 + 8);
+		acc.high64 += Mix16B(input2, secret + 16, seed);
+		acc.high64 ^= Read64(input1) + Read64(input1 + 8);
+		return acc;
+	}
+
+	//=================================================================================================================================================================================================
+	// Short inputs (up to 240 bytes) each have their own way of being hashed
+	//=================================================================================================================================================================================================
+	Hash128 HashLen1to3(const uint8_t *input, size_t len, const uint8_t *secret)
+	{
+		uint8_t c1 = input[0];
+		uint8_t c2 = input[len >> 1];
+		uint8_t c3 = input[len - 1];
+
+		uint32_t combinedl = (static_cast<uint32_t>(c1) << 16) | (static_cast<uint32_t>(c2) << 24) | (static_cast<uint32_t>(c3) << 0) | (static_cast<uint32_t>(len) << 8);
+		uint32_t combinedh = Rotl32(Swap32(combinedl), 13);
+
+		uint64_t bitflipl = Read32(secret) ^ Read32(secret + 4);
+		uint64_t bitfliph = Read32(secret + 8) ^ Read32(secret + 12);
+
+		Hash128 h128;
+		h128.low64 = Xxh64Avalanche(combinedl ^ bitflipl);
+		h128.high64 = Xxh64Avalanche(combinedh ^ bitfliph);
+		return h128;
+	}
+
+	Hash128 HashLen4to8(const uint8_t *input, size_t len, const uint8_t *secret)
+	{
+		uint32_t inputLo = Read32(input);
+		uint32_t inputHi = Read32(input + len - 4);
+		uint64_t input64 = inputLo + (static_cast<uint64_t>(inputHi) << 32);
+		uint64_t bitflip = Read64(secret + 16) ^ Read64(secret + 24);
+		uint64_t keyed = input64 ^ bitflip;
+
+		Hash128 m128 = Mult64to128(keyed, PRIME64_1 + (len << 2));
+
+		m128.high64 += (m128.low64 << 1);
+		m128.low64 ^= (m128.high64 >> 3);
+		m128.low64 = XorShift64(m128.low64, 35);
+		m128.low64 *= PRIME_MX2;
+		m128.low64 = XorShift64(m128.low64, 28);
+		m128.high64 = Avalanche(m128.high64);
+		return m128;
+	}
+
+	Hash128 HashLen9to16(const uint8_t *input, size_t len, const uint8_t *secret)
+	{
+		uint64_t bitflipl = Read64(secret + 32) ^ Read64(secret + 40);
+		uint64_t bitfliph = Read64(secret + 48) ^ Read64(secret + 56);
+		uint64_t inputLo = Read64(input);
+		uint64_t inputHi = Read64(input + len - 8);
+
+		Hash128 m128 = Mult64to128(inputLo ^ inputHi ^ bitflipl, PRIME64_1);
+
+		m128.low64 += static_cast<uint64_t>(len - 1) << 54;
+		inputHi ^= bitfliph;
+		m128.high64 += inputHi + static_cast<uint64_t>(static_cast<uint32_t>(inputHi)) * (PRIME32_2 - 1);
+		m128.low64 ^= Swap64(m128.high64);
+
+		Hash128 h128 = Mult64to128(m128.low64, PRIME64_2);
+		h128.high64 += m128.high64 * PRIME64_2;
+		h128.low64 = Avalanche(h128.low64);
+		h128.high64 = Avalanche(h128.high64);
+		return h128;
+	}
+
+	Hash128 HashLen0to16(const uint8_t *input, size_t len, const uint8_t *secret)
+	{
+		if (len > 8)
+		{
+			return HashLen9to16(input, len, secret);
+		}
+
+		if (len >= 4)
+		{
+			return HashLen4to8(input, len, secret);
+		}
+
+		if (len > 0)
+		{
+			return HashLen1to3(input, len, secret);
+		}
+
+		Hash128 h128;
+		h128.low64 = Xxh64Avalanche(Read64(secret + 64) ^ Read64(secret + 72));
+		h128.high64 = Xxh64Avalanche(Read64(secret + 80) ^ Read64(secret + 88));
+		return h128;
+	}
+
+	Hash128 FinishMidSize(Hash128 acc, size_t len)
+	{
+		Hash128 h128;
+		h128.low64 = acc.low64 + acc.high64;
+		h128.high64 = (acc.low64 * PRIME64_1) + (acc.high64 * PRIME64_4) + (len * PRIME64_2);
+		h128.low64 = Avalanche(h128.low64);
+		h128.high64 = 0 - Avalanche(h128.high64);
+		return h128;
+	}
+
+	Hash128 HashLen17to128(const uint8_t *input, size_t len, const uint8_t *secret)
+	{
+		Hash128 acc;
+		acc.low64 = len * PRIME64_1;
+		acc.high64 = 0;
+
+		if (len > 32)
+		{
+			if (len > 64)
+			{
+				if (len > 96)
+				{
+					acc = Mix32B(acc, input + 48, input + len - 64, secret + 96, 0);
+				}
+
+				acc = Mix32B(acc, input + 32, input + len - 48, secret + 64, 0);
+			}
+
+			acc = Mix32B(acc, input + 16, input + len - 32, secret + 32, 0);
+		}
+
+		acc = Mix32B(acc, input, input + len - 16, secret, 0);
+
+		return FinishMidSize(acc, len);
+	}
+
+	Hash128 HashLen129to240(const uint8_t *input, size_t len, const uint8_t *secret)
+	{
+		Hash128 acc;
+		acc.low64 = len * PRIME64_1;
+		acc.high64 = 0;
+
+		size_t i;
+
+		for (i = 32; i < 160; i += 32)
+		{
+			acc = Mix32B(acc, input + i - 32, input + i - 16, secret + i - 32, 0);
+		}
+
+		acc.low64 = Avalanche(acc.low64);
+		acc.high64 = Avalanche(acc.high64);
+
+		for (i = 160; i <= len; i += 32)
+		{
+			acc = Mix32B(acc, input + i - 32, input + i - 16, secret + MIDSIZE_STARTOFFSET + i - 160, 0);
+		}
+
+		// the last bytes
+		acc = Mix32B(acc, input + len - 16, input + len - 32, secret + SECRET_SIZE_MIN - MIDSIZE_LASTOFFSET - 16, 0);
+
+		return FinishMidSize(acc, len);
+	}
+
+	//=================================================================================================================================================================================================
+	// Long inputs: accumulate each 64-byte stripe into eight 64-bit lanes, and scramble the lanes
+	// after every block of 16 stripes
+	//=================================================================================================================================================================================================
+	void Accumulate512Scalar(uint64_t *acc, const uint8_t *input, const uint8_t *secret)
+	{
+		for (size_t i = 0; i < ACC_NB; ++i)
+		{
+			uint64_t dataVal = Read64(input + 8 * i);
+			uint64_t dataKey = dataVal ^ Read64(secret + 8 * i);
+			acc[i ^ 1] += dataVal;
+			acc[i] += static_cast<uint64_t>(static_cast<uint32_t>(dataKey)) * (dataKey >> 32);
+		}
+	}
+
+	void ScrambleAccScalar(uint64_t *acc, const uint8_t *secret)
+	{
+		for (size_t i = 0; i < ACC_NB; ++i)
+		{
+			uint64_t acc64 = acc[i];
+			acc64 = XorShift64(acc64, 47);
+			acc64 ^= Read64(secret + 8 * i);
+			acc64 *= PRIME32_1;
+			acc[i] = acc64;
+		}
+	}
+
+	void AccumulateScalar(uint64_t *acc, const uint8_t *input, const uint8_t *secret, size_t nbStripes)
+	{
+		for (size_t n = 0; n < nbStripes; ++n)
+		{
+			Accumulate512Scalar(acc, input + n * STRIPE_LEN, secret + n * SECRET_CONSUME_RATE);
+		}
+	}
+
+	void AccumulateAvx2(uint64_t *acc, const uint8_t *input, const uint8_t *secret, size_t nbStripes)
+	{
+		__m256i *pacc = reinterpret_cast<__m256i *>(acc);
+		__m256i acc0 = _mm256_load_si256(pacc);
+		__m256i acc1 = _mm256_load_si256(pacc + 1);
+
+		for (size_t n = 0; n < nbStripes; ++n)
+		{
+			const __m256i *pinput = reinterpret_cast<const __m256i *>(input + n * STRIPE_LEN);
+			const __m256i *psecret = reinterpret_cast<const __m256i *>(secret + n * SECRET_CONSUME_RATE);
+
+			__m256i data0 = _mm256_loadu_si256(pinput);
+			__m256i data1 = _mm256_loadu_si256(pinput + 1);
+			__m256i key0 = _mm256_xor_si256(data0, _mm256_loadu_si256(psecret));
+			__m256i key1 = _mm256_xor_si256(data1, _mm256_loadu_si256(psecret + 1));
+
+			// the low 32 bits of each lane times the high 32 bits
+			__m256i product0 = _mm256_mul_epu32(key0, _mm256_srli_epi64(key0, 32));
+			__m256i product1 = _mm256_mul_epu32(key1, _mm256_srli_epi64(key1, 32));
+
+			// and the data itself goes into the neighboring lane
+			acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(product0, _mm256_shuffle_epi32(data0, _MM_SHUFFLE(1, 0, 3, 2))));
+			acc1 = _mm256_add_epi64(acc1, _mm256_add_epi64(product1, _mm256_shuffle_epi32(data1, _MM_SHUFFLE(1, 0, 3, 2))));
+		}
+
+		_mm256_store_si256(pacc, acc0);
+		_mm256_store_si256(pacc + 1, acc1);
+	}
+
+	void ScrambleAccAvx2(uint64_t *acc, const uint8_t *secret)
+	{
+		__m256i *pacc = reinterpret_cast<__m256i *>(acc);
+		const __m256i *psecret = reinterpret_cast<const __m256i *>(secret);
+		const __m256i prime32 = _mm256_set1_epi32(static_cast<int>(PRIME32_1));
+
+		for (size_t i = 0; i < 2; ++i)
+		{
+			__m256i accVec = _mm256_load_si256(pacc + i);
+			__m256i data = _mm256_xor_si256(accVec, _mm256_srli_epi64(accVec, 47));
+			__m256i key = _mm256_xor_si256(data, _mm256_loadu_si256(psecret + i));
+
+			// a 64 x 32 bit multiply, done as two 32 x 32 bit ones
+			__m256i productLo = _mm256_mul_epu32(key, prime32);
+			__m256i productHi = _mm256_mul_epu32(_mm256_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)), prime32);
+
+			_mm256_store_si256(pacc + i, _mm256_add_epi64(productLo, _mm256_slli_epi64(productHi, 32)));
+		}
+	}
+
+	inline uint64_t MergeAccs(const uint64_t *acc, const uint8_t *secret, uint64_t start)
+	{
+		uint64_t result = start;
+
+		for (size_t i = 0; i < 4; ++i)
+		{
+			result += Mul128Fold64(acc[2 * i] ^ Read64(secret + 16 * i), acc[2 * i + 1] ^ Read64(secret + 16 * i + 8));
+		}
+
+		return Avalanche(result);
+	}
+}
+
+
+//=====================================================================================================================================================================================================
+// Xxh3DigestEngine
+//
+// The streaming form: input is buffered until there's more than 256 bytes of it, and then whole
+// stripes are run through the accumulators as they come in. The last stripe of the input is
+// always kept back, since it's treated differently at the end.
+//=====================================================================================================================================================================================================
+class Xxh3DigestEngine : public DigestEngine
+{
+public:
+	Xxh3DigestEngine()
+	{
+		static const uint64_t initAcc[ACC_NB] = { PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1 };
+		memcpy(this->acc, initAcc, sizeof(this->acc));
+
+		static const bool avx2 = CpuHasAvx2();
+		this->accumulate	= avx2 ? AccumulateAvx2 : AccumulateScalar;
+		this->scramble		= avx2 ? ScrambleAccAvx2 : ScrambleAccScalar;
+	}
+
+	bool Reset() override
+	{
+		*this = Xxh3DigestEngine();
+		return true;
+	}
+
+	bool Update(const void *pData, size_t size) override
+	{
+		const uint8_t *input = reinterpret_cast<const uint8_t *>(pData);
+		const uint8_t *end = input + size;
+
+		this->totalLen += size;
+
+		if (this->bufferedSize + size <= INTERNAL_BUFFER_SIZE)
+		{
+			memcpy(this->buffer + this->bufferedSize, input, size);
+			this->bufferedSize += size;
+			return true;
+		}
+
+		// there's more input after what's buffered, so it can all go through now
+		if (0 != this->bufferedSize)
+		{
+			size_t loadSize = INTERNAL_BUFFER_SIZE - this->bufferedSize;
+			memcpy(this->buffer + this->bufferedSize, input, loadSize);
+			input += loadSize;
+			this->ConsumeStripes(this->acc, this->nbStripesSoFar, this->buffer, INTERNAL_BUFFER_SIZE / STRIPE_LEN);
+			this->bufferedSize = 0;
+		}
+
+		// everything but the last (partial or not) stripe
+		if (static_cast<size_t>(end - input) > INTERNAL_BUFFER_SIZE)
+		{
+			size_t nbStripes = (static_cast<size_t>(end - input) - 1) / STRIPE_LEN;
+			input = this->ConsumeStripes(this->acc, this->nbStripesSoFar, input, nbStripes);
+
+			// keep the last stripe, in case what comes next is too short to make up a whole one
+			memcpy(this->buffer + INTERNAL_BUFFER_SIZE - STRIPE_LEN, input - STRIPE_LEN, STRIPE_LEN);
+		}
+
+		memcpy(this->buffer, input, end - input);
+		this->bufferedSize = static_cast<size_t>(end - input);
+		return true;
+	}
+
+	bool Final(Md5Hash &hash) override
+	{
+		Hash128 h128;
+
+		if (this->totalLen > 240)
+		{
+			alignas(32) uint64_t finalAcc[ACC_NB];
+			memcpy(finalAcc, this->acc, sizeof(finalAcc));
+
+			uint8_t lastStripe[STRIPE_LEN];
+			const uint8_t *plastStripe;
+
+			if (this->bufferedSize >= STRIPE_LEN)
+			{
+				size_t nbStripes = (this->bufferedSize - 1) / STRIPE_LEN;
+				size_t nbStripesSoFar = this->nbStripesSoFar;
+				this->ConsumeStripes(finalAcc, nbStripesSoFar, this->buffer, nbStripes);
+				plastStripe = this->buffer + this->bufferedSize - STRIPE_LEN;
+			}
+			else
+			{
+				// the last stripe is partly from the one before
+				size_t catchupSize = STRIPE_LEN - this->bufferedSize;
+				memcpy(lastStripe, this->buffer + INTERNAL_BUFFER_SIZE - catchupSize, catchupSize);
+				memcpy(lastStripe + catchupSize, this->buffer, this->bufferedSize);
+				plastStripe = lastStripe;
+			}
+
+			this->accumulate(finalAcc, plastStripe, kSecret + SECRET_SIZE - STRIPE_LEN - SECRET_LASTACC_START, 1);
+
+			h128.low64 = MergeAccs(finalAcc, kSecret + SECRET_MERGEACCS_START, this->totalLen * PRIME64_1);
+			h128.high64 = MergeAccs(finalAcc, kSecret + SECRET_SIZE - sizeof(finalAcc) - SECRET_MERGEACCS_START, ~(this->totalLen * PRIME64_2));
+		}
+		else if (this->totalLen > 128)
+		{
+			h128 = HashLen129to240(this->buffer, static_cast<size_t>(this->totalLen), kSecret);
+		}
+		else if (this->totalLen > 16)
+		{
+			h128 = HashLen17to128(this->buffer, static_cast<size_t>(this->totalLen), kSecret);
+		}
+		else
+		{
+			h128 = HashLen0to16(this->buffer, static_cast<size_t>(this->totalLen), kSecret);
+		}
+
+		// the canonical form is big-endian, high half first
+		uint64_t canonical[2] = { Swap64(h128.high64), Swap64(h128.low64) };
+		memcpy(hash._data, canonical, sizeof(hash._data));
+
+		return true;
+	}
+
+private:
+	typedef void (*AccumulateFunction)(uint64_t *acc, const uint8_t *input, const uint8_t *secret, size_t nbStripes);
+	typedef void (*ScrambleFunction)(uint64_t *acc, const uint8_t *secret);
+
+	// run stripes through the accumulators, scrambling them at the end of each block
+	const uint8_t *ConsumeStripes(uint64_t *pacc, size_t &nbStripesSoFarInBlock, const uint8_t *input, size_t nbStripes)
+	{
+		while (nbStripes >= STRIPES_PER_BLOCK - nbStripesSoFarInBlock)
+		{
+			size_t stripesThisBlock = STRIPES_PER_BLOCK - nbStripesSoFarInBlock;
+			this->accumulate(pacc, input, kSecret + nbStripesSoFarInBlock * SECRET_CONSUME_RATE, stripesThisBlock);
+			this->scramble(pacc, kSecret + SECRET_SIZE - STRIPE_LEN);
+			input += stripesThisBlock * STRIPE_LEN;
+			nbStripes -= stripesThisBlock;
+			nbStripesSoFarInBlock = 0;
+		}
+
+		if (nbStripes > 0)
+		{
+			this->accumulate(pacc, input, kSecret + nbStripesSoFarInBlock * SECRET_CONSUME_RATE, nbStripes);
+			input += nbStripes * STRIPE_LEN;
+			nbStripesSoFarInBlock += nbStripes;
+		}
+
+		return input;
+	}
+
+	alignas(32) uint64_t	acc[ACC_NB];
+	uint8_t					buffer[INTERNAL_BUFFER_SIZE];
+	size_t					bufferedSize = 0;
+	size_t					nbStripesSoFar = 0;
+	unsigned long long		totalLen = 0;
+
+	AccumulateFunction		accumulate;
+	ScrambleFunction		scramble;
+};
+
+//=====================================================================================================================================================================================================
+//=====================================================================================================================================================================================================
+std::unique_ptr<DigestEngine> CreateXxh3DigestEngine()
+{
+	return std::make_unique<Xxh3DigestEngine>();
+}
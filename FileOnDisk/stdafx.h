@@ -16,9 +16,14 @@
 #include <algorithm>
 #include <array>
 #include <assert.h>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <iomanip>
+#include <list>
+#include <memory>
 #include <mutex>
 #include <regex>
 #include <set>
@@ -2,6 +2,12 @@
 
 #include <utilities.h>
 #include <FileOnDisk.h>
+#include <Md5CacheRegistry.h>
+#include <HashCacheStore.h>
+#include <Digest.h>
+#include <FileHasher.h>
+#include <BatchHasher.h>
+#include <DeviceScheduler.h>
 #include <HardLink.h>
 #include <console.h>
 #include <ConsoleIcon.h>
@@ -32,8 +38,11 @@ struct CommandLineOptions
 	char szInFolder[maxPathLength];
 	char szSyncFolderLeft[maxPathLength];
 	char szSyncFolderRght[maxPathLength];
+	char szSnapshotFile[maxPathLength];
+	char szIndexFile[maxPathLength];
 
 	int maxNumThreads;
+	int maxNumScanThreads;
 
 	// options
 	bool trim = false;
@@ -48,6 +57,13 @@ struct CommandLineOptions
 	bool syncFolders = false;
 	bool sortOnSize = false;
 	bool sortInReverse = false;
+	bool snapshot = false;
+	bool useIndex = false;
+	bool importIndex = false;
+	bool exportIndex = false;
+	bool benchmarkDigests = false;
+	bool compareOnly = false;
+	bool sortOnLayout = false;
 };
 
 
@@ -187,6 +203,150 @@ bool GetCommandLineOptions(int argc, wchar_t* argv[], CommandLineOptions &comman
 				uint32_t maxNumThreads = _wtoi(argv[i]);
 				commandLineOptions.maxNumThreads = maxNumThreads;
 			}
+			else if (L'p' == argv[i][1])
+			{
+				if (argc < i + 1)
+				{
+					Logger::Get().printf(Logger::Level::Error, "Error: missing arg\n");
+					return false;
+				}
+
+				++i;
+
+				commandLineOptions.maxNumScanThreads = _wtoi(argv[i]);
+			}
+			else if (L'm' == argv[i][1])
+			{
+				if (argc < i + 1)
+				{
+					Logger::Get().printf(Logger::Level::Error, "Error: missing arg\n");
+					return false;
+				}
+
+				++i;
+
+				//
+				// convert the snapshot file from Unicode to UTF-8
+				//
+				std::string sSnapshotFile = UnicodeToUtf8(argv[i]);
+				strcpy_s(commandLineOptions.szSnapshotFile, sSnapshotFile.c_str());
+				commandLineOptions.snapshot = true;
+			}
+			else if (L'd' == argv[i][1])
+			{
+				if (argc < i + 1)
+				{
+					Logger::Get().printf(Logger::Level::Error, "Error: missing arg\n");
+					return false;
+				}
+
+				++i;
+
+				//
+				// convert the index file from Unicode to UTF-8
+				//
+				std::string sIndexFile = UnicodeToUtf8(argv[i]);
+				strcpy_s(commandLineOptions.szIndexFile, sIndexFile.c_str());
+
+				if (!RelativeToFullpath(commandLineOptions.szIndexFile, ARRAYSIZE(commandLineOptions.szIndexFile)))
+				{
+					Logger::Get().printf(Logger::Level::Error, "Error: could not resolve \"%s\"\n", commandLineOptions.szIndexFile);
+					return false;
+				}
+
+				commandLineOptions.useIndex = true;
+			}
+			else if (L'g' == argv[i][1])
+			{
+				if (argc < i + 1)
+				{
+					Logger::Get().printf(Logger::Level::Error, "Error: missing arg\n");
+					return false;
+				}
+
+				++i;
+
+				std::string sAlgorithm = UnicodeToUtf8(argv[i]);
+				DigestAlgorithm algorithm;
+
+				if (!DigestEngine::ParseAlgorithmName(sAlgorithm.c_str(), algorithm))
+				{
+					Logger::Get().printf(Logger::Level::Error, "Error: unknown hash algorithm \"%s\"\n", sAlgorithm.c_str());
+					return false;
+				}
+
+				DigestEngine::SetAlgorithm(algorithm);
+			}
+			else if (L'G' == argv[i][1])
+			{
+				commandLineOptions.benchmarkDigests = true;
+			}
+			else if (L'b' == argv[i][1])
+			{
+				commandLineOptions.compareOnly = true;
+			}
+			else if (L'k' == argv[i][1])
+			{
+				if (argc < i + 3)
+				{
+					Logger::Get().printf(Logger::Level::Error, "Error: missing arg\n");
+					return false;
+				}
+
+				++i;
+				FileHasher::SetBlockSize(static_cast<size_t>(_wtoi(argv[i])) * 1024);
+
+				++i;
+				FileHasher::SetQueueDepth(static_cast<size_t>(_wtoi(argv[i])));
+			}
+			else if (L'D' == argv[i][1])
+			{
+				if (argc < i + 3)
+				{
+					Logger::Get().printf(Logger::Level::Error, "Error: missing arg\n");
+					return false;
+				}
+
+				++i;
+				std::string sPath = UnicodeToUtf8(argv[i]);
+
+				++i;
+				if (!DeviceScheduler::Get().SetLimit(sPath.c_str(), static_cast<uint32_t>(_wtoi(argv[i]))))
+				{
+					Logger::Get().printf(Logger::Level::Error, "Error: could not find the volume for \"%s\"\n", sPath.c_str());
+					return false;
+				}
+			}
+			else if (L'j' == argv[i][1])
+			{
+				if (argc < i + 1)
+				{
+					Logger::Get().printf(Logger::Level::Error, "Error: missing arg\n");
+					return false;
+				}
+
+				++i;
+				DigestEngine::SetTreeThreshold(static_cast<long long>(_wtoi(argv[i])) * 1024 * 1024);
+			}
+			else if (L'o' == argv[i][1])
+			{
+				if (argc < i + 1)
+				{
+					Logger::Get().printf(Logger::Level::Error, "Error: missing arg\n");
+					return false;
+				}
+
+				++i;
+				BatchHasher::SetFilesInFlight(static_cast<size_t>(_wtoi(argv[i])));
+			}
+			else if (L'x' == argv[i][1])
+			{
+				commandLineOptions.importIndex = true;
+			}
+			else if (L'X' == argv[i][1])
+			{
+				commandLineOptions.exportIndex = true;
+			}
 			else if (L'n' == argv[i][1])
 			{
 				commandLineOptions.logo = false;
@@ -216,10 +376,17 @@ bool GetCommandLineOptions(int argc, wchar_t* argv[], CommandLineOptions &comman
 			else if (L't' == argv[i][1])
 			{
 				commandLineOptions.sortOnSize = true;
+				commandLineOptions.sortOnLayout = false;
 			}
 			else if (L'T' == argv[i][1])
 			{
 				commandLineOptions.sortOnSize = false;
+				commandLineOptions.sortOnLayout = false;
+			}
+			else if (L'l' == argv[i][1])
+			{
+				commandLineOptions.sortOnSize = false;
+				commandLineOptions.sortOnLayout = true;
 			}
 			else if (L'r' == argv[i][1])
 			{
@@ -270,6 +437,12 @@ bool GetCommandLineOptions(int argc, wchar_t* argv[], CommandLineOptions &comman
 		}
 	}
 
+	if ((commandLineOptions.importIndex || commandLineOptions.exportIndex) && !commandLineOptions.useIndex)
+	{
+		Logger::Get().printf(Logger::Level::Error, "Error: /x and /X need a hash index file (/d).\n");
+		return false;
+	}
+
 	if (commandLineOptions.infile)
 	{
 		if (!RelativeToFullpath(commandLineOptions.szInFolder, maxPathLength))
@@ -285,10 +458,10 @@ bool GetCommandLineOptions(int argc, wchar_t* argv[], CommandLineOptions &comman
 
 //=====================================================================================================================================================================================================
 //=====================================================================================================================================================================================================
-void GenerateHashForAllFiles(const char *szRootFolder, bool verbose, bool sortOnSize, bool sortInReverse)
+void GenerateHashForAllFiles(const char *szRootFolder, bool verbose, bool sortOnSize, bool sortInReverse, int maxNumScanThreads=1, const char *szSnapshotFile=nullptr, bool sortOnLayout=false)
 {
 	const size_t itemsSizeReserve = 500000;
-	const size_t avgStringSizeToReserve = 128;
+	const size_t avgStringSizeToReserve = 48;		// just the name (the folders are kept once each)
 
 	// create the files list
 	FileOnDiskSet files;
@@ -298,7 +471,7 @@ void GenerateHashForAllFiles(const char *szRootFolder, bool verbose, bool sortOn
 
 	{
 		TimeThis t("Read the directory structure");
-		files.QueryFileSystem(szRootFolder);
+		files.QueryFileSystem(szRootFolder, false, maxNumScanThreads, szSnapshotFile);
 		files.CheckStrings();
 		Logger::Get().printf(Logger::Level::Debug, "There are %s files in the directory structure.\n", comma(files.Items.size()));
 	}
@@ -310,6 +483,7 @@ void GenerateHashForAllFiles(const char *szRootFolder, bool verbose, bool sortOn
 		SetFindDupesFlags(flags, FindDupesFlags::Verbose, verbose);
 		SetFindDupesFlags(flags, FindDupesFlags::SortOnSize, sortOnSize);
 		SetFindDupesFlags(flags, FindDupesFlags::SortInReverse, sortInReverse);
+		SetFindDupesFlags(flags, FindDupesFlags::SortOnLayout, sortOnLayout);
 		files.UpdateHashedFiles(flags);
 	}
 }
@@ -317,10 +491,10 @@ void GenerateHashForAllFiles(const char *szRootFolder, bool verbose, bool sortOn
 
 //=====================================================================================================================================================================================================
 //=====================================================================================================================================================================================================
-void SyncFolders(const char *szSyncFolderLeft, const char *szSyncFolderRght, bool verbose)
+void SyncFolders(const char *szSyncFolderLeft, const char *szSyncFolderRght, bool verbose, int maxNumScanThreads=1)
 {
 	const size_t itemsSizeReserve = 500000;
-	const size_t avgStringSizeToReserve = 128;
+	const size_t avgStringSizeToReserve = 48;		// just the name (the folders are kept once each)
 
 	// create the files list
 	FileOnDiskSet left;
@@ -335,7 +509,7 @@ void SyncFolders(const char *szSyncFolderLeft, const char *szSyncFolderRght, boo
 	{
 		TimeThis t("Read the first directory structure");
 		verboseprintf("Reading the first directory structure...\n");
-		left.QueryFileSystem(szSyncFolderLeft, true);
+		left.QueryFileSystem(szSyncFolderLeft, true, maxNumScanThreads);
 		left.CheckStrings();
 		Logger::Get().printf(Logger::Level::Debug, "There are %s files in the directory structure.\n", comma(left.Items.size()));
 	}
@@ -343,7 +517,7 @@ void SyncFolders(const char *szSyncFolderLeft, const char *szSyncFolderRght, boo
 	{
 		TimeThis t("Read the second directory structure");
 		verboseprintf("Reading the second directory structure...\n");
-		rght.QueryFileSystem(szSyncFolderRght, true);
+		rght.QueryFileSystem(szSyncFolderRght, true, maxNumScanThreads);
 		rght.CheckStrings();
 		Logger::Get().printf(Logger::Level::Debug, "There are %s files in the directory structure.\n", comma(rght.Items.size()));
 	}
@@ -351,13 +525,15 @@ void SyncFolders(const char *szSyncFolderLeft, const char *szSyncFolderRght, boo
 	std::unordered_map<Path, FileOnDisk *> umap;
 	umap.reserve(left.Items.size());
 
+	// the sub-paths are put together on the fly, so keep them here for the map's keys to point at
+	std::vector<std::string> leftSubPaths;
+	leftSubPaths.reserve(left.Items.size());
+
 	for (auto &item : left.Items)
 	{
-		auto lname = left.GetFileName(item);
-		auto lpath = left.GetFilePath(item);
-		auto lsubp = left.GetSubPathName(item);
+		leftSubPaths.push_back(left.GetSubPathName(item));
 
-		auto subpathname = lsubp;
+		auto subpathname = leftSubPaths.back().c_str();
 		umap[subpathname] = &item;
 	}
 
@@ -385,7 +561,7 @@ void SyncFolders(const char *szSyncFolderLeft, const char *szSyncFolderRght, boo
 		auto rsubp = rght.GetSubPathName(item);
 
 		//if (0 == strcmp(rsubp, R"(Software\TurboTax\2013\TurboTax 2013\Runtime\license.rtf)"))
-		if (0 == strcmp(rsubp, R"(Runtime\license.rtf)"))
+		if (0 == strcmp(rsubp.c_str(), R"(Runtime\license.rtf)"))
 		{
 			__nop();
 		}
@@ -394,7 +570,7 @@ void SyncFolders(const char *szSyncFolderLeft, const char *szSyncFolderRght, boo
 			__nop();
 		}
 
-		auto subpathname = rsubp;
+		auto subpathname = rsubp.c_str();
 		auto leftitemref = umap.find(subpathname);
 		if (leftitemref != umap.end())
 		{
@@ -417,17 +593,17 @@ void SyncFolders(const char *szSyncFolderLeft, const char *szSyncFolderRght, boo
 //#define VALIDATE_TIMESTAMPS
 #endif
 #ifdef VALIDATE_TIMESTAMPS
-				auto lefttime_actual = FileTimeToUInt64(GetFileTimeStamp(lpath));
-				auto rghttime_actual = FileTimeToUInt64(GetFileTimeStamp(rpath));
+				auto lefttime_actual = FileTimeToUInt64(GetFileTimeStamp(lpath.c_str()));
+				auto rghttime_actual = FileTimeToUInt64(GetFileTimeStamp(rpath.c_str()));
 
 				if (lefttime_cached != lefttime_actual)
 				{
-					Logger::Get().printf(Logger::Level::Error, "Timestamp mismatch between cache file and actual file: \"%s\".\n", lpath);
+					Logger::Get().printf(Logger::Level::Error, "Timestamp mismatch between cache file and actual file: \"%s\".\n", lpath.c_str());
 				}
 
 				if (rghttime_cached != rghttime_actual)
 				{
-					Logger::Get().printf(Logger::Level::Error, "Timestamp mismatch between cache file and actual file: \"%s\".\n", rpath);
+					Logger::Get().printf(Logger::Level::Error, "Timestamp mismatch between cache file and actual file: \"%s\".\n", rpath.c_str());
 				}
 #endif
 
@@ -475,7 +651,7 @@ void SyncFolders(const char *szSyncFolderLeft, const char *szSyncFolderRght, boo
 						}
 						else
 						{
-							Logger::Get().printf(Logger::Level::Info, "Copying hash from:\n    \"%s\" to\n    \"%s\"\n", lpath, rpath);
+							Logger::Get().printf(Logger::Level::Info, "Copying hash from:\n    \"%s\" to\n    \"%s\"\n", lpath.c_str(), rpath.c_str());
 
 							item.Hash = leftitem.Hash;
 							item.Hashed = true;
@@ -497,7 +673,7 @@ void SyncFolders(const char *szSyncFolderLeft, const char *szSyncFolderRght, boo
 						}
 						else
 						{
-							Logger::Get().printf(Logger::Level::Info, "Copying hash from:\n    \"%s\" to\n    \"%s\"\n", rpath, lpath);
+							Logger::Get().printf(Logger::Level::Info, "Copying hash from:\n    \"%s\" to\n    \"%s\"\n", rpath.c_str(), lpath.c_str());
 
 							leftitem.Hash = item.Hash;
 							leftitem.Hashed = true;
@@ -534,7 +710,7 @@ void SyncFolders(const char *szSyncFolderLeft, const char *szSyncFolderRght, boo
 
 //=====================================================================================================================================================================================================
 //=====================================================================================================================================================================================================
-bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *szDupesPs1File, const wchar_t *szDupesCmdFile, bool includeDeleteScript, bool infile, bool verbose, bool sortOnSize, bool sortInReverse, int maxNumThreads=1)
+bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *szDupesPs1File, const wchar_t *szDupesCmdFile, bool includeDeleteScript, bool infile, bool verbose, bool sortOnSize, bool sortInReverse, int maxNumThreads=1, int maxNumScanThreads=1, const char *szSnapshotFile=nullptr, bool compareOnly=false, bool sortOnLayout=false)
 {
 	// convert the infile to the full path name
 	if (infile)
@@ -569,7 +745,7 @@ bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *
 	}
 
 	const size_t itemsSizeReserve = 500000;
-	const size_t avgStringSizeToReserve = 128;
+	const size_t avgStringSizeToReserve = 48;		// just the name (the folders are kept once each)
 
 	// create the files list
 	FileOnDiskSet files;
@@ -584,7 +760,7 @@ bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *
 		TimeThis t("Read the directory structure");
 		verboseprintf("Reading the directory structure...\n");
 		if (ControlCHandler::TestShouldTerminate()) { return false; }
-		files.QueryFileSystem(szRootFolder);
+		files.QueryFileSystem(szRootFolder, false, maxNumScanThreads, szSnapshotFile);
 		files.CheckStrings();
 		Logger::Get().printf(Logger::Level::Debug, "There are %s files in the directory structure.\n", comma(files.Items.size()));
 	}
@@ -615,7 +791,7 @@ bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *
 		{
 			TimeThis t("Read the \"in\" directory structure");
 			verboseprintf("Reading the directory structure of the \"in\" folder...\n");
-			infiles.QueryFileSystem(szInFolder);
+			infiles.QueryFileSystem(szInFolder, false, maxNumScanThreads);
 			Logger::Get().printf(Logger::Level::Debug, "There are %s files in the \"in\" directory structure.\n", comma(infiles.Items.size()));
 		}
 
@@ -654,6 +830,8 @@ bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *
 				SetFindDupesFlags(flags, FindDupesFlags::Verbose, verbose);
 				SetFindDupesFlags(flags, FindDupesFlags::SortOnSize, sortOnSize);
 				SetFindDupesFlags(flags, FindDupesFlags::SortInReverse, sortInReverse);
+				SetFindDupesFlags(flags, FindDupesFlags::CompareOnly, compareOnly);
+				SetFindDupesFlags(flags, FindDupesFlags::SortOnLayout, sortOnLayout);
 				SetMaxNumThreads(flags, maxNumThreads);
 
 				allFiles.UpdateHashedFiles(flags);
@@ -676,6 +854,7 @@ bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *
 				TimeThis t("Clean up uber set.");
 				verboseprintf("Cleaning up uber set...\n");
 				allFiles.Items.clear();
+				allFiles.Folders.clear();
 				allFiles.Strings.clear();
 			}
 		}
@@ -697,15 +876,7 @@ bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *
 		if (ControlCHandler::TestShouldTerminate()) { return false; }
 
 		// sort the "infiles" on size
-		std::sort(infiles.Items.begin(), infiles.Items.end(), [&](FileOnDisk const &left, FileOnDisk const &right)
-		{
-			if (left.Size == right.Size)
-			{
-				return (_stricmp(infiles.GetFilePath(left), infiles.GetFilePath(right)) < 0);
-			}
-
-			return left.Size > right.Size;
-		});
+		infiles.SortOnSizeAndPath();
 
 		if (ControlCHandler::TestShouldTerminate()) { return false; }
 
@@ -723,7 +894,7 @@ bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *
 				for (auto &index : indices)
 				{
 					const FileOnDisk &file = files.Items[index];
-					if (infile.Hash == file.Hash)
+					if (!infile.Distinct && !file.Distinct && (infile.Hash == file.Hash))
 					{
 						hashMatch = true;
 					}
@@ -733,12 +904,12 @@ bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *
 				{
 					if (includeDeleteScript)
 					{
-						Logger::Get().printf(Logger::Level::CmdScript, "del /F /A \"%s\"\n", infiles.GetFilePath(infile));
-						Logger::Get().printf(Logger::Level::Ps1Script, "\t'%s'\n", EscapePowerShellString(infiles.GetFilePath(infile)).c_str());
+						Logger::Get().printf(Logger::Level::CmdScript, "del /F /A \"%s\"\n", infiles.GetFilePath(infile).c_str());
+						Logger::Get().printf(Logger::Level::Ps1Script, "\t'%s'\n", EscapePowerShellString(infiles.GetFilePath(infile).c_str()).c_str());
 					}
 
 					Logger::Get().printf(Logger::Level::Dupes, "====================================================================================================\n");
-					Logger::Get().printf(Logger::Level::Dupes, "        %20s %s \"%s\"\n", comma(infile.Size), infile.HashToString(), infiles.GetFilePath(infile));
+					Logger::Get().printf(Logger::Level::Dupes, "        %20s %s \"%s\"\n", comma(infile.Size), infile.HashToString(), infiles.GetFilePath(infile).c_str());
 
 					++duplicateFiles;
 					duplicateBytes += infile.Size;
@@ -747,9 +918,9 @@ bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *
 					{
 						const FileOnDisk &file = files.Items[index];
 
-						if (infile.Hash == file.Hash)
+						if (!file.Distinct && (infile.Hash == file.Hash))
 						{
-							Logger::Get().printf(Logger::Level::Dupes, "        %20s %s \"%s\"\n", comma(file.Size), file.HashToString(), files.GetFilePath(file));
+							Logger::Get().printf(Logger::Level::Dupes, "        %20s %s \"%s\"\n", comma(file.Size), file.HashToString(), files.GetFilePath(file).c_str());
 						}
 					}
 				}
@@ -778,6 +949,8 @@ bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *
 			SetFindDupesFlags(flags, FindDupesFlags::Verbose, verbose);
 			SetFindDupesFlags(flags, FindDupesFlags::SortOnSize, sortOnSize);
 			SetFindDupesFlags(flags, FindDupesFlags::SortInReverse, sortInReverse);
+			SetFindDupesFlags(flags, FindDupesFlags::CompareOnly, compareOnly);
+			SetFindDupesFlags(flags, FindDupesFlags::SortOnLayout, sortOnLayout);
 
 			files.UpdateHashedFiles(flags);
 		}
@@ -788,24 +961,26 @@ bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *
 		{
 			TimeThis t("To find dupes");
 
-			// go through each item. we cannot do a "for each" here, since we may skip some
+			// the grouping only looks at the sizes, hashes and paths, which come from the set's columns (the sort
+			// put it into columns), until it has a group to show
 			if (!files.Items.empty())
 			{
+				// go through each item. we cannot do a "for each" here, since we may skip some
 				for (size_t i = 0; i<files.Items.size() - 1;)
 				{
 					if (ControlCHandler::TestShouldTerminate()) { return false; }
 
-					FileOnDisk &file = files.Items[i];
+					long long size = files.GetSize(i);
 
 					// quit when we reach zero-byte sized files
-					if (file.Size == 0)
+					if (size == 0)
 					{
 						break;
 					}
 
 					// now, loop through every file that is the same size
 					size_t j = i + 1;
-					while (j<files.Items.size() && (files.Items[j].Size == file.Size))
+					while (j<files.Items.size() && (files.GetSize(j) == size))
 					{
 						++j;
 					}
@@ -817,97 +992,114 @@ bool FindDupes(const char *szRootFolder, const char *szInFolder, const wchar_t *
 						continue;
 					}
 
-					// now each file from i..j-1 are all the same size
-					auto PathCompare = [&](const FileOnDisk&left, const FileOnDisk&right)->bool
-					{
-						return (0 > _stricmp(files.GetFilePath(left), files.GetFilePath(right)));
-					};
-
-					std::set<FileOnDisk, std::function<bool(const FileOnDisk&left, const FileOnDisk&right)> > same(PathCompare);
-					std::set<FileOnDisk, std::function<bool(const FileOnDisk&left, const FileOnDisk&right)> > diff(PathCompare);
+					// now each file from i..j-1 are all the same size. Sort them on hash (and path), so the files with the same
+					// hash are next to each other (the ones whose heads or tails were different from every other file only match
+					// themselves, since they may not have a hash at all, so they're left out)
+					std::vector<size_t> span;
+					span.reserve(j - i);
 
-					// leave the "same" set empty, but put everything in the "diff" set to start with
 					for (size_t i0 = i; i0 < j; ++i0)
 					{
-						diff.insert(files.Items[i0]);
+						if (!files.IsDistinct(i0))
+						{
+							span.push_back(i0);
+						}
 					}
 
-					// now, loop until the "diff" set is empty
-					do
+					std::sort(span.begin(), span.end(), [&](size_t left, size_t right)
 					{
-						if (ControlCHandler::TestShouldTerminate()) { return false; }
+						int order = memcmp(files.GetHash(left)._data, files.GetHash(right)._data, sizeof(files.GetHash(left)._data));
+						if (0 != order)
+						{
+							return order < 0;
+						}
+
+						return (0 > files.ComparePaths(left, right));
+					});
 
-						// get the hash of the first file in the set, which is the item we're going to compare with
-						auto &compareitem = *diff.begin();
+					// the runs of files that have the same hash (with more than one file in them), shown in the order of their
+					// first paths, like they always have been
+					std::vector<std::pair<size_t, size_t>> groups;
 
-						// put all the files in "diff" that match the hash into the "same" bucket
-						for (auto &file : diff)
+					for (size_t s0 = 0; s0 < span.size();)
+					{
+						size_t s1 = s0 + 1;
+						while ((s1 < span.size()) && (files.GetHash(span[s1]) == files.GetHash(span[s0])))
 						{
-							if (compareitem.Hash == file.Hash)
-							{
-								same.insert(file);
-							}
+							++s1;
 						}
 
-						// remove the items that are in the "same" bucket from the "diff" bucket
-						for (auto &file : same)
+						if (s1 - s0 > 1)
 						{
-							diff.erase(file);
+							groups.push_back(std::make_pair(s0, s1));
 						}
 
-						// we will always have the "compareitem", but do we have more than just that one?
-						if (same.size()>1)
-						{
-							duplicateFiles += same.size() - 1;
-							duplicateBytes += (same.size() - 1) * (same.begin()->Size);
+						s0 = s1;
+					}
 
-							long hardLinkChar = static_cast<long>('a');
-							std::unordered_map<unsigned long long, long> hardLinkMap;
+					std::sort(groups.begin(), groups.end(), [&](const std::pair<size_t, size_t> &left, const std::pair<size_t, size_t> &right)
+					{
+						return (0 > files.ComparePaths(span[left.first], span[right.first]));
+					});
 
-							for (auto &file : same)
-							{
-								auto filePath = files.GetFilePath(file);
-								file.nNumberOfLinks = GetHardLinkCount(filePath, &file.nFileIndex);
+					for (auto &group : groups)
+					{
+						if (ControlCHandler::TestShouldTerminate()) { return false; }
 
-								if (hardLinkMap.find(file.nFileIndex) == hardLinkMap.end())
-								{
-									hardLinkMap[file.nFileIndex] = hardLinkChar;
-									++hardLinkChar;
-								}
-							}
+						const FileOnDisk &first = files.Items[span[group.first]];
+						size_t numSame = group.second - group.first;
 
-							Logger::Get().printf(Logger::Level::Dupes, "    ================================================================================================\n");
-							Logger::Get().printf(Logger::Level::Json, "\t{\n");
+						duplicateFiles += numSame - 1;
+						duplicateBytes += (numSame - 1) * (first.Size);
 
-							if (true)
-							{
-								auto &file = *same.begin();
+						long hardLinkChar = static_cast<long>('a');
+						std::unordered_map<unsigned long long, long> hardLinkMap;
 
-								Logger::Get().printf(Logger::Level::Json, "\t\tSize: \"%s\",\n", comma(file.Size));
-								Logger::Get().printf(Logger::Level::Json, "\t\tHash: \"%s\",\n", file.HashToString());
-								Logger::Get().printf(Logger::Level::Json, "\t\tFiles: [\n");
-							}
+						for (size_t s = group.first; s < group.second; ++s)
+						{
+							const FileOnDisk &file = files.Items[span[s]];
 
-							for (auto &file : same)
+							// the scan found out which file each one is, unless it couldn't
+							if (0 == file.nNumberOfLinks)
 							{
 								auto filePath = files.GetFilePath(file);
-								long hardLinkCharLong = hardLinkMap[file.nFileIndex];
-								char hardLinkChar = hardLinkCharLong <= static_cast<long>('z') ? static_cast<char>(hardLinkCharLong) : '*';
-								Logger::Get().printf(Logger::Level::Dupes, "        %20s %s (%d,%c) \"%s\"\n", comma(file.Size), file.HashToString(), file.nNumberOfLinks, hardLinkChar, filePath);
-
-								Logger::Get().printf(Logger::Level::Json, "\t\t\t{\n");
-								Logger::Get().printf(Logger::Level::Json, "\t\t\t\tHardLink: \"%c\",\n", hardLinkChar);
-								Logger::Get().printf(Logger::Level::Json, "\t\t\t\tPath: \"%s\",\n", EscapeJsonString(filePath));
-								Logger::Get().printf(Logger::Level::Json, "\t\t\t},\n");
+								file.nNumberOfLinks = GetHardLinkCount(filePath.c_str(), &file.nFileIndex);
+							}
+
+							if (hardLinkMap.find(file.nFileIndex) == hardLinkMap.end())
+							{
+								hardLinkMap[file.nFileIndex] = hardLinkChar;
+								++hardLinkChar;
 							}
+						}
+
+						Logger::Get().printf(Logger::Level::Dupes, "    ================================================================================================\n");
+						Logger::Get().printf(Logger::Level::Json, "\t{\n");
 
-							Logger::Get().printf(Logger::Level::Json, "\t\t]\n");
-							Logger::Get().printf(Logger::Level::Json, "\t},\n");
+						if (true)
+						{
+							Logger::Get().printf(Logger::Level::Json, "\t\tSize: \"%s\",\n", comma(first.Size));
+							Logger::Get().printf(Logger::Level::Json, "\t\tHash: \"%s\",\n", first.HashToString());
+							Logger::Get().printf(Logger::Level::Json, "\t\tFiles: [\n");
 						}
 
-						same.clear();
+						for (size_t s = group.first; s < group.second; ++s)
+						{
+							const FileOnDisk &file = files.Items[span[s]];
+							auto filePath = files.GetFilePath(file);
+							long hardLinkCharLong = hardLinkMap[file.nFileIndex];
+							char hardLinkChar = hardLinkCharLong <= static_cast<long>('z') ? static_cast<char>(hardLinkCharLong) : '*';
+							Logger::Get().printf(Logger::Level::Dupes, "        %20s %s (%d,%c) \"%s\"\n", comma(file.Size), file.HashToString(), file.nNumberOfLinks, hardLinkChar, filePath.c_str());
+
+							Logger::Get().printf(Logger::Level::Json, "\t\t\t{\n");
+							Logger::Get().printf(Logger::Level::Json, "\t\t\t\tHardLink: \"%c\",\n", hardLinkChar);
+							Logger::Get().printf(Logger::Level::Json, "\t\t\t\tPath: \"%s\",\n", EscapeJsonString(filePath.c_str()));
+							Logger::Get().printf(Logger::Level::Json, "\t\t\t},\n");
+						}
 
-					} while (diff.size() > 0);
+						Logger::Get().printf(Logger::Level::Json, "\t\t]\n");
+						Logger::Get().printf(Logger::Level::Json, "\t},\n");
+					}
 
 
 					i = j;
@@ -986,7 +1178,35 @@ int _main(int argc, wchar_t* argv[])
 		return -1;
 	}
 
-	if (commandLineOptions.cleanCacheFiles)
+	// time the hash algorithms, and do nothing else
+	if (commandLineOptions.benchmarkDigests)
+	{
+		BenchmarkDigestAlgorithms();
+		return 0;
+	}
+
+	verboseprintf("Hashing with %s\n", DigestEngine::GetAlgorithmName(DigestEngine::GetAlgorithm()));
+
+	// keep the hashes in an index file instead of md5cache.md5 files
+	if (commandLineOptions.useIndex)
+	{
+		if (!HashCacheStore::OpenIndexFile(commandLineOptions.szIndexFile))
+		{
+			return -1;
+		}
+	}
+
+	if (commandLineOptions.importIndex)
+	{
+		verboseprintf("Importing md5cache.md5 files into \"%s\"...\n", commandLineOptions.szIndexFile);
+		ImportHashCacheFiles(commandLineOptions.szRootFolder);
+	}
+	else if (commandLineOptions.exportIndex)
+	{
+		verboseprintf("Exporting md5cache.md5 files from \"%s\"...\n", commandLineOptions.szIndexFile);
+		ExportHashCacheFiles(commandLineOptions.szRootFolder);
+	}
+	else if (commandLineOptions.cleanCacheFiles)
 	{
 		verboseprintf("Cleaning cache files...\n");
 		CleanCacheFiles(commandLineOptions.szRootFolder, commandLineOptions.cleanEmptyFolders);
@@ -994,18 +1214,21 @@ int _main(int argc, wchar_t* argv[])
 	else if (commandLineOptions.generateHashForAllFiles)
 	{
 		verboseprintf("Generating hash for ALL files...\n");
-		GenerateHashForAllFiles(commandLineOptions.szRootFolder, verbose, commandLineOptions.sortOnSize, commandLineOptions.sortInReverse);
+		GenerateHashForAllFiles(commandLineOptions.szRootFolder, verbose, commandLineOptions.sortOnSize, commandLineOptions.sortInReverse, commandLineOptions.maxNumScanThreads, commandLineOptions.snapshot ? commandLineOptions.szSnapshotFile : nullptr, commandLineOptions.sortOnLayout);
 	}
 	else if (commandLineOptions.syncFolders)
 	{
 		verboseprintf("Syncing folders \"%s\" and \"%s\".\n", commandLineOptions.szSyncFolderLeft, commandLineOptions.szSyncFolderRght);
-		SyncFolders(commandLineOptions.szSyncFolderLeft, commandLineOptions.szSyncFolderRght, verbose);
+		SyncFolders(commandLineOptions.szSyncFolderLeft, commandLineOptions.szSyncFolderRght, verbose, commandLineOptions.maxNumScanThreads);
 	}
 	else
 	{
-		FindDupes(commandLineOptions.szRootFolder, commandLineOptions.szInFolder, commandLineOptions.szDupesPs1File, commandLineOptions.szDupesCmdFile, commandLineOptions.includeDeleteScript, commandLineOptions.infile, commandLineOptions.verbose, commandLineOptions.sortOnSize, commandLineOptions.sortInReverse, commandLineOptions.maxNumThreads);
+		FindDupes(commandLineOptions.szRootFolder, commandLineOptions.szInFolder, commandLineOptions.szDupesPs1File, commandLineOptions.szDupesCmdFile, commandLineOptions.includeDeleteScript, commandLineOptions.infile, commandLineOptions.verbose, commandLineOptions.sortOnSize, commandLineOptions.sortInReverse, commandLineOptions.maxNumThreads, commandLineOptions.maxNumScanThreads, commandLineOptions.snapshot ? commandLineOptions.szSnapshotFile : nullptr, commandLineOptions.compareOnly, commandLineOptions.sortOnLayout);
 	}
 
+	// write out anything still pending in the index
+	HashCacheStore::CloseIndexFile();
+
 	printf("Log file: \"%S\"\n", commandLineOptions.szDupesLogFile);
 	printf("Json file: \"%S\"\n", commandLineOptions.szDupesJsnFile);
 	if (commandLineOptions.includeDeleteScript)
@@ -0,0 +1,34 @@
+#pragma once
+
+//=====================================================================================================================================================================================================
+// BatchHasher
+//
+// Hashes a whole list of files at once through one I/O completion port: up to GetFilesInFlight
+// files are open at a time, each with one read outstanding into its own buffer from a pool that's
+// allocated once, and a fixed number of workers hash whichever blocks come back and issue the
+// next read for that file (or open the next file). That keeps plenty of reads in flight with
+// only as many threads as there are cores to hash with, rather than a thread per folder.
+//
+// It's off (zero files in flight) unless asked for, and HashFiles returns false, without doing
+// anything, if it can't be used, in which case the files should be hashed the usual way.
+//=====================================================================================================================================================================================================
+class BatchHasher
+{
+public:
+	static constexpr size_t maxFilesInFlight = 1024;
+
+	struct Request
+	{
+		std::string	FileName;
+		Md5Hash		Hash;
+		bool		Hashed;
+	};
+
+	static void SetFilesInFlight(size_t filesInFlight);
+	static size_t GetFilesInFlight();
+
+	// hash each of the files (each one's Hashed says whether it worked), on numWorkers threads,
+	// with no more than filesInFlight of them (and GetFilesInFlight) open at once; bytesRead is
+	// added to as the blocks come in
+	static bool HashFiles(std::vector<Request> &requests, uint32_t numWorkers, size_t filesInFlight, std::atomic<long long> &bytesRead);
+};
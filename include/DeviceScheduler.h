@@ -0,0 +1,78 @@
+#pragma once
+
+//=====================================================================================================================================================================================================
+// DeviceScheduler
+//
+// Keeps track of which device (volume) each folder is on, and how many readers each one should
+// have at once: one for a spinning disk (more just makes it seek), more for an SSD or a network
+// share. The kind of device is worked out from whether the volume has a seek penalty, and the
+// limit for a volume can be set from the command line instead.
+//
+// Everything that reads from a device counts itself as one of its readers while it does, so that
+// the limit holds however the reads are split up.
+//
+// The devices are numbered in the order they're first seen. It also adds up how much was read
+// from each, and for how long, so the throughput of each can be shown at the end.
+//=====================================================================================================================================================================================================
+class DeviceScheduler
+{
+public:
+	enum class Kind
+	{
+		Unknown,
+		Rotational,
+		SolidState,
+		Network,
+	};
+
+	static DeviceScheduler &Get() { return thescheduler; }
+
+	// the device the path is on (each path's volume is only looked up once)
+	size_t GetDevice(const char *pszPath);
+
+	// how many readers the device should have at once
+	uint32_t GetLimit(size_t device);
+
+	// what kind of device it is
+	Kind GetKind(size_t device);
+
+	// set the limit for the volume the path is on (before it's first used)
+	bool SetLimit(const char *pszPath, uint32_t limit);
+
+	// count one more reader on the device, waiting for one to finish if it's at its limit
+	void AddReader(size_t device);
+
+	// the same, but only if it's under its limit (false if it isn't)
+	bool TryAddReader(size_t device);
+
+	void RemoveReader(size_t device);
+
+	// bytes read from the device, taking seconds of its time
+	void AddUsage(size_t device, long long bytes, double seconds);
+
+	// log what was read from each device, and how fast
+	void Report();
+
+private:
+	struct Device
+	{
+		std::string		root;
+		Kind			kind = Kind::Unknown;
+		uint32_t		limit = 1;
+		uint32_t		readers = 0;
+		long long		bytes = 0;
+		double			seconds = 0;
+	};
+
+	static std::string GetVolumeRoot(const char *pszPath);
+	static Kind DetectKind(const std::string &root);
+
+	std::mutex									mutex;
+	std::condition_variable						readerDone;
+	std::vector<Device>							devices;
+	std::unordered_map<std::string, size_t>		byRoot;
+	std::unordered_map<std::string, size_t>		byPath;
+	std::unordered_map<std::string, uint32_t>	overrides;
+
+	static DeviceScheduler						thescheduler;
+};
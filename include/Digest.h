@@ -0,0 +1,104 @@
+#pragma once
+
+//=====================================================================================================================================================================================================
+// DigestAlgorithm
+//
+// Which hash the file contents are digested with. Whichever one it is, the digest is kept in an
+// Md5Hash (i.e., 16 bytes), so the caches don't change shape; BLAKE3 is truncated to its first
+// 16 bytes, and XXH3-128 is stored in its canonical (big-endian) form.
+//
+// The values are stored in the cache files, so they must never change. MD5 is zero so that
+// files from before there was a choice read as MD5.
+//
+// The tree flavors cut the file into treeChunkSize chunks, hash each one with the plain
+// algorithm, and then hash the chunks' hashes (and the file's length) together, so that the
+// chunks of a big file can be hashed at the same time. They come out different from the plain
+// ones, even for a file that's just one chunk, which is why they're algorithms of their own.
+//=====================================================================================================================================================================================================
+enum class DigestAlgorithm : uint32_t
+{
+	Md5				= 0,
+	Blake3			= 1,
+	Xxh3			= 2,
+	Md5Tree			= 3,
+	Blake3Tree		= 4,
+	Xxh3Tree		= 5,
+
+	Count,
+};
+
+const long long treeChunkSize = 64*1024*1024;
+
+//=====================================================================================================================================================================================================
+// DigestEngine
+//
+// Hashes a stream of bytes with one particular algorithm. One can be Reset and used again for
+// the next file, rather than making a new one each time.
+//=====================================================================================================================================================================================================
+class DigestEngine
+{
+public:
+	virtual ~DigestEngine() = default;
+
+	virtual bool Update(const void *pData, size_t size) = 0;
+	virtual bool Final(Md5Hash &hash) = 0;
+
+	// start over, as if it had just been created
+	virtual bool Reset() = 0;
+
+	// nullptr if the algorithm isn't available
+	static std::unique_ptr<DigestEngine> Create(DigestAlgorithm algorithm);
+
+	// the algorithm used for all new hashes (and the only one accepted from the caches)
+	static DigestAlgorithm GetAlgorithm();
+	static void SetAlgorithm(DigestAlgorithm algorithm);
+
+	static const char *GetAlgorithmName(DigestAlgorithm algorithm);
+	static bool ParseAlgorithmName(const char *pszName, DigestAlgorithm &algorithm);
+
+	// for the tree flavors: the plain algorithm the chunks are hashed with (the algorithm itself
+	// if it isn't a tree), and how the chunks' hashes make the file's hash
+	static bool IsTree(DigestAlgorithm algorithm);
+	static DigestAlgorithm GetChunkAlgorithm(DigestAlgorithm algorithm);
+	static bool CombineChunks(DigestAlgorithm algorithm, const std::vector<Md5Hash> &chunks, unsigned long long size, Md5Hash &hash);
+
+	// files bigger than this have their chunks hashed in parallel (when it's a tree algorithm)
+	static long long GetTreeThreshold();
+	static void SetTreeThreshold(long long threshold);
+};
+
+extern std::unique_ptr<DigestEngine> CreateBlake3DigestEngine();
+extern std::unique_ptr<DigestEngine> CreateXxh3DigestEngine();
+
+//=====================================================================================================================================================================================================
+// Multi-buffer MD5
+//
+// MD5 over several messages at once, one per SIMD lane (see Md5Lanes.cpp). It's worth it for lots
+// of small files, which would otherwise each keep a core busy on their own; big files are left
+// to FileHasher.
+//=====================================================================================================================================================================================================
+const long long md5LaneMaxFileSize = 1024*1024;
+
+struct Md5LaneRequest
+{
+	std::string	FileName;
+	long long	Size;
+	Md5Hash		Hash;
+	bool		Hashed;
+};
+
+// how many messages are hashed side by side (8 with AVX2, otherwise 4)
+extern size_t Md5LaneCount();
+
+// hash each of the buffers
+extern void Md5HashBuffers(const unsigned char *const *ppData, const size_t *pSizes, size_t count, Md5Hash *pHashes);
+
+// hash each of the files (each one's Hashed says whether it worked), with numWorkers[queue]
+// threads reading each queue's files at once (e.g., a queue for each device)
+extern void Md5HashFilesInLanes(std::vector<std::vector<Md5LaneRequest>> &queues, const std::vector<uint32_t> &numWorkers);
+
+// can we use AVX2 (the CPU has it, and the OS saves the registers)?
+extern bool CpuHasAvx2();
+
+// hash an in-memory buffer with each algorithm, and print how fast each one went
+extern void BenchmarkDigestAlgorithms();
@@ -0,0 +1,63 @@
+#pragma once
+
+class ProgressBar;
+
+//=====================================================================================================================================================================================================
+// FileHasher
+//
+// Hashes whole files, keeping several reads in flight while the block before them is hashed, so
+// that the disk and the hashing overlap instead of taking turns. Each thread has its own (see
+// ForThisThread), which owns the ring of sector-aligned buffers and the digest engine, so nothing
+// is allocated, and no CryptoAPI context is acquired, per file.
+//=====================================================================================================================================================================================================
+class FileHasher
+{
+public:
+	static constexpr size_t defaultBlockSize	= 1024*1024;
+	static constexpr size_t defaultQueueDepth	= 4;
+	static constexpr size_t maxQueueDepth		= 64;
+
+	FileHasher() = default;
+	~FileHasher();
+
+	FileHasher(const FileHasher &) = delete;
+	FileHasher &operator=(const FileHasher &) = delete;
+
+	// the calling thread's hasher
+	static FileHasher &ForThisThread();
+
+	// how much each read asks for (rounded up to a whole number of pages), and how many reads are
+	// kept in flight at once; hashers pick up a change the next time they're used
+	static void SetBlockSize(size_t blockSize);
+	static void SetQueueDepth(size_t queueDepth);
+	static size_t GetBlockSize();
+	static size_t GetQueueDepth();
+
+	// hash the whole file with the current algorithm; pb (if any) is kept up to date as it goes
+	bool HashFile(const char *szFileName, Md5Hash &hash, ProgressBar *pb);
+
+	// hash length bytes of the file starting at offset (which must be a whole number of pages),
+	// or as much of them as there is, with the given algorithm
+	bool HashRange(const char *szFileName, long long offset, long long length, DigestAlgorithm algorithm, Md5Hash &hash, ProgressBar *pb);
+
+private:
+	struct Slot
+	{
+		OVERLAPPED	Overlapped;
+		BYTE		*pBuffer;
+		bool		Pending;
+	};
+
+	bool PrepareRing();
+	bool PrepareEngine(DigestAlgorithm algorithm);
+	void FreeRing();
+	bool IssueRead(HANDLE hFile, Slot &slot, LONGLONG offset, bool &atEnd);
+	void CancelPending(HANDLE hFile);
+
+	BYTE								*pRing = nullptr;
+	size_t								blockSize = 0;
+	std::vector<Slot>					slots;
+
+	std::unique_ptr<DigestEngine>		engine;
+	DigestAlgorithm						engineAlgorithm = DigestAlgorithm::Count;
+};
@@ -1,7 +1,39 @@
-#define FILEONDISK_VERSION		0x00000100
+#define FILEONDISK_VERSION_1	0x00000100		// HashCacheHeader, items, strings
+#define FILEONDISK_VERSION_2	0x00000200		// HashCacheHeaderEx, items, strings, journal records
+#define FILEONDISK_VERSION		0x00000300		// same as version 2, but the items have head and tail fingerprints
 
 //=====================================================================================================================================================================================================
-// Path represents a path. It's just a case-insensitive string
+// Case policy
+//
+// Windows paths are case-insensitive, so that's how paths are compared (and hashed) by default.
+// Define FILEONDISK_CASE_SENSITIVE_PATHS as 1 to compare them case-sensitively instead, as paths
+// on most Linux filesystems are.
+//=====================================================================================================================================================================================================
+#ifndef FILEONDISK_CASE_SENSITIVE_PATHS
+#define FILEONDISK_CASE_SENSITIVE_PATHS		0
+#endif
+
+inline int ComparePathStrings(const char *psz1, const char *psz2)
+{
+#if FILEONDISK_CASE_SENSITIVE_PATHS
+	return strcmp(psz1, psz2);
+#else
+	return _stricmp(psz1, psz2);
+#endif
+}
+
+// a character of a path, folded the way ComparePathStrings compares them (for keys and hashes)
+inline char FoldPathChar(char c)
+{
+#if FILEONDISK_CASE_SENSITIVE_PATHS
+	return c;
+#else
+	return static_cast<char>(tolower(static_cast<unsigned char>(c)));
+#endif
+}
+
+//=====================================================================================================================================================================================================
+// Path represents a path. It's just a case-insensitive string (see the case policy above)
 //
 // We use it instead of a "char *" because it abstracts what it is, and prevents the compiler
 // from using any of a variation of "char *" operators to determine equality and compute hashes
@@ -20,15 +52,16 @@ private:
 	// Internal data
 	//=================================================================================================================================================================================================
 	const char *_p;
+	size_t		_hash;			// worked out once, when it's made (see HashOf)
 
 
 public:
 	//=================================================================================================================================================================================================
 	// Constructors...
 	//=================================================================================================================================================================================================
-	Path() : _p(nullptr) {}
-	Path(const char *p) : _p(p) {}
-	Path(char *p) : _p(p) {}
+	Path() : _p(nullptr), _hash(0) {}
+	Path(const char *p) : _p(p), _hash(HashOf(p)) {}
+	Path(char *p) : _p(p), _hash(HashOf(p)) {}
 
 	//=================================================================================================================================================================================================
 	// Destructor
@@ -43,29 +76,21 @@ public:
 	//=================================================================================================================================================================================================
 	inline size_t GetHash() const
 	{
-		const size_t maxpath = 2048;
-
-		assert(strlen(_p) < maxpath);
-
-		char lowercase[maxpath];
-		char *p = lowercase;
-		const char *pszPath = _p;
-
-		while (*pszPath && ((p-lowercase)<maxpath))
-		{
-			*p++ = tolower(*pszPath++);
-		}
-
-		//return std::_Hash_seq(reinterpret_cast<unsigned char *>(lowercase), p - lowercase);
-		return std::_Hash_array_representation(reinterpret_cast<unsigned char *>(lowercase), p - lowercase);
+		return this->_hash;
 	}
 
+	// the hash of the path with its case folded (see FileOnDisk.cpp)
+	static size_t HashOf(const char *psz);
+
 	//=================================================================================================================================================================================================
 	// equality operators
+	//
+	// Paths with different hashes can't be the same, so the strings are only compared when the
+	// hashes match.
 	//=================================================================================================================================================================================================
 	inline bool operator ==(const Path &other) const
 	{
-		return (0 == _stricmp(this->_p, other._p));
+		return (this->_hash == other._hash) && (0 == ComparePathStrings(this->_p, other._p));
 	}
 };
 
@@ -175,6 +200,27 @@ struct HashCacheHeader
 	long long		numFiles;
 };
 
+//=====================================================================================================================================================================================================
+// HashCacheHeaderEx
+//
+// The header of a version 0x200 (and up) md5cache.md5 file. It starts out the same as the old
+// one, and says how big it and the items are, so that fields can be added later without
+// breaking older readers. After the items and strings come zero or more journal records.
+//
+// A cache made with a different DigestAlgorithm than the current one is ignored (and replaced
+// the next time the folder is hashed), since its hashes can't be compared with ours.
+//=====================================================================================================================================================================================================
+struct HashCacheHeaderEx
+{
+	long long		version;
+	long long		numFiles;
+	long long		headerSize;			// sizeof(HashCacheHeaderEx) in whatever wrote it
+	long long		itemSize;			// sizeof(Md5CacheItem) in whatever wrote it
+	long long		stringsSize;
+	long long		algorithm;			// the DigestAlgorithm the hashes were made with
+	long long		reserved[2];
+};
+
 
 //=====================================================================================================================================================================================================
 // create a set of buckets for each folder
@@ -201,30 +247,58 @@ struct HashBucketInfo
 };
 
 
+//=====================================================================================================================================================================================================
+// FileOnDiskFolder
+//
+// A folder that some of a FileOnDiskSet's files are in. Both are offsets into the set's Strings;
+// SubPath is the part of Path under the root folder (which is empty for the root itself).
+//=====================================================================================================================================================================================================
+struct FileOnDiskFolder
+{
+	size_t						Path;
+	size_t						SubPath;
+};
+
+
 //=====================================================================================================================================================================================================
 // File on Disk structure
 //
 // Represents a file in the filesystem.
 //
-// I considered using a "char *" instead of an offset (size_t) for the Name and Path. It certainly
+// A file's path isn't kept whole: it's its folder's path (which is only kept once, however many
+// files are in the folder; see FileOnDiskFolder), a backslash, and its name.
+//
+// I considered using a "char *" instead of an offset (size_t) for the Name. It certainly
 // would make the code look cleaner. However, since all the names are in a dynamic array (i.e.,
 // a std::vector), the base location of the vector *CAN* change when items are added, and thus
 // all those pointers would become invalid.
 //
+// The fields that the passes over the whole table look at (the size, the hash and whether there
+// is one, and the path) come first, and the small ones are kept together so there's no padding
+// between them. The order doesn't matter anywhere else, except to the scan snapshots, which hold
+// these as they are (so its version goes up whenever this changes).
+//
 //=====================================================================================================================================================================================================
 struct FileOnDisk
 {
-	bool						Hashed;
 	long long					Size;
-	FILETIME					Time;
 	Md5Hash						Hash;
+	bool						Hashed;
+
+	// its head or tail is different from that of every other file of the same size, so it can't
+	// have a duplicate, whether or not it has a hash
+	bool						Distinct;
+
+	unsigned long				Prints;			// which of Head and Tail we have (HASHCACHE_ITEM_HEAD, HASHCACHE_ITEM_TAIL)
+	size_t						Folder;			// which of the set's Folders it's in
 	size_t						Name;
-	size_t						Path;
+	FILETIME					Time;
+	unsigned long long			Head;
+	unsigned long long			Tail;
 
 	// not in the Md5Cache...
-	size_t						SubPath;
-	mutable DWORD   			nNumberOfLinks;
-	mutable unsigned long long	nFileIndex;
+	mutable unsigned long long	nFileIndex;		// from the scan, when it can tell (0 if not); the same for all the hard links to a file
+	mutable DWORD   			nNumberOfLinks;	// how many links to it the scan found (0 if it can't tell)
 
 	inline const char *HashToString() const
 	{
@@ -239,6 +313,34 @@ struct FileOnDisk
 	}
 };
 
+//=====================================================================================================================================================================================================
+// FileOnDiskColumns
+//
+// The fields of a FileOnDiskSet's files that the passes over the whole table look at, a column
+// each, so that a pass that only wants the sizes (say) doesn't drag every file's whole FileOnDisk
+// through the cache. A set that has them keeps them in step with its Items (see
+// FileOnDiskSet::BuildColumns).
+//=====================================================================================================================================================================================================
+struct FileOnDiskColumns
+{
+	enum : unsigned char
+	{
+		FlagHashed		= 0x01,
+		FlagDistinct	= 0x02,
+	};
+
+	std::vector<long long>		Sizes;
+	std::vector<Md5Hash>		Hashes;
+	std::vector<unsigned char>	Flags;			// Flag*
+	std::vector<size_t>			Folders;
+	std::vector<size_t>			Names;
+
+	static inline unsigned char GetFlags(const FileOnDisk &file)
+	{
+		return (file.Hashed ? FlagHashed : 0) | (file.Distinct ? FlagDistinct : 0);
+	}
+};
+
 //=====================================================================================================================================================================================================
 //=====================================================================================================================================================================================================
 enum class FindDupesFlags : uint32_t
@@ -249,6 +351,8 @@ enum class FindDupesFlags : uint32_t
 	SortOnSize		= 0x0002,
 	SortInReverse	= 0x0004,
 	ForceAll		= 0x0008,
+	CompareOnly		= 0x0010,		// don't hash the files that were compared directly and turned out the same
+	SortOnLayout	= 0x0020,		// hash the files in the order they are on the disk
 	MaxNumThreads	= 0xFF00,
 };
 
@@ -300,31 +404,104 @@ static inline void SetMaxNumThreads(FindDupesFlags &flags, uint32_t numThreads)
 //=====================================================================================================================================================================================================
 struct FileOnDiskSet
 {
-	std::vector<FileOnDisk>		Items;
-	std::vector<char>			Strings;
-	size_t						RootPathLength;
+	std::vector<FileOnDisk>			Items;
+	std::vector<FileOnDiskFolder>	Folders;
+	std::vector<char>				Strings;		// the folders' paths and the files' names
+	size_t							RootPathLength = 0;
+
+	// the hot fields of Items, when the set is kept in columns (only while HasColumns says so)
+	FileOnDiskColumns				Columns;
+
+	//=================================================================================================================================================================================================
+	// Columns
+	//
+	// SortOnSizeAndPath puts the set into columns (if it isn't already), and from then on the
+	// sort, the hashing and ApplyHashFrom keep them up to date. Anything that adds files, or
+	// replaces them, takes the set out of columns again (or just leaves them the wrong length,
+	// which HasColumns notices). The accessors that take an index go through the columns when
+	// there are some.
+	//=================================================================================================================================================================================================
+	inline bool HasColumns() const
+	{
+		return (this->Columns.Sizes.size() == this->Items.size());
+	}
+
+	// copy the hot fields of Items into the columns
+	void BuildColumns();
+
+	// copy the hashes (and whether there are any) from Items into the columns again
+	void UpdateHashColumns();
+
+	void DropColumns();
+
+	inline long long GetSize(size_t index) const
+	{
+		assert(index < this->Items.size());
+		return this->HasColumns() ? this->Columns.Sizes[index] : this->Items[index].Size;
+	}
+
+	inline const Md5Hash &GetHash(size_t index) const
+	{
+		assert(index < this->Items.size());
+		return this->HasColumns() ? this->Columns.Hashes[index] : this->Items[index].Hash;
+	}
+
+	inline bool IsDistinct(size_t index) const
+	{
+		assert(index < this->Items.size());
+		return this->HasColumns() ? (0 != (this->Columns.Flags[index] & FileOnDiskColumns::FlagDistinct)) : this->Items[index].Distinct;
+	}
+
+	// which of Folders the file is in
+	inline size_t GetFolder(size_t index) const
+	{
+		assert(index < this->Items.size());
+		return this->HasColumns() ? this->Columns.Folders[index] : this->Items[index].Folder;
+	}
 
 	//=================================================================================================================================================================================================
 	// Const/non versions
+	//
+	// The paths are put together when they're asked for, so they come back as strings of their
+	// own; to compare two of them, use ComparePaths, which doesn't have to.
 	//=================================================================================================================================================================================================
-	inline const char *GetFilePath(size_t index) const
+	inline std::string GetFilePath(size_t index) const
 	{
 		assert(index < this->Items.size());
-		assert(this->Items[index].Path < this->Strings.size());
-		return &this->Strings[this->Items[index].Path];
+		return this->GetFilePath(this->Items[index]);
+	}
+
+	inline std::string GetFilePath(const FileOnDisk &file) const
+	{
+		std::string path;
+		this->GetFilePath(file, path);
+		return path;
+	}
+
+	// the same, put together in path, which keeps its capacity from one call to the next (so a
+	// loop over lots of files can use the one string for all of them)
+	inline const char *GetFilePath(size_t index, std::string &path) const
+	{
+		path.assign(this->GetFolderName(index));
+		path += '\\';
+		path += this->GetFileName(index);
+		return path.c_str();
 	}
 
-	inline const char *GetFilePath(const FileOnDisk &file) const
+	inline const char *GetFilePath(const FileOnDisk &file, std::string &path) const
 	{
-		assert(file.Path < this->Strings.size());
-		return &this->Strings[file.Path];
+		path.assign(this->GetFolderName(file));
+		path += '\\';
+		path += this->GetFileName(file);
+		return path.c_str();
 	}
 
 	inline const char *GetFileName(size_t index) const
 	{
 		assert(index < this->Items.size());
-		assert(this->Items[index].Name < this->Strings.size());
-		return &this->Strings[this->Items[index].Name];
+		size_t name = this->HasColumns() ? this->Columns.Names[index] : this->Items[index].Name;
+		assert(name < this->Strings.size());
+		return &this->Strings[name];
 	}
 
 	inline const char *GetFileName(const FileOnDisk &file) const
@@ -333,41 +510,79 @@ struct FileOnDiskSet
 		return &this->Strings[file.Name];
 	}
 
-	inline const char *GetSubPathName(size_t index) const
+	inline std::string GetSubPathName(size_t index) const
 	{
 		assert(index < this->Items.size());
-		assert(this->Items[index].SubPath < this->Strings.size());
-		return &this->Strings[this->Items[index].SubPath];
+		return this->GetSubPathName(this->Items[index]);
 	}
 
-	inline const char *GetSubPathName(const FileOnDisk &file) const
+	inline std::string GetSubPathName(const FileOnDisk &file) const
 	{
-		assert(file.SubPath < this->Strings.size());
-		return &this->Strings[file.SubPath];
+		assert(file.Folder < this->Folders.size());
+		std::string subPath(&this->Strings[this->Folders[file.Folder].SubPath]);
+		if (!subPath.empty())
+		{
+			subPath += '\\';
+		}
+		subPath += this->GetFileName(file);
+		return subPath;
 	}
 
-	inline const std::string GetFolderName(size_t index) const
+	inline const char *GetFolderName(size_t index) const
 	{
-		const char *p0 = this->GetFilePath(index);
-		const char *p1 = this->GetFileName(index)-1;
-		return std::string(p0, p1-p0);
+		size_t folder = this->GetFolder(index);
+		assert(folder < this->Folders.size());
+		assert(this->Folders[folder].Path < this->Strings.size());
+		return &this->Strings[this->Folders[folder].Path];
 	}
 
-	inline const std::string GetFolderName(const FileOnDisk &file) const
+	inline const char *GetFolderName(const FileOnDisk &file) const
 	{
-		const char *p0 = this->GetFilePath(file);
-		const char *p1 = this->GetFileName(file)-1;
-		return std::string(p0, p1-p0);
+		assert(file.Folder < this->Folders.size());
+		assert(this->Folders[file.Folder].Path < this->Strings.size());
+		return &this->Strings[this->Folders[file.Folder].Path];
 	}
 
-	void AddPathToStrings(FileOnDisk &file, const char *szPath, size_t nameOffset)
+	// compare two files' paths (as ComparePathStrings would if they were put together)
+	static int ComparePaths(const char *pszFolder1, const char *pszName1, const char *pszFolder2, const char *pszName2);
+
+	inline int ComparePaths(size_t left, size_t right) const
 	{
-		size_t offset	= this->Strings.size();
-		file.Path		= offset;
-		file.Name		= file.Path + nameOffset;
-		this->Strings.insert(this->Strings.end(), szPath, szPath+strlen(szPath)+1);
+		return ComparePaths(this->GetFolderName(left), this->GetFileName(left), this->GetFolderName(right), this->GetFileName(right));
 	}
 
+	// the folder's index in Folders, adding it if it isn't the last one added (the files in a
+	// folder are all added together, so that's the only one worth looking at)
+	size_t AddFolder(const char *szFolder)
+	{
+		if (!this->Folders.empty() && (0 == strcmp(&this->Strings[this->Folders.back().Path], szFolder)))
+		{
+			return this->Folders.size() - 1;
+		}
+
+		size_t folderLength	= strlen(szFolder);
+		FileOnDiskFolder folder;
+		folder.Path			= this->Strings.size();
+		folder.SubPath		= (folderLength > this->RootPathLength) ? (folder.Path + this->RootPathLength + 1) : (folder.Path + folderLength);
+		this->Strings.insert(this->Strings.end(), szFolder, szFolder + folderLength + 1);
+		this->Folders.push_back(folder);
+		return this->Folders.size() - 1;
+	}
+
+	// the file is in the folder (from AddFolder), so only its name needs adding
+	void AddPathToStrings(FileOnDisk &file, size_t folder, const char *szName)
+	{
+		assert(folder < this->Folders.size());
+		file.Folder		= folder;
+		file.Name		= this->Strings.size();
+		this->Strings.insert(this->Strings.end(), szName, szName + strlen(szName) + 1);
+	}
+
+	// same as above, but adds the folder too
+	void AddPathToStrings(FileOnDisk &file, const char *szFolder, const char *szName)
+	{
+		this->AddPathToStrings(file, this->AddFolder(szFolder), szName);
+	}
 
 public:
 	// add the files from the input list to ours
@@ -383,8 +598,13 @@ public:
 	// calculate the hash for all files in the set that need it
 	void UpdateHashedFiles(FindDupesFlags flags);
 
-	// read in from the file system (including relevant md5cache.md5 files)
-	void QueryFileSystem(const char *pszRootPath, bool clean=false);
+	// sort the files on size (biggest first), and then on path, on all the cores (see FileSort.cpp)
+	void SortOnSizeAndPath();
+
+	// read in from the file system (including relevant md5cache.md5 files), using up to
+	// numThreads threads to walk the folders, and optionally keeping a snapshot of the scan
+	// so that the next one only needs to read the folders that changed
+	void QueryFileSystem(const char *pszRootPath, bool clean=false, uint32_t numThreads=1, const char *pszSnapshotFile=nullptr);
 
 	// update a single one
 	bool UpdateFile(const FileOnDisk &file);
@@ -392,15 +612,65 @@ public:
 	// calc hashes of files in a bucket
 	void CalcAllNeededHashesFromOneBucket(FolderBucket& bucket, HashBucketInfo& hbi, TimeThis& t, std::chrono::system_clock::time_point& hashCalcStart, bool verbose, int& hashedCount, long long& byteCount, int iNum);
 
+	// fingerprint the head (or tail) of the files in a bucket, and add them to the cache
+	void CalcPartialHashesFromOneBucket(FolderBucket& bucket, unsigned long print, std::atomic<long long>& bytesRead);
+
+	// take the files that can be told apart by their heads and tails out of the list of files
+	// that need a hash
+	void EliminateByPartialHashes(std::vector<std::size_t> &filesThatNeedTheirHashCalculated, uint32_t maxNumThreads, bool sortReverse);
+
+	// read the files in a small group of same-sized files side by side, until they're all
+	// different or they're known to be the same (and hash them, if wanted, while we're at it)
+	bool CompareInLockstep(FolderBucket& group, bool wantHash, std::atomic<long long>& bytesRead);
+
+	// compare the small groups of files that need a hash directly, and take the ones that got
+	// settled that way out of the list
+	void CompareSmallGroups(std::vector<std::size_t> &filesThatNeedTheirHashCalculated, uint32_t maxNumThreads, bool wantHash);
+
+	// add (or update) the given files, which are all in the folder, in the folder's cache
+	void CacheFiles(const std::string &folder, const std::vector<std::size_t> &indices);
+
+	// take the hard links to a file that's already hashed, or that's earlier in the list, out of
+	// the list of files that need a hash, so each file on the disk is only read once; returns each
+	// of them along with the file it's a link to
+	std::vector<std::pair<std::size_t, std::size_t>> TakeOutHardLinks(std::vector<std::size_t> &filesThatNeedTheirHashCalculated, bool verbose);
+
+	// give the links taken out by TakeOutHardLinks the hashes of the files they're links to, and cache them
+	void ShareHashesWithHardLinks(const std::vector<std::pair<std::size_t, std::size_t>> &links, uint32_t maxNumThreads);
+
+	// set each file's nNumberOfLinks from how many of the files are the same file (without opening any of them)
+	void CountHardLinks();
+
+	// group the files into a bucket per folder (or per file when sorting on size), biggest first
+	std::vector<FolderBucket> MakeFolderBuckets(const std::vector<std::size_t> &indices, bool sortOnSize, bool sortReverse, bool sortOnLayout=false) const;
+
+	// hash all the files in the buckets in one batch (see BatchHasher), leaving any it couldn't
+	// do unhashed, for the buckets to do the usual way
+	void HashBucketsInBatch(std::vector<FolderBucket> &buckets, uint32_t numWorkers, bool verbose);
+
+	// hash the small files in the buckets with MD5, several side by side (see Md5HashFilesInLanes)
+	void HashSmallFilesInLanes(std::vector<FolderBucket> &buckets, uint32_t numWorkers, bool verbose);
+
+	// with a tree algorithm, hash the chunks of the big files in the buckets, side by side on an SSD
+	void HashBigFilesInChunks(std::vector<FolderBucket> &buckets, uint32_t numWorkers, bool verbose);
+
 
 	//=================================================================================================================================================================================================
 	//=================================================================================================================================================================================================
 	inline void CheckStrings(void)
 	{
 #ifdef _DEBUG
+		for (auto &folder : this->Folders)
+		{
+			if ((folder.Path > this->Strings.size()) || (folder.SubPath > this->Strings.size()))
+			{
+				assert(0);
+			}
+		}
+
 		for (auto &file : this->Items)
 		{
-			if (file.Path > this->Strings.size())
+			if ((file.Folder >= this->Folders.size()) || (file.Name > this->Strings.size()))
 			{
 				assert(0);
 			}
@@ -413,25 +683,70 @@ private:
 };
 
 //=====================================================================================================================================================================================================
+// Partial hashes
+//
+// Before reading all of a big file to hash it, we fingerprint just its first and last blocks.
+// Files that are the same size, but whose heads or tails are different, can't be duplicates, so
+// most of them never need to be read in full. The fingerprints are kept in the cache along with
+// the hash, so it's only done once per file.
+//=====================================================================================================================================================================================================
+const long long partialHashBlockSize		= 64 * 1024;
+const long long partialHashMinFileSize		= 16 * partialHashBlockSize;		// below this, just read the whole thing
+
+#define HASHCACHE_ITEM_HASH			0x00000001		// Hash is valid
+#define HASHCACHE_ITEM_HEAD			0x00000002		// Head is valid
+#define HASHCACHE_ITEM_TAIL			0x00000004		// Tail is valid
+
+//=====================================================================================================================================================================================================
+// Md5CacheItem
+//
+// Items in version 1 and 2 files stop after Flags (which wasn't used, and isn't initialized),
+// and always have a hash.
 //=====================================================================================================================================================================================================
+#define HASHCACHE_LEGACY_ITEM_SIZE	40
+
 struct Md5CacheItem
 {
 	long long			Size;
 	FILETIME			Time;
 	Md5Hash				Hash;
 	unsigned long		Name;
-	unsigned long		Filler;
+	unsigned long		Flags;			// HASHCACHE_ITEM_*
+	unsigned long long	Head;			// fingerprint of the first partialHashBlockSize bytes
+	unsigned long long	Tail;			// fingerprint of the last partialHashBlockSize bytes
 
 	Md5CacheItem(const FileOnDisk &file)
 	{
-		this->Size = file.Size;
-		this->Time = file.Time;
-		this->Hash = file.Hash;
+		this->Size	= file.Size;
+		this->Time	= file.Time;
+		this->Hash	= file.Hash;
+		this->Flags	= (file.Hashed ? HASHCACHE_ITEM_HASH : 0) | file.Prints;
+		this->Head	= file.Head;
+		this->Tail	= file.Tail;
 	}
 
 	Md5CacheItem(){}
 };
 
+static_assert(offsetof(Md5CacheItem, Head) == HASHCACHE_LEGACY_ITEM_SIZE, "the new fields must come after the old ones");
+
+//=====================================================================================================================================================================================================
+// HashCacheJournalRecord
+//
+// Hashes calculated since the file was last written in full are appended to it as journal
+// records rather than rewriting the whole file. Each one is this, followed by the file's name
+// (with its terminator), padded out to a multiple of 8 bytes. Loading replays them in order,
+// and a record for a name that's already there replaces it.
+//=====================================================================================================================================================================================================
+#define HASHCACHE_JOURNAL_MARKER	0x4C4E524A		// "JRNL"
+
+struct HashCacheJournalRecord
+{
+	unsigned long		marker;
+	unsigned long		recordSize;		// including the name and the padding
+	Md5CacheItem		item;			// item.Name is the size of the name that follows
+};
+
 //=====================================================================================================================================================================================================
 //=====================================================================================================================================================================================================
 struct Md5Cache
@@ -439,9 +754,18 @@ struct Md5Cache
 	std::vector<Md5CacheItem>	Items;
 	std::vector<char>			Strings;
 
+	// the version of the file it was loaded from (only files of the current version can be
+	// appended to)
+	long long					LoadedVersion = 0;
+
 	bool Load(const char *pszFileName);
+
+	// write the whole thing out, compacting away any journal
 	bool Save(const char *pszFileName);
 
+	// append the given items to the file's journal; the file must already be of the current version
+	bool Append(const char *pszFileName, const std::vector<size_t> &indices);
+
 	inline char *GetFileName(size_t index)
 	{
 		assert(index < this->Items.size());
@@ -460,6 +784,79 @@ struct Md5Cache
 	}
 };
 
+//=====================================================================================================================================================================================================
+// ConstArrayView
+//
+// A read-only window onto a run of items that live somewhere else, e.g., in a memory-mapped
+// file. It looks enough like a const std::vector to be used in its place.
+//=====================================================================================================================================================================================================
+template <typename _Ty> struct ConstArrayView
+{
+	const _Ty *	pData = nullptr;
+	size_t		count = 0;
+
+	inline const _Ty *begin() const { return this->pData; }
+	inline const _Ty *end() const { return this->pData + this->count; }
+	inline size_t size() const { return this->count; }
+	inline bool empty() const { return 0 == this->count; }
+
+	inline const _Ty &operator [](size_t index) const
+	{
+		assert(index < this->count);
+		return this->pData[index];
+	}
+};
+
+//=====================================================================================================================================================================================================
+// Md5CacheView
+//
+// A read-only Md5Cache. Rather than copying the file into vectors, the file is mapped into
+// memory and Items and Strings point straight into it. On network drives, where mapping a
+// small file costs more than it saves, and for small files, the whole file is read into one
+// buffer with a single ReadFile instead. If the file has journal records, they're replayed
+// into vectors that the view owns, and Items and Strings point at those instead. The same goes
+// for the items of older files, which are smaller than ours.
+//=====================================================================================================================================================================================================
+class Md5CacheView
+{
+public:
+	ConstArrayView<Md5CacheItem>	Items;
+	ConstArrayView<char>			Strings;
+
+	// the file's version, and how many journal records were replayed on top of it
+	long long						Version = 0;
+	size_t							NumJournalRecords = 0;
+
+	Md5CacheView() = default;
+	~Md5CacheView() { this->Close(); }
+
+	Md5CacheView(const Md5CacheView &) = delete;
+	Md5CacheView &operator =(const Md5CacheView &) = delete;
+
+	bool Load(const char *pszFileName);
+	void Close();
+
+	// take over items and strings that were put together in memory rather than read from a file
+	void Assign(std::vector<Md5CacheItem> &&items, std::vector<char> &&strings);
+
+	inline const char *GetFileName(const Md5CacheItem &file) const
+	{
+		assert(file.Name < this->Strings.size());
+		return &this->Strings[file.Name];
+	}
+
+private:
+	void ReplayJournal(const char *pJournal, size_t journalSize, size_t itemSize);
+
+	HANDLE						hMapping = nullptr;
+	const void *				pView = nullptr;
+	std::vector<long long>		buffer;
+
+	// when there's a journal, the items and strings end up here instead
+	std::vector<Md5CacheItem>	replayedItems;
+	std::vector<char>			replayedStrings;
+};
+
 
 //=====================================================================================================================================================================================================
 //=====================================================================================================================================================================================================
@@ -467,6 +864,9 @@ __declspec(selectany) const char * pszLocalCacheFileName = "md5cache.md5";
 __declspec(selectany) const char * pszOldLocalCacheFileName = "md5cache.bin";
 
 extern void CleanCacheFiles(const char *pszRootPath, bool cleanEmptyFolders);
+extern void ImportHashCacheFiles(const char *pszRootPath);
+extern void ExportHashCacheFiles(const char *pszRootPath);
 extern bool CalcFileMd5Hash(const char *szFileName, Md5Hash &chash, bool verbose);
+extern bool CalcFilePartialHash(const char *szFileName, long long offset, unsigned long long &print);
 //extern bool ParallelCalcFileMd5Hash(const char *szFileName, Md5Hash &chash, bool verbose);
 
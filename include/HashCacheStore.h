@@ -0,0 +1,192 @@
+#pragma once
+
+//=====================================================================================================================================================================================================
+// HashCacheStore
+//
+// Where the hashes of files are kept from one run to the next. Everything that reads or writes
+// cached hashes goes through the current store, one folder at a time, so it doesn't matter to
+// them whether the hashes live in an md5cache.md5 file in each folder (the default) or in one
+// index file somewhere else (see HashIndexStore).
+//=====================================================================================================================================================================================================
+class HashIndexStore;
+
+class HashCacheStore
+{
+public:
+	virtual ~HashCacheStore() = default;
+
+	// the store everything is currently using
+	static HashCacheStore &Get();
+
+	// switch everything over to an index file (creating it if need be), or back to the
+	// md5cache.md5 files; closing commits anything that's still pending
+	static bool OpenIndexFile(const char *pszIndexFile);
+	static void CloseIndexFile();
+
+	// the index, if that's what's being used; nullptr otherwise
+	static HashIndexStore *GetIndex();
+
+	// the cached items for one folder; nullptr if it doesn't have any
+	virtual std::shared_ptr<const Md5CacheEntry> LoadFolder(const char *pszFolderName) = 0;
+
+	// replace everything cached for a folder with what's in the cache
+	virtual bool Save(const char *pszFolderName, Md5Cache &cache) = 0;
+
+	// add (or update) just the given items of the cache, which came from Load
+	virtual bool Append(const char *pszFolderName, Md5Cache &cache, const std::vector<size_t> &indices) = 0;
+
+	// forget everything cached for a folder
+	virtual bool Remove(const char *pszFolderName) = 0;
+
+	// let go of anything the store is holding on to for a folder (a big md5cache.md5 file is
+	// mapped while it's loaded, and a mapped file can't be rewritten or deleted); whoever is
+	// about to Save or Remove a folder must drop their own LoadFolder pointer first, too
+	virtual void Release(const char *pszFolderName) {}
+
+	// when the folder's cached items last changed (zero if it has none)
+	virtual FILETIME GetFolderTime(const char *pszFolderName) = 0;
+
+	// make sure that everything written so far has made it to disk
+	virtual bool Commit() { return true; }
+
+	// same as LoadFolder, but into vectors we can change
+	bool Load(const char *pszFolderName, Md5Cache &cache);
+};
+
+//=====================================================================================================================================================================================================
+// SidecarHashCacheStore
+//
+// The original way of doing things: an md5cache.md5 file in each folder, read through the
+// Md5CacheRegistry.
+//=====================================================================================================================================================================================================
+class SidecarHashCacheStore : public HashCacheStore
+{
+public:
+	std::shared_ptr<const Md5CacheEntry> LoadFolder(const char *pszFolderName) override;
+	bool Save(const char *pszFolderName, Md5Cache &cache) override;
+	bool Append(const char *pszFolderName, Md5Cache &cache, const std::vector<size_t> &indices) override;
+	bool Remove(const char *pszFolderName) override;
+	void Release(const char *pszFolderName) override;
+	FILETIME GetFolderTime(const char *pszFolderName) override;
+};
+
+//=====================================================================================================================================================================================================
+// The index file
+//
+// A HashIndexHeader, followed by records. Each record starts with a marker and its size, and
+// item and clear records are followed by the folder's path and (for items) the file's name,
+// each with its terminator, padded out to a multiple of 8 bytes.
+//
+// Records are written in batches, and each batch ends with a commit record that says how many
+// records were in it. A batch only counts once its commit record is there, so if we're killed
+// in the middle of writing one, that whole batch is dropped the next time the file is opened,
+// and the folders are left as they were before it.
+//=====================================================================================================================================================================================================
+#define HASHINDEX_VERSION			0x00000200		// 0x100 had the smaller, version 2 Md5CacheItem
+
+#define HASHINDEX_ITEM_MARKER		0x4D455449		// "ITEM"
+#define HASHINDEX_CLEAR_MARKER		0x524C4C43		// "CLLR"
+#define HASHINDEX_COMMIT_MARKER		0x544D4D43		// "CMMT"
+
+struct HashIndexHeader
+{
+	long long			version;
+	long long			headerSize;		// sizeof(HashIndexHeader) in whatever wrote it
+	long long			itemSize;		// sizeof(Md5CacheItem) in whatever wrote it
+	long long			algorithm;		// the DigestAlgorithm all of its hashes were made with
+	long long			reserved[4];
+};
+
+struct HashIndexRecord
+{
+	unsigned long		marker;
+	unsigned long		recordSize;		// including the strings and the padding
+	FILETIME			Stamp;			// when it was written
+	unsigned long		folderSize;		// including the terminator
+	unsigned long		nameSize;		// including the terminator; 0 for a clear record
+	Md5CacheItem		item;			// only used by item records
+};
+
+struct HashIndexCommit
+{
+	unsigned long		marker;
+	unsigned long		recordSize;
+	unsigned long long	numRecords;		// in the batch this ends
+};
+
+//=====================================================================================================================================================================================================
+// HashIndexStore
+//
+// All the cached hashes in a single file, rather than one in each folder. That's one file to
+// open for a whole run instead of one per folder, which matters a lot on a slow network share,
+// and it works for folders that can't be written to at all (e.g., read-only media).
+//
+// The whole index is read in when it's opened, and kept in memory, by folder, keyed on the
+// folder's normalized path (see MakeKey). Changes are queued up and written out in batches:
+// whenever enough of them have piled up, or enough time has gone by, or on Commit. When it's
+// closed, and the file has grown to be mostly superseded records, it's rewritten from scratch
+// into a new file that then replaces the old one.
+//=====================================================================================================================================================================================================
+class HashIndexStore : public HashCacheStore
+{
+public:
+	HashIndexStore() = default;
+	~HashIndexStore() { this->Close(); }
+
+	HashIndexStore(const HashIndexStore &) = delete;
+	HashIndexStore &operator =(const HashIndexStore &) = delete;
+
+	bool Open(const char *pszFileName);
+	void Close();
+
+	std::shared_ptr<const Md5CacheEntry> LoadFolder(const char *pszFolderName) override;
+	bool Save(const char *pszFolderName, Md5Cache &cache) override;
+	bool Append(const char *pszFolderName, Md5Cache &cache, const std::vector<size_t> &indices) override;
+	bool Remove(const char *pszFolderName) override;
+	FILETIME GetFolderTime(const char *pszFolderName) override;
+	bool Commit() override;
+
+	// write out an md5cache.md5 file, through the given store, for every folder in the index
+	// that's at or under the root
+	size_t Export(const char *pszRootPath, HashCacheStore &dest);
+
+private:
+	static const size_t	commitBatchSize = 4096;		// records
+	static const int	commitInterval = 3;			// seconds
+
+	struct Folder
+	{
+		std::unordered_map<Path, size_t>		Names;			// points into Strings
+		std::string								FolderName;		// as it was first given to us
+		std::vector<Md5CacheItem>				Items;
+		std::vector<char>						Strings;
+		FILETIME								Time = {0};		// the stamp of the last change
+	};
+
+	static std::string MakeKey(const char *pszPath);
+
+	Folder *FindFolder(const char *pszFolderName);
+	Folder &GetFolder(const char *pszFolderName);
+	void SetItem(Folder &folder, const char *pszName, const Md5CacheItem &item);
+	void ClearFolder(Folder &folder);
+	void ApplyRecord(const HashIndexRecord *precord);
+
+	// the rest must be called with the lock held
+	void QueueRecord(unsigned long marker, const Folder &folder, const char *pszName, const Md5CacheItem *pitem);
+	bool CommitIfDue();
+	bool CommitLocked();
+	bool Compact();
+
+	std::mutex								mutex;
+	std::string								fileName;
+	HANDLE									hFile = nullptr;
+	unsigned long long						fileSize = 0;			// up to the end of the last complete batch
+	size_t									numRecordsInFile = 0;
+	size_t									numItems = 0;
+
+	std::vector<char>						pending;
+	size_t									numPending = 0;
+	ULONGLONG								lastCommit = 0;
+
+	std::unordered_map<std::string, Folder>	folders;
+};
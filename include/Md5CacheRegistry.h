@@ -0,0 +1,85 @@
+#pragma once
+
+//=====================================================================================================================================================================================================
+// Md5CacheEntry
+//
+// A loaded md5cache.md5 file, along with an index of its items by file name.
+//=====================================================================================================================================================================================================
+struct Md5CacheEntry
+{
+	static constexpr size_t npos = static_cast<size_t>(-1);
+
+	Md5CacheView						Cache;
+	std::unordered_map<Path, size_t>	Index;
+	size_t								MemoryUsed = 0;
+
+	// the index of the item with the given name; npos if there isn't one
+	inline size_t Find(const char *pszName) const
+	{
+		auto iter = this->Index.find(pszName);
+		return (iter == this->Index.end()) ? npos : iter->second;
+	}
+
+	inline const Md5CacheItem *FindItem(const char *pszName) const
+	{
+		size_t index = this->Find(pszName);
+		return (npos == index) ? nullptr : &this->Cache.Items[index];
+	}
+
+	// (re)build the index and the memory estimate once Cache holds the items
+	void BuildIndex();
+};
+
+//=====================================================================================================================================================================================================
+// Md5CacheRegistry
+//
+// Every md5cache.md5 file used during a run goes through here, so that each one is read and
+// indexed once, no matter how many times (or from how many threads) it's asked for. Entries are
+// handed out as shared pointers, so an entry stays valid for as long as someone is using it,
+// even if it's evicted in the meantime. The least recently used entries are dropped once the
+// total goes over the memory budget.
+//
+// Every Invalidate (or Clear) moves the file on to a new generation, so that a Load that was
+// already reading it when that happened can tell, and doesn't keep what it read.
+//
+// Anything that writes or deletes a cache file must Invalidate it.
+//=====================================================================================================================================================================================================
+class Md5CacheRegistry
+{
+public:
+	static Md5CacheRegistry &Get() { return theregistry; }
+
+	// nullptr if the file doesn't exist (or isn't a usable cache file)
+	std::shared_ptr<const Md5CacheEntry> Load(const char *pszFileName);
+
+	void Invalidate(const char *pszFileName);
+	void SetMemoryBudget(size_t bytes);
+	void Clear();
+
+	Md5CacheRegistry() : memoryBudget(defaultMemoryBudget), memoryUsed(0) {}
+
+private:
+	static const size_t defaultMemoryBudget = 256 * 1024 * 1024;
+
+	struct Slot
+	{
+		std::shared_ptr<const Md5CacheEntry>	entry;
+		std::list<std::string>::iterator		lru;
+	};
+
+	static std::string MakeKey(const char *pszFileName);
+	void EvictOverBudget();
+
+	// which generation the file is on; must be called with the lock held
+	size_t GetGeneration(const std::string &key) const;
+
+	static Md5CacheRegistry					theregistry;
+	std::mutex								mutex;
+	size_t									memoryBudget;
+	size_t									memoryUsed;
+	std::list<std::string>					lru;			// most recently used first
+	std::unordered_map<std::string, Slot>	slots;
+	std::unordered_map<std::string, size_t>	generations;	// only for files that have been invalidated
+	size_t									lastGeneration = 0;
+	size_t									clearedGeneration = 0;
+};
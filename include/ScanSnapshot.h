@@ -0,0 +1,144 @@
+#pragma once
+
+#define SCANSNAPSHOT_VERSION		0x00000203
+
+//=====================================================================================================================================================================================================
+// ScanSnapshot
+//
+// A snapshot of everything QueryFileSystem found, saved at the end of a scan so that the next
+// scan of the same tree can skip loading the cached hashes of any folder that hasn't changed
+// since.
+//
+// A folder is only taken from the snapshot if both its own last write time and the last write
+// time of its md5cache.md5 file are the same as when the snapshot was taken. Adding, removing
+// or renaming anything in a folder changes the folder's time, and hashing anything in it
+// rewrites its cache file. Changing the contents of an existing file in place does NOT change
+// the time of the folder it's in, though, so such a folder is still enumerated, and each file
+// is only taken from the snapshot if its size and last write time still match; any other file
+// is looked up in the folder's cache just as if there were no snapshot.
+//
+// On disk, it's a ScanSnapshotHeader, then the folders, then the files, and then the strings.
+//=====================================================================================================================================================================================================
+struct ScanSnapshotHeader
+{
+	long long		version;
+	long long		itemSize;			// sizeof(FileOnDisk) in whatever wrote the file
+	long long		numFolders;
+	long long		numItems;
+	long long		stringsSize;
+	long long		algorithm;			// the DigestAlgorithm the files' hashes were made with
+};
+
+//=====================================================================================================================================================================================================
+// ScanSnapshotFolder
+//
+// The folders are stored in the order the scan visits them: a folder, then each of its
+// sub-folders (and everything below them) in turn. So the first sub-folder of a folder always
+// comes right after it, and a folder's files are NumFiles items starting at FirstItem.
+//=====================================================================================================================================================================================================
+struct ScanSnapshotFolder
+{
+	unsigned long long	Path;			// offset into the strings
+	FILETIME			Time;			// the folder's last write time, taken before it was read
+	FILETIME			CacheTime;		// the md5cache.md5 file's last write time, or zero if there wasn't one
+	unsigned long long	FirstItem;
+	unsigned long		NumFiles;
+	unsigned long		NumSubFolders;
+};
+
+//=====================================================================================================================================================================================================
+// ScanSnapshot
+//
+// The snapshot being built up by the current scan. The files' Name is an offset into Strings,
+// and only holds the name; the folder's path is stored once, with the folder.
+//=====================================================================================================================================================================================================
+struct ScanSnapshot
+{
+	std::vector<ScanSnapshotFolder>	Folders;
+	std::vector<FileOnDisk>			Items;
+	std::vector<char>				Strings;
+
+	inline size_t AddString(const char *psz)
+	{
+		size_t offset = this->Strings.size();
+		this->Strings.insert(this->Strings.end(), psz, psz + strlen(psz) + 1);
+		return offset;
+	}
+
+	bool Save(const char *pszFileName) const;
+};
+
+//=====================================================================================================================================================================================================
+// ScanSnapshotView
+//
+// The snapshot from the previous scan, mapped straight into memory rather than read in.
+//=====================================================================================================================================================================================================
+class ScanSnapshotView
+{
+public:
+	static constexpr size_t npos = static_cast<size_t>(-1);
+
+	ScanSnapshotView() = default;
+	~ScanSnapshotView() { this->Close(); }
+
+	ScanSnapshotView(const ScanSnapshotView &) = delete;
+	ScanSnapshotView &operator =(const ScanSnapshotView &) = delete;
+
+	bool Open(const char *pszFileName);
+	void Close();
+
+	inline bool IsOpen() const
+	{
+		return nullptr != this->pView;
+	}
+
+	inline size_t GetNumFolders() const
+	{
+		return this->next.size();
+	}
+
+	inline const ScanSnapshotFolder &GetFolder(size_t index) const
+	{
+		assert(index < this->next.size());
+		return this->pFolders[index];
+	}
+
+	inline const char *GetFolderPath(size_t index) const
+	{
+		return &this->pStrings[this->GetFolder(index).Path];
+	}
+
+	inline const FileOnDisk &GetItem(size_t index) const
+	{
+		assert(index < static_cast<size_t>(this->pHeader->numItems));
+		return this->pItems[index];
+	}
+
+	inline const char *GetFileName(const FileOnDisk &file) const
+	{
+		return &this->pStrings[file.Name];
+	}
+
+	// the folder that comes after this one and everything below it, i.e., its next sibling
+	inline size_t GetNextSibling(size_t index) const
+	{
+		assert(index < this->next.size());
+		return this->next[index];
+	}
+
+	// look up a folder by its full path; npos if it isn't in the snapshot
+	size_t FindFolder(const char *pszPath) const;
+
+private:
+	HANDLE								hFile = nullptr;
+	HANDLE								hMapping = nullptr;
+	const void *						pView = nullptr;
+
+	const ScanSnapshotHeader *			pHeader = nullptr;
+	const ScanSnapshotFolder *			pFolders = nullptr;
+	const FileOnDisk *					pItems = nullptr;
+	const char *						pStrings = nullptr;
+
+	std::vector<size_t>					next;
+	std::unordered_map<Path, size_t>	folderMap;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+class TaskGroup;
+
+//=====================================================================================================================================================================================================
+// ThreadPool
+//
+// One set of worker threads for the whole run, each with its own WorkStealingQueue of tasks. A
+// task queued from a worker goes on that worker's queue (so a task that splits itself up keeps
+// the pieces close), and one queued from anywhere else is dealt out round-robin. A worker with
+// nothing of its own steals from the others, and sleeps on a condition variable when there's
+// nothing anywhere, rather than polling.
+//
+// Tasks are queued and waited for through a TaskGroup.
+//=====================================================================================================================================================================================================
+class ThreadPool
+{
+public:
+	typedef std::function<void()> Task;
+
+	static ThreadPool &Get() { return thepool; }
+
+	~ThreadPool();
+
+	// start (or restart with) that many workers; only while nothing is running on the pool
+	void SetNumThreads(uint32_t numThreads);
+	uint32_t GetNumThreads() const { return static_cast<uint32_t>(this->threads.size()); }
+
+	// which of the pool's workers this is (-1 if it isn't one)
+	static int GetWorkerIndex();
+
+private:
+	friend class TaskGroup;
+
+	struct QueuedTask
+	{
+		const TaskGroup		*pGroup;
+		Task				task;
+	};
+
+	void Submit(const TaskGroup *pGroup, Task task);
+	bool RunOne(size_t self);
+	bool RunOneFrom(size_t self, const TaskGroup *pGroup);
+	void Worker(size_t self);
+	void Stop();
+
+	std::vector<std::unique_ptr<WorkStealingQueue<QueuedTask>>>	queues;
+	std::vector<std::thread>									threads;
+
+	std::mutex													mutex;
+	std::condition_variable										wake;
+	std::atomic<size_t>											queued{0};
+	std::atomic<size_t>											nextQueue{0};
+	bool														stopping = false;
+
+	static ThreadPool											thepool;
+};
+
+//=====================================================================================================================================================================================================
+// TaskGroup
+//
+// Tasks queued on the pool that can be waited for together. Once ControlCHandler says to stop,
+// the tasks that haven't started yet are dropped, and Wait returns false. A worker that waits
+// keeps running tasks (the group's own first) until the group is done, so tasks can wait on
+// tasks of their own without tying up the pool.
+//=====================================================================================================================================================================================================
+class TaskGroup
+{
+public:
+	~TaskGroup() { this->Wait(); }
+
+	void Run(ThreadPool::Task task);
+
+	// false if we were told to stop
+	bool Wait();
+
+private:
+	void Finished();
+
+	std::mutex					mutex;
+	std::condition_variable		done;
+	std::atomic<size_t>			pending{0};
+};
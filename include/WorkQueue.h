@@ -0,0 +1,81 @@
+#pragma once
+
+//=====================================================================================================================================================================================================
+// WorkStealingQueue
+//
+// A double-ended queue of work items, one per worker thread. The thread that owns the queue
+// pushes and pops at the back, so it works depth-first and keeps its working set small. Other
+// threads steal from the front when their own queue runs dry, which hands them the oldest (and
+// usually the largest) pieces of outstanding work.
+//
+// A plain mutex is plenty here: the work items are whole folders or whole files, so the time
+// spent in the lock is tiny compared to the time spent on each item.
+//=====================================================================================================================================================================================================
+template <typename _Ty> class WorkStealingQueue
+{
+public:
+	//=================================================================================================================================================================================================
+	// owner side
+	//=================================================================================================================================================================================================
+	void Push(const _Ty &item)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->items.push_back(item);
+	}
+
+	bool Pop(_Ty &item)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		if (this->items.empty())
+		{
+			return false;
+		}
+
+		item = std::move(this->items.back());
+		this->items.pop_back();
+		return true;
+	}
+
+	// only if the one at the back is one that pred likes
+	template <typename _Pred> bool PopIf(_Ty &item, _Pred pred)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		if (this->items.empty() || !pred(this->items.back()))
+		{
+			return false;
+		}
+
+		item = std::move(this->items.back());
+		this->items.pop_back();
+		return true;
+	}
+
+	//=================================================================================================================================================================================================
+	// thief side
+	//=================================================================================================================================================================================================
+	bool Steal(_Ty &item)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		if (this->items.empty())
+		{
+			return false;
+		}
+
+		item = std::move(this->items.front());
+		this->items.pop_front();
+		return true;
+	}
+
+	size_t Size()
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->items.size();
+	}
+
+private:
+	std::mutex		mutex;
+	std::deque<_Ty>	items;
+};